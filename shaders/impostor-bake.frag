@@ -0,0 +1,22 @@
+#version 330 core
+
+/* Inputs */
+in vec3 vs_normal;
+flat in int vs_mat_idx;
+
+/* Materials of all the models (TER_MODEL_ARENA_MAX_MATERIALS) */
+layout(std140) uniform Materials {
+   vec4 MaterialAmbient[128];
+   vec4 MaterialDiffuse[128];
+   vec4 MaterialSpecular[128];   /* w: shininess */
+};
+
+/* Outputs: albedo and coverage, model space normal */
+layout(location = 0) out vec4 fs_albedo;
+layout(location = 1) out vec4 fs_normal;
+
+void main()
+{
+   fs_albedo = vec4(MaterialDiffuse[vs_mat_idx].xyz, 1.0);
+   fs_normal = vec4(normalize(vs_normal) * 0.5 + 0.5, 1.0);
+}
@@ -0,0 +1,40 @@
+#version 330 core
+
+/* Renders a model variant into a view of the impostor atlas. The model is
+ * drawn in its own space (the instance transform is the identity).
+ */
+
+/* Attributes */
+layout(location = 0) in vec3 vertexPosition;
+layout(location = 1) in vec4 InstancePosition;   /* w: uniform scale */
+layout(location = 2) in vec4 InstanceRotation;   /* Unit quaternion */
+layout(location = 9) in int VariantIdx;
+layout(location = 10) in vec3 vertexNormal;
+layout(location = 11) in int vertexMatIdx;
+
+/* Uniforms */
+uniform mat4 View;
+uniform mat4 Projection;
+
+/* Outputs */
+out vec3 vs_normal;
+flat out int vs_mat_idx;
+
+/* Rotates v by the unit quaternion q */
+vec3 rotate(vec4 q, vec3 v)
+{
+   return v + 2.0 * cross(q.xyz, cross(q.xyz, v) + q.w * v);
+}
+
+/* World space position of a point of the instance */
+vec4 instance_position(vec3 v)
+{
+   return vec4(InstancePosition.xyz +
+               InstancePosition.w * rotate(InstanceRotation, v), 1.0);
+}
+
+void main() {
+   gl_Position = Projection * View * instance_position(vertexPosition);
+   vs_normal = vertexNormal;
+   vs_mat_idx = vertexMatIdx + VariantIdx;
+}
@@ -0,0 +1,22 @@
+#version 330 core
+
+/* Inputs */
+in vec2 vs_uv[2];
+flat in float vs_view_weight;
+
+/* Uniforms */
+uniform sampler2D TexAlbedo;
+
+/* Outputs */
+out vec4 fs_color;
+
+void main()
+{
+   /* Only the texels covered by the model cast a shadow */
+   float coverage = mix(texture(TexAlbedo, vs_uv[0]).a,
+                        texture(TexAlbedo, vs_uv[1]).a, vs_view_weight);
+   if (coverage < 0.5)
+      discard;
+
+   fs_color = vec4(1.0);
+}
@@ -0,0 +1,110 @@
+#version 330 core
+
+#define MAX_ROWS 16   /* TER_IMPOSTOR_MAX_ROWS */
+
+const int CSM_LEVELS = 4;
+
+/* Attributes */
+layout(location = 0) in vec2 vertexCorner;   /* (0, 0) to (1, 1) */
+layout(location = 1) in vec4 InstancePosition;   /* w: uniform scale */
+layout(location = 2) in vec4 InstanceRotation;   /* Unit quaternion */
+layout(location = 9) in int VariantIdx;      /* Atlas row */
+layout(location = 14) in float Fade;
+
+/* Uniforms */
+uniform mat4 View;
+uniform mat4 Projection;
+uniform mat4 PrevViewProjection;   /* Objects don't move */
+uniform vec4 ClipPlane;
+
+uniform vec4 Eye;                   /* Position, or direction if w = 0 */
+uniform int NumViews;
+uniform int NumRows;
+uniform vec4 RowCenter[MAX_ROWS];   /* Model space center of the views */
+uniform vec2 RowSize[MAX_ROWS];     /* Half width and height of the views */
+
+uniform mat4 ShadowMapSpaceViewProjection[CSM_LEVELS];
+uniform float ShadowDistance;
+const float ShadowTransitionDistance = 10.0;
+
+const float fog_density = 0.0125;
+const float fog_gradient = 2.0;
+
+/* Outputs */
+out vec4 vs_pos;
+out vec2 vs_uv[2];
+flat out float vs_view_weight;
+flat out mat3 vs_normal_matrix;
+flat out float vs_fade;
+out vec4 vs_shadow_map_uv[CSM_LEVELS];
+out float vs_dist_from_camera;
+out float vs_visibility;
+out vec4 vs_clip_pos;
+out vec4 vs_prev_clip_pos;
+
+/* Rotates v by the unit quaternion q */
+vec3 rotate(vec4 q, vec3 v)
+{
+   return v + 2.0 * cross(q.xyz, cross(q.xyz, v) + q.w * v);
+}
+
+/* World space position of a point of the instance */
+vec4 instance_position(vec3 v)
+{
+   return vec4(InstancePosition.xyz +
+               InstancePosition.w * rotate(InstanceRotation, v), 1.0);
+}
+
+void main() {
+   int row = VariantIdx;
+   vec3 center = RowCenter[row].xyz;
+
+   /* Direction to the eye around the vertical axis of the model */
+   vec3 to_eye = Eye.xyz - Eye.w * instance_position(center).xyz;
+   vec4 inv_rotation = vec4(-InstanceRotation.xyz, InstanceRotation.w);
+   vec3 dir = rotate(inv_rotation, to_eye);
+   dir.y = 0.0;
+   dir = length(dir) > 0.0 ? normalize(dir) : vec3(0.0, 0.0, 1.0);
+
+   /* A quad facing the eye, oriented like the views in the atlas */
+   vec3 right = vec3(dir.z, 0.0, -dir.x);
+   vec2 corner = vertexCorner * 2.0 - 1.0;
+   vec3 pos = center + right * corner.x * RowSize[row].x +
+              vec3(0.0, corner.y * RowSize[row].y, 0.0);
+
+   vs_pos = instance_position(pos);
+   vec4 pos_from_camera = View * vs_pos;
+   gl_Position = Projection * pos_from_camera;
+   gl_ClipDistance[0] = dot(vs_pos, ClipPlane);
+
+   /* Blend the two views closest to the direction of the eye */
+   float view = mod(atan(dir.x, dir.z) * NumViews / 6.2831853 + NumViews,
+                    NumViews);
+   float view0 = floor(view);
+   float view1 = mod(view0 + 1.0, NumViews);
+   vec2 cell = vec2(1.0 / NumViews, 1.0 / NumRows);
+   vs_uv[0] = (vec2(view0, row) + vertexCorner) * cell;
+   vs_uv[1] = (vec2(view1, row) + vertexCorner) * cell;
+   vs_view_weight = view - view0;
+
+   vs_normal_matrix = mat3(rotate(InstanceRotation, vec3(1.0, 0.0, 0.0)),
+                           rotate(InstanceRotation, vec3(0.0, 1.0, 0.0)),
+                           rotate(InstanceRotation, vec3(0.0, 0.0, 1.0)));
+   vs_fade = Fade;
+
+   float distance_from_camera = length(pos_from_camera.xyz);
+   float shadow_distance =
+      distance_from_camera - (ShadowDistance - ShadowTransitionDistance);
+   for (int i = 0; i < CSM_LEVELS; i++) {
+      vs_shadow_map_uv[i] = ShadowMapSpaceViewProjection[i] * vs_pos;
+      vs_shadow_map_uv[i].w =
+         clamp(1.0 - shadow_distance / ShadowTransitionDistance, 0.0, 1.0);
+   }
+   vs_dist_from_camera = distance_from_camera;
+
+   vs_visibility = clamp(exp(-pow(distance_from_camera * fog_density, fog_gradient)),
+                         0.0, 1.0);
+
+   vs_clip_pos = gl_Position;
+   vs_prev_clip_pos = PrevViewProjection * vs_pos;
+}
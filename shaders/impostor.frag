@@ -0,0 +1,91 @@
+#version 330 core
+
+/* Inputs */
+in vec4 vs_pos;
+in vec2 vs_uv[2];
+flat in float vs_view_weight;
+flat in mat3 vs_normal_matrix;
+flat in float vs_fade;
+
+/* Uniforms */
+uniform sampler2D TexAlbedo;
+uniform sampler2D TexNormal;
+
+uniform vec4 LightPosition;
+uniform float LightAttenuation;
+uniform vec3 LightDiffuse;
+uniform vec3 LightAmbient;
+
+uniform float NearPlane;
+uniform float FarClipPlane;
+uniform float FarRenderPlane;
+
+/* Outputs */
+out vec4 fs_color;
+
+/* Threshold of the pixel in a 4x4 ordered dither pattern */
+float dither_threshold()
+{
+   const float bayer[16] = float[16](0.0, 8.0, 2.0, 10.0,
+                                     12.0, 4.0, 14.0, 6.0,
+                                     3.0, 11.0, 1.0, 9.0,
+                                     15.0, 7.0, 13.0, 5.0);
+   ivec2 p = ivec2(gl_FragCoord.xy) & 3;
+   return (bayer[p.y * 4 + p.x] + 0.5) / 16.0;
+}
+
+void main()
+{
+   /* Cross-fade with the geometry of the model, which is drawn in the
+    * other pixels of the dither pattern
+    */
+   if (vs_fade < dither_threshold())
+      discard;
+
+   /* Blend the two closest views, weighting the texels by their coverage */
+   vec4 albedo0 = texture(TexAlbedo, vs_uv[0]);
+   vec4 albedo1 = texture(TexAlbedo, vs_uv[1]);
+   float w0 = albedo0.a * (1.0 - vs_view_weight);
+   float w1 = albedo1.a * vs_view_weight;
+   float coverage = w0 + w1;
+   if (coverage < 0.5)
+      discard;
+
+   vec3 vs_diffuse = (albedo0.rgb * w0 + albedo1.rgb * w1) / coverage;
+   vec3 model_normal = (texture(TexNormal, vs_uv[0]).xyz * w0 +
+                        texture(TexNormal, vs_uv[1]).xyz * w1) / coverage;
+   vec3 normal = normalize(vs_normal_matrix * (model_normal * 2.0 - 1.0));
+
+   vec3 light_dir;
+   float attenuation;
+
+   /* Light direction and attenuation factor */
+   if (LightPosition.w == 0.0f) {
+      /* Directional light */
+      light_dir = normalize(vec3(LightPosition));
+      attenuation = 1.0f;
+   } else {
+      /* Positional light */
+      vec3 pos_to_light = vec3(LightPosition - vs_pos);
+      float distance = length(pos_to_light);
+      light_dir = normalize(pos_to_light);
+      attenuation = 1.0 / (LightAttenuation * distance);
+   }
+
+   /* Diffuse */
+   vec3 diffuse = attenuation * LightDiffuse * vs_diffuse *
+      max(0.0, dot(normal, light_dir));
+
+   /* Ambient */
+   vec3 ambient = LightAmbient * vs_diffuse;
+
+   /* Alpha (objects close to the far clipping plane fade-in progressively) */
+   float near = NearPlane;
+   float far = FarRenderPlane;
+   float fade_dist = 15.0;
+   float depth =
+      2.0 * near * far / (far + near - (2.0 * gl_FragCoord.z - 1.0) * (far - near));
+   float alpha = 1.0 - clamp((depth - (FarClipPlane - fade_dist)) / fade_dist, 0.0, 1.0);
+
+   fs_color = vec4(diffuse + ambient, alpha);
+}
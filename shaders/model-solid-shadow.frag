@@ -6,6 +6,7 @@ const int CSM_LEVELS = 4;
 in vec4 vs_pos;
 in vec3 vs_normal;
 flat in int vs_mat_idx;
+flat in float vs_fade;
 in vec4 vs_shadow_map_uv[CSM_LEVELS];
 in float vs_dist_from_camera;
 in float vs_visibility;
@@ -21,10 +22,12 @@ uniform vec3 LightDiffuse;
 uniform vec3 LightAmbient;
 uniform vec3 LightSpecular;
 
-uniform vec3 MaterialDiffuse[16];
-uniform vec3 MaterialAmbient[16];
-uniform vec3 MaterialSpecular[16];
-uniform float MaterialShininess[16];
+/* Materials of all the models (TER_MODEL_ARENA_MAX_MATERIALS) */
+layout(std140) uniform Materials {
+   vec4 MaterialAmbient[128];
+   vec4 MaterialDiffuse[128];
+   vec4 MaterialSpecular[128];   /* w: shininess */
+};
 
 uniform sampler2DShadow ShadowMap[CSM_LEVELS];
 uniform float ShadowCSMEndClipSpace[CSM_LEVELS];
@@ -43,6 +46,17 @@ uniform vec3 SkyColor;
 out vec4 fs_color;
 out vec4 fs_motion_vector;
 
+/* Threshold of the pixel in a 4x4 ordered dither pattern */
+float dither_threshold()
+{
+   const float bayer[16] = float[16](0.0, 8.0, 2.0, 10.0,
+                                     12.0, 4.0, 14.0, 6.0,
+                                     3.0, 11.0, 1.0, 9.0,
+                                     15.0, 7.0, 13.0, 5.0);
+   ivec2 p = ivec2(gl_FragCoord.xy) & 3;
+   return (bayer[p.y * 4 + p.x] + 0.5) / 16.0;
+}
+
 float sample_shadow_map(int level, vec3 shadow_coords)
 {
    /* Can't use non-uniform expressions with sampler arrays :-( */
@@ -85,6 +99,12 @@ float compute_shadow_factor(float dp)
 
 void main()
 {
+   /* Cross-fade with the impostor of the model, which is drawn in the
+    * other pixels of the dither pattern
+    */
+   if (vs_fade >= dither_threshold())
+      discard;
+
    vec3 light_dir;
    float attenuation;
 
@@ -107,10 +127,10 @@ void main()
    /* Is this pixel in the shade? Take mutiple samples to soften shadow edges */
    float shadow_factor = compute_shadow_factor(dp);
 
-   vec3 vs_ambient = MaterialAmbient[vs_mat_idx];
-   vec3 vs_diffuse = MaterialDiffuse[vs_mat_idx];
-   vec3 vs_specular = MaterialSpecular[vs_mat_idx];
-   float vs_shininess = MaterialShininess[vs_mat_idx];
+   vec3 vs_ambient = MaterialAmbient[vs_mat_idx].xyz;
+   vec3 vs_diffuse = MaterialDiffuse[vs_mat_idx].xyz;
+   vec3 vs_specular = MaterialSpecular[vs_mat_idx].xyz;
+   float vs_shininess = MaterialSpecular[vs_mat_idx].w;
 
    /* Diffuse */
    vec3 diffuse = attenuation * LightDiffuse * vs_diffuse *
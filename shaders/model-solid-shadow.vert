@@ -4,15 +4,17 @@ const int CSM_LEVELS = 4;
 
 /* Attributes */
 layout(location = 0) in vec3 vertexPosition;
-layout(location = 1) in mat4 Model;
-layout(location = 5) in mat4 PrevMVP;
+layout(location = 1) in vec4 InstancePosition;   /* w: uniform scale */
+layout(location = 2) in vec4 InstanceRotation;   /* Unit quaternion */
 layout(location = 9) in int VariantIdx;
 layout(location = 10) in vec3 vertexNormal;
 layout(location = 11) in int vertexMatIdx;
+layout(location = 14) in float Fade;
 
 /* Uniforms */
 uniform mat4 View;
 uniform mat4 Projection;
+uniform mat4 PrevViewProjection;   /* Objects don't move */
 uniform vec4 ClipPlane;
 
 uniform mat4 ShadowMapSpaceViewProjection[CSM_LEVELS];
@@ -26,20 +28,34 @@ const float fog_gradient = 2.0;
 out vec4 vs_pos;
 out vec3 vs_normal;
 flat out int vs_mat_idx;
+flat out float vs_fade;
 out vec4 vs_shadow_map_uv[CSM_LEVELS];
 out float vs_dist_from_camera;
 out float vs_visibility;
 out vec4 vs_clip_pos;
 out vec4 vs_prev_clip_pos;
 
-void main() {
-   mat3 ModelInvTransp = transpose(inverse(mat3(Model)));
+/* Rotates v by the unit quaternion q */
+vec3 rotate(vec4 q, vec3 v)
+{
+   return v + 2.0 * cross(q.xyz, cross(q.xyz, v) + q.w * v);
+}
 
-   vs_pos = Model * vec4(vertexPosition, 1.0);
+/* World space position of a point of the instance */
+vec4 instance_position(vec3 v)
+{
+   return vec4(InstancePosition.xyz +
+               InstancePosition.w * rotate(InstanceRotation, v), 1.0);
+}
+
+void main() {
+   vs_pos = instance_position(vertexPosition);
    vec4 pos_from_camera = View * vs_pos;
    gl_Position = Projection * pos_from_camera;
-   vs_normal = normalize(ModelInvTransp * vertexNormal);
+   /* The scale is uniform, so normals only need to be rotated */
+   vs_normal = normalize(rotate(InstanceRotation, vertexNormal));
    vs_mat_idx = vertexMatIdx + VariantIdx;
+   vs_fade = Fade;
 
    gl_ClipDistance[0] = dot(vs_pos, ClipPlane);
 
@@ -57,5 +73,5 @@ void main() {
                          0.0, 1.0);
 
    vs_clip_pos = gl_Position;
-   vs_prev_clip_pos = PrevMVP * vec4(vertexPosition, 1.0);
+   vs_prev_clip_pos = PrevViewProjection * vs_pos;
 }
@@ -2,10 +2,12 @@
 
 /* Attributes */
 layout(location = 0) in vec3 vertexPosition;
-layout(location = 1) in mat4 Model;
+layout(location = 1) in vec4 InstancePosition;   /* w: uniform scale */
+layout(location = 2) in vec4 InstanceRotation;   /* Unit quaternion */
 layout(location = 9) in int VariantIdx;
 layout(location = 10) in vec3 vertexNormal;
 layout(location = 11) in int vertexMatIdx;
+layout(location = 14) in float Fade;
 
 /* Uniforms */
 uniform mat4 View;
@@ -16,14 +18,27 @@ uniform vec4 ClipPlane;
 out vec4 vs_pos;
 out vec3 vs_normal;
 flat out int vs_mat_idx;
+flat out float vs_fade;
 
-void main() {
-   mat3 ModelInvTransp = transpose(inverse(mat3(Model)));
+/* Rotates v by the unit quaternion q */
+vec3 rotate(vec4 q, vec3 v)
+{
+   return v + 2.0 * cross(q.xyz, cross(q.xyz, v) + q.w * v);
+}
 
-   mat4 MVP = Projection * View * Model;
-   gl_Position = MVP * vec4(vertexPosition, 1.0);
-   vs_pos = Model * vec4(vertexPosition, 1.0);
-   vs_normal = normalize(ModelInvTransp * vertexNormal);
+/* World space position of a point of the instance */
+vec4 instance_position(vec3 v)
+{
+   return vec4(InstancePosition.xyz +
+               InstancePosition.w * rotate(InstanceRotation, v), 1.0);
+}
+
+void main() {
+   vs_pos = instance_position(vertexPosition);
+   gl_Position = Projection * View * vs_pos;
+   /* The scale is uniform, so normals only need to be rotated */
+   vs_normal = normalize(rotate(InstanceRotation, vertexNormal));
    vs_mat_idx = vertexMatIdx + VariantIdx;
+   vs_fade = Fade;
    gl_ClipDistance[0] = dot(vs_pos, ClipPlane);
 }
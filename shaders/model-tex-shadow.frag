@@ -23,10 +23,12 @@ uniform vec3 LightDiffuse;
 uniform vec3 LightAmbient;
 uniform vec3 LightSpecular;
 
-uniform vec3 MaterialDiffuse[8];
-uniform vec3 MaterialAmbient[8];
-uniform vec3 MaterialSpecular[8];
-uniform float MaterialShininess[8];
+/* Materials of all the models (TER_MODEL_ARENA_MAX_MATERIALS) */
+layout(std140) uniform Materials {
+   vec4 MaterialAmbient[128];
+   vec4 MaterialDiffuse[128];
+   vec4 MaterialSpecular[128];   /* w: shininess */
+};
 
 uniform sampler2D TexDiffuse[4];
 
@@ -111,10 +113,10 @@ void main()
    /* Is this pixel in the shade? Take mutiple samples to soften shadow edges */
    float shadow_factor = compute_shadow_factor(dp);
 
-   vec3 vs_ambient = MaterialAmbient[vs_mat_idx];
-   vec3 vs_diffuse = MaterialDiffuse[vs_mat_idx];
-   vec3 vs_specular = MaterialSpecular[vs_mat_idx];
-   float vs_shininess = MaterialShininess[vs_mat_idx];
+   vec3 vs_ambient = MaterialAmbient[vs_mat_idx].xyz;
+   vec3 vs_diffuse = MaterialDiffuse[vs_mat_idx].xyz;
+   vec3 vs_specular = MaterialSpecular[vs_mat_idx].xyz;
+   float vs_shininess = MaterialSpecular[vs_mat_idx].w;
 
    /* Diffuse */
    /* GLSL only permits indexing into sampler arrays with constants... */
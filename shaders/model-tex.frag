@@ -16,10 +16,12 @@ uniform vec3 LightDiffuse;
 uniform vec3 LightAmbient;
 uniform vec3 LightSpecular;
 
-uniform vec3 MaterialDiffuse[8];
-uniform vec3 MaterialAmbient[8];
-uniform vec3 MaterialSpecular[8];
-uniform float MaterialShininess[8];
+/* Materials of all the models (TER_MODEL_ARENA_MAX_MATERIALS) */
+layout(std140) uniform Materials {
+   vec4 MaterialAmbient[128];
+   vec4 MaterialDiffuse[128];
+   vec4 MaterialSpecular[128];   /* w: shininess */
+};
 
 uniform sampler2D TexDiffuse[8];
 
@@ -50,10 +52,10 @@ void main()
 
    vec3 normal = normalize(vs_normal);
 
-   vec3 vs_ambient = MaterialAmbient[vs_mat_idx];
-   vec3 vs_diffuse = MaterialDiffuse[vs_mat_idx];
-   vec3 vs_specular = MaterialSpecular[vs_mat_idx];
-   float vs_shininess = MaterialShininess[vs_mat_idx];
+   vec3 vs_ambient = MaterialAmbient[vs_mat_idx].xyz;
+   vec3 vs_diffuse = MaterialDiffuse[vs_mat_idx].xyz;
+   vec3 vs_specular = MaterialSpecular[vs_mat_idx].xyz;
+   float vs_shininess = MaterialSpecular[vs_mat_idx].w;
 
    /* Diffuse */
    /* GLSL only permits indexing into sampler arrays with constants... */
@@ -2,13 +2,26 @@
 
 /* Attributes */
 layout(location = 0) in vec3 vertexPosition;
-layout(location = 1) in mat4 Model;
+layout(location = 1) in vec4 InstancePosition;   /* w: uniform scale */
+layout(location = 2) in vec4 InstanceRotation;   /* Unit quaternion */
 
 /* Uniforms */
 uniform mat4 View;
 uniform mat4 Projection;
 
+/* Rotates v by the unit quaternion q */
+vec3 rotate(vec4 q, vec3 v)
+{
+   return v + 2.0 * cross(q.xyz, cross(q.xyz, v) + q.w * v);
+}
+
+/* World space position of a point of the instance */
+vec4 instance_position(vec3 v)
+{
+   return vec4(InstancePosition.xyz +
+               InstancePosition.w * rotate(InstanceRotation, v), 1.0);
+}
+
 void main() {
-   mat4 MVP = Projection * View * Model;
-   gl_Position = MVP * vec4(vertexPosition, 1.0);
+   gl_Position = Projection * View * instance_position(vertexPosition);
 }
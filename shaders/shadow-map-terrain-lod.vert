@@ -0,0 +1,52 @@
+#version 330 core
+
+const int LOD_LEVELS = 8;
+
+/* Per-chunk attributes (instanced) */
+layout(location = 0) in vec4 chunkOrigin;  /* sample x, sample z, spacing, lod */
+layout(location = 1) in ivec4 chunkTile;   /* layer, tile sample x, tile sample z */
+
+/* Uniforms */
+uniform mat4 View;
+uniform mat4 Projection;
+
+uniform sampler2DArray HeightMap;
+uniform int LodGridSize;
+uniform float TerrainStep;
+uniform ivec2 TerrainMaxSample;
+uniform vec3 LodCameraPosition;
+uniform vec2 LodMorph[LOD_LEVELS];
+
+float height_at(ivec2 s)
+{
+   /* Tiles have a 1-sample border on each side */
+   ivec2 tc = clamp(s, ivec2(0), TerrainMaxSample) - chunkTile.yz + ivec2(1);
+   return texelFetch(HeightMap, ivec3(tc, chunkTile.x), 0).r;
+}
+
+/* Same as in terrain-lod.vert, but we don't need normals here */
+vec3 lod_vertex()
+{
+   int grid_verts = LodGridSize + 1;
+   ivec2 grid = ivec2(gl_VertexID % grid_verts, gl_VertexID / grid_verts);
+   int spacing = int(chunkOrigin.z);
+   ivec2 s = min(ivec2(chunkOrigin.xy) + grid * spacing, TerrainMaxSample);
+
+   float h = height_at(s);
+   vec3 pos = vec3(float(s.x) * TerrainStep, h, -float(s.y) * TerrainStep);
+
+   ivec2 odd = grid & ivec2(1);
+   ivec2 d = ivec2(odd.x, odd.x != 0 ? -odd.y : odd.y) * spacing;
+   float h_coarse = 0.5 * (height_at(s + d) + height_at(s - d));
+
+   vec2 morph = LodMorph[int(chunkOrigin.w)];
+   float k = clamp((distance(pos, LodCameraPosition) - morph.x) * morph.y,
+                   0.0, 1.0);
+   pos.y = mix(h, h_coarse, k);
+
+   return pos;
+}
+
+void main() {
+   gl_Position = Projection * View * vec4(lod_vertex(), 1.0);
+}
@@ -0,0 +1,29 @@
+#version 330 core
+
+/* Attributes. Vertices are laid out in a grid of TerrainGridDepth rows, so
+ * X and Z are derived from the vertex ID.
+ */
+layout(location = 0) in float vertexHeight;  /* Normalized, see TerrainHeight */
+
+/* Uniforms */
+uniform mat4 Model;
+uniform mat4 View;
+uniform mat4 Projection;
+
+uniform int TerrainGridDepth;
+uniform float TerrainStep;
+uniform vec2 TerrainHeight;                  /* Scale, bias */
+
+vec3 terrain_position()
+{
+   int x = gl_VertexID / TerrainGridDepth;
+   int z = gl_VertexID - x * TerrainGridDepth;
+   return vec3(float(x) * TerrainStep,
+               vertexHeight * TerrainHeight.x + TerrainHeight.y,
+               -float(z) * TerrainStep);
+}
+
+void main() {
+   mat4 MVP = Projection * View * Model;
+   gl_Position = MVP * vec4(terrain_position(), 1.0);
+}
@@ -0,0 +1,100 @@
+#version 330 core
+
+const int CSM_LEVELS = 4;
+const int LOD_LEVELS = 8;
+
+/* Per-chunk attributes (instanced) */
+layout(location = 0) in vec4 chunkOrigin;  /* sample x, sample z, spacing, lod */
+layout(location = 1) in ivec4 chunkTile;   /* layer, tile sample x, tile sample z */
+
+/* Uniforms */
+uniform mat4 View;
+uniform mat4 Projection;
+uniform mat4 PrevMVP;
+uniform vec4 ClipPlane;
+
+uniform sampler2DArray HeightMap;
+uniform int LodGridSize;
+uniform float TerrainStep;
+uniform ivec2 TerrainMaxSample;
+uniform vec3 LodCameraPosition;
+uniform vec2 LodMorph[LOD_LEVELS];
+
+uniform mat4 ShadowMapSpaceViewProjection[CSM_LEVELS];
+uniform float ShadowDistance;
+const float ShadowTransitionDistance = 10.0;
+
+const float fog_density = 0.0125;
+const float fog_gradient = 2.0;
+
+/* Outputs */
+out vec4 vs_pos;
+out vec3 vs_normal;
+out vec4 vs_shadow_map_uv[CSM_LEVELS];
+out float vs_dist_from_camera;
+out float vs_visibility;
+out vec4 vs_clip_pos;
+out vec4 vs_prev_clip_pos;
+
+float height_at(ivec2 s)
+{
+   /* Tiles have a 1-sample border on each side */
+   ivec2 tc = clamp(s, ivec2(0), TerrainMaxSample) - chunkTile.yz + ivec2(1);
+   return texelFetch(HeightMap, ivec3(tc, chunkTile.x), 0).r;
+}
+
+/* See terrain-lod.vert */
+vec3 lod_vertex(out vec3 normal)
+{
+   int grid_verts = LodGridSize + 1;
+   ivec2 grid = ivec2(gl_VertexID % grid_verts, gl_VertexID / grid_verts);
+   int spacing = int(chunkOrigin.z);
+   ivec2 s = min(ivec2(chunkOrigin.xy) + grid * spacing, TerrainMaxSample);
+
+   float h = height_at(s);
+   vec3 pos = vec3(float(s.x) * TerrainStep, h, -float(s.y) * TerrainStep);
+
+   ivec2 odd = grid & ivec2(1);
+   ivec2 d = ivec2(odd.x, odd.x != 0 ? -odd.y : odd.y) * spacing;
+   float h_coarse = 0.5 * (height_at(s + d) + height_at(s - d));
+
+   vec2 morph = LodMorph[int(chunkOrigin.w)];
+   float k = clamp((distance(pos, LodCameraPosition) - morph.x) * morph.y,
+                   0.0, 1.0);
+   pos.y = mix(h, h_coarse, k);
+
+   float hl = height_at(s - ivec2(1, 0));
+   float hr = height_at(s + ivec2(1, 0));
+   float hd = height_at(s + ivec2(0, 1)); /* Terrain expands towards -Z */
+   float hu = height_at(s - ivec2(0, 1));
+   normal = normalize(vec3(hl - hr, 2.0, hd - hu));
+
+   return pos;
+}
+
+void main() {
+   vec3 normal;
+   vs_pos = vec4(lod_vertex(normal), 1.0);
+   vec4 pos_from_camera = View * vs_pos;
+   float distance_from_camera = length(pos_from_camera.xyz);
+   gl_Position = Projection * pos_from_camera;
+
+   vs_normal = normal;
+
+   gl_ClipDistance[0] = dot(vs_pos, ClipPlane);
+
+   float shadow_distance =
+      distance_from_camera - (ShadowDistance - ShadowTransitionDistance);
+   for (int i = 0; i < CSM_LEVELS; i++) {
+      vs_shadow_map_uv[i] = ShadowMapSpaceViewProjection[i] * vs_pos;
+      vs_shadow_map_uv[i].w =
+         clamp(1.0 - shadow_distance / ShadowTransitionDistance, 0.0, 1.0);
+   }
+   vs_dist_from_camera = distance_from_camera;
+
+   vs_visibility = clamp(exp(-pow(distance_from_camera * fog_density, fog_gradient)),
+                         0.0, 1.0);
+
+   vs_clip_pos = gl_Position;
+   vs_prev_clip_pos = PrevMVP * vs_pos;
+}
@@ -0,0 +1,74 @@
+#version 330 core
+
+const int LOD_LEVELS = 8;
+
+/* Per-chunk attributes (instanced) */
+layout(location = 0) in vec4 chunkOrigin;  /* sample x, sample z, spacing, lod */
+layout(location = 1) in ivec4 chunkTile;   /* layer, tile sample x, tile sample z */
+
+/* Uniforms */
+uniform mat4 View;
+uniform mat4 Projection;
+uniform vec4 ClipPlane;
+
+uniform sampler2DArray HeightMap;
+uniform int LodGridSize;
+uniform float TerrainStep;
+uniform ivec2 TerrainMaxSample;
+uniform vec3 LodCameraPosition;
+uniform vec2 LodMorph[LOD_LEVELS];
+
+/* Outputs */
+out vec4 vs_pos;
+out vec3 vs_normal;
+
+float height_at(ivec2 s)
+{
+   /* Tiles have a 1-sample border on each side */
+   ivec2 tc = clamp(s, ivec2(0), TerrainMaxSample) - chunkTile.yz + ivec2(1);
+   return texelFetch(HeightMap, ivec3(tc, chunkTile.x), 0).r;
+}
+
+/* Computes the world position and normal of the current vertex. The height
+ * is morphed towards the height of the next (coarser) level as the vertex
+ * gets closer to the end of the range of its level.
+ */
+vec3 lod_vertex(out vec3 normal)
+{
+   int grid_verts = LodGridSize + 1;
+   ivec2 grid = ivec2(gl_VertexID % grid_verts, gl_VertexID / grid_verts);
+   int spacing = int(chunkOrigin.z);
+   ivec2 s = min(ivec2(chunkOrigin.xy) + grid * spacing, TerrainMaxSample);
+
+   float h = height_at(s);
+   vec3 pos = vec3(float(s.x) * TerrainStep, h, -float(s.y) * TerrainStep);
+
+   /* Vertices that don't exist in the coarser level lie in the middle of an
+    * edge of a coarser triangle, so their coarse height is the average of
+    * the vertices at each end of that edge.
+    */
+   ivec2 odd = grid & ivec2(1);
+   ivec2 d = ivec2(odd.x, odd.x != 0 ? -odd.y : odd.y) * spacing;
+   float h_coarse = 0.5 * (height_at(s + d) + height_at(s - d));
+
+   vec2 morph = LodMorph[int(chunkOrigin.w)];
+   float k = clamp((distance(pos, LodCameraPosition) - morph.x) * morph.y,
+                   0.0, 1.0);
+   pos.y = mix(h, h_coarse, k);
+
+   float hl = height_at(s - ivec2(1, 0));
+   float hr = height_at(s + ivec2(1, 0));
+   float hd = height_at(s + ivec2(0, 1)); /* Terrain expands towards -Z */
+   float hu = height_at(s - ivec2(0, 1));
+   normal = normalize(vec3(hl - hr, 2.0, hd - hu));
+
+   return pos;
+}
+
+void main() {
+   vec3 normal;
+   vs_pos = vec4(lod_vertex(normal), 1.0);
+   gl_Position = Projection * View * vs_pos;
+   vs_normal = normal;
+   gl_ClipDistance[0] = dot(vs_pos, ClipPlane);
+}
@@ -2,9 +2,11 @@
 
 const int CSM_LEVELS = 4;
 
-/* Attributes */
-layout(location = 0) in vec3 vertexPosition;
-layout(location = 1) in vec3 vertexNormal;
+/* Attributes. Vertices are laid out in a grid of TerrainGridDepth rows, so
+ * X and Z are derived from the vertex ID.
+ */
+layout(location = 0) in float vertexHeight;  /* Normalized, see TerrainHeight */
+layout(location = 1) in vec2 vertexNormal;   /* Octahedral encoding */
 
 /* Uniforms */
 uniform mat4 Model;
@@ -14,6 +16,10 @@ uniform mat4 PrevMVP;
 uniform mat3 ModelInvTransp;
 uniform vec4 ClipPlane;
 
+uniform int TerrainGridDepth;
+uniform float TerrainStep;
+uniform vec2 TerrainHeight;                  /* Scale, bias */
+
 uniform mat4 ShadowMapSpaceViewProjection[CSM_LEVELS];
 uniform float ShadowDistance;
 const float ShadowTransitionDistance = 10.0;
@@ -30,13 +36,33 @@ out float vs_visibility;
 out vec4 vs_clip_pos;
 out vec4 vs_prev_clip_pos;
 
+vec3 terrain_position()
+{
+   int x = gl_VertexID / TerrainGridDepth;
+   int z = gl_VertexID - x * TerrainGridDepth;
+   return vec3(float(x) * TerrainStep,
+               vertexHeight * TerrainHeight.x + TerrainHeight.y,
+               -float(z) * TerrainStep);
+}
+
+vec3 terrain_normal()
+{
+   vec3 n = vec3(vertexNormal.x,
+                 1.0 - abs(vertexNormal.x) - abs(vertexNormal.y),
+                 vertexNormal.y);
+   if (n.y < 0.0)
+      n.xz = (1.0 - abs(n.zx)) * sign(n.xz);
+   return normalize(n);
+}
+
 void main() {
+   vec3 vertexPosition = terrain_position();
    vs_pos = Model * vec4(vertexPosition, 1.0);
    vec4 pos_from_camera = View * vs_pos;
    float distance_from_camera = length(pos_from_camera.xyz);
    gl_Position = Projection * pos_from_camera;
 
-   vs_normal = normalize(ModelInvTransp * vertexNormal);
+   vs_normal = normalize(ModelInvTransp * terrain_normal());
 
    gl_ClipDistance[0] = dot(vs_pos, ClipPlane);
 
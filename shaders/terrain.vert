@@ -1,8 +1,10 @@
 #version 330 core
 
-/* Attributes */
-layout(location = 0) in vec3 vertexPosition;
-layout(location = 1) in vec3 vertexNormal;
+/* Attributes. Vertices are laid out in a grid of TerrainGridDepth rows, so
+ * X and Z are derived from the vertex ID.
+ */
+layout(location = 0) in float vertexHeight;  /* Normalized, see TerrainHeight */
+layout(location = 1) in vec2 vertexNormal;   /* Octahedral encoding */
 
 /* Uniforms */
 uniform mat4 Model;
@@ -11,14 +13,38 @@ uniform mat4 Projection;
 uniform mat3 ModelInvTransp;
 uniform vec4 ClipPlane;
 
+uniform int TerrainGridDepth;
+uniform float TerrainStep;
+uniform vec2 TerrainHeight;                  /* Scale, bias */
+
 /* Outputs */
 out vec4 vs_pos;
 out vec3 vs_normal;
 
+vec3 terrain_position()
+{
+   int x = gl_VertexID / TerrainGridDepth;
+   int z = gl_VertexID - x * TerrainGridDepth;
+   return vec3(float(x) * TerrainStep,
+               vertexHeight * TerrainHeight.x + TerrainHeight.y,
+               -float(z) * TerrainStep);
+}
+
+vec3 terrain_normal()
+{
+   vec3 n = vec3(vertexNormal.x,
+                 1.0 - abs(vertexNormal.x) - abs(vertexNormal.y),
+                 vertexNormal.y);
+   if (n.y < 0.0)
+      n.xz = (1.0 - abs(n.zx)) * sign(n.xz);
+   return normalize(n);
+}
+
 void main() {
+   vec3 vertexPosition = terrain_position();
    mat4 MVP = Projection * View * Model;
    gl_Position = MVP * vec4(vertexPosition, 1.0);
    vs_pos = Model * vec4(vertexPosition, 1.0);
-   vs_normal = normalize(ModelInvTransp * vertexNormal);
+   vs_normal = normalize(ModelInvTransp * terrain_normal());
    gl_ClipDistance[0] = dot(vs_pos, ClipPlane);
 }
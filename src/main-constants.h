@@ -62,6 +62,29 @@
 #define TER_DEBUG_TRACE_RENDER_ENABLE false
 #define TER_DEBUG_TRACE_SHADER_ENABLE true
 
+/*
+ * Run CPU micro-benchmarks after loading the scene and report the results
+ * on stdout. The number of iterations of each benchmark is set below.
+ */
+#define TER_DEBUG_RUN_BENCHMARKS false
+#define TER_BENCH_HEIGHT_QUERIES (1024 * 1024)
+#define TER_BENCH_ROUNDS 10
+#define TER_BENCH_MESH_MIN_SIZE 256
+#define TER_BENCH_MESH_MAX_SIZE 8192
+#define TER_BENCH_RAYCAST_RAYS (64 * 1024)
+#define TER_BENCH_RAYCAST_MIN_SIZE 256
+#define TER_BENCH_RAYCAST_MAX_SIZE 4096
+#define TER_BENCH_EDITS_PER_SEC 1000
+#define TER_BENCH_EDIT_RADIUS 2.0f
+#define TER_BENCH_CULLING_VIEWS 8
+#define TER_BENCH_PLACEMENT_OBJECTS 500000
+
+/*
+ * Number of worker threads used for parallel CPU work, such as building the
+ * terrain mesh. Set to 0 to use one thread per CPU.
+ */
+#define TER_THREAD_POOL_THREADS 0
+
 /*
  * Enable camera collision detection
  */
@@ -147,34 +170,23 @@
 #define TER_WATER_REFLECTION_SHADOWS_ENABLE true
 
 /*
- * Object instances of the same model use instanced rendering, so we
- * map the model matrix for all of them in a single vertex buffer object.
- * This determines the size of the buffer, and thus, imposes a limit on
- * the maximum number of objects of a particular model we can draw
- * in single draw call.
+ * Data that the CPU writes every frame for the GPU (object instances,
+ * terrain chunks and indices) is streamed through a persistently mapped
+ * buffer with a region per frame in flight (see TerStreamBuffer). This is
+ * the initial size of each region, it grows if a frame needs more room.
  *
- * 32KB is sufficient to render up to 512 instances of each model in
- * a single draw call, but a larger buffer allows us to re-use the same
- * buffer through multiple render calls, where each call uses a different
- * segment of the buffer. This helps prevent GPU stalls between different
- * passes.
- */
-#define TER_MODEL_MAX_INSTANCED_VBO_BYTES (64 * 1024)
-
-/* We use multi-buffering for dynamically updated instanced data
- * to prevent stalls between on-going draw commands reading data from the
- * instanced buffer and data uploads to the same buffer triggered by new
- * draw commands being emitted by the application in subsequent frames
- * or even the same frame (we render model data multiple times in the same
- * frame for the various passes we use). This setting indicates the number
- * of buffers to use (each of size TER_MAX_INSTANCED_VBO_BYTES).
+ * The number of frames in flight is how many frames the CPU can get ahead
+ * of the GPU before it has to wait for it. More frames mean fewer stalls,
+ * but also more latency and memory. The maximum is
+ * TER_STREAM_BUFFER_MAX_FRAMES.
  */
-#define TER_MODEL_NUM_INSTANCED_BUFFERS 2
+#define TER_STREAM_BUFFER_FRAME_BYTES      (4 * 1024 * 1024)
+#define TER_STREAM_BUFFER_FRAMES_IN_FLIGHT 3
 
 /* Maximum number of materials and textures per model
  *
- * Warning: these numbers cannot be larger than the arrays in the model shaders
- * (variants * materials, variants * textures)
+ * Warning: the materials of all the models and variants must fit in the
+ * material table of the model shaders (TER_MODEL_ARENA_MAX_MATERIALS)
  *
  * FIXME: We only really support 1 texture per model.
  */
@@ -182,6 +194,43 @@
 #define TER_MODEL_MAX_MATERIALS 4
 #define TER_MODEL_MAX_TEXTURES  4
 
+/*
+ * Levels of detail of the models. They are generated at load time, each one
+ * simplified from the previous one down to TER_MODEL_LOD_REDUCTION of its
+ * triangles. Levels that can't be simplified below
+ * TER_MODEL_LOD_MIN_REDUCTION of the previous one are dropped.
+ *
+ * Instances use the coarsest level whose simplification error is below
+ * TER_MODEL_LOD_ERROR times their distance to the camera (1-2 pixels at
+ * our field of view and resolution) and only switch levels when the error
+ * is off by more than TER_MODEL_LOD_HYSTERESIS, so they don't flicker
+ * between levels around a threshold distance.
+ */
+#define TER_MODEL_MAX_LODS          4
+#define TER_MODEL_LOD_REDUCTION     0.5f
+#define TER_MODEL_LOD_MIN_REDUCTION 0.85f
+#define TER_MODEL_LOD_ERROR         0.002f
+#define TER_MODEL_LOD_HYSTERESIS    0.15f
+
+/*
+ * Impostors. Models with impostors (the trees) are rendered at load time
+ * from TER_IMPOSTOR_VIEWS directions around their vertical axis into an
+ * atlas, with TER_IMPOSTOR_CELL_SIZE pixels per side for each view. All the
+ * variants of all the models must fit in TER_IMPOSTOR_MAX_ROWS rows of the
+ * atlas.
+ *
+ * Instances further than TER_IMPOSTOR_DISTANCE from the camera are drawn as
+ * camera facing quads textured with the atlas, cross-fading from the
+ * geometry over TER_IMPOSTOR_FADE_DISTANCE. Passes with a LOD bias switch to
+ * impostors closer to the camera (the distances are divided by the bias).
+ */
+#define TER_IMPOSTOR_ENABLE         true
+#define TER_IMPOSTOR_VIEWS          8
+#define TER_IMPOSTOR_CELL_SIZE      128
+#define TER_IMPOSTOR_MAX_ROWS       16
+#define TER_IMPOSTOR_DISTANCE       40.0f
+#define TER_IMPOSTOR_FADE_DISTANCE  5.0f
+
 /*
  * Enable clipping (at the distances indicated below)
  *
@@ -191,6 +240,55 @@
  */
 #define TER_OBJECT_RENDERER_ENABLE_CLIPPING true
 
+/*
+ * Size of the memory blocks used to store object instance data
+ */
+#define TER_OBJECT_RENDERER_ARENA_BLOCK_SIZE (1024 * 1024)
+
+/*
+ * Maximum depth of the loose quadtrees used to cull objects. Cells at the
+ * deepest level are 1 / 2^DEPTH of the world size per side.
+ */
+#define TER_OBJECT_RENDERER_TREE_DEPTH 6
+
+/*
+ * Cull objects on the GPU with a compute shader and render them with
+ * indirect draws, so the CPU cost of rendering objects doesn't grow with
+ * their number. Requires OpenGL 4.3, objects are culled on the CPU if it is
+ * not available.
+ */
+#define TER_OBJECT_RENDERER_GPU_CULLING_ENABLE false
+
+/*
+ * Cull scene objects hidden behind the terrain. The CPU renders a coarse
+ * version of the visible terrain (with a quad per block of 2^LEVEL terrain
+ * quads per side) into an occlusion buffer of WIDTH x HEIGHT pixels every
+ * frame and objects are tested against it before packing their instance
+ * data. Not used with GPU culling.
+ *
+ * The coarse terrain goes through the lowest heights of each block, so
+ * terrain features narrower than a few blocks don't occlude anything.
+ * Streamed terrains use blocks of at least the heightfield chunk size.
+ */
+#define TER_OCCLUSION_CULLING_ENABLE true
+#define TER_OCCLUSION_BUFFER_WIDTH 256
+#define TER_OCCLUSION_BUFFER_HEIGHT 128
+#define TER_OCCLUSION_TERRAIN_LEVEL 2
+
+/*
+ * Objects are placed at startup by tiles of TILE_SIZE world units, in
+ * parallel, and each tile draws its positions from its own random generator
+ * seeded from SEED, so the same seed always produces the same scene. Change
+ * the seed to get a different scene.
+ *
+ * Placements that collide with other objects are found with a grid of
+ * CELL_SIZE world units and retried up to MAX_ATTEMPTS times per object.
+ */
+#define TER_OBJECT_PLACEMENT_SEED 1
+#define TER_OBJECT_PLACEMENT_TILE_SIZE 16.0f
+#define TER_OBJECT_PLACEMENT_CELL_SIZE 2.0f
+#define TER_OBJECT_PLACEMENT_MAX_ATTEMPTS 64
+
 /*
  * Enable clipping of the terrain surface
  *
@@ -199,6 +297,91 @@
  */
 #define TER_TERRAIN_ENABLE_CLIPPING true
 
+/*
+ * Use a static terrain index buffer
+ *
+ * Upload the indices for the full terrain grid once, as one triangle strip
+ * per column separated with primitive restarts, and clip the terrain by
+ * drawing only the ranges of each column that are visible with
+ * glMultiDrawElements(). This avoids any index uploads after startup.
+ * Only used without terrain LOD.
+ */
+#define TER_TERRAIN_STATIC_INDICES true
+
+/*
+ * Terrain chunk culling
+ *
+ * With static indices, split the terrain in chunks of CHUNK_SIZE quads per
+ * side and skip chunks that are outside the view frustum (or the shadow
+ * cascade box when rendering shadow maps). The LOD renderer culls its
+ * quadtree nodes in the same way.
+ */
+#define TER_TERRAIN_ENABLE_CHUNK_CULLING true
+#define TER_TERRAIN_CHUNK_SIZE 32
+
+/*
+ * Terrain edits
+ *
+ * Vertex heights are quantized to the height range of the terrain. Reserve
+ * this fraction of the range above and below it so runtime edits (see
+ * ter_terrain_update_region) don't need to re-quantize the whole terrain.
+ */
+#define TER_TERRAIN_EDIT_HEIGHT_MARGIN 0.25f
+
+/*
+ * Terrain level of detail (CDLOD)
+ *
+ * Instead of rendering the full terrain grid, split it in a quadtree of
+ * chunks and render each chunk with a resolution that depends on its distance
+ * to the camera. All chunks are rendered with a single instanced draw of the
+ * same grid mesh, displaced in the vertex shader using the height map. As
+ * vertices get further away they morph into the next level, so we don't get
+ * popping or cracks between chunks of different levels.
+ *
+ * - TILE_SIZE: quads per side of each height map tile. Each tile is a layer
+ *   of the height map texture and the root of a chunk quadtree. Must be a
+ *   power of 2 and the number of tiles must not exceed the driver's
+ *   GL_MAX_ARRAY_TEXTURE_LAYERS.
+ * - CHUNK_SIZE: quads per side of the smallest chunks. Must be a power of 2
+ *   smaller than the tile size. The number of LOD levels is
+ *   log2(TILE_SIZE / CHUNK_SIZE) + 1 (8 at most).
+ * - DISTANCE: distance from the camera covered by the most detailed level.
+ *   Each subsequent level covers twice the distance of the previous one.
+ * - MORPH_RATIO: fraction of a level's range after which its vertices
+ *   start morphing into the next level.
+ * - MAX_CHUNKS: maximum number of chunks we can render in a single pass.
+ */
+#define TER_TERRAIN_LOD_ENABLE true
+#define TER_TERRAIN_LOD_TILE_SIZE 256
+#define TER_TERRAIN_LOD_CHUNK_SIZE 32
+#define TER_TERRAIN_LOD_DISTANCE 48.0f
+#define TER_TERRAIN_LOD_MORPH_RATIO 0.66f
+#define TER_TERRAIN_LOD_MAX_CHUNKS 4096
+
+/*
+ * Terrain streaming (requires terrain LOD)
+ *
+ * Instead of keeping the whole height map in memory, read it from a tiled
+ * heightfield file that is memory-mapped and paged in one tile at a time as
+ * the camera moves around. Tiles are loaded in a separate thread and
+ * uploaded to the GPU as they become available. Memory usage is bounded
+ * by the number of tiles we keep resident, no matter the size of the world.
+ *
+ * If the heightfield file doesn't exist (or uses different tile or chunk
+ * sizes) it is created from the heightmap texture on startup.
+ *
+ * - FILE: path to the heightfield file.
+ * - GPU_TILES: tiles resident in the height map texture.
+ * - CPU_TILES: tiles resident in system memory.
+ * - UPLOADS_PER_FRAME: maximum number of tiles uploaded to the GPU per
+ *   rendering pass.
+ */
+#define TER_TERRAIN_STREAMING_ENABLE false
+#define TER_TERRAIN_STREAMING_FILE "terrain-heightmap-01.thf"
+#define TER_TERRAIN_STREAMING_GPU_TILES 64
+#define TER_TERRAIN_STREAMING_CPU_TILES 128
+#define TER_TERRAIN_STREAMING_UPLOADS_PER_FRAME 4
+
 
 /*
  * Distance at which we stop rendering under water objects to the refraction
@@ -227,6 +410,13 @@
  */
 #define TER_WATER_REFLECTION_CLIPPING_DISTANCE 60.0f
 
+/*
+ * Level of detail bias for objects rendered to the water textures: the
+ * tolerated simplification error is multiplied by this, since the textures
+ * are distorted by the water anyway.
+ */
+#define TER_WATER_LOD_BIAS 2.0f
+
 /*
  * Enable dynamic light
  *
@@ -259,6 +449,13 @@
  */
 #define TER_SHADOW_RENDERER_ENABLE_CLIPPING true
 
+/*
+ * Level of detail bias for objects rendered to the shadow map: the tolerated
+ * simplification error is multiplied by this, since shadows are filtered
+ * and lower resolution than the scene.
+ */
+#define TER_SHADOW_RENDERER_LOD_BIAS 4.0f
+
 /* Area around the camera where shadows are casted. Larger values
  * decrease shadow quality. Too small values can make relatively
  * close obects not cast a shadow.
@@ -35,6 +35,24 @@ TerShadowRenderer *shadow_renderer = NULL;
 /* Object renderer */
 TerObjectRenderer *obj_renderer = NULL;
 
+/* Object render passes, prepared in parallel at the start of each frame */
+TerObjectRenderPass *obj_pass_scene = NULL;
+TerObjectRenderPass *obj_pass_reflection = NULL;
+TerObjectRenderPass *obj_pass_refraction = NULL;
+bool obj_pass_reflection_visible = false;
+bool obj_pass_refraction_visible = false;
+
+/* Terrain occluders of the scene objects pass */
+TerOcclusionBuffer *occlusion_buffer = NULL;
+
+/* Shadow map updates */
+bool shadow_map_rendered = false;
+int shadow_map_age = 0;
+
+/* Worker threads */
+TerThreadPool *thread_pool = NULL;
+TerStreamBuffer *stream_buffer = NULL;
+
 /* Global texture manager */
 TerTextureManager *tex_mgr = NULL;
 
@@ -177,14 +195,57 @@ create_model_variants()
    ter_model_add_variant(model, variant_mat, variant_tids, 2);
 }
 
+/*
+ * Opens the heightfield file for terrain streaming, creating it from the
+ * heightmap texture if it doesn't exist or doesn't match our settings.
+ */
+static TerHeightfield *
+open_terrain_heightfield()
+{
+   TerHeightfield *hf =
+      ter_heightfield_open(TER_TERRAIN_STREAMING_FILE,
+                           TER_TERRAIN_STREAMING_CPU_TILES);
+   if (hf &&
+       hf->header.width == TER_TERRAIN_VX &&
+       hf->header.depth == TER_TERRAIN_VZ &&
+       hf->header.tile_size == TER_TERRAIN_LOD_TILE_SIZE &&
+       hf->header.chunk_size == TER_TERRAIN_LOD_CHUNK_SIZE) {
+      return hf;
+   }
+
+   if (hf)
+      ter_heightfield_free(hf);
+
+   if (!ter_heightfield_convert_from_texture(TER_TERRAIN_STREAMING_FILE,
+                                             TER_TEX_TERRAIN_HEIGHTMAP_01,
+                                             TER_TERRAIN_VX, TER_TERRAIN_VZ,
+                                             0.0f, 12.0f,
+                                             TER_TERRAIN_LOD_TILE_SIZE,
+                                             TER_TERRAIN_LOD_CHUNK_SIZE)) {
+      return NULL;
+   }
+
+   return ter_heightfield_open(TER_TERRAIN_STREAMING_FILE,
+                               TER_TERRAIN_STREAMING_CPU_TILES);
+}
+
 static void
 load_models()
 {
    /* Terrain */
-   terrain =
-      ter_terrain_new(TER_TERRAIN_VX, TER_TERRAIN_VZ, TER_TERRAIN_TILE_SIZE);
-   ter_terrain_set_heights_from_texture(terrain, TER_TEX_TERRAIN_HEIGHTMAP_01,
-                                        0.0f, 12.0f);
+   TerHeightfield *hf = NULL;
+   if (TER_TERRAIN_STREAMING_ENABLE && TER_TERRAIN_LOD_ENABLE)
+      hf = open_terrain_heightfield();
+
+   if (hf) {
+      terrain = ter_terrain_new_from_heightfield(hf, TER_TERRAIN_TILE_SIZE);
+   } else {
+      terrain =
+         ter_terrain_new(TER_TERRAIN_VX, TER_TERRAIN_VZ, TER_TERRAIN_TILE_SIZE);
+      ter_terrain_set_heights_from_texture(terrain,
+                                           TER_TEX_TERRAIN_HEIGHTMAP_01,
+                                           0.0f, 12.0f);
+   }
    ter_terrain_build_mesh(terrain);
    terrain->material.diffuse = glm::vec3(1.0f, 1.0f, 1.0f);
    terrain->material.ambient = glm::vec3(1.0f, 1.0f, 1.0f);
@@ -211,12 +272,26 @@ load_models()
    ter_cache_set("water/water-tile-01", water);
 
    /* OBJ models */
+   TerModel *models[TER_OBJECT_TYPE_LAST];
    for (int i = 0; i < TER_OBJECT_TYPE_LAST; i++) {
-      TerModel *model = ter_model_load_obj(obj_model_list[i].path);
-      ter_cache_set(obj_model_list[i].key, model);
+      models[i] = ter_model_load_obj(obj_model_list[i].path);
+      ter_cache_set(obj_model_list[i].key, models[i]);
    }
 
    create_model_variants();
+
+   /* Merge the geometry of all the OBJ models (needs all variants) */
+   TerModelArena *model_arena =
+      ter_model_arena_new(models, TER_OBJECT_TYPE_LAST);
+   ter_cache_set("models/arena", model_arena);
+
+   /* Impostors for distant trees (needs the model arena) */
+   if (TER_IMPOSTOR_ENABLE) {
+      TerImpostorAtlas *impostors =
+         ter_impostor_atlas_new(&models[TER_OBJECT_TYPE_TREE1],
+                                TER_OBJECT_TYPE_TREE3 + 1);
+      ter_cache_set("models/impostors", impostors);
+   }
 }
 
 static void
@@ -226,6 +301,9 @@ free_obj_models()
       TerModel *m = (TerModel *) ter_cache_get(obj_model_list[i].key);
       ter_model_free(m);
    }
+   ter_model_arena_free((TerModelArena *) ter_cache_get("models/arena"));
+   ter_impostor_atlas_free(
+      (TerImpostorAtlas *) ter_cache_get("models/impostors"));
 }
 
 static void
@@ -237,20 +315,6 @@ load_skybox()
    ter_cache_set("skybox/skybox-01", skybox);
 }
 
-static void
-legalize_object_position(float *x, float *y, float *z)
-{
-   if (*x < 1.0f)
-      *x = 1.0f;
-   else if (*x >= ter_terrain_get_width(terrain))
-      *x = ter_terrain_get_width(terrain) - 1.0f;
-
-   if (*z > -1.0f)
-      *z = -1.0f;
-   else if (*z <= -ter_terrain_get_depth(terrain))
-      *z = ter_terrain_get_depth(terrain) + 1.0f;
-}
-
 static bool
 allow_underwater_object(int t)
 {
@@ -281,65 +345,60 @@ allow_rotated_object(int t)
    }
 }
 
+static void
+get_placement_types(TerObjectPlacementType *types)
+{
+   for (int i = 0; i < TER_OBJECT_TYPE_LAST; i++) {
+      types[i].constructor = obj_constructors[i];
+      types[i].count = object_count[i];
+      types[i].allow_underwater = allow_underwater_object(i);
+      types[i].allow_rotation = allow_rotated_object(i);
+   }
+}
+
 static void
 load_objects()
 {
    unsigned num_objects = 0;
 
-   obj_renderer = ter_object_renderer_new();
+   obj_renderer = ter_object_renderer_new(ter_terrain_get_width(terrain),
+                                          ter_terrain_get_depth(terrain));
    ter_cache_set("rendering/obj-renderer", obj_renderer);
 
-   int max_x = (TER_TERRAIN_VX - 1) * TER_TERRAIN_TILE_SIZE;
-   int max_z = (TER_TERRAIN_VZ - 1) * TER_TERRAIN_TILE_SIZE;
+   if (TER_OBJECT_RENDERER_GPU_CULLING_ENABLE)
+      ter_object_renderer_enable_gpu_culling(obj_renderer);
 
-   float offset_y = -0.05f;
+   obj_pass_scene =
+      ter_object_render_pass_new("scene objects",
+                                 TER_MOTION_BLUR_FILTER_ENABLE ?
+                                    TER_OBJECT_RENDER_PASS_MOTION : 0);
+   obj_pass_reflection = ter_object_render_pass_new("water reflection", 0);
+   obj_pass_reflection->lod_bias = TER_WATER_LOD_BIAS;
+   obj_pass_refraction = ter_object_render_pass_new("water refraction", 0);
+   obj_pass_refraction->lod_bias = TER_WATER_LOD_BIAS;
 
-   for (int i = 0; i < TER_OBJECT_TYPE_LAST; i++) {
-      OBJ_CONSTRUCTOR constructor = obj_constructors[i];
-      for (unsigned j = 0; j < object_count[i]; j++) {
-         float x = random() % max_x;
-         float z = -(random() % max_z);
-         float y = ter_terrain_get_height_at(terrain, x, z);
-         legalize_object_position(&x, &y, &z);
-
-         /* We only allow certain objects to be submerged */
-         if (y < TER_TERRAIN_WATER_HEIGHT - 0.25f &&
-             !allow_underwater_object(i)) {
-            j--; /* Try again */
-            continue;
-         }
-
-         float s = 1.0f + ((float)(random() % 100)) / 150.0f;
-         TerObject *o = constructor(x, y + offset_y, z, s);
-
-         if (allow_rotated_object(i))
-            o->rot.y = ((float)(random() % 360));
-
-         if (o->model->num_variants > 1)
-            o->variant = random() % o->model->num_variants;
-
-         ter_object_update_box(o);
-
-         /* Make sure we don't place objects in places where they collide
-          * with other existing objects
-          */
-         GList *objects = ter_object_renderer_get_solid(obj_renderer);
-         GList *iter = objects;
-         while (iter) {
-            TerObject *o2 = (TerObject *) iter->data;
-            if (ter_object_collision(o2, &o->box))
-               break;
-            iter = g_list_next(iter);
-         }
-         if (iter != NULL) {
-            j--; /* Try again*/
-            continue;
-         }
+   /* Reflection and refraction cameras look at the terrain from below the
+    * water, where the terrain occluders are not conservative.
+    */
+   if (TER_OCCLUSION_CULLING_ENABLE && !obj_renderer->gpu_culling) {
+      occlusion_buffer = ter_occlusion_buffer_new(TER_OCCLUSION_BUFFER_WIDTH,
+                                                  TER_OCCLUSION_BUFFER_HEIGHT);
+      obj_pass_scene->occlusion = occlusion_buffer;
+   }
 
-         ter_object_renderer_add_object(obj_renderer, o);
-         num_objects++;
-      }
+   TerObjectPlacementType types[TER_OBJECT_TYPE_LAST];
+   get_placement_types(types);
+
+   GPtrArray *objects =
+      ter_object_placement_run(terrain, thread_pool, types,
+                               TER_OBJECT_TYPE_LAST,
+                               TER_OBJECT_PLACEMENT_SEED);
+   for (unsigned i = 0; i < objects->len; i++) {
+      TerObject *o = (TerObject *) g_ptr_array_index(objects, i);
+      ter_object_renderer_add_object(obj_renderer, o);
+      num_objects++;
    }
+   g_ptr_array_free(objects, TRUE);
 
    ter_dbg(LOG_DEFAULT, "MAIN: INFO: Loaded %d objects\n", num_objects);
 }
@@ -361,6 +420,12 @@ load_shaders()
    add_shader("program/terrain", sh);
    sh = ter_shader_program_terrain_shadow_new();
    add_shader("program/terrain-shadow", sh);
+   if (TER_TERRAIN_LOD_ENABLE) {
+      sh = ter_shader_program_terrain_lod_new();
+      add_shader("program/terrain-lod", sh);
+      sh = ter_shader_program_terrain_lod_shadow_new();
+      add_shader("program/terrain-lod-shadow", sh);
+   }
 
    /* Skybox */
    sh = ter_shader_program_skybox_new();
@@ -378,6 +443,16 @@ load_shaders()
    sh = ter_shader_program_model_tex_shadow_new();
    add_shader("program/model-tex-shadow", sh);
 
+   /* Impostors */
+   sh = ter_shader_program_impostor_bake_new();
+   add_shader("program/impostor-bake", sh);
+   sh = ter_shader_program_impostor_new();
+   add_shader("program/impostor", sh);
+   sh = ter_shader_program_impostor_shadow_new();
+   add_shader("program/impostor-shadow", sh);
+   sh = ter_shader_program_impostor_shadow_map_new();
+   add_shader("program/impostor-shadow-map", sh);
+
    /* 2D Tiles */
    sh = ter_shader_program_tile_new();
    add_shader("program/tile", sh);
@@ -391,11 +466,25 @@ load_shaders()
    add_shader("program/shadow-map", sh);
    sh = ter_shader_program_shadow_map_instanced_new();
    add_shader("program/shadow-map-instanced", sh);
+   if (TER_TERRAIN_LOD_ENABLE) {
+      sh = ter_shader_program_shadow_map_terrain_lod_new();
+      add_shader("program/shadow-map-terrain-lod", sh);
+   } else {
+      sh = ter_shader_program_shadow_map_terrain_new();
+      add_shader("program/shadow-map-terrain", sh);
+   }
 
    /* Bounding box */
    sh = ter_shader_program_box_new();
    add_shader("program/box", sh);
 
+   /* GPU object culling */
+   if (TER_OBJECT_RENDERER_GPU_CULLING_ENABLE &&
+       ter_util_gl_version_at_least(4, 3)) {
+      sh = ter_shader_program_object_cull_new();
+      add_shader("program/object-cull", sh);
+   }
+
    /* Bloom - brightness */
    sh = ter_shader_program_filter_brightness_select_new(
       "../shaders/bloom-brightness.vert",
@@ -505,6 +594,13 @@ setup_scene()
 {
    setup_gl();
 
+   thread_pool = ter_thread_pool_new(TER_THREAD_POOL_THREADS);
+   ter_cache_set("threads/pool", thread_pool);
+
+   stream_buffer = ter_stream_buffer_new(TER_STREAM_BUFFER_FRAME_BYTES,
+                                         TER_STREAM_BUFFER_FRAMES_IN_FLIGHT);
+   ter_cache_set("rendering/stream-buffer", stream_buffer);
+
    /* Load resources */
    load_shaders();
    load_textures();
@@ -619,9 +715,37 @@ update_terrain_index_buffer()
    float far_dist = MAX(far_dist_x, far_dist_z);
 
    TerClipVolume clip;
-   ter_camera_get_clipping_box_for_distance(cam, far_dist, &clip);
+   if (TER_TERRAIN_ENABLE_CLIPPING) {
+      ter_camera_get_clipping_box_for_distance(cam, far_dist, &clip);
+   } else {
+      /* Terrain LOD needs to select chunks even if we don't clip */
+      clip.x0 = 0.0f;
+      clip.x1 = ter_terrain_get_width(terrain);
+      clip.z0 = -ter_terrain_get_depth(terrain);
+      clip.z1 = 0.0f;
+      clip.y0 = -FLT_MAX;
+      clip.y1 = FLT_MAX;
+   }
 
-   ter_terrain_update_index_buffer_for_clip_volume(terrain, &clip);
+   /* Cull terrain chunks against the camera frustum. The water reflection
+    * pass reuses this selection with the camera mirrored about the water
+    * plane, so keep whatever is visible to the mirrored camera too.
+    */
+   glm::mat4 ViewProj = Projection * ter_camera_get_view_matrix(cam);
+   glm::mat4 Reflect = glm::translate(glm::mat4(1.0f),
+                                      glm::vec3(0.0f, water->h, 0.0f)) *
+                       glm::scale(glm::mat4(1.0f),
+                                  glm::vec3(1.0f, -1.0f, 1.0f)) *
+                       glm::translate(glm::mat4(1.0f),
+                                      glm::vec3(0.0f, -water->h, 0.0f));
+   glm::mat4 ViewProjReflect = ViewProj * Reflect;
+
+   TerFrustum frustums[2];
+   ter_util_frustum_from_matrix(&frustums[0], &ViewProj);
+   ter_util_frustum_from_matrix(&frustums[1], &ViewProjReflect);
+
+   ter_terrain_update_index_buffer_for_clip_volume(terrain, &clip,
+                                                   frustums, 2);
 }
 
 static void
@@ -642,16 +766,9 @@ render_water_refraction()
       glEnable(GL_CLIP_DISTANCE0);
 
       /* We don't want to render stuff outside the viewing frustum or objects
-       * above the water level
+       * above the water level (see prepare_water_refraction_objects())
        */
-      TerClipVolume clip;
-      TerCamera *cam = (TerCamera *) ter_cache_get("camera/main");
-      ter_camera_get_clipping_box_for_distance(
-         cam, TER_WATER_REFRACTION_CLIPPING_DISTANCE, &clip);
-
-      if (clip.y0 < Y_clip_height) {
-         if (clip.y1 >= Y_clip_height)
-            clip. y1 = Y_clip_height;
+      if (obj_pass_refraction_visible) {
          /* Refracted objects also write to the depth texture. This means that
           * water depth around them will be small which will make it
           * transparent and not distorted when rendered by the water shader.
@@ -668,13 +785,10 @@ render_water_refraction()
          /* Because the refraction texture includes depth information we
           * render it with TER_FAR_PLANE so that the water shader can use it.
           */
-         ter_object_renderer_render_clipped(obj_renderer,
+         ter_object_renderer_render_pass(obj_renderer, obj_pass_refraction,
             TER_WATER_REFRACTION_CLIPPING_DISTANCE, TER_FAR_PLANE,
             true,
-            TER_WATER_REFRACTION_SHADOWS_ENABLE, TER_SHADOW_PFC_WATER,
-            &clip,
-            false,
-            "water refraction");
+            TER_WATER_REFRACTION_SHADOWS_ENABLE, TER_SHADOW_PFC_WATER);
 
          if (!TER_WATER_REFRACTION_RECORD_OBJECT_DEPTH)
             glEnable(GL_DEPTH_TEST);
@@ -719,24 +833,15 @@ render_water_reflection()
       glEnable(GL_CLIP_DISTANCE0);
 
       /* We don't want to render stuff outside the viewing frustum or objects
-       * under the water level
+       * under the water level (see prepare_water_reflection_objects())
        */
-      TerClipVolume clip;
-      ter_camera_get_clipping_box_for_distance(
-         cam, TER_WATER_REFLECTION_CLIPPING_DISTANCE, &clip);
-      if (clip.y1 >= Y_clip_height) {
-         if (clip.y0 < Y_clip_height)
-            clip. y0 = Y_clip_height;
-
-         ter_object_renderer_render_clipped(obj_renderer,
+      if (obj_pass_reflection_visible) {
+         ter_object_renderer_render_pass(obj_renderer, obj_pass_reflection,
             TER_WATER_REFLECTION_CLIPPING_DISTANCE,
             TER_WATER_REFLECTION_CLIPPING_DISTANCE,
             true,
             TER_WATER_REFLECTION_SHADOWS_ENABLE,
-            TER_SHADOW_PFC_WATER,
-            &clip,
-            false,
-            "water reflection");
+            TER_SHADOW_PFC_WATER);
       }
 
       ter_terrain_render(terrain, TER_WATER_REFLECTION_SHADOWS_ENABLE, false);
@@ -774,19 +879,12 @@ render_water_textures()
 }
 
 static void
-render_objects(bool enable_shadows, bool render_motion)
+render_objects(bool enable_shadows)
 {
-   TerClipVolume clip;
-   TerCamera *cam = (TerCamera *) ter_cache_get("camera/main");
-   ter_camera_get_clipping_box_for_distance(
-      cam, TER_FAR_PLANE, &clip);
-   ter_object_renderer_render_clipped(obj_renderer,
+   ter_object_renderer_render_pass(obj_renderer, obj_pass_scene,
       TER_FAR_PLANE, TER_FAR_PLANE,
       true,
-      enable_shadows, TER_SHADOW_PFC,
-      &clip,
-      render_motion,
-      "scene objects");
+      enable_shadows, TER_SHADOW_PFC);
 }
 
 static void
@@ -819,12 +917,9 @@ render_motion_tile()
    ter_tile_render(tile);
 }
 
-static void
-render_shadow_map()
+static bool
+shadow_map_needs_update()
 {
-   static bool shadow_map_rendered = false;
-   static int shadow_map_age = 0;
-
    /* If static lighting is enabled we fix the shadow-map update rate to
     * once every 30 frames to boost performance.
     */
@@ -832,11 +927,18 @@ render_shadow_map()
        (TER_DYNAMIC_LIGHT_ENABLE &&
         shadow_map_age == TER_SHADOW_UPDATE_INTERVAL) ||
        (!TER_DYNAMIC_LIGHT_ENABLE && shadow_map_age == 30)) {
-      shadow_map_rendered = ter_shadow_renderer_render(shadow_renderer);
       shadow_map_age = 0;
-   } else {
-      shadow_map_age++;
+      return true;
    }
+
+   shadow_map_age++;
+   return false;
+}
+
+static void
+render_shadow_map()
+{
+   shadow_map_rendered = ter_shadow_renderer_render(shadow_renderer);
 }
 
 static inline void
@@ -909,7 +1011,7 @@ render_result()
        * be closer to the camera and last things that are further away and/or
        * more expensive to render.
        */
-      render_objects(true, TER_MOTION_BLUR_FILTER_ENABLE);
+      render_objects(true);
       ter_terrain_render(terrain, true, TER_MOTION_BLUR_FILTER_ENABLE);
       ter_water_tile_render(water, TER_MOTION_BLUR_FILTER_ENABLE);
       ter_skybox_render(skybox, TER_MOTION_BLUR_FILTER_ENABLE);
@@ -939,20 +1041,120 @@ render_result()
                                      GL_COLOR_ATTACHMENT0);
 }
 
+static bool
+prepare_water_refraction_objects(TerCamera *cam)
+{
+   /* Only objects below the water level */
+   float Y_clip_height = water->h + TER_WATER_REFRACTION_CLIPPING_OFFSET;
+
+   TerObjectRenderPass *p = obj_pass_refraction;
+   ter_camera_get_clipping_box_for_distance(
+      cam, TER_WATER_REFRACTION_CLIPPING_DISTANCE, &p->clip);
+   if (p->clip.y0 >= Y_clip_height)
+      return false;
+   if (p->clip.y1 >= Y_clip_height)
+      p->clip.y1 = Y_clip_height;
+
+   ter_camera_get_frustum_for_distance(
+      cam, TER_WATER_REFRACTION_CLIPPING_DISTANCE, &p->frustum);
+   p->use_frustum = true;
+   p->lod_origin = cam->pos;
+   return true;
+}
+
+static bool
+prepare_water_reflection_objects(TerCamera *cam)
+{
+   /* Only objects above the water level, seen from the reflected camera
+    * (see render_water_reflection())
+    */
+   float Y_clip_height = water->h - TER_WATER_REFLECTION_CLIPPING_OFFSET;
+
+   TerCamera reflected = *cam;
+   reflected.pos.y -= 2 * (cam->pos.y - water->h);
+   reflected.rot.x = -reflected.rot.x;
+
+   TerObjectRenderPass *p = obj_pass_reflection;
+   ter_camera_get_clipping_box_for_distance(
+      &reflected, TER_WATER_REFLECTION_CLIPPING_DISTANCE, &p->clip);
+   if (p->clip.y1 < Y_clip_height)
+      return false;
+   if (p->clip.y0 < Y_clip_height)
+      p->clip.y0 = Y_clip_height;
+
+   ter_camera_get_frustum_for_distance(
+      &reflected, TER_WATER_REFLECTION_CLIPPING_DISTANCE, &p->frustum);
+   p->use_frustum = true;
+   p->lod_origin = reflected.pos;
+   return true;
+}
+
+/*
+ * Sets up the object render passes for the frame and computes their visible
+ * objects and instance data in parallel, so the render passes only have to
+ * draw.
+ */
+static void
+prepare_object_passes(bool update_shadow_map)
+{
+   TerCamera *cam = (TerCamera *) ter_cache_get("camera/main");
+   TerObjectRenderPass *passes[3 + TER_MAX_CSM_LEVELS];
+   unsigned num_passes = 0;
+
+   TerObjectRenderPass *p = obj_pass_scene;
+   ter_camera_get_clipping_box_for_distance(cam, TER_FAR_PLANE, &p->clip);
+   ter_camera_get_frustum_for_distance(cam, TER_FAR_PLANE, &p->frustum);
+   p->use_frustum = true;
+   p->VP = Projection * ter_camera_get_view_matrix(cam);
+   p->lod_origin = cam->pos;
+   passes[num_passes++] = p;
+
+   if (p->occlusion) {
+      ter_occlusion_buffer_begin(p->occlusion, &p->VP);
+      ter_terrain_add_occluders(terrain, p->occlusion,
+                                TER_OCCLUSION_TERRAIN_LEVEL,
+                                &p->clip, &p->frustum);
+      ter_occlusion_buffer_rasterize(p->occlusion, thread_pool);
+   }
+
+   obj_pass_reflection_visible = prepare_water_reflection_objects(cam);
+   if (obj_pass_reflection_visible)
+      passes[num_passes++] = obj_pass_reflection;
+
+   /* See render_water_textures() */
+   obj_pass_refraction_visible =
+      cam->dirty && prepare_water_refraction_objects(cam);
+   if (obj_pass_refraction_visible)
+      passes[num_passes++] = obj_pass_refraction;
+
+   if (update_shadow_map) {
+      num_passes += ter_shadow_renderer_prepare(shadow_renderer,
+                                                passes + num_passes);
+   }
+
+   ter_object_renderer_prepare(obj_renderer, thread_pool, passes, num_passes);
+}
+
 /**
  * Renders the current frame
  */
 static void
 render_scene()
 {
+   bool update_shadow_map = shadow_map_needs_update();
+
+   /* Compute object visibility for all the passes of the frame */
+   prepare_object_passes(update_shadow_map);
+
    /* Render shadow map */
-   render_shadow_map();
+   if (update_shadow_map)
+      render_shadow_map();
 
    /* After rendering the shadow map, subsequent rendering passes will
     * always render the same region of the terrain, so update the index
     * buffer with the current clipping region only once
     */
-   if (TER_TERRAIN_ENABLE_CLIPPING)
+   if (TER_TERRAIN_ENABLE_CLIPPING || TER_TERRAIN_LOD_ENABLE)
       update_terrain_index_buffer();
 
    /* Render water textures */
@@ -972,20 +1174,8 @@ check_for_camera_collision(TerCamera *cam)
 
    /* Check for collisions against objects only, we correct the camera's
     * height automatically if it collides against the terrain.
-    *
-    * FIXME: split the terrain in sectors and assign objects to them, then
-    * only test for collisions with objects in the same sector as the camera.
     */
-   GList *objects = ter_object_renderer_get_solid(obj_renderer);
-   GList *iter = objects;
-   while (iter) {
-      TerObject *o = (TerObject *) iter->data;
-      if (ter_object_collision(o, cam_box))
-         return true;
-      iter = g_list_next(iter);
-   }
-
-   return false;
+   return ter_object_renderer_collides(obj_renderer, cam_box);
 }
 
 static void
@@ -1112,6 +1302,29 @@ frame_end()
          if (fps_frames == 60) {
             ter_dbg(LOG_FPS,
                     "STATS: INFO: FPS: %.2f\n", fps_frames / fps_total_time);
+            TerRenderStats *rs = &obj_renderer->stats;
+            ter_dbg(LOG_FPS,
+                    "STATS: INFO: Objects: %u program binds, %u texture "
+                    "binds, %u VAO binds, %u draw calls per frame\n",
+                    rs->program_binds, rs->texture_binds, rs->vao_binds,
+                    rs->draw_calls);
+            TerStreamBufferStats *ss = &stream_buffer->stats;
+            ter_dbg(LOG_FPS,
+                    "STATS: INFO: Streaming: %u KB last frame (%u KB peak), "
+                    "%u stalls (%.2f ms), %u overflows, %u grows in %u "
+                    "frames\n",
+                    (unsigned) (ss->frame_bytes / 1024),
+                    (unsigned) (ss->peak_frame_bytes / 1024),
+                    ss->stalls, ss->stall_ms, ss->overflows, ss->grows,
+                    ss->frames);
+            if (occlusion_buffer) {
+               TerOcclusionBufferStats *os = &occlusion_buffer->stats;
+               ter_dbg(LOG_FPS,
+                       "STATS: INFO: Occlusion: %u triangles (%.2f ms), "
+                       "%u objects occluded in the %s pass\n",
+                       os->triangles, os->raster_ms,
+                       obj_pass_scene->num_occluded, obj_pass_scene->stage);
+            }
             fps_total_run_time += fps_total_time;
             fps_total_run_frames += fps_frames;
             fps_total_time = 0.0;
@@ -1151,6 +1364,38 @@ show_statistics()
    }
 }
 
+static void
+run_benchmarks()
+{
+   ter_bench_terrain_height_queries(terrain, TER_BENCH_HEIGHT_QUERIES,
+                                    TER_BENCH_ROUNDS);
+   ter_bench_terrain_mesh_build(thread_pool, TER_BENCH_MESH_MIN_SIZE,
+                                TER_BENCH_MESH_MAX_SIZE, TER_BENCH_ROUNDS);
+   ter_bench_terrain_raycast(thread_pool, TER_BENCH_RAYCAST_MIN_SIZE,
+                             TER_BENCH_RAYCAST_MAX_SIZE, TER_BENCH_RAYCAST_RAYS,
+                             TER_BENCH_ROUNDS);
+   ter_bench_terrain_edits(terrain, TER_BENCH_EDITS_PER_SEC,
+                           TER_BENCH_EDIT_RADIUS, TER_BENCH_ROUNDS);
+   ter_bench_object_culling(obj_renderer,
+                            (TerCamera *) ter_cache_get("camera/main"),
+                            TER_FAR_PLANE, TER_BENCH_CULLING_VIEWS,
+                            TER_BENCH_ROUNDS);
+
+   /* Fill the scene with grass up to TER_BENCH_PLACEMENT_OBJECTS */
+   TerObjectPlacementType types[TER_OBJECT_TYPE_LAST];
+   get_placement_types(types);
+   unsigned count = 0;
+   for (int i = 0; i < TER_OBJECT_TYPE_LAST; i++)
+      count += types[i].count;
+   if (count < TER_BENCH_PLACEMENT_OBJECTS) {
+      unsigned grass = TER_BENCH_PLACEMENT_OBJECTS - count;
+      types[TER_OBJECT_TYPE_GRASS1].count += grass / 2;
+      types[TER_OBJECT_TYPE_GRASS2].count += grass - grass / 2;
+   }
+   ter_bench_object_placement(terrain, thread_pool, types,
+                              TER_OBJECT_TYPE_LAST, TER_BENCH_ROUNDS);
+}
+
 /**
  * Free allocated resources and deinit GLFW
  */
@@ -1165,6 +1410,11 @@ teardown()
       ter_bloom_filter_free(bloom_filter);
    if (motion_blur_filter)
       ter_motion_blur_filter_free(motion_blur_filter);
+   ter_object_render_pass_free(obj_pass_scene);
+   ter_object_render_pass_free(obj_pass_reflection);
+   ter_object_render_pass_free(obj_pass_refraction);
+   if (occlusion_buffer)
+      ter_occlusion_buffer_free(occlusion_buffer);
    ter_object_renderer_free(obj_renderer);
    free_obj_models();
    ter_terrain_free(terrain);
@@ -1174,6 +1424,8 @@ teardown()
    ter_texture_manager_free(tex_mgr);
    free_shaders();
    free_lights();
+   ter_stream_buffer_free(stream_buffer);
+   ter_thread_pool_free(thread_pool);
    ter_cache_clear();
    glfwTerminate();
 }
@@ -1184,11 +1436,12 @@ teardown()
 int
 main()
 {
-   srandom(time(NULL));
-
    setup_glfw();
    setup_scene();
 
+   if (TER_DEBUG_RUN_BENCHMARKS)
+      run_benchmarks();
+
    do {
       frame_start();
 
@@ -1196,6 +1449,9 @@ main()
 
       render_scene();
 
+      /* Fence the data streamed for this frame */
+      ter_stream_buffer_next_frame(stream_buffer);
+
       glfwSwapBuffers(window);
       glfwPollEvents();
 
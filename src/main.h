@@ -9,6 +9,7 @@
 
 #include <glib.h>
 #include <math.h>
+#include <float.h>
 
 #define GL_GLEXT_PROTOTYPES 1
 #include <GL/gl.h>
@@ -26,12 +27,19 @@
 #include "ter-cache.h"
 #include "ter-light.h"
 #include "ter-shader-program.h"
+#include "ter-thread-pool.h"
+#include "ter-stream-buffer.h"
+#include "ter-arena.h"
+#include "ter-heightfield.h"
+#include "ter-occlusion-buffer.h"
 #include "ter-terrain.h"
 #include "ter-sky-box.h"
 #include "ter-model.h"
+#include "ter-impostor.h"
 #include "ter-object.h"
 #include "ter-object-catalog.h"
 #include "ter-object-renderer.h"
+#include "ter-object-placement.h"
 #include "ter-render-texture.h"
 #include "ter-tile.h"
 #include "ter-water-tile.h"
@@ -39,6 +47,7 @@
 #include "ter-shadow-box.h"
 #include "ter-shadow-renderer.h"
 #include "ter-filter.h"
+#include "ter-bench.h"
 
 #include "main-constants.h"
 
@@ -0,0 +1,67 @@
+#include "main.h"
+
+/* Block data starts after the header, at a cache line boundary */
+#define ARENA_BLOCK_HEADER_SIZE 64
+
+TerArena *
+ter_arena_new(size_t block_size)
+{
+   TerArena *a = g_new0(TerArena, 1);
+   a->block_size = block_size;
+   return a;
+}
+
+void
+ter_arena_free(TerArena *a)
+{
+   TerArenaBlock *b = a->blocks;
+   while (b) {
+      TerArenaBlock *next = b->next;
+      free(b);
+      b = next;
+   }
+   g_free(a);
+}
+
+static TerArenaBlock *
+arena_new_block(TerArena *a, size_t min_size)
+{
+   size_t size = MAX(a->block_size, min_size);
+   void *mem = NULL;
+   if (posix_memalign(&mem, ARENA_BLOCK_HEADER_SIZE,
+                      ARENA_BLOCK_HEADER_SIZE + size) != 0) {
+      ter_dbg(LOG_DEFAULT,
+              "ARENA: ERROR: failed to allocate block of %lu bytes\n",
+              (unsigned long) size);
+      abort();
+   }
+
+   TerArenaBlock *b = (TerArenaBlock *) mem;
+   b->size = size;
+   b->used = 0;
+   b->next = a->blocks;
+   a->blocks = b;
+   a->allocated += size;
+   return b;
+}
+
+/*
+ * Returns bytes of uninitialized memory aligned to align (a power of two no
+ * larger than a cache line). The memory is owned by the arena.
+ */
+void *
+ter_arena_alloc(TerArena *a, size_t bytes, size_t align)
+{
+   assert(align > 0 && align <= ARENA_BLOCK_HEADER_SIZE &&
+          (align & (align - 1)) == 0);
+
+   TerArenaBlock *b = a->blocks;
+   size_t offset = b ? (b->used + align - 1) & ~(align - 1) : 0;
+   if (!b || offset + bytes > b->size) {
+      b = arena_new_block(a, bytes);
+      offset = 0;
+   }
+
+   b->used = offset + bytes;
+   return ((uint8_t *) b) + ARENA_BLOCK_HEADER_SIZE + offset;
+}
@@ -0,0 +1,35 @@
+#ifndef __TER_ARENA_H__
+#define __TER_ARENA_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Bump allocator. Memory is carved out of large blocks and released all at
+ * once when the arena is freed, so allocations are cheap and data allocated
+ * together stays close in memory.
+ */
+typedef struct _TerArenaBlock TerArenaBlock;
+
+struct _TerArenaBlock {
+   TerArenaBlock *next;
+   size_t size;
+   size_t used;
+};
+
+typedef struct {
+   TerArenaBlock *blocks;     /* Most recent first */
+   size_t block_size;
+   size_t allocated;
+} TerArena;
+
+TerArena *ter_arena_new(size_t block_size);
+void ter_arena_free(TerArena *a);
+
+void *ter_arena_alloc(TerArena *a, size_t bytes, size_t align);
+
+#define ter_arena_new0(a, type, count) \
+   ((type *) memset(ter_arena_alloc((a), sizeof(type) * (count), 64), 0, \
+                    sizeof(type) * (count)))
+
+#endif
@@ -0,0 +1,465 @@
+#include "main.h"
+
+/*
+ * Micro-benchmarks for CPU-side hot paths. These run once at startup when
+ * TER_DEBUG_RUN_BENCHMARKS is enabled and report their results on stdout
+ * using the same format as the frame statistics.
+ */
+
+static inline double
+bench_time_ms()
+{
+   return g_get_monotonic_time() / 1000.0;
+}
+
+static void
+bench_report_ops(const char *name, double ms, unsigned ops, unsigned rounds,
+                 const char *op_name)
+{
+   double ops_per_sec = ((double) ops) * rounds / (ms / 1000.0);
+   printf("BENCH: INFO: %s: %.3f ms/round, %.2f M %s/s\n",
+          name, ms / rounds, ops_per_sec / 1000000.0, op_name);
+}
+
+static inline void
+bench_report(const char *name, double ms, unsigned ops, unsigned rounds)
+{
+   bench_report_ops(name, ms, ops, rounds, "queries");
+}
+
+/*
+ * Compares ter_terrain_get_height_at() against ter_terrain_get_heights_at()
+ * for the same set of random positions within the terrain.
+ */
+void
+ter_bench_terrain_height_queries(TerTerrain *t, unsigned count,
+                                 unsigned rounds)
+{
+   float *x = g_new(float, count);
+   float *z = g_new(float, count);
+   float *h_scalar = g_new(float, count);
+   float *h_batch = g_new(float, count);
+
+   /* Use a fixed seed so results are comparable across runs */
+   GRand *rand = g_rand_new_with_seed(0);
+   float w = ter_terrain_get_width(t);
+   float d = ter_terrain_get_depth(t);
+   for (unsigned i = 0; i < count; i++) {
+      x[i] = g_rand_double_range(rand, 0.0, w);
+      z[i] = -g_rand_double_range(rand, 0.0, d);
+   }
+   g_rand_free(rand);
+
+   /* Warm up so lazy plane computation is not accounted for */
+   ter_terrain_get_heights_at(t, x, z, h_batch, MIN(count, 4));
+
+   double start = bench_time_ms();
+   for (unsigned r = 0; r < rounds; r++) {
+      for (unsigned i = 0; i < count; i++)
+         h_scalar[i] = ter_terrain_get_height_at(t, x[i], z[i]);
+   }
+   bench_report("terrain height (scalar)", bench_time_ms() - start,
+                count, rounds);
+
+   start = bench_time_ms();
+   for (unsigned r = 0; r < rounds; r++)
+      ter_terrain_get_heights_at(t, x, z, h_batch, count);
+   bench_report("terrain height (batched)", bench_time_ms() - start,
+                count, rounds);
+
+   float max_error = 0.0f;
+   for (unsigned i = 0; i < count; i++)
+      max_error = MAX(max_error, fabsf(h_scalar[i] - h_batch[i]));
+   printf("BENCH: INFO: terrain height: max. scalar/batched difference: %f\n",
+          max_error);
+
+   g_free(x);
+   g_free(z);
+   g_free(h_scalar);
+   g_free(h_batch);
+}
+
+/*
+ * Measures the time it takes to build the terrain vertex data for grids of
+ * min_size^2 to max_size^2 quads (doubling the size each time), both in the
+ * calling thread and using the thread pool. Smaller grids run more rounds.
+ */
+void
+ter_bench_terrain_mesh_build(TerThreadPool *pool, unsigned min_size,
+                             unsigned max_size, unsigned rounds)
+{
+   for (unsigned size = min_size; size <= max_size; size *= 2) {
+      TerTerrain *t = ter_terrain_new(size + 1, size + 1, 1.0f);
+      for (int x = 0; x < t->width; x++) {
+         for (int z = 0; z < t->depth; z++)
+            TERRAIN(t, x, z) = sinf(x * 0.05f) * cosf(z * 0.03f) * 10.0f;
+      }
+
+      unsigned size_rounds =
+         MAX(1, rounds * (min_size * min_size) / (size * size));
+      unsigned num_vertices = t->width * t->depth;
+      char name[64];
+
+      /* Warm up, this also allocates the vertex data */
+      ter_terrain_build_vertices(t, pool);
+
+      double start = bench_time_ms();
+      for (unsigned r = 0; r < size_rounds; r++)
+         ter_terrain_build_vertices(t, NULL);
+      snprintf(name, sizeof(name), "terrain mesh %u^2 (1 thread)", size);
+      bench_report_ops(name, bench_time_ms() - start, num_vertices,
+                       size_rounds, "vertices");
+
+      start = bench_time_ms();
+      for (unsigned r = 0; r < size_rounds; r++)
+         ter_terrain_build_vertices(t, pool);
+      snprintf(name, sizeof(name), "terrain mesh %u^2 (pool of %u)",
+               size, pool ? pool->num_threads : 1);
+      bench_report_ops(name, bench_time_ms() - start, num_vertices,
+                       size_rounds, "vertices");
+
+      ter_terrain_free(t);
+   }
+}
+
+/*
+ * Reference ray-cast that marches the ray in steps of half a quad using
+ * ter_terrain_get_height_at(), refining the hit by linear interpolation.
+ */
+static bool
+bench_raycast_march(TerTerrain *t, glm::vec3 o, glm::vec3 d, float max_dist,
+                    float *hit_dist)
+{
+   float dt = 0.5f * t->step / glm::length(d);
+   float prev_t = 0.0f;
+   float prev_f = o.y - ter_terrain_get_height_at(t, o.x, o.z);
+   if (prev_f <= 0.0f) {
+      *hit_dist = 0.0f;
+      return true;
+   }
+
+   for (float s = dt; prev_t < max_dist; s += dt) {
+      s = MIN(s, max_dist);
+      glm::vec3 p = o + d * s;
+      if (p.x < 0.0f || p.x > ter_terrain_get_width(t) ||
+          p.z > 0.0f || p.z < -ter_terrain_get_depth(t))
+         return false;
+
+      float f = p.y - ter_terrain_get_height_at(t, p.x, p.z);
+      if (f <= 0.0f) {
+         *hit_dist = prev_t + (s - prev_t) * prev_f / (prev_f - f);
+         return true;
+      }
+      prev_t = s;
+      prev_f = f;
+   }
+
+   return false;
+}
+
+/*
+ * Measures ray-casts against terrains of min_size^2 to max_size^2 quads
+ * (doubling the size each time), comparing a naive ray march against
+ * ter_terrain_raycast() and ter_terrain_raycast_batch(). Rays start above
+ * the terrain and look in random directions, mostly downwards, so most of
+ * them hit the terrain after a long traversal.
+ */
+void
+ter_bench_terrain_raycast(TerThreadPool *pool, unsigned min_size,
+                          unsigned max_size, unsigned num_rays,
+                          unsigned rounds)
+{
+   glm::vec3 *origin = g_new(glm::vec3, num_rays);
+   glm::vec3 *dir = g_new(glm::vec3, num_rays);
+   float *hit_march = g_new(float, num_rays);
+   float *hit_batch = g_new(float, num_rays);
+
+   for (unsigned size = min_size; size <= max_size; size *= 2) {
+      TerTerrain *t = ter_terrain_new(size + 1, size + 1, 1.0f);
+      for (int x = 0; x < t->width; x++) {
+         for (int z = 0; z < t->depth; z++) {
+            TERRAIN(t, x, z) = sinf(x * 0.05f) * cosf(z * 0.03f) * 10.0f +
+                               sinf(x * 0.31f + z * 0.17f) * 2.0f;
+         }
+      }
+
+      /* Use a fixed seed so results are comparable across runs */
+      GRand *rand = g_rand_new_with_seed(0);
+      float w = ter_terrain_get_width(t);
+      float d = ter_terrain_get_depth(t);
+      for (unsigned i = 0; i < num_rays; i++) {
+         float x = g_rand_double_range(rand, 0.0, w);
+         float z = -g_rand_double_range(rand, 0.0, d);
+         float y = ter_terrain_get_height_at(t, x, z) +
+                   g_rand_double_range(rand, 1.0, 20.0);
+         float yaw = g_rand_double_range(rand, 0.0, 2.0 * M_PI);
+         float pitch = g_rand_double_range(rand, -0.3, 0.05);
+         origin[i] = glm::vec3(x, y, z);
+         dir[i] = glm::vec3(cosf(yaw) * cosf(pitch), sinf(pitch),
+                            sinf(yaw) * cosf(pitch));
+      }
+      g_rand_free(rand);
+
+      float max_dist = MAX(w, d) * 1.5f;
+      unsigned size_rounds = MAX(1, rounds * min_size / size);
+      char name[64];
+
+      /* Warm up so lazy plane and pyramid computation is not accounted for */
+      ter_terrain_raycast_batch(t, NULL, origin, dir, max_dist, hit_batch, 1);
+
+      /* The naive march is slow, so we only run it on a subset of the rays */
+      unsigned num_march = MAX(1, num_rays / 16);
+      double start = bench_time_ms();
+      for (unsigned i = 0; i < num_march; i++) {
+         if (!bench_raycast_march(t, origin[i], dir[i], max_dist,
+                                  &hit_march[i]))
+            hit_march[i] = -1.0f;
+      }
+      snprintf(name, sizeof(name), "terrain raycast %u^2 (march)", size);
+      bench_report_ops(name, bench_time_ms() - start, num_march, 1, "rays");
+
+      start = bench_time_ms();
+      for (unsigned r = 0; r < size_rounds; r++) {
+         for (unsigned i = 0; i < num_rays; i++) {
+            if (!ter_terrain_raycast(t, origin[i], dir[i], max_dist,
+                                     &hit_batch[i]))
+               hit_batch[i] = -1.0f;
+         }
+      }
+      snprintf(name, sizeof(name), "terrain raycast %u^2 (pyramid)", size);
+      bench_report_ops(name, bench_time_ms() - start, num_rays,
+                       size_rounds, "rays");
+
+      start = bench_time_ms();
+      for (unsigned r = 0; r < size_rounds; r++) {
+         ter_terrain_raycast_batch(t, pool, origin, dir, max_dist,
+                                   hit_batch, num_rays);
+      }
+      snprintf(name, sizeof(name), "terrain raycast %u^2 (pool of %u)",
+               size, pool ? pool->num_threads : 1);
+      bench_report_ops(name, bench_time_ms() - start, num_rays,
+                       size_rounds, "rays");
+
+      /* The march can step over thin features, so expect a few misses */
+      unsigned mismatches = 0;
+      float max_error = 0.0f;
+      for (unsigned i = 0; i < num_march; i++) {
+         if ((hit_march[i] < 0.0f) != (hit_batch[i] < 0.0f))
+            mismatches++;
+         else if (hit_march[i] >= 0.0f)
+            max_error = MAX(max_error, fabsf(hit_march[i] - hit_batch[i]));
+      }
+      printf("BENCH: INFO: terrain raycast %u^2: %u/%u hit mismatches "
+             "against march, max. distance difference: %f\n",
+             size, mismatches, num_march, max_error);
+
+      ter_terrain_free(t);
+   }
+
+   g_free(origin);
+   g_free(dir);
+   g_free(hit_march);
+   g_free(hit_batch);
+}
+
+/*
+ * Measures the cost of runtime terrain edits on the scene terrain: one
+ * second worth of edits_per_sec small deformations, spread over 60 frames.
+ * Edits come in pairs that raise and then lower the same spot, and the
+ * heights are restored afterwards, so the terrain is left exactly as it was.
+ * Streamed terrains are read-only, so there is nothing to measure.
+ */
+void
+ter_bench_terrain_edits(TerTerrain *t, unsigned edits_per_sec, float radius,
+                        unsigned rounds)
+{
+   if (t->hf) {
+      printf("BENCH: INFO: terrain edits: skipped, the terrain is streamed\n");
+      return;
+   }
+
+   const unsigned frames = 60;
+   unsigned edits_per_frame = MAX(2, (edits_per_sec / frames) & ~1);
+   unsigned num_edits = edits_per_frame * frames;
+
+   /* Use a fixed seed so results are comparable across runs */
+   GRand *rand = g_rand_new_with_seed(0);
+   float w = ter_terrain_get_width(t);
+   float d = ter_terrain_get_depth(t);
+   float *x = g_new(float, num_edits / 2);
+   float *z = g_new(float, num_edits / 2);
+   for (unsigned i = 0; i < num_edits / 2; i++) {
+      x[i] = g_rand_double_range(rand, 0.0, w);
+      z[i] = -g_rand_double_range(rand, 0.0, d);
+   }
+   g_rand_free(rand);
+
+   size_t height_bytes = t->width * t->depth * sizeof(float);
+   float *saved_height = g_new(float, t->width * t->depth);
+   memcpy(saved_height, t->height, height_bytes);
+
+   glFinish();
+   double start = bench_time_ms();
+   double max_frame = 0.0;
+   for (unsigned r = 0; r < rounds; r++) {
+      for (unsigned f = 0; f < frames; f++) {
+         double frame_start = bench_time_ms();
+         for (unsigned e = f * edits_per_frame / 2;
+              e < (f + 1) * edits_per_frame / 2; e++) {
+            ter_terrain_deform(t, x[e], z[e], radius, 1.0f);
+            ter_terrain_deform(t, x[e], z[e], radius, -1.0f);
+         }
+         glFinish();
+         max_frame = MAX(max_frame, bench_time_ms() - frame_start);
+      }
+   }
+   double ms = bench_time_ms() - start;
+
+   bench_report_ops("terrain edits", ms, num_edits, rounds, "edits");
+   printf("BENCH: INFO: terrain edits: %u edits/s cost %.3f ms/frame "
+          "(worst %.3f ms) at %u fps\n", num_edits, ms / (rounds * frames),
+          max_frame, frames);
+
+   memcpy(t->height, saved_height, height_bytes);
+   ter_terrain_update_region(t, 0, 0, t->width - 1, t->depth - 1);
+   g_free(saved_height);
+
+   g_free(x);
+   g_free(z);
+}
+
+/*
+ * The angular test the object renderer used before frustum plane culling:
+ * an object is visible if any corner of its box is within the far plane and
+ * at an angle from the view direction smaller than the FOV (plus a margin).
+ * Only kept here as a reference.
+ */
+static bool
+bench_cull_angular(TerObjectSet *s, unsigned i, const TerClipVolume *clip,
+                   float far_plane, glm::vec3 cam_pos, glm::vec3 view_dir)
+{
+   float x0 = s->x0[i], x1 = s->x1[i];
+   float y0 = s->y0[i], y1 = s->y1[i];
+   float z0 = s->z0[i], z1 = s->z1[i];
+
+   bool outside = x1 < clip->x0 || x0 > clip->x1 ||
+                  z1 < clip->z0 || z0 > clip->z1 ||
+                  y1 < clip->y0 || y0 > clip->y1;
+   if (outside)
+      return false;
+
+   for (int c = 0; c < 8; c++) {
+      glm::vec3 corner((c & 4) ? x1 : x0, (c & 2) ? y1 : y0, (c & 1) ? z1 : z0);
+      glm::vec3 dir_from_cam = corner - cam_pos;
+      float dist = ter_util_vec3_module(dir_from_cam, 1, 1, 1);
+      if (dist > far_plane || dist < TER_NEAR_PLANE)
+         continue;
+
+      ter_util_vec3_normalize(&dir_from_cam);
+      float dot = ter_util_vec3_dot(dir_from_cam, view_dir);
+      dot = CLAMP(dot, -1.0f, 1.0f);
+      if (fabsf(acos(dot)) <= DEG_TO_RAD(TER_FOV + 5.0f))
+         return true;
+   }
+
+   return false;
+}
+
+/*
+ * Compares the throughput of the old angular object culling test against
+ * ter_object_set_cull() on the scene objects, from the camera position
+ * looking in num_views directions around the Y axis. Also reports how many
+ * objects each test accepts, the frustum test being exact for boxes.
+ */
+void
+ter_bench_object_culling(TerObjectRenderer *r, TerCamera *cam,
+                         float far_plane, unsigned num_views, unsigned rounds)
+{
+   glm::vec3 rot = cam->rot;
+
+   unsigned max_count = 0;
+   for (unsigned j = 0; j < r->sets->len; j++) {
+      TerObjectSet *s = (TerObjectSet *) g_ptr_array_index(r->sets, j);
+      max_count = MAX(max_count, s->count);
+   }
+   unsigned *visible = g_new(unsigned, MAX(max_count, 1));
+
+   double ms_angular = 0.0, ms_frustum = 0.0;
+   unsigned accepted_angular = 0, accepted_frustum = 0;
+   for (unsigned v = 0; v < num_views; v++) {
+      cam->rot.y = rot.y + 360.0f * v / num_views;
+
+      TerClipVolume clip;
+      ter_camera_get_clipping_box_for_distance(cam, far_plane, &clip);
+      glm::vec3 view_dir = ter_camera_get_viewdir(cam);
+      ter_util_vec3_normalize(&view_dir);
+
+      double start = bench_time_ms();
+      for (unsigned k = 0; k < rounds; k++) {
+         accepted_angular = 0;
+         for (unsigned j = 0; j < r->sets->len; j++) {
+            TerObjectSet *s = (TerObjectSet *) g_ptr_array_index(r->sets, j);
+            for (unsigned i = 0; i < s->count; i++) {
+               accepted_angular +=
+                  bench_cull_angular(s, i, &clip, far_plane, cam->pos,
+                                     view_dir);
+            }
+         }
+      }
+      ms_angular += bench_time_ms() - start;
+
+      start = bench_time_ms();
+      for (unsigned k = 0; k < rounds; k++) {
+         /* Frustum extraction is part of the per-pass cost */
+         TerFrustum frustum;
+         ter_camera_get_frustum_for_distance(cam, far_plane, &frustum);
+         accepted_frustum = 0;
+         for (unsigned j = 0; j < r->sets->len; j++) {
+            TerObjectSet *s = (TerObjectSet *) g_ptr_array_index(r->sets, j);
+            accepted_frustum += ter_object_set_cull(s, &clip, &frustum,
+                                                    visible, s->candidates);
+         }
+      }
+      ms_frustum += bench_time_ms() - start;
+
+      printf("BENCH: INFO: object culling: view %u: accepted %u (angular) "
+             "vs %u (frustum) of %u objects\n", v, accepted_angular,
+             accepted_frustum, r->num_objects);
+   }
+
+   bench_report_ops("object culling (angular)", ms_angular,
+                    r->num_objects * num_views, rounds, "objects");
+   bench_report_ops("object culling (frustum)", ms_frustum,
+                    r->num_objects * num_views, rounds, "objects");
+
+   cam->rot = rot;
+   g_free(visible);
+}
+
+/*
+ * Measures how long it takes to place the objects of the given types on the
+ * terrain, with a different seed each round.
+ */
+void
+ter_bench_object_placement(TerTerrain *t, TerThreadPool *pool,
+                           const TerObjectPlacementType *types,
+                           unsigned num_types, unsigned rounds)
+{
+   double ms = 0.0;
+   unsigned placed = 0;
+   for (unsigned k = 0; k < rounds; k++) {
+      double start = bench_time_ms();
+      GPtrArray *objects =
+         ter_object_placement_run(t, pool, types, num_types,
+                                  TER_OBJECT_PLACEMENT_SEED + k);
+      ms += bench_time_ms() - start;
+
+      placed = objects->len;
+      for (unsigned i = 0; i < objects->len; i++)
+         ter_object_free((TerObject *) g_ptr_array_index(objects, i));
+      g_ptr_array_free(objects, TRUE);
+   }
+
+   printf("BENCH: INFO: object placement: placed %u objects\n", placed);
+   bench_report_ops("object placement", ms, placed, rounds, "objects");
+}
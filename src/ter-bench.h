@@ -0,0 +1,26 @@
+#ifndef __TER_BENCH_H__
+#define __TER_BENCH_H__
+
+#include "ter-terrain.h"
+#include "ter-thread-pool.h"
+#include "ter-object-renderer.h"
+#include "ter-object-placement.h"
+#include "ter-camera.h"
+
+void ter_bench_terrain_height_queries(TerTerrain *t, unsigned count,
+                                      unsigned rounds);
+void ter_bench_object_placement(TerTerrain *t, TerThreadPool *pool,
+                                const TerObjectPlacementType *types,
+                                unsigned num_types, unsigned rounds);
+void ter_bench_terrain_mesh_build(TerThreadPool *pool, unsigned min_size,
+                                  unsigned max_size, unsigned rounds);
+void ter_bench_terrain_raycast(TerThreadPool *pool, unsigned min_size,
+                               unsigned max_size, unsigned num_rays,
+                               unsigned rounds);
+void ter_bench_terrain_edits(TerTerrain *t, unsigned edits_per_sec,
+                             float radius, unsigned rounds);
+void ter_bench_object_culling(TerObjectRenderer *r, TerCamera *cam,
+                              float far_plane, unsigned num_views,
+                              unsigned rounds);
+
+#endif
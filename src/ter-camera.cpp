@@ -284,6 +284,20 @@ ter_camera_get_clipping_box_for_distance(TerCamera *cam, float dist,
    }
 }
 
+/*
+ * Computes the planes of the camera viewing frustum with the far plane at
+ * the given distance.
+ */
+void
+ter_camera_get_frustum_for_distance(TerCamera *cam, float dist, TerFrustum *f)
+{
+   glm::mat4 Projection = glm::perspective(DEG_TO_RAD(TER_FOV),
+                                           TER_ASPECT_RATIO,
+                                           TER_NEAR_PLANE, dist);
+   glm::mat4 VP = Projection * ter_camera_get_view_matrix(cam);
+   ter_util_frustum_from_matrix(f, &VP);
+}
+
 TerBox *
 ter_camera_get_box(TerCamera *cam)
 {
@@ -40,6 +40,8 @@ glm::mat4 ter_camera_get_rotation_matrix(TerCamera *cam);
 
 void ter_camera_get_clipping_box_for_distance(TerCamera *cam, float dist,
                                               TerClipVolume *clip);
+void ter_camera_get_frustum_for_distance(TerCamera *cam, float dist,
+                                         TerFrustum *f);
 
 TerBox *ter_camera_get_box(TerCamera *cam);
 
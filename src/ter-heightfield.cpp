@@ -0,0 +1,361 @@
+#include "main.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define PAGE_ALIGN(x) (((x) + 4095) & ~((uint64_t) 4095))
+
+/*
+ * Height of sample (x, z) of a width x depth terrain, taken from the red
+ * channel of an RGBA heightmap image.
+ */
+float
+ter_heightfield_sample_image(SDL_Surface *image,
+                             unsigned width, unsigned depth,
+                             int x, int z, float offset, float scale)
+{
+   uint8_t *pixels = (uint8_t *) image->pixels;
+   float scale_x = ((float) image->w) / (width - 1);
+   float scale_z = ((float) image->h) / (depth - 1);
+
+   int img_x = (int) truncf(x * scale_x);
+   int img_y = (int) truncf(z * scale_z);
+   float h = pixels[img_y * image->pitch + img_x * 4];
+
+   /* Normalize height to [-1, 1] */
+   h = h / 127.5 - 1.0f;
+
+   /* Apply scale */
+   h *= scale;
+
+   /* Apply height offset */
+   h += offset;
+
+   return h;
+}
+
+/*
+ * Converts a heightmap texture into a tiled heightfield file. This only needs
+ * to hold the decoded image in memory, heights are computed and written
+ * one tile at a time.
+ */
+bool
+ter_heightfield_convert_from_texture(const char *path, int texture,
+                                     unsigned width, unsigned depth,
+                                     float offset, float scale,
+                                     unsigned tile_size, unsigned chunk_size)
+{
+   TerTextureManager *tex_mgr =
+      (TerTextureManager *) ter_cache_get("textures/manager");
+   SDL_Surface *image = ter_texture_manager_get_image(tex_mgr, texture);
+   if (!image) {
+      printf("HEIGHTFIELD: ERROR: heightmap texture %d is not loaded\n",
+             texture);
+      return false;
+   }
+
+   assert(tile_size % chunk_size == 0);
+
+   TerHeightfieldHeader h;
+   memset(&h, 0, sizeof(h));
+   memcpy(h.magic, TER_HEIGHTFIELD_MAGIC, sizeof(h.magic));
+   h.version = TER_HEIGHTFIELD_VERSION;
+   h.width = width;
+   h.depth = depth;
+   h.tile_size = tile_size;
+   h.tiles_x = (width - 2) / tile_size + 1;
+   h.tiles_z = (depth - 2) / tile_size + 1;
+   h.chunk_size = chunk_size;
+   h.chunks_x = (width - 2) / chunk_size + 1;
+   h.chunks_z = (depth - 2) / chunk_size + 1;
+
+   unsigned tile_samples = tile_size + 3;
+   h.tile_stride = PAGE_ALIGN(tile_samples * tile_samples * sizeof(float));
+   h.bounds_offset = sizeof(h);
+   h.tiles_offset =
+      PAGE_ALIGN(h.bounds_offset + h.chunks_x * h.chunks_z * 2 * sizeof(float));
+
+   FILE *f = fopen(path, "wb");
+   if (!f) {
+      printf("HEIGHTFIELD: ERROR: can't open '%s' for writing\n", path);
+      return false;
+   }
+
+   /* Chunk height bounds */
+   float *bounds = g_new(float, h.chunks_x * h.chunks_z * 2);
+   for (unsigned cx = 0; cx < h.chunks_x; cx++) {
+      for (unsigned cz = 0; cz < h.chunks_z; cz++) {
+         float min_h = FLT_MAX, max_h = -FLT_MAX;
+         unsigned x1 = MIN((cx + 1) * chunk_size, width - 1);
+         unsigned z1 = MIN((cz + 1) * chunk_size, depth - 1);
+         for (unsigned x = cx * chunk_size; x <= x1; x++) {
+            for (unsigned z = cz * chunk_size; z <= z1; z++) {
+               float s = ter_heightfield_sample_image(image, width, depth,
+                                                      x, z, offset, scale);
+               min_h = MIN(min_h, s);
+               max_h = MAX(max_h, s);
+            }
+         }
+         bounds[(cx * h.chunks_z + cz) * 2 + 0] = min_h;
+         bounds[(cx * h.chunks_z + cz) * 2 + 1] = max_h;
+      }
+   }
+
+   bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+   ok = ok && fwrite(bounds, sizeof(float) * 2, h.chunks_x * h.chunks_z, f) ==
+              h.chunks_x * h.chunks_z;
+   g_free(bounds);
+
+   /* Tiles, including a 1-sample border replicating the terrain edges */
+   float *data = (float *) g_malloc0(h.tile_stride);
+   for (unsigned tz = 0; ok && tz < h.tiles_z; tz++) {
+      for (unsigned tx = 0; ok && tx < h.tiles_x; tx++) {
+         int x0 = tx * tile_size - 1;
+         int z0 = tz * tile_size - 1;
+         for (unsigned j = 0; j < tile_samples; j++) {
+            int z = CLAMP(z0 + (int) j, 0, (int) depth - 1);
+            for (unsigned i = 0; i < tile_samples; i++) {
+               int x = CLAMP(x0 + (int) i, 0, (int) width - 1);
+               data[j * tile_samples + i] =
+                  ter_heightfield_sample_image(image, width, depth,
+                                               x, z, offset, scale);
+            }
+         }
+
+         unsigned tile = tz * h.tiles_x + tx;
+         ok = fseek(f, h.tiles_offset + (uint64_t) tile * h.tile_stride,
+                    SEEK_SET) == 0 &&
+              fwrite(data, h.tile_stride, 1, f) == 1;
+      }
+   }
+   g_free(data);
+
+   ok = fclose(f) == 0 && ok;
+   if (!ok) {
+      printf("HEIGHTFIELD: ERROR: failed to write '%s'\n", path);
+      unlink(path);
+      return false;
+   }
+
+   ter_dbg(LOG_DEFAULT,
+           "HEIGHTFIELD: INFO: Converted %ux%u heightmap to '%s' "
+           "(%ux%u tiles)\n", width, depth, path, h.tiles_x, h.tiles_z);
+
+   return true;
+}
+
+static inline void
+touch_tile(TerHeightfield *hf, int tile)
+{
+   g_atomic_int_set(&hf->tile_stamp[tile], g_atomic_int_get(&hf->frame));
+   g_atomic_int_set(&hf->tile_resident[tile], 1);
+}
+
+static gpointer
+loader_thread(gpointer data)
+{
+   TerHeightfield *hf = (TerHeightfield *) data;
+   size_t bytes = hf->tile_samples * hf->tile_samples * sizeof(float);
+
+   while (true) {
+      /* Tiles are pushed as tile + 1, 0 means we should finish */
+      int tile = GPOINTER_TO_INT(g_async_queue_pop(hf->requests)) - 1;
+      if (tile < 0)
+         break;
+
+      /* Copy the tile out of the mapping here so that any page faults
+       * happen in this thread and not in the rendering thread.
+       */
+      TerHeightfieldTileData *td = g_new(TerHeightfieldTileData, 1);
+      td->tile = tile;
+      td->data = (float *) g_malloc(bytes);
+      memcpy(td->data, ter_heightfield_get_tile(hf, tile), bytes);
+
+      g_async_queue_push(hf->loaded, td);
+   }
+
+   return NULL;
+}
+
+TerHeightfield *
+ter_heightfield_open(const char *path, unsigned max_resident_tiles)
+{
+   int fd = open(path, O_RDONLY);
+   if (fd < 0)
+      return NULL;
+
+   struct stat st;
+   if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(TerHeightfieldHeader)) {
+      close(fd);
+      return NULL;
+   }
+
+   uint8_t *map =
+      (uint8_t *) mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   if (map == MAP_FAILED) {
+      close(fd);
+      return NULL;
+   }
+
+   TerHeightfieldHeader *h = (TerHeightfieldHeader *) map;
+   uint64_t expected_size =
+      h->tiles_offset + (uint64_t) h->tiles_x * h->tiles_z * h->tile_stride;
+   if (memcmp(h->magic, TER_HEIGHTFIELD_MAGIC, sizeof(h->magic)) ||
+       h->version != TER_HEIGHTFIELD_VERSION ||
+       (uint64_t) st.st_size < expected_size) {
+      printf("HEIGHTFIELD: ERROR: '%s' is not a valid heightfield file\n",
+             path);
+      munmap(map, st.st_size);
+      close(fd);
+      return NULL;
+   }
+
+   /* Tiles are accessed in no particular order, so prevent read-ahead of
+    * pages we may not need.
+    */
+   madvise(map, st.st_size, MADV_RANDOM);
+
+   TerHeightfield *hf = g_new0(TerHeightfield, 1);
+   hf->header = *h;
+   hf->fd = fd;
+   hf->map = map;
+   hf->map_size = st.st_size;
+   hf->tile_samples = h->tile_size + 3;
+   hf->max_resident_tiles = max_resident_tiles;
+
+   unsigned num_tiles = h->tiles_x * h->tiles_z;
+   hf->tile_stamp = g_new0(int, num_tiles);
+   hf->tile_resident = g_new0(int, num_tiles);
+
+   hf->requests = g_async_queue_new();
+   hf->loaded = g_async_queue_new();
+   hf->loader = g_thread_new("heightfield-loader", loader_thread, hf);
+
+   ter_dbg(LOG_DEFAULT,
+           "HEIGHTFIELD: INFO: Opened '%s': %ux%u samples, %ux%u tiles\n",
+           path, h->width, h->depth, h->tiles_x, h->tiles_z);
+
+   return hf;
+}
+
+void
+ter_heightfield_free(TerHeightfield *hf)
+{
+   g_async_queue_push(hf->requests, GINT_TO_POINTER(0));
+   g_thread_join(hf->loader);
+
+   TerHeightfieldTileData *td;
+   while ((td = ter_heightfield_pop_loaded_tile(hf)))
+      ter_heightfield_tile_data_free(td);
+
+   g_async_queue_unref(hf->requests);
+   g_async_queue_unref(hf->loaded);
+
+   munmap(hf->map, hf->map_size);
+   close(hf->fd);
+
+   g_free((int *) hf->tile_stamp);
+   g_free((int *) hf->tile_resident);
+   g_free(hf);
+}
+
+const float *
+ter_heightfield_get_tile(TerHeightfield *hf, int tile)
+{
+   touch_tile(hf, tile);
+   return (const float *)
+      (hf->map + hf->header.tiles_offset + (uint64_t) tile * hf->header.tile_stride);
+}
+
+float
+ter_heightfield_get_sample(TerHeightfield *hf, int x, int z)
+{
+   TerHeightfieldHeader *h = &hf->header;
+   x = CLAMP(x, 0, (int) h->width - 1);
+   z = CLAMP(z, 0, (int) h->depth - 1);
+
+   /* Samples at tile edges are in both tiles, pick the first */
+   int tx = MIN(x / (int) h->tile_size, (int) h->tiles_x - 1);
+   int tz = MIN(z / (int) h->tile_size, (int) h->tiles_z - 1);
+   const float *data = ter_heightfield_get_tile(hf, tz * h->tiles_x + tx);
+
+   int i = x - tx * h->tile_size + 1;
+   int j = z - tz * h->tile_size + 1;
+   return data[j * hf->tile_samples + i];
+}
+
+void
+ter_heightfield_get_chunk_bounds(TerHeightfield *hf, int cx, int cz,
+                                 float *min_height, float *max_height)
+{
+   const float *bounds = (const float *) (hf->map + hf->header.bounds_offset);
+   unsigned idx = (cx * hf->header.chunks_z + cz) * 2;
+   *min_height = bounds[idx];
+   *max_height = bounds[idx + 1];
+}
+
+/*
+ * Queues a tile for loading. Loaded tiles are retrieved with
+ * ter_heightfield_pop_loaded_tile().
+ */
+void
+ter_heightfield_request_tile(TerHeightfield *hf, int tile)
+{
+   g_async_queue_push(hf->requests, GINT_TO_POINTER(tile + 1));
+}
+
+TerHeightfieldTileData *
+ter_heightfield_pop_loaded_tile(TerHeightfield *hf)
+{
+   return (TerHeightfieldTileData *) g_async_queue_try_pop(hf->loaded);
+}
+
+void
+ter_heightfield_tile_data_free(TerHeightfieldTileData *td)
+{
+   g_free(td->data);
+   g_free(td);
+}
+
+static int
+compare_tile_stamps(const void *a, const void *b, void *data)
+{
+   TerHeightfield *hf = (TerHeightfield *) data;
+   return hf->tile_stamp[*(const int *) a] - hf->tile_stamp[*(const int *) b];
+}
+
+/*
+ * Releases the pages of the least recently used tiles so that no more than
+ * max_resident_tiles stay mapped in memory. Should be called regularly, each
+ * call starts a new period for the LRU.
+ */
+void
+ter_heightfield_trim(TerHeightfield *hf)
+{
+   TerHeightfieldHeader *h = &hf->header;
+   int num_tiles = h->tiles_x * h->tiles_z;
+
+   int *resident = g_new(int, num_tiles);
+   unsigned num_resident = 0;
+   for (int i = 0; i < num_tiles; i++) {
+      if (g_atomic_int_get(&hf->tile_resident[i]))
+         resident[num_resident++] = i;
+   }
+
+   if (num_resident > hf->max_resident_tiles) {
+      g_qsort_with_data(resident, num_resident, sizeof(int),
+                        compare_tile_stamps, hf);
+
+      for (unsigned i = 0; i < num_resident - hf->max_resident_tiles; i++) {
+         int tile = resident[i];
+         g_atomic_int_set(&hf->tile_resident[tile], 0);
+         madvise(hf->map + h->tiles_offset + (uint64_t) tile * h->tile_stride,
+                 h->tile_stride, MADV_DONTNEED);
+      }
+   }
+
+   g_free(resident);
+   g_atomic_int_inc(&hf->frame);
+}
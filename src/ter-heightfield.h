@@ -0,0 +1,85 @@
+#ifndef __TER_HEIGHTFIELD_H__
+#define __TER_HEIGHTFIELD_H__
+
+#include <stdint.h>
+#include <glib.h>
+#include <SDL.h>
+
+/*
+ * Tiled on-disk heightfield.
+ *
+ * The file starts with a TerHeightfieldHeader, followed by the height bounds
+ * (min, max pairs) of each chunk and then by the tiles. Each tile stores
+ * (tile_size + 3)^2 float heights: the tile_size + 1 samples per side covered
+ * by the tile plus a border of 1 sample on each side, which is the same
+ * layout we use for the terrain height map texture layers. Tiles start at
+ * page-aligned offsets so they can be paged in and out independently.
+ */
+#define TER_HEIGHTFIELD_MAGIC "TERHFLD"
+#define TER_HEIGHTFIELD_VERSION 1
+
+typedef struct {
+   char magic[8];
+   uint32_t version;
+   uint32_t width, depth;        /* Samples */
+   uint32_t tile_size;           /* Quads per tile side */
+   uint32_t tiles_x, tiles_z;
+   uint32_t chunk_size;          /* Quads per chunk side */
+   uint32_t chunks_x, chunks_z;
+   uint32_t tile_stride;         /* Bytes between tiles */
+   uint64_t bounds_offset;
+   uint64_t tiles_offset;
+} TerHeightfieldHeader;
+
+typedef struct {
+   int tile;
+   float *data;
+} TerHeightfieldTileData;
+
+typedef struct {
+   TerHeightfieldHeader header;
+   int fd;
+   uint8_t *map;
+   size_t map_size;
+   unsigned tile_samples;        /* Samples per tile side, including borders */
+
+   /* CPU residency of the mapped tiles. Tiles are touched by height queries
+    * and by the loader thread and released (LRU) on ter_heightfield_trim().
+    */
+   volatile int *tile_stamp;
+   volatile int *tile_resident;
+   volatile int frame;
+   unsigned max_resident_tiles;
+
+   /* Asynchronous tile loading */
+   GThread *loader;
+   GAsyncQueue *requests;
+   GAsyncQueue *loaded;
+} TerHeightfield;
+
+float ter_heightfield_sample_image(SDL_Surface *image,
+                                   unsigned width, unsigned depth,
+                                   int x, int z, float offset, float scale);
+
+bool ter_heightfield_convert_from_texture(const char *path, int texture,
+                                          unsigned width, unsigned depth,
+                                          float offset, float scale,
+                                          unsigned tile_size,
+                                          unsigned chunk_size);
+
+TerHeightfield *ter_heightfield_open(const char *path,
+                                     unsigned max_resident_tiles);
+void ter_heightfield_free(TerHeightfield *hf);
+
+const float *ter_heightfield_get_tile(TerHeightfield *hf, int tile);
+float ter_heightfield_get_sample(TerHeightfield *hf, int x, int z);
+void ter_heightfield_get_chunk_bounds(TerHeightfield *hf, int cx, int cz,
+                                      float *min_height, float *max_height);
+
+void ter_heightfield_request_tile(TerHeightfield *hf, int tile);
+TerHeightfieldTileData *ter_heightfield_pop_loaded_tile(TerHeightfield *hf);
+void ter_heightfield_tile_data_free(TerHeightfieldTileData *td);
+
+void ter_heightfield_trim(TerHeightfield *hf);
+
+#endif
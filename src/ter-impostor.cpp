@@ -0,0 +1,420 @@
+#include "ter-impostor.h"
+
+#include <float.h>
+#include <glib.h>
+
+#define GL_GLEXT_PROTOTYPES 1
+#include <GL/gl.h>
+
+
+#include "ter-cache.h"
+#include "ter-light.h"
+#include "ter-shadow-renderer.h"
+
+/* Texture units of the atlas (shadow maps go after them) */
+#define IMPOSTOR_ALBEDO_UNIT 0
+#define IMPOSTOR_NORMAL_UNIT 1
+#define IMPOSTOR_SHADOW_UNIT 2
+
+/* Instanced attributes read by the impostor shaders (see
+ * ter_model_bind_instanced_attributes())
+ */
+static const unsigned impostor_instanced_attribs[] = { 1, 2, 9, 14 };
+
+/* Space around the models in their views, so filtering doesn't blend
+ * neighboring views
+ */
+#define IMPOSTOR_VIEW_MARGIN 1.05f
+
+/*
+ * Computes the box that the views of the model capture: centered at the
+ * model center, as wide as the model is across its vertical axis in any
+ * direction and as tall as the model.
+ */
+static void
+model_view_bounds(TerModel *m, glm::vec4 *center, glm::vec2 *size)
+{
+   float y0 = FLT_MAX, y1 = -FLT_MAX;
+   for (unsigned i = 0; i < m->vertices.size(); i++) {
+      y0 = MIN(y0, m->vertices[i].y);
+      y1 = MAX(y1, m->vertices[i].y);
+   }
+
+   glm::vec3 c = glm::vec3(m->center.x, (y0 + y1) * 0.5f, m->center.z);
+   float radius = 0.0f;
+   for (unsigned i = 0; i < m->vertices.size(); i++) {
+      glm::vec2 d = glm::vec2(m->vertices[i].x - c.x, m->vertices[i].z - c.z);
+      radius = MAX(radius, glm::length(d));
+   }
+
+   *center = glm::vec4(c, 1.0f);
+   *size = glm::vec2(radius, (y1 - y0) * 0.5f) * IMPOSTOR_VIEW_MARGIN;
+}
+
+/*
+ * Renders every view of every model variant into its cell of the atlas.
+ * View k looks at the model from angle 2 * PI * k / num_views around its
+ * vertical axis (from +Z towards +X), with an orthographic projection of
+ * the view bounds.
+ */
+static void
+atlas_bake(TerImpostorAtlas *a, TerModel **models, unsigned count)
+{
+   TerShaderProgramModel *sh =
+      (TerShaderProgramModel *) ter_cache_get("program/impostor-bake");
+   TerModelArena *arena = a->arena;
+   const unsigned cell = TER_IMPOSTOR_CELL_SIZE;
+
+   ter_render_texture_start(a->rt);
+   glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+   glUseProgram(sh->basic.prog.program);
+   glBindBufferBase(GL_UNIFORM_BUFFER,
+                    TER_SHADER_PROGRAM_MODEL_MATERIALS_BINDING,
+                    arena->material_buf);
+
+   for (unsigned i = 0; i < count; i++) {
+      TerModel *m = models[i];
+      for (unsigned v = 0; v < m->num_variants; v++) {
+         unsigned row = m->impostor_row + v;
+         glm::vec3 center = glm::vec3(a->row_center[row]);
+         glm::vec2 size = a->row_size[row];
+
+         /* Identity transform, no fade */
+         TerModelInstance instance;
+         memset(&instance, 0, sizeof(instance));
+         ter_model_instance_set_transform(&instance, glm::vec3(0.0f),
+                                          glm::vec3(0.0f), 1.0f);
+         instance.variant_idx = v * TER_MODEL_MAX_MATERIALS;
+
+         unsigned instanced_buf;
+         TerModelDrawCommand cmd;
+         cmd.count = m->lods[0].num_indices;
+         cmd.instance_count = 1;
+         cmd.first_index = m->first_index + m->lods[0].first_index;
+         cmd.base_vertex = m->first_vertex;
+         cmd.base_instance =
+            ter_model_arena_upload_instances(arena,
+                                             (const uint8_t *) &instance, 1,
+                                             &instanced_buf);
+         ter_model_arena_render_prepare_for_program(arena, m->batch,
+                                                    instanced_buf);
+
+         float distance = 2.0f * MAX(size.x, size.y) + 1.0f;
+         glm::mat4 Projection = glm::ortho(-size.x, size.x, -size.y, size.y,
+                                           0.0f, 2.0f * distance);
+
+         for (unsigned k = 0; k < a->num_views; k++) {
+            float angle = 2.0f * M_PI * k / a->num_views;
+            glm::vec3 dir = glm::vec3(sinf(angle), 0.0f, cosf(angle));
+            glm::mat4 View = glm::lookAt(center + dir * distance, center,
+                                         glm::vec3(0.0f, 1.0f, 0.0f));
+            glm::mat4 ViewInv = glm::inverse(View);
+            ter_shader_program_basic_load_VP(&sh->basic, &Projection,
+                                             &View, &ViewInv);
+
+            glViewport(k * cell, row * cell, cell, cell);
+            ter_model_arena_draw(arena, &cmd, 1);
+         }
+      }
+
+      ter_model_arena_render_finish(arena, m->batch);
+   }
+
+   ter_render_texture_stop(a->rt);
+   glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+
+   /* Distant impostors are small on the screen */
+   for (unsigned t = 0; t < 2; t++) {
+      glBindTexture(GL_TEXTURE_2D, a->rt->texture[t]);
+      glGenerateMipmap(GL_TEXTURE_2D);
+      glSamplerParameteri(a->rt->sampler[t], GL_TEXTURE_MIN_FILTER,
+                          GL_LINEAR_MIPMAP_LINEAR);
+   }
+   glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+/*
+ * Creates the impostors of the models, which must be solid models in a
+ * model arena (see ter_model_arena_new()) and have all their variants. The
+ * models keep a reference to the atlas.
+ */
+TerImpostorAtlas *
+ter_impostor_atlas_new(TerModel **models, unsigned count)
+{
+   TerImpostorAtlas *a = g_new0(TerImpostorAtlas, 1);
+   a->num_views = TER_IMPOSTOR_VIEWS;
+
+   for (unsigned i = 0; i < count; i++) {
+      TerModel *m = models[i];
+      assert(m->arena && !ter_model_is_textured(m) && !m->impostors);
+      assert(!a->arena || a->arena == m->arena);
+      a->arena = m->arena;
+
+      m->impostors = a;
+      m->impostor_row = a->num_rows;
+      a->num_rows += m->num_variants;
+      assert(a->num_rows <= TER_IMPOSTOR_MAX_ROWS);
+
+      glm::vec4 center;
+      glm::vec2 size;
+      model_view_bounds(m, &center, &size);
+      for (unsigned v = 0; v < m->num_variants; v++) {
+         a->row_center[m->impostor_row + v] = center;
+         a->row_size[m->impostor_row + v] = size;
+      }
+   }
+
+   a->rt = ter_render_texture_new(a->num_views * TER_IMPOSTOR_CELL_SIZE,
+                                  a->num_rows * TER_IMPOSTOR_CELL_SIZE,
+                                  true, true, false, false, 2);
+   atlas_bake(a, models, count);
+
+   /* A quad with its corners at (0, 0) - (1, 1), expanded in the vertex
+    * shader. Its instanced attributes are bound before drawing.
+    */
+   static const float corners[] = {
+      0.0f, 0.0f,
+      1.0f, 0.0f,
+      1.0f, 1.0f,
+      0.0f, 1.0f,
+   };
+   static const unsigned indices[] = { 0, 1, 2, 0, 2, 3 };
+
+   glGenVertexArrays(1, &a->vao);
+   glBindVertexArray(a->vao);
+
+   glGenBuffers(1, &a->vertex_buf);
+   glBindBuffer(GL_ARRAY_BUFFER, a->vertex_buf);
+   glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+   glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), 0);
+
+   glGenBuffers(1, &a->index_buf);
+   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, a->index_buf);
+   glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices,
+                GL_STATIC_DRAW);
+
+   glBindVertexArray(0);
+   glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+   ter_dbg(LOG_DEFAULT, "IMPOSTOR: INFO: Baked %u views of %u models "
+           "(%u variants) into a %dx%d atlas\n", a->num_views, count,
+           a->num_rows, a->rt->width, a->rt->height);
+
+   return a;
+}
+
+void
+ter_impostor_atlas_free(TerImpostorAtlas *a)
+{
+   if (!a)
+      return;
+
+   ter_render_texture_free(a->rt);
+   glDeleteVertexArrays(1, &a->vao);
+   glDeleteBuffers(1, &a->vertex_buf);
+   glDeleteBuffers(1, &a->index_buf);
+
+   g_free(a);
+}
+
+/*
+ * Sets up a draw command for the impostor quad. The caller fills in the
+ * instances to draw.
+ */
+void
+ter_impostor_init_draw_command(TerModelDrawCommand *cmd)
+{
+   cmd->count = 6;
+   cmd->instance_count = 0;
+   cmd->first_index = 0;
+   cmd->base_vertex = 0;
+   cmd->base_instance = 0;
+}
+
+/*
+ * Binds the atlas and the quad VAO, with its instanced attributes reading
+ * from instanced_buf.
+ */
+static void
+atlas_bind(TerImpostorAtlas *a, TerShaderProgramImpostor *sh,
+           unsigned instanced_buf)
+{
+   for (unsigned t = 0; t < 2; t++) {
+      glActiveTexture(GL_TEXTURE0 + IMPOSTOR_ALBEDO_UNIT + t);
+      glBindTexture(GL_TEXTURE_2D, a->rt->texture[t]);
+      glBindSampler(IMPOSTOR_ALBEDO_UNIT + t, a->rt->sampler[t]);
+   }
+   ter_shader_program_impostor_load_atlas(sh, IMPOSTOR_ALBEDO_UNIT,
+                                          IMPOSTOR_NORMAL_UNIT, a->num_views,
+                                          a->row_center, a->row_size,
+                                          a->num_rows);
+
+   glBindVertexArray(a->vao);
+   a->bound_instanced_buf = instanced_buf;
+   ter_model_bind_instanced_attributes(a->bound_instanced_buf, 0);
+
+   glEnableVertexAttribArray(0);
+   for (unsigned i = 0; i < G_N_ELEMENTS(impostor_instanced_attribs); i++)
+      glEnableVertexAttribArray(impostor_instanced_attribs[i]);
+}
+
+/*
+ * Sets up the state to draw impostors, like ter_model_arena_render_prepare()
+ * does for the models.
+ */
+void
+ter_impostor_atlas_render_prepare(TerImpostorAtlas *a,
+                                  unsigned instanced_buf,
+                                  float clip_far_plane,
+                                  float render_far_plane,
+                                  bool enable_shadow,
+                                  unsigned shadow_pfc,
+                                  const glm::mat4 *prev_vp)
+{
+   TerShaderProgramImpostor *sh = (TerShaderProgramImpostor *)
+      ter_cache_get(enable_shadow ? "program/impostor-shadow" :
+                                    "program/impostor");
+   TerShaderProgramBasic *basic = &sh->basic;
+
+   glUseProgram(basic->prog.program);
+
+   /* Same projection as the models, see ter_model_arena_render_prepare() */
+   glm::mat4 Projection =
+      glm::perspective(DEG_TO_RAD(TER_FOV), TER_ASPECT_RATIO,
+                       TER_NEAR_PLANE, render_far_plane);
+
+   assert(!prev_vp || render_far_plane == TER_FAR_PLANE);
+
+   glm::mat4 *View = (glm::mat4 *) ter_cache_get("matrix/View");
+   glm::mat4 *ViewInv = (glm::mat4 *) ter_cache_get("matrix/ViewInv");
+   ter_shader_program_basic_load_VP(basic, &Projection, View, ViewInv);
+
+   /* Impostors face the camera */
+   glm::vec4 eye = glm::vec4(glm::vec3((*ViewInv)[3]), 1.0f);
+   ter_shader_program_impostor_load_eye(sh, &eye);
+
+   TerLight *light = (TerLight *) ter_cache_get("light/light0");
+   ter_shader_program_basic_load_light(basic, light);
+
+   ter_shader_program_basic_load_sky_color(basic, &light->diffuse);
+
+   glm::vec4 *clip_plane = (glm::vec4 *) ter_cache_get("clip/clip-plane-0");
+   if (clip_plane)
+      ter_shader_program_basic_load_clip_plane(basic, *clip_plane);
+
+   if (enable_shadow) {
+      TerShadowRenderer *sr =
+         (TerShadowRenderer *) ter_cache_get("rendering/shadow-renderer");
+
+      for (unsigned level = 0; level < sr->shadow_box->csm_levels; level++) {
+         glActiveTexture(GL_TEXTURE0 + IMPOSTOR_SHADOW_UNIT + level);
+         glBindTexture(GL_TEXTURE_2D,
+                       sr->shadow_box->csm[level].shadow_map->map->depth_texture);
+      }
+      ter_shader_program_shadow_data_load_(&sh->shadow, sr,
+                                           IMPOSTOR_SHADOW_UNIT);
+   }
+
+   ter_shader_program_model_load_near_far_planes(&sh->model,
+      TER_NEAR_PLANE, clip_far_plane, render_far_plane);
+
+   /* Motion vectors, see TerModelInstance */
+   if (prev_vp)
+      ter_shader_program_model_load_prev_VP(&sh->model, prev_vp);
+
+   atlas_bind(a, sh, instanced_buf);
+}
+
+/*
+ * Sets up the state to draw impostors into a shadow map. Impostors face the
+ * light, so they cast the shadow of the view of the model from the light.
+ */
+void
+ter_impostor_atlas_render_prepare_for_shadow_map(TerImpostorAtlas *a,
+                                                 unsigned instanced_buf,
+                                                 const glm::mat4 *projection,
+                                                 const glm::mat4 *view)
+{
+   TerShaderProgramImpostor *sh = (TerShaderProgramImpostor *)
+      ter_cache_get("program/impostor-shadow-map");
+
+   glUseProgram(sh->basic.prog.program);
+
+   glm::mat4 view_inv = glm::inverse(*view);
+   ter_shader_program_basic_load_VP(&sh->basic, projection, view, &view_inv);
+
+   /* The light looks down the -Z axis of its view */
+   glm::vec4 eye = glm::vec4(glm::vec3(view_inv[2]), 0.0f);
+   ter_shader_program_impostor_load_eye(sh, &eye);
+
+   atlas_bind(a, sh, instanced_buf);
+}
+
+/*
+ * Draws the impostor commands (see ter_impostor_init_draw_command()),
+ * like ter_model_arena_draw() does for models.
+ */
+void
+ter_impostor_atlas_draw(TerImpostorAtlas *a,
+                        const TerModelDrawCommand *cmds, unsigned count)
+{
+   if (count == 0)
+      return;
+
+   if (a->arena->multi_draw) {
+      size_t offset = ter_model_bind_draw_commands(cmds, count);
+      glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT,
+                                  (void *) offset, count, 0);
+      glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+      return;
+   }
+
+   for (unsigned i = 0; i < count; i++) {
+      const TerModelDrawCommand *cmd = &cmds[i];
+      if (cmd->instance_count == 0)
+         continue;
+      ter_model_bind_instanced_attributes(a->bound_instanced_buf,
+         (size_t) cmd->base_instance * TER_MODEL_INSTANCED_ITEM_SIZE);
+      glDrawElementsInstanced(GL_TRIANGLES, cmd->count, GL_UNSIGNED_INT,
+         (void *) (cmd->first_index * sizeof(unsigned)),
+         cmd->instance_count);
+   }
+}
+
+/*
+ * Draws count impostor commands starting at command first in draw_buf,
+ * typically written by a compute shader. This requires OpenGL 4.3.
+ */
+void
+ter_impostor_atlas_draw_indirect(TerImpostorAtlas *a, unsigned draw_buf,
+                                 unsigned first, unsigned count)
+{
+   assert(a->arena->multi_draw);
+
+   if (count == 0)
+      return;
+
+   glBindBuffer(GL_DRAW_INDIRECT_BUFFER, draw_buf);
+   glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT,
+                               (void *) (first * sizeof(TerModelDrawCommand)),
+                               count, 0);
+   glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
+
+void
+ter_impostor_atlas_render_finish(TerImpostorAtlas *a)
+{
+   for (unsigned t = 0; t < 2; t++) {
+      glActiveTexture(GL_TEXTURE0 + IMPOSTOR_ALBEDO_UNIT + t);
+      glBindTexture(GL_TEXTURE_2D, 0);
+      glBindSampler(IMPOSTOR_ALBEDO_UNIT + t, 0);
+   }
+   glActiveTexture(GL_TEXTURE0);
+
+   glDisableVertexAttribArray(0);
+   for (unsigned i = 0; i < G_N_ELEMENTS(impostor_instanced_attribs); i++)
+      glDisableVertexAttribArray(impostor_instanced_attribs[i]);
+   glBindVertexArray(0);
+}
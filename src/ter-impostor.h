@@ -0,0 +1,58 @@
+#ifndef __TER_IMPOSTOR_H__
+#define __TER_IMPOSTOR_H__
+
+#include <glm/glm.hpp>
+
+#include "ter-model.h"
+#include "ter-render-texture.h"
+#include "ter-shader-program.h"
+
+/* Views of the variants of a set of models rendered at load time, used to
+ * draw distant instances of the models as textured quads facing the camera
+ * (impostors). The atlas has a column per view, taken around the vertical
+ * axis of the models, and a row per model variant. It stores the albedo
+ * (diffuse color) and coverage of the models and their model space normals,
+ * so impostors are lit like the models (except for specular lighting).
+ *
+ * Impostors use the same instance data as the models, with the atlas row in
+ * place of the variant index (see TerModel::impostor_row), so they can be
+ * streamed to the same buffers. All the impostors of a pass are drawn with
+ * a single multi-draw (one command per model).
+ */
+typedef struct _TerImpostorAtlas {
+   TerRenderTexture *rt;         /* Albedo + coverage, normal */
+   unsigned num_views;
+   unsigned num_rows;
+   glm::vec4 row_center[TER_IMPOSTOR_MAX_ROWS];
+   glm::vec2 row_size[TER_IMPOSTOR_MAX_ROWS];
+
+   TerModelArena *arena;         /* Instance data of the models */
+   unsigned vao;
+   unsigned vertex_buf;
+   unsigned index_buf;
+   unsigned bound_instanced_buf;
+} TerImpostorAtlas;
+
+TerImpostorAtlas *ter_impostor_atlas_new(TerModel **models, unsigned count);
+void ter_impostor_atlas_free(TerImpostorAtlas *a);
+
+void ter_impostor_init_draw_command(TerModelDrawCommand *cmd);
+
+void ter_impostor_atlas_render_prepare(TerImpostorAtlas *a,
+                                       unsigned instanced_buf,
+                                       float clip_far_plane,
+                                       float render_far_plane,
+                                       bool enable_shadow,
+                                       unsigned shadow_pfc,
+                                       const glm::mat4 *prev_vp);
+void ter_impostor_atlas_render_prepare_for_shadow_map(TerImpostorAtlas *a,
+                                                      unsigned instanced_buf,
+                                                      const glm::mat4 *projection,
+                                                      const glm::mat4 *view);
+void ter_impostor_atlas_draw(TerImpostorAtlas *a,
+                             const TerModelDrawCommand *cmds, unsigned count);
+void ter_impostor_atlas_draw_indirect(TerImpostorAtlas *a, unsigned draw_buf,
+                                      unsigned first, unsigned count);
+void ter_impostor_atlas_render_finish(TerImpostorAtlas *a);
+
+#endif
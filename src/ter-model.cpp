@@ -2,6 +2,8 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <float.h>
+#include <limits.h>
 #include <glib.h>
 
 #define GL_GLEXT_PROTOTYPES 1
@@ -11,16 +13,22 @@
 
 #include "ter-cache.h"
 #include "ter-shadow-renderer.h"
+#include "ter-stream-buffer.h"
 #include "main-constants.h"
 
 #define TER_MODEL_ENABLE_DEBUG true
 #define NUM_VERTEX_ATTRIBS_SOLID    12
 #define NUM_VERTEX_ATTRIBS_TEXTURED 14
+#define INSTANCED_ATTRIB_POSITION   1
+#define INSTANCED_ATTRIB_ROTATION   2
+#define INSTANCED_ATTRIB_VARIANT    9
+#define INSTANCED_ATTRIB_FADE       14
 
+/* Locations between the instance transform and the variant index are free */
 static inline bool
-is_motion_attrib(int index)
+is_unused_attrib(int index)
 {
-   return index >= 5 && index <= 8;
+   return index > INSTANCED_ATTRIB_ROTATION && index < INSTANCED_ATTRIB_VARIANT;
 }
 
 static TerModel *
@@ -282,6 +290,1023 @@ cleanup:
    return res;
 }
 
+/* Size of the post-transform vertex cache we optimize for. Real caches are
+ * usually smaller, but the Forsyth ordering degrades gracefully on them.
+ */
+#define VERTEX_CACHE_SIZE 32
+
+/* FIFO cache size used to report the average cache miss ratio (ACMR) */
+#define VERTEX_CACHE_ACMR_SIZE 16
+
+/* Attributes of an expanded vertex, for deduplication */
+typedef struct {
+   glm::vec3 position;
+   glm::vec3 normal;
+   glm::vec2 uv;
+   int mat_idx;
+   int sampler;
+} ModelVertex;
+
+static guint
+model_vertex_hash(gconstpointer key)
+{
+   /* FNV-1a */
+   const uint8_t *p = (const uint8_t *) key;
+   guint h = 2166136261u;
+   for (unsigned i = 0; i < sizeof(ModelVertex); i++)
+      h = (h ^ p[i]) * 16777619u;
+   return h;
+}
+
+static gboolean
+model_vertex_equal(gconstpointer a, gconstpointer b)
+{
+   return memcmp(a, b, sizeof(ModelVertex)) == 0;
+}
+
+/*
+ * Average number of vertex shader invocations per triangle with a FIFO
+ * post-transform cache (3.0 is the worst, ~0.5 the best for regular meshes)
+ */
+static float
+compute_acmr(const unsigned *indices, unsigned num_indices,
+             unsigned num_vertices)
+{
+   if (num_indices == 0)
+      return 0.0f;
+
+   /* A vertex is in the cache if it missed in the last cache size misses */
+   unsigned *stamp = g_new0(unsigned, num_vertices);
+   unsigned misses = 0;
+   for (unsigned i = 0; i < num_indices; i++) {
+      unsigned v = indices[i];
+      if (stamp[v] == 0 || misses - stamp[v] >= VERTEX_CACHE_ACMR_SIZE)
+         stamp[v] = ++misses;
+   }
+   g_free(stamp);
+
+   return misses / (num_indices / 3.0f);
+}
+
+static float
+forsyth_vertex_score(int cache_pos, unsigned remaining_tris)
+{
+   if (remaining_tris == 0)
+      return -1.0f;
+
+   float score = 0.0f;
+   if (cache_pos >= 0) {
+      /* The vertices of the last triangle get a fixed score so we don't
+       * favor the triangle we just used.
+       */
+      if (cache_pos < 3) {
+         score = 0.75f;
+      } else {
+         float scale = 1.0f / (VERTEX_CACHE_SIZE - 3);
+         score = powf(1.0f - (cache_pos - 3) * scale, 1.5f);
+      }
+   }
+
+   /* Favor vertices with few triangles left, to avoid leaving them alone */
+   score += 2.0f * powf((float) remaining_tris, -0.5f);
+   return score;
+}
+
+/*
+ * Reorders the triangles of an indexed triangle list to improve the hit rate
+ * of the post-transform vertex cache, using Tom Forsyth's linear-speed
+ * algorithm: triangles are emitted greedily, picking the one with the
+ * highest score, where vertex scores reward being recently used (in an
+ * emulated LRU cache) and having few triangles left.
+ */
+static void
+optimize_vertex_cache(unsigned *indices, unsigned num_indices,
+                      unsigned num_vertices)
+{
+   unsigned num_tris = num_indices / 3;
+   if (num_tris == 0)
+      return;
+
+   /* Triangles that use each vertex and have not been emitted yet */
+   unsigned *remaining = g_new0(unsigned, num_vertices);
+   for (unsigned i = 0; i < num_indices; i++)
+      remaining[indices[i]]++;
+
+   unsigned *tri_start = g_new(unsigned, num_vertices + 1);
+   tri_start[0] = 0;
+   for (unsigned v = 0; v < num_vertices; v++)
+      tri_start[v + 1] = tri_start[v] + remaining[v];
+
+   unsigned *vertex_tris = g_new(unsigned, num_indices);
+   unsigned *fill = g_new(unsigned, num_vertices);
+   memcpy(fill, tri_start, num_vertices * sizeof(unsigned));
+   for (unsigned i = 0; i < num_indices; i++)
+      vertex_tris[fill[indices[i]]++] = i / 3;
+   g_free(fill);
+
+   int *cache_pos = g_new(int, num_vertices);
+   float *vertex_score = g_new(float, num_vertices);
+   for (unsigned v = 0; v < num_vertices; v++) {
+      cache_pos[v] = -1;
+      vertex_score[v] = forsyth_vertex_score(-1, remaining[v]);
+   }
+
+   float *tri_score = g_new(float, num_tris);
+   bool *emitted = g_new0(bool, num_tris);
+   for (unsigned t = 0; t < num_tris; t++) {
+      tri_score[t] = vertex_score[indices[3 * t]] +
+                     vertex_score[indices[3 * t + 1]] +
+                     vertex_score[indices[3 * t + 2]];
+   }
+
+   unsigned *output = g_new(unsigned, num_indices);
+   unsigned cache[VERTEX_CACHE_SIZE + 3];
+   unsigned cache_size = 0;
+   int best = -1;
+
+   for (unsigned n = 0; n < num_tris; n++) {
+      /* If no triangle in the cache can be used, pick the best one overall.
+       * This only happens when we start a new connected piece of the mesh.
+       */
+      if (best < 0) {
+         float best_score = -FLT_MAX;
+         for (unsigned t = 0; t < num_tris; t++) {
+            if (!emitted[t] && tri_score[t] > best_score) {
+               best_score = tri_score[t];
+               best = t;
+            }
+         }
+      }
+
+      unsigned *tri = &indices[3 * best];
+      memcpy(&output[3 * n], tri, 3 * sizeof(unsigned));
+      emitted[best] = true;
+
+      for (unsigned k = 0; k < 3; k++) {
+         unsigned v = tri[k];
+         unsigned *list = &vertex_tris[tri_start[v]];
+         for (unsigned i = 0; i < remaining[v]; i++) {
+            if (list[i] == (unsigned) best) {
+               list[i] = list[remaining[v] - 1];
+               remaining[v]--;
+               break;
+            }
+         }
+      }
+
+      /* The vertices of the triangle move to the front of the cache */
+      unsigned new_cache[VERTEX_CACHE_SIZE + 3];
+      unsigned new_size = 0;
+      for (unsigned k = 0; k < 3; k++) {
+         unsigned i = 0;
+         while (i < new_size && new_cache[i] != tri[k])
+            i++;
+         if (i == new_size)
+            new_cache[new_size++] = tri[k];
+      }
+      for (unsigned i = 0; i < cache_size; i++) {
+         unsigned v = cache[i];
+         if (v != tri[0] && v != tri[1] && v != tri[2])
+            new_cache[new_size++] = v;
+      }
+
+      for (unsigned i = 0; i < new_size; i++) {
+         unsigned v = new_cache[i];
+         cache_pos[v] = i < VERTEX_CACHE_SIZE ? (int) i : -1;
+         vertex_score[v] = forsyth_vertex_score(cache_pos[v], remaining[v]);
+      }
+
+      /* Rescore the triangles that use vertices whose score changed and
+       * pick the best of them for the next iteration.
+       */
+      best = -1;
+      float best_score = -FLT_MAX;
+      for (unsigned i = 0; i < new_size; i++) {
+         unsigned v = new_cache[i];
+         unsigned *list = &vertex_tris[tri_start[v]];
+         for (unsigned j = 0; j < remaining[v]; j++) {
+            unsigned t = list[j];
+            tri_score[t] = vertex_score[indices[3 * t]] +
+                           vertex_score[indices[3 * t + 1]] +
+                           vertex_score[indices[3 * t + 2]];
+            if (tri_score[t] > best_score) {
+               best_score = tri_score[t];
+               best = t;
+            }
+         }
+      }
+
+      cache_size = MIN(new_size, VERTEX_CACHE_SIZE);
+      memcpy(cache, new_cache, cache_size * sizeof(unsigned));
+   }
+
+   memcpy(indices, output, num_indices * sizeof(unsigned));
+
+   g_free(output);
+   g_free(emitted);
+   g_free(tri_score);
+   g_free(vertex_score);
+   g_free(cache_pos);
+   g_free(vertex_tris);
+   g_free(tri_start);
+   g_free(remaining);
+}
+
+/*
+ * Turns the expanded vertex lists of the model (3 vertices per triangle) into
+ * unique vertices and an index list, optimized for the post-transform vertex
+ * cache. Vertices are then sorted by first use, so they are also fetched in
+ * order.
+ */
+static void
+model_build_indices(TerModel *m)
+{
+   unsigned count = m->vertices.size();
+   bool has_uvs = m->uvs.size() > 0;
+   bool has_normals = m->normals.size() > 0;
+   bool has_materials = m->mat_idx.size() > 0;
+   bool has_samplers = m->samplers.size() > 0;
+
+   ModelVertex *keys = g_new0(ModelVertex, count);
+   GHashTable *unique =
+      g_hash_table_new(model_vertex_hash, model_vertex_equal);
+   std::vector<unsigned> source;   /* Expanded vertex of each unique vertex */
+
+   m->indices.resize(count);
+   for (unsigned i = 0; i < count; i++) {
+      ModelVertex *key = &keys[i];
+      key->position = m->vertices[i];
+      if (has_normals)
+         key->normal = m->normals[i];
+      if (has_uvs)
+         key->uv = m->uvs[i];
+      if (has_materials)
+         key->mat_idx = m->mat_idx[i];
+      if (has_samplers)
+         key->sampler = m->samplers[i];
+
+      gpointer value;
+      if (g_hash_table_lookup_extended(unique, key, NULL, &value)) {
+         m->indices[i] = GPOINTER_TO_UINT(value);
+      } else {
+         m->indices[i] = source.size();
+         g_hash_table_insert(unique, key, GUINT_TO_POINTER(source.size()));
+         source.push_back(i);
+      }
+   }
+   g_hash_table_destroy(unique);
+   g_free(keys);
+
+   unsigned num_unique = source.size();
+   float acmr = compute_acmr(&m->indices[0], count, num_unique);
+   optimize_vertex_cache(&m->indices[0], count, num_unique);
+
+   /* Sort vertices by first use */
+   std::vector<unsigned> order(num_unique, UINT_MAX);
+   unsigned next = 0;
+   for (unsigned i = 0; i < count; i++) {
+      unsigned &v = m->indices[i];
+      if (order[v] == UINT_MAX)
+         order[v] = next++;
+      v = order[v];
+   }
+   assert(next == num_unique);
+
+   std::vector<glm::vec3> vertices(num_unique), normals;
+   std::vector<glm::vec2> uvs;
+   std::vector<int> mat_idx, samplers;
+   if (has_normals)
+      normals.resize(num_unique);
+   if (has_uvs)
+      uvs.resize(num_unique);
+   if (has_materials)
+      mat_idx.resize(num_unique);
+   if (has_samplers)
+      samplers.resize(num_unique);
+
+   for (unsigned u = 0; u < num_unique; u++) {
+      unsigned dst = order[u];
+      unsigned src = source[u];
+      vertices[dst] = m->vertices[src];
+      if (has_normals)
+         normals[dst] = m->normals[src];
+      if (has_uvs)
+         uvs[dst] = m->uvs[src];
+      if (has_materials)
+         mat_idx[dst] = m->mat_idx[src];
+      if (has_samplers)
+         samplers[dst] = m->samplers[src];
+   }
+
+   m->vertices.swap(vertices);
+   m->normals.swap(normals);
+   m->uvs.swap(uvs);
+   m->mat_idx.swap(mat_idx);
+   m->samplers.swap(samplers);
+
+   m->lods[0].first_index = 0;
+   m->lods[0].num_indices = count;
+   m->lods[0].error = 0.0f;
+   m->num_lods = 1;
+
+   ter_dbg(LOG_OBJ_LOAD,
+           "OBJ-LOADER: INFO: Indexed %u vertices into %u unique vertices, "
+           "ACMR(%u): %.2f -> %.2f\n", count, num_unique,
+           VERTEX_CACHE_ACMR_SIZE, acmr,
+           compute_acmr(&m->indices[0], count, num_unique));
+}
+
+/*
+ * Level of detail generation: the model is simplified with half-edge
+ * collapses (a vertex moves to the position of a neighbor) ordered by the
+ * quadric error metric of Garland and Heckbert. Since positions don't move
+ * to new places, simplified triangles can mostly reuse the vertices of the
+ * model and all the levels share the same vertex buffer.
+ */
+
+/* Weight of the planes that keep the borders and material seams in place,
+ * relative to the planes of the faces
+ */
+#define LOD_BORDER_WEIGHT 10.0f
+
+/* Smallest cosine of the angle a triangle can rotate in a collapse */
+#define LOD_MAX_FLIP_COS 0.25f
+
+/* Sum of weighted squared distances to a set of planes (a symmetric 4x4
+ * matrix) and the sum of the weights, to normalize it.
+ */
+typedef struct {
+   double a00, a01, a02, a03;
+   double a11, a12, a13;
+   double a22, a23;
+   double a33;
+   double w;
+} ModelQuadric;
+
+static void
+quadric_add_plane(ModelQuadric *q, glm::vec3 n, float d, float w)
+{
+   q->a00 += w * n.x * n.x;
+   q->a01 += w * n.x * n.y;
+   q->a02 += w * n.x * n.z;
+   q->a03 += w * n.x * d;
+   q->a11 += w * n.y * n.y;
+   q->a12 += w * n.y * n.z;
+   q->a13 += w * n.y * d;
+   q->a22 += w * n.z * n.z;
+   q->a23 += w * n.z * d;
+   q->a33 += w * d * d;
+   q->w += w;
+}
+
+static void
+quadric_add(ModelQuadric *q, const ModelQuadric *o)
+{
+   q->a00 += o->a00;
+   q->a01 += o->a01;
+   q->a02 += o->a02;
+   q->a03 += o->a03;
+   q->a11 += o->a11;
+   q->a12 += o->a12;
+   q->a13 += o->a13;
+   q->a22 += o->a22;
+   q->a23 += o->a23;
+   q->a33 += o->a33;
+   q->w += o->w;
+}
+
+/* Weighted mean of the squared distances from p to the planes */
+static float
+quadric_error(const ModelQuadric *q, glm::vec3 p)
+{
+   if (q->w <= 0.0)
+      return 0.0f;
+
+   double x = p.x, y = p.y, z = p.z;
+   double e = q->a00 * x * x + q->a11 * y * y + q->a22 * z * z + q->a33 +
+              2.0 * (q->a01 * x * y + q->a02 * x * z + q->a12 * y * z +
+                     q->a03 * x + q->a13 * y + q->a23 * z);
+   return (float) (fabs(e) / q->w);
+}
+
+static guint
+model_position_hash(gconstpointer key)
+{
+   const uint8_t *p = (const uint8_t *) key;
+   guint h = 2166136261u;
+   for (unsigned i = 0; i < sizeof(glm::vec3); i++)
+      h = (h ^ p[i]) * 16777619u;
+   return h;
+}
+
+static gboolean
+model_position_equal(gconstpointer a, gconstpointer b)
+{
+   return memcmp(a, b, sizeof(glm::vec3)) == 0;
+}
+
+/* Vertices on different sides of a seam have different attributes, other
+ * than position and normal (models are often flat shaded, so normals are
+ * discontinuous everywhere).
+ */
+static bool
+model_vertex_same_surface(const ModelVertex *a, const ModelVertex *b)
+{
+   return a->uv == b->uv && a->mat_idx == b->mat_idx &&
+          a->sampler == b->sampler;
+}
+
+typedef struct {
+   unsigned a, b;    /* Positions, a < b */
+   unsigned tri;
+} ModelEdge;
+
+static int
+model_edge_compare(const void *p1, const void *p2)
+{
+   const ModelEdge *e1 = (const ModelEdge *) p1;
+   const ModelEdge *e2 = (const ModelEdge *) p2;
+   if (e1->a != e2->a)
+      return e1->a < e2->a ? -1 : 1;
+   if (e1->b != e2->b)
+      return e1->b < e2->b ? -1 : 1;
+   return 0;
+}
+
+typedef struct {
+   unsigned a, b;    /* a moves to b */
+   float error;
+} ModelCollapse;
+
+static int
+model_collapse_compare(const void *p1, const void *p2)
+{
+   const ModelCollapse *c1 = (const ModelCollapse *) p1;
+   const ModelCollapse *c2 = (const ModelCollapse *) p2;
+   if (c1->error != c2->error)
+      return c1->error < c2->error ? -1 : 1;
+   return 0;
+}
+
+typedef struct {
+   /* Vertices of the model and the ones created by collapses (a vertex of
+    * the model moved to another position) and their unique positions.
+    */
+   std::vector<ModelVertex> vertices;
+   std::vector<unsigned> vertex_pos;
+   std::vector<unsigned> model_vertex;   /* UINT_MAX if not in the model */
+   GHashTable *vertex_index;             /* ModelVertex -> index + 1 */
+
+   std::vector<glm::vec3> positions;
+   std::vector<ModelQuadric> quadrics;
+
+   /* Triangles of the simplified mesh (vertex indices) and whether they are
+    * flat shaded, so we recompute their normal when they change.
+    */
+   std::vector<unsigned> tris;
+   std::vector<bool> flat;
+   unsigned num_tris;
+
+   /* Triangles using each position, rebuilt in each pass */
+   std::vector<unsigned> pos_tri_start;
+   std::vector<unsigned> pos_tris;
+
+   float error;                          /* Largest collapse error */
+} ModelSimplifier;
+
+static unsigned
+simplifier_add_vertex(ModelSimplifier *s, const ModelVertex *v, unsigned pos)
+{
+   gpointer value;
+   if (g_hash_table_lookup_extended(s->vertex_index, v, NULL, &value))
+      return GPOINTER_TO_UINT(value) - 1;
+
+   unsigned index = s->vertices.size();
+   s->vertices.push_back(*v);
+   s->vertex_pos.push_back(pos);
+   s->model_vertex.push_back(UINT_MAX);
+
+   ModelVertex *key = g_new(ModelVertex, 1);
+   memcpy(key, v, sizeof(ModelVertex));
+   g_hash_table_insert(s->vertex_index, key, GUINT_TO_POINTER(index + 1));
+   return index;
+}
+
+static inline unsigned
+simplifier_tri_pos(ModelSimplifier *s, unsigned t, unsigned k)
+{
+   return s->vertex_pos[s->tris[3 * t + k]];
+}
+
+/* Corner of a triangle at a position */
+static inline unsigned
+simplifier_tri_corner(ModelSimplifier *s, unsigned t, unsigned pos)
+{
+   for (unsigned k = 0; k < 3; k++) {
+      if (simplifier_tri_pos(s, t, k) == pos)
+         return k;
+   }
+   return 3;
+}
+
+static glm::vec3
+simplifier_tri_normal(ModelSimplifier *s, unsigned t)
+{
+   glm::vec3 p0 = s->positions[simplifier_tri_pos(s, t, 0)];
+   glm::vec3 p1 = s->positions[simplifier_tri_pos(s, t, 1)];
+   glm::vec3 p2 = s->positions[simplifier_tri_pos(s, t, 2)];
+   return glm::cross(p1 - p0, p2 - p0);
+}
+
+/*
+ * Returns the edges of the mesh sorted by position, so the triangles
+ * sharing an edge are consecutive, and rebuilds the triangle lists of the
+ * positions.
+ */
+static ModelEdge *
+simplifier_build_adjacency(ModelSimplifier *s)
+{
+   unsigned num_pos = s->positions.size();
+   ModelEdge *edges = g_new(ModelEdge, 3 * s->num_tris);
+
+   s->pos_tri_start.assign(num_pos + 1, 0);
+   for (unsigned t = 0; t < s->num_tris; t++) {
+      for (unsigned k = 0; k < 3; k++) {
+         unsigned a = simplifier_tri_pos(s, t, k);
+         unsigned b = simplifier_tri_pos(s, t, (k + 1) % 3);
+         ModelEdge *e = &edges[3 * t + k];
+         e->a = MIN(a, b);
+         e->b = MAX(a, b);
+         e->tri = t;
+         s->pos_tri_start[a + 1]++;
+      }
+   }
+   qsort(edges, 3 * s->num_tris, sizeof(ModelEdge), model_edge_compare);
+
+   for (unsigned p = 0; p < num_pos; p++)
+      s->pos_tri_start[p + 1] += s->pos_tri_start[p];
+   s->pos_tris.resize(3 * s->num_tris);
+   std::vector<unsigned> fill(s->pos_tri_start.begin(),
+                              s->pos_tri_start.end() - 1);
+   for (unsigned t = 0; t < s->num_tris; t++) {
+      for (unsigned k = 0; k < 3; k++)
+         s->pos_tris[fill[simplifier_tri_pos(s, t, k)]++] = t;
+   }
+
+   return edges;
+}
+
+/* Whether the two triangles of an edge are on different sides of a seam */
+static bool
+simplifier_edge_is_seam(ModelSimplifier *s, const ModelEdge *e)
+{
+   unsigned t1 = e[0].tri, t2 = e[1].tri;
+   unsigned a1 = s->tris[3 * t1 + simplifier_tri_corner(s, t1, e->a)];
+   unsigned a2 = s->tris[3 * t2 + simplifier_tri_corner(s, t2, e->a)];
+   unsigned b1 = s->tris[3 * t1 + simplifier_tri_corner(s, t1, e->b)];
+   unsigned b2 = s->tris[3 * t2 + simplifier_tri_corner(s, t2, e->b)];
+   return !model_vertex_same_surface(&s->vertices[a1], &s->vertices[a2]) ||
+          !model_vertex_same_surface(&s->vertices[b1], &s->vertices[b2]);
+}
+
+static void
+simplifier_init(ModelSimplifier *s, TerModel *m)
+{
+   unsigned num_vertices = m->vertices.size();
+   bool has_uvs = m->uvs.size() > 0;
+   bool has_normals = m->normals.size() > 0;
+   bool has_materials = m->mat_idx.size() > 0;
+   bool has_samplers = m->samplers.size() > 0;
+
+   s->vertex_index =
+      g_hash_table_new_full(model_vertex_hash, model_vertex_equal,
+                            g_free, NULL);
+   GHashTable *pos_index =
+      g_hash_table_new(model_position_hash, model_position_equal);
+
+   for (unsigned i = 0; i < num_vertices; i++) {
+      gpointer value;
+      unsigned pos;
+      if (g_hash_table_lookup_extended(pos_index, &m->vertices[i], NULL,
+                                       &value)) {
+         pos = GPOINTER_TO_UINT(value);
+      } else {
+         pos = s->positions.size();
+         s->positions.push_back(m->vertices[i]);
+         g_hash_table_insert(pos_index, &m->vertices[i],
+                             GUINT_TO_POINTER(pos));
+      }
+
+      ModelVertex v;
+      v.position = m->vertices[i];
+      v.normal = has_normals ? m->normals[i] : glm::vec3(0.0f);
+      v.uv = has_uvs ? m->uvs[i] : glm::vec2(0.0f);
+      v.mat_idx = has_materials ? m->mat_idx[i] : 0;
+      v.sampler = has_samplers ? m->samplers[i] : 0;
+      unsigned index = simplifier_add_vertex(s, &v, pos);
+      assert(index == i);
+      s->model_vertex[index] = i;
+   }
+   g_hash_table_destroy(pos_index);
+
+   /* Triangles with repeated positions are invisible, we drop them */
+   for (unsigned i = 0; i < m->lods[0].num_indices; i += 3) {
+      const unsigned *tri = &m->indices[i];
+      unsigned p0 = s->vertex_pos[tri[0]];
+      unsigned p1 = s->vertex_pos[tri[1]];
+      unsigned p2 = s->vertex_pos[tri[2]];
+      if (p0 == p1 || p1 == p2 || p2 == p0)
+         continue;
+
+      s->tris.insert(s->tris.end(), tri, tri + 3);
+      s->flat.push_back(s->vertices[tri[0]].normal == s->vertices[tri[1]].normal &&
+                        s->vertices[tri[0]].normal == s->vertices[tri[2]].normal);
+   }
+   s->num_tris = s->flat.size();
+
+   /* Planes of the faces, weighted by their area */
+   s->quadrics.assign(s->positions.size(), ModelQuadric());
+   for (unsigned t = 0; t < s->num_tris; t++) {
+      glm::vec3 n = simplifier_tri_normal(s, t);
+      float len = glm::length(n);
+      if (len == 0.0f)
+         continue;
+      n /= len;
+      float d = -glm::dot(n, s->positions[simplifier_tri_pos(s, t, 0)]);
+      for (unsigned k = 0; k < 3; k++)
+         quadric_add_plane(&s->quadrics[simplifier_tri_pos(s, t, k)],
+                           n, d, 0.5f * len);
+   }
+
+   /* Planes perpendicular to the faces along borders and seams, so
+    * vertices on them can't move away from them.
+    */
+   ModelEdge *edges = simplifier_build_adjacency(s);
+   unsigned num_edges = 3 * s->num_tris;
+   for (unsigned i = 0, n = 1; i < num_edges; i += n) {
+      n = 1;
+      while (i + n < num_edges &&
+             model_edge_compare(&edges[i], &edges[i + n]) == 0)
+         n++;
+      if (n == 2 && !simplifier_edge_is_seam(s, &edges[i]))
+         continue;
+
+      for (unsigned j = i; j < i + n; j++) {
+         glm::vec3 pa = s->positions[edges[j].a];
+         glm::vec3 edge = s->positions[edges[j].b] - pa;
+         glm::vec3 normal = glm::cross(edge, simplifier_tri_normal(s, edges[j].tri));
+         float len = glm::length(normal);
+         if (len == 0.0f)
+            continue;
+         normal /= len;
+         float d = -glm::dot(normal, pa);
+         float w = LOD_BORDER_WEIGHT * glm::dot(edge, edge);
+         quadric_add_plane(&s->quadrics[edges[j].a], normal, d, w);
+         quadric_add_plane(&s->quadrics[edges[j].b], normal, d, w);
+      }
+   }
+   g_free(edges);
+
+   s->error = 0.0f;
+}
+
+static void
+simplifier_free(ModelSimplifier *s)
+{
+   g_hash_table_destroy(s->vertex_index);
+}
+
+/*
+ * Finds the triangles that contain the edge a-b (which are removed by the
+ * collapse) and checks that collapsing it doesn't change the topology of
+ * the mesh nor flip any of the remaining triangles around a.
+ */
+static bool
+simplifier_can_collapse(ModelSimplifier *s, unsigned a, unsigned b,
+                        unsigned *edge_tris, unsigned *num_edge_tris)
+{
+   const unsigned *a_tris = &s->pos_tris[s->pos_tri_start[a]];
+   unsigned a_count = s->pos_tri_start[a + 1] - s->pos_tri_start[a];
+   const unsigned *b_tris = &s->pos_tris[s->pos_tri_start[b]];
+   unsigned b_count = s->pos_tri_start[b + 1] - s->pos_tri_start[b];
+
+   *num_edge_tris = 0;
+   for (unsigned i = 0; i < a_count; i++) {
+      unsigned t = a_tris[i];
+      if (simplifier_tri_corner(s, t, b) < 3) {
+         if (*num_edge_tris == 2)
+            return false;
+         edge_tris[(*num_edge_tris)++] = t;
+      }
+   }
+   if (*num_edge_tris == 0)
+      return false;
+
+   /* The only neighbors of both a and b must be the opposite corners of the
+    * edge triangles, otherwise the collapse creates non-manifold edges.
+    */
+   unsigned num_shared = 0;
+   unsigned shared[4];
+   for (unsigned i = 0; i < a_count; i++) {
+      for (unsigned k = 0; k < 3; k++) {
+         unsigned p = simplifier_tri_pos(s, a_tris[i], k);
+         if (p == a || p == b)
+            continue;
+
+         bool is_b_neighbor = false;
+         for (unsigned j = 0; j < b_count && !is_b_neighbor; j++)
+            is_b_neighbor = simplifier_tri_corner(s, b_tris[j], p) < 3;
+         if (!is_b_neighbor)
+            continue;
+
+         unsigned n = 0;
+         while (n < num_shared && shared[n] != p)
+            n++;
+         if (n == num_shared) {
+            if (num_shared == *num_edge_tris)
+               return false;
+            shared[num_shared++] = p;
+         }
+      }
+   }
+
+   for (unsigned i = 0; i < a_count; i++) {
+      unsigned t = a_tris[i];
+      if (simplifier_tri_corner(s, t, b) < 3)
+         continue;
+
+      /* We need an edge triangle on the same side of any seam to take the
+       * attributes of b from
+       */
+      unsigned c = simplifier_tri_corner(s, t, a);
+      const ModelVertex *v = &s->vertices[s->tris[3 * t + c]];
+      bool found = false;
+      for (unsigned j = 0; j < *num_edge_tris && !found; j++) {
+         unsigned e = edge_tris[j];
+         unsigned ec = simplifier_tri_corner(s, e, a);
+         found = model_vertex_same_surface(v, &s->vertices[s->tris[3 * e + ec]]);
+      }
+      if (!found)
+         return false;
+
+      glm::vec3 p[3];
+      for (unsigned k = 0; k < 3; k++)
+         p[k] = s->positions[simplifier_tri_pos(s, t, k)];
+      glm::vec3 n0 = glm::cross(p[1] - p[0], p[2] - p[0]);
+      p[c] = s->positions[b];
+      glm::vec3 n1 = glm::cross(p[1] - p[0], p[2] - p[0]);
+      float len = glm::length(n0) * glm::length(n1);
+      if (len == 0.0f || glm::dot(n0, n1) < LOD_MAX_FLIP_COS * len)
+         return false;
+   }
+
+   return true;
+}
+
+/* Moves position a to position b */
+static void
+simplifier_collapse(ModelSimplifier *s, unsigned a, unsigned b,
+                    const unsigned *edge_tris, unsigned num_edge_tris)
+{
+   const unsigned *a_tris = &s->pos_tris[s->pos_tri_start[a]];
+   unsigned a_count = s->pos_tri_start[a + 1] - s->pos_tri_start[a];
+
+   for (unsigned i = 0; i < a_count; i++) {
+      unsigned t = a_tris[i];
+      unsigned *tri = &s->tris[3 * t];
+      if (simplifier_tri_corner(s, t, b) < 3)
+         continue;
+
+      /* The corner takes the attributes of b on the same side of any seam,
+       * and its normal too if normals are smooth there.
+       */
+      unsigned c = simplifier_tri_corner(s, t, a);
+      ModelVertex v = s->vertices[tri[c]];
+      for (unsigned j = 0; j < num_edge_tris; j++) {
+         unsigned e = edge_tris[j];
+         const ModelVertex *ea =
+            &s->vertices[s->tris[3 * e + simplifier_tri_corner(s, e, a)]];
+         const ModelVertex *eb =
+            &s->vertices[s->tris[3 * e + simplifier_tri_corner(s, e, b)]];
+         if (model_vertex_same_surface(&v, ea)) {
+            v.uv = eb->uv;
+            if (v.normal == ea->normal)
+               v.normal = eb->normal;
+            break;
+         }
+      }
+      v.position = s->positions[b];
+      tri[c] = simplifier_add_vertex(s, &v, b);
+
+      if (s->flat[t]) {
+         glm::vec3 n = glm::normalize(simplifier_tri_normal(s, t));
+         for (unsigned k = 0; k < 3; k++) {
+            ModelVertex fv = s->vertices[tri[k]];
+            fv.normal = n;
+            tri[k] = simplifier_add_vertex(s, &fv, s->vertex_pos[tri[k]]);
+         }
+      }
+   }
+
+   /* The triangles of the edge are gone */
+   for (unsigned j = 0; j < num_edge_tris; j++)
+      s->tris[3 * edge_tris[j]] = UINT_MAX;
+   s->num_tris -= num_edge_tris;
+
+   quadric_add(&s->quadrics[b], &s->quadrics[a]);
+}
+
+/*
+ * Collapses the edges with the smallest error until the mesh has target
+ * triangles, collapsing edges of each vertex at most once since the
+ * adjacency is only rebuilt between passes. Returns the number of
+ * collapses.
+ */
+static unsigned
+simplifier_pass(ModelSimplifier *s, unsigned target)
+{
+   unsigned num_pos = s->positions.size();
+   unsigned num_edges = 3 * s->num_tris;
+   ModelEdge *edges = simplifier_build_adjacency(s);
+
+   /* Vertices on a border (edges with a single triangle) or a seam can only
+    * move along it and vertices in more of them (corners) can't move.
+    */
+   std::vector<unsigned> num_border(num_pos, 0), num_seam(num_pos, 0);
+   std::vector<bool> locked(num_pos, false);
+   for (unsigned i = 0, n = 1; i < num_edges; i += n) {
+      n = 1;
+      while (i + n < num_edges &&
+             model_edge_compare(&edges[i], &edges[i + n]) == 0)
+         n++;
+      if (n == 1) {
+         num_border[edges[i].a]++;
+         num_border[edges[i].b]++;
+      } else if (n > 2) {
+         locked[edges[i].a] = locked[edges[i].b] = true;
+      } else if (simplifier_edge_is_seam(s, &edges[i])) {
+         num_seam[edges[i].a]++;
+         num_seam[edges[i].b]++;
+      }
+   }
+   for (unsigned p = 0; p < num_pos; p++) {
+      unsigned special = num_border[p] + num_seam[p];
+      if (special == 1 || special > 2 || (special == 2 && num_border[p] == 1))
+         locked[p] = true;
+   }
+
+   ModelCollapse *collapses = g_new(ModelCollapse, num_edges);
+   unsigned num_collapses = 0;
+   for (unsigned i = 0, n = 1; i < num_edges; i += n) {
+      n = 1;
+      while (i + n < num_edges &&
+             model_edge_compare(&edges[i], &edges[i + n]) == 0)
+         n++;
+      if (n > 2)
+         continue;
+
+      bool border = n == 1;
+      bool seam = n == 2 && simplifier_edge_is_seam(s, &edges[i]);
+      unsigned ends[2] = { edges[i].a, edges[i].b };
+
+      ModelCollapse *best = &collapses[num_collapses];
+      best->error = FLT_MAX;
+      for (unsigned k = 0; k < 2; k++) {
+         unsigned a = ends[k], b = ends[1 - k];
+         if (locked[a])
+            continue;
+         if (border || seam) {
+            if (num_border[a] + num_seam[a] != 2 ||
+                (border && num_border[a] != 2) || (seam && num_seam[a] != 2))
+               continue;
+         } else if (num_border[a] + num_seam[a] > 0) {
+            continue;
+         }
+
+         ModelQuadric q = s->quadrics[a];
+         quadric_add(&q, &s->quadrics[b]);
+         float error = quadric_error(&q, s->positions[b]);
+         if (error < best->error) {
+            best->a = a;
+            best->b = b;
+            best->error = error;
+         }
+      }
+      if (best->error < FLT_MAX)
+         num_collapses++;
+   }
+   g_free(edges);
+
+   qsort(collapses, num_collapses, sizeof(ModelCollapse),
+         model_collapse_compare);
+
+   std::vector<bool> touched(num_pos, false);
+   unsigned done = 0;
+   for (unsigned i = 0; i < num_collapses && s->num_tris > target; i++) {
+      unsigned a = collapses[i].a, b = collapses[i].b;
+      if (touched[a] || touched[b])
+         continue;
+
+      unsigned edge_tris[2], num_edge_tris;
+      if (!simplifier_can_collapse(s, a, b, edge_tris, &num_edge_tris))
+         continue;
+
+      /* The neighbors of a get new triangles, so their adjacency is stale */
+      const unsigned *a_tris = &s->pos_tris[s->pos_tri_start[a]];
+      unsigned a_count = s->pos_tri_start[a + 1] - s->pos_tri_start[a];
+      for (unsigned j = 0; j < a_count; j++) {
+         for (unsigned k = 0; k < 3; k++)
+            touched[simplifier_tri_pos(s, a_tris[j], k)] = true;
+      }
+
+      simplifier_collapse(s, a, b, edge_tris, num_edge_tris);
+      s->error = MAX(s->error, collapses[i].error);
+      done++;
+   }
+   g_free(collapses);
+
+   /* Drop the collapsed triangles */
+   unsigned n = 0;
+   for (unsigned t = 0; n < s->num_tris; t++) {
+      if (s->tris[3 * t] == UINT_MAX)
+         continue;
+      memmove(&s->tris[3 * n], &s->tris[3 * t], 3 * sizeof(unsigned));
+      s->flat[n] = s->flat[t];
+      n++;
+   }
+   s->tris.resize(3 * n);
+   s->flat.resize(n);
+
+   return done;
+}
+
+/* Appends the simplified mesh to the model as a new level of detail */
+static void
+simplifier_add_lod(ModelSimplifier *s, TerModel *m)
+{
+   bool has_uvs = m->uvs.size() > 0;
+   bool has_normals = m->normals.size() > 0;
+   bool has_materials = m->mat_idx.size() > 0;
+   bool has_samplers = m->samplers.size() > 0;
+
+   TerModelLod *lod = &m->lods[m->num_lods++];
+   lod->first_index = m->indices.size();
+   lod->num_indices = 3 * s->num_tris;
+   lod->error = sqrtf(s->error);
+
+   for (unsigned i = 0; i < lod->num_indices; i++) {
+      unsigned v = s->tris[i];
+      if (s->model_vertex[v] == UINT_MAX) {
+         const ModelVertex *mv = &s->vertices[v];
+         s->model_vertex[v] = m->vertices.size();
+         m->vertices.push_back(mv->position);
+         if (has_normals)
+            m->normals.push_back(mv->normal);
+         if (has_uvs)
+            m->uvs.push_back(mv->uv);
+         if (has_materials)
+            m->mat_idx.push_back(mv->mat_idx);
+         if (has_samplers)
+            m->samplers.push_back(mv->sampler);
+      }
+      m->indices.push_back(s->model_vertex[v]);
+   }
+
+   optimize_vertex_cache(&m->indices[lod->first_index], lod->num_indices,
+                         m->vertices.size());
+}
+
+/*
+ * Generates the levels of detail of the model from its full resolution
+ * mesh (the first level). Each level is simplified from the previous one,
+ * so the simplification error grows with the level.
+ */
+static void
+model_build_lods(TerModel *m)
+{
+   ModelSimplifier s;
+   simplifier_init(&s, m);
+
+   unsigned num_tris = s.num_tris;
+   while (m->num_lods < TER_MODEL_MAX_LODS) {
+      unsigned target = (unsigned) (num_tris * TER_MODEL_LOD_REDUCTION);
+      while (s.num_tris > target && simplifier_pass(&s, target) > 0);
+
+      if (s.num_tris == 0 ||
+          s.num_tris > num_tris * TER_MODEL_LOD_MIN_REDUCTION)
+         break;
+
+      simplifier_add_lod(&s, m);
+      num_tris = s.num_tris;
+
+      ter_dbg(LOG_OBJ_LOAD,
+              "OBJ-LOADER: INFO: LOD %u: %u triangles, error %.4f\n",
+              m->num_lods - 1, num_tris, m->lods[m->num_lods - 1].error);
+   }
+
+   simplifier_free(&s);
+}
+
 TerModel *
 ter_model_load_obj(const char *path)
 {
@@ -516,6 +1541,9 @@ ter_model_load_obj(const char *path)
       }
    }
 
+   model_build_indices(m);
+   model_build_lods(m);
+
    m->num_tids = tid_count;
    for (unsigned i = 0; i < tid_count; i++)
       m->tids[i] = tids[i];
@@ -536,12 +1564,12 @@ ter_model_load_obj(const char *path)
 
    ter_dbg(LOG_OBJ_LOAD,
            "OBJ-LOADER: INFO: Loaded model '%s'. "
-           "Vertices: %d (%d triangles), "
+           "Vertices: %d (%d triangles), LODs: %d, "
            "Materials: %d, Texture Coords: %s, Num Textures: %d, "
            "Normals: %s\n",
            m->name,
-           (int) m->vertices.size(), (int) m->vertices.size() / 3,
-           m->num_materials, has_uvs ? "Yes" : "No", tid_count,
+           (int) m->vertices.size(), (int) m->lods[0].num_indices / 3,
+           m->num_lods, m->num_materials, has_uvs ? "Yes" : "No", tid_count,
            has_normals ? "Yes" : "No");
 
 
@@ -559,9 +1587,22 @@ cleanup:
    return m;
 }
 
+static inline unsigned
+vertex_byte_size(bool is_textured)
+{
+   unsigned size = sizeof(glm::vec3) + sizeof(glm::vec3) + sizeof(int);
+   if (is_textured)
+      size += sizeof(glm::vec2) + sizeof(int);
+   return size;
+}
+
+/* Interleave attributes for better performance on some platforms. Material
+ * indices are rebased to the materials of the model in the arena material
+ * table and sampler indices to the textures of the model in its batch.
+ */
 static void
-upload_and_bind_vertex_data(TerModel *model, float *M4x4_list,
-                            unsigned num_instances)
+model_write_vertex_data(TerModel *model, uint8_t *vertex_data,
+                        int sampler_base)
 {
    unsigned vert_count = model->vertices.size();
    assert(model->normals.size() == vert_count);
@@ -569,323 +1610,331 @@ upload_and_bind_vertex_data(TerModel *model, float *M4x4_list,
    assert(!model_is_textured(model) || model->uvs.size() == vert_count);
 
    bool is_textured = model_is_textured(model);
-
-   /* Interleave attributes for better performance on some platforms.
-    * We need to allocate a buffer large enough to store all attribute data for
-    * each vertex considering whether it is textured or not.
-    */
-   unsigned position_size = sizeof(glm::vec3);
-   unsigned normal_size = sizeof(glm::vec3);
-   unsigned mat_idx_size = sizeof(int);
-   unsigned uv_size = 0;
-   unsigned sampler_size = 0;
-   unsigned num_attrs = NUM_VERTEX_ATTRIBS_SOLID;
-   if (is_textured) {
-      uv_size = sizeof(glm::vec2);
-      sampler_size = sizeof(int);
-      num_attrs = NUM_VERTEX_ATTRIBS_TEXTURED;
-   }
-
-   unsigned vertex_byte_size =
-      position_size + normal_size + mat_idx_size + uv_size + sampler_size;
-
-   unsigned bytes = vert_count * vertex_byte_size;
-   uint8_t *vertex_data = g_new(uint8_t, bytes);
+   unsigned stride = vertex_byte_size(is_textured);
 
    for (unsigned i = 0; i < vert_count; i++) {
-      unsigned offset = 0;
+      uint8_t *v = &vertex_data[stride * i];
 
-      memcpy(&vertex_data[vertex_byte_size * i + offset],
-             &model->vertices[i], position_size);
-      offset += position_size;
+      memcpy(v, &model->vertices[i], sizeof(glm::vec3));
+      v += sizeof(glm::vec3);
 
-      memcpy(&vertex_data[vertex_byte_size * i + offset],
-             &model->normals[i], normal_size);
-      offset += normal_size;
+      memcpy(v, &model->normals[i], sizeof(glm::vec3));
+      v += sizeof(glm::vec3);
 
-      memcpy(&vertex_data[vertex_byte_size * i + offset],
-             &model->mat_idx[i], mat_idx_size);
-      offset += mat_idx_size;
+      int mat_idx = model->mat_idx[i] + model->material_base;
+      memcpy(v, &mat_idx, sizeof(int));
+      v += sizeof(int);
 
       if (is_textured) {
-         memcpy(&vertex_data[vertex_byte_size * i + offset],
-                &model->uvs[i], uv_size);
-         offset += uv_size;
+         memcpy(v, &model->uvs[i], sizeof(glm::vec2));
+         v += sizeof(glm::vec2);
 
-         memcpy(&vertex_data[vertex_byte_size * i + offset],
-                &model->samplers[i], sampler_size);
-         offset += sampler_size;
+         int sampler = model->samplers[i] + sampler_base;
+         memcpy(v, &sampler, sizeof(int));
+         v += sizeof(int);
       }
    }
+}
 
-   /* Upload non-mutable vertex buffer */
-   glGenBuffers(1, &model->vertex_buf);
-   glBindBuffer(GL_ARRAY_BUFFER, model->vertex_buf);
-   glBufferData(GL_ARRAY_BUFFER, bytes, vertex_data, GL_STATIC_DRAW);
-   g_free(vertex_data);
-
-   /* Upload instanced data to the first instanced buffer and allocate buffer
-    * storage for the other buffers
-    */
-   glGenBuffers(TER_MODEL_NUM_INSTANCED_BUFFERS, model->instanced_buf);
-   for (int i = 0; i < TER_MODEL_NUM_INSTANCED_BUFFERS; i++) {
-      glBindBuffer(GL_ARRAY_BUFFER, model->instanced_buf[i]);
-      glBufferData(GL_ARRAY_BUFFER,
-                   TER_MODEL_MAX_INSTANCED_VBO_BYTES,
-                   i == 0 ? &M4x4_list[0] : NULL,
-                   GL_DYNAMIC_DRAW);
-   }
-
-   glGenVertexArrays(1, &model->vao);
-   glBindVertexArray(model->vao);
-
-   /* WARNING: if you add new instanced attributes you need to:
-    *
-    * 1. bind them here
-    * 2. update upload_instanced_data_and_bind
-    */
-
-   /* Model matrix (attribute locations 1-4) */
-   model->ibuf_idx = 0;
-   size_t buffer_offset = 0;
-   glBindBuffer(GL_ARRAY_BUFFER, model->instanced_buf[model->ibuf_idx]);
-   for (int i = 1; i < 5; i++) {
-      glEnableVertexAttribArray(i);
-      glVertexAttribPointer(
-         i,                  // Attribute index
-         4,                  // size
-         GL_FLOAT,           // type
-         GL_FALSE,           // normalized?
-         TER_MODEL_INSTANCED_ITEM_SIZE, // stride
-         (void*) buffer_offset // array buffer offset
-      );
-      glVertexAttribDivisor(i, 1);
-      buffer_offset += 4 * sizeof(float);
-   }
-
-   /* Previous MVP (for motion blur) */
-   for (int i = 5; i < 9; i++) {
-      glVertexAttribPointer(
-         i,                  // Attribute index
-         4,                  // size
-         GL_FLOAT,           // type
-         GL_FALSE,           // normalized?
-         TER_MODEL_INSTANCED_ITEM_SIZE,         // stride
-         (void*) buffer_offset // array buffer offset
-      );
-      glVertexAttribDivisor(i, 1);
-
-      if (TER_MOTION_BLUR_FILTER_ENABLE) {
-         glEnableVertexAttribArray(i);
-         buffer_offset += 4 * sizeof(float);
-      } else {
-         glDisableVertexAttribArray(i);
-      }
-   }
-
-   /* Model variant index */
-   glEnableVertexAttribArray(9);
-   glVertexAttribIPointer(
-      9,                     // Attribute index
-      1,                     // size
-      GL_INT,                // type
-      TER_MODEL_INSTANCED_ITEM_SIZE,   // stride
-      (void*) buffer_offset  // array buffer offset
-   );
-   glVertexAttribDivisor(9, 1);
-   buffer_offset += sizeof(int);
-
-   model->ibuf_used = num_instances;
+/* Configures the per-vertex attributes of the bound VAO to read from the
+ * vertex buffer of the batch
+ */
+static void
+batch_bind_vertex_attributes(TerModelBatch *batch)
+{
+   unsigned stride = vertex_byte_size(batch->textured);
+   unsigned num_attrs = batch->textured ?
+      NUM_VERTEX_ATTRIBS_TEXTURED : NUM_VERTEX_ATTRIBS_SOLID;
 
-   /* Unmutable interleaved data */
-   glBindBuffer(GL_ARRAY_BUFFER, model->vertex_buf);
+   glBindBuffer(GL_ARRAY_BUFFER, batch->vertex_buf);
 
    /* Position */
    size_t offset = 0;
-   glEnableVertexAttribArray(0);
    glVertexAttribPointer(
       0,                  // Attribute index
       3,                  // size
       GL_FLOAT,           // type
       GL_FALSE,           // normalized?
-      vertex_byte_size,   // stride
+      stride,             // stride
       (void*)offset       // array buffer offset
    );
-   offset += position_size;
+   offset += sizeof(glm::vec3);
 
    /* Normals */
    unsigned attr_index = 10;
-   glEnableVertexAttribArray(attr_index);
    glVertexAttribPointer(
       attr_index++,       // Attribute index
       3,                  // size
       GL_FLOAT,           // type
       GL_FALSE,           // normalized?
-      vertex_byte_size,   // stride
+      stride,             // stride
       (void*)offset       // array buffer offset
    );
-   offset += normal_size;
+   offset += sizeof(glm::vec3);
 
    /* Material index */
-   glEnableVertexAttribArray(attr_index);
    glVertexAttribIPointer(
       attr_index++,       // Attribute index
       1,                  // size
       GL_INT,             // type
-      vertex_byte_size,   // stride
+      stride,             // stride
       (void*)offset       // array buffer offset
    );
-   offset += mat_idx_size;
+   offset += sizeof(int);
 
-   if (is_textured) {
+   if (batch->textured) {
       /* UVs */
-      glEnableVertexAttribArray(attr_index);
       glVertexAttribPointer(
          attr_index++,       // Attribute index
          2,                  // size
          GL_FLOAT,           // type
          GL_FALSE,           // normalized?
-         vertex_byte_size,   // stride
+         stride,             // stride
          (void*)offset       // array buffer offset
       );
-      offset += uv_size;
+      offset += sizeof(glm::vec2);
 
       /* Sampler index */
-      glEnableVertexAttribArray(attr_index);
       glVertexAttribIPointer(
          attr_index++,       // Attribute index
          1,                  // size
          GL_INT,             // type
-         vertex_byte_size,   // stride
+         stride,             // stride
          (void*)offset       // array buffer offset
       );
-      offset += sampler_size;
+      offset += sizeof(int);
    }
 
-   ter_dbg(LOG_VBO, "MODEL(%s): VBO: INFO: Uploaded %u bytes (%u KB) "
-           "for %u vertices (%u bytes/vertex)\n",
-           model->name, bytes, bytes / 1024, vert_count, vertex_byte_size);
-
-   ter_dbg(LOG_VBO, "MODEL(%s): VBO: INFO: Created %u bytes (%u KB) buffer for "
-           "instanced data\n", model->name, TER_MODEL_MAX_INSTANCED_VBO_BYTES,
-           TER_MODEL_MAX_INSTANCED_VBO_BYTES / 1024);
-
    assert(attr_index == num_attrs);
-   assert(offset == vertex_byte_size);
+   assert(offset == stride);
 }
 
-static void inline
-upload_instanced_data_and_bind(TerModel *model,
-                               float *M4x4_list, unsigned num_instances)
+/* Configures the instanced attributes of the bound VAO to read from the
+ * given buffer and offset
+ *
+ * WARNING: if you add new instanced attributes you need to bind them here
+ * and add them to TerModelInstance.
+ */
+void
+ter_model_bind_instanced_attributes(unsigned buf, size_t buffer_offset)
 {
-   /* Upload the new instance data */
-   size_t buffer_offset = 0;
-
-   unsigned ibuf_available = TER_MODEL_MAX_INSTANCED_OBJECTS - model->ibuf_used;
-   if (num_instances > ibuf_available) {
-      model->ibuf_idx++;
-      if (model->ibuf_idx >= TER_MODEL_NUM_INSTANCED_BUFFERS)
-         model->ibuf_idx = 0;
-      model->ibuf_used = num_instances;
-   } else {
-      buffer_offset = model->ibuf_used * TER_MODEL_INSTANCED_ITEM_SIZE;
-      model->ibuf_used += num_instances;
-   }
-
-   unsigned bytes = num_instances * TER_MODEL_INSTANCED_ITEM_SIZE;
-   glBindBuffer(GL_ARRAY_BUFFER, model->instanced_buf[model->ibuf_idx]);
-   glBufferSubData(GL_ARRAY_BUFFER, buffer_offset, bytes, &M4x4_list[0]);
-
-   ter_dbg(LOG_VBO,
-           "MODEL(%s): VBO: INFO: Updated %u bytes (%u KB) of instanced data "
-           "for %d instances (buf=%u, off=%u)\n",
-           model->name, bytes, bytes / 1024, num_instances,
-           model->ibuf_idx, buffer_offset);
-
-   /* Bind the VAO and re-configure the instanced attributes to read from
-    * the correct buffer and offset where we have just uploaded the data
-    */
-   glBindVertexArray(model->vao);
-   glBindBuffer(GL_ARRAY_BUFFER, model->instanced_buf[model->ibuf_idx]);
-   for (int i = 1; i < 5; i++) {
-      glEnableVertexAttribArray(i);
-      glVertexAttribPointer(
-         i,                  // Attribute index
-         4,                  // size
-         GL_FLOAT,           // type
-         GL_FALSE,           // normalized?
-         TER_MODEL_INSTANCED_ITEM_SIZE, // stride
-         (void*)(buffer_offset) // array buffer offset
-      );
-      glVertexAttribDivisor(i, 1);
-      buffer_offset += 4 * sizeof(float);
-   }
+   /* Position and scale */
+   glBindBuffer(GL_ARRAY_BUFFER, buf);
+   glVertexAttribPointer(
+      INSTANCED_ATTRIB_POSITION, // Attribute index
+      4,                     // size
+      GL_FLOAT,              // type
+      GL_FALSE,              // normalized?
+      TER_MODEL_INSTANCED_ITEM_SIZE, // stride
+      (void*)(buffer_offset) // array buffer offset
+   );
+   glVertexAttribDivisor(INSTANCED_ATTRIB_POSITION, 1);
+   buffer_offset += 4 * sizeof(float);
 
-   /* No need to remap or enable motion blur attributes if
-    * motion blur is disabled
-    */
-   if (TER_MOTION_BLUR_FILTER_ENABLE) {
-      for (int i = 5; i < 9; i++) {
-         glEnableVertexAttribArray(i);
-         glVertexAttribPointer(
-            i,                  // Attribute index
-            4,                  // size
-            GL_FLOAT,           // type
-            GL_FALSE,           // normalized?
-            TER_MODEL_INSTANCED_ITEM_SIZE, // stride
-            (void*)(buffer_offset) // array buffer offset
-         );
-         glVertexAttribDivisor(i, 1);
-         buffer_offset += 4 * sizeof(float);
-      }
-   }
+   /* Rotation */
+   glVertexAttribPointer(
+      INSTANCED_ATTRIB_ROTATION, // Attribute index
+      4,                     // size
+      GL_FLOAT,              // type
+      GL_FALSE,              // normalized?
+      TER_MODEL_INSTANCED_ITEM_SIZE, // stride
+      (void*)(buffer_offset) // array buffer offset
+   );
+   glVertexAttribDivisor(INSTANCED_ATTRIB_ROTATION, 1);
+   buffer_offset += 4 * sizeof(float);
 
-   glEnableVertexAttribArray(9);
+   /* Model variant index */
    glVertexAttribIPointer(
-      9,                     // Attribute index
+      INSTANCED_ATTRIB_VARIANT, // Attribute index
       1,                     // size
       GL_INT,                // type
       TER_MODEL_INSTANCED_ITEM_SIZE, // stride
       (void*)(buffer_offset) // array buffer offset
    );
-   glVertexAttribDivisor(9, 1);
+   glVertexAttribDivisor(INSTANCED_ATTRIB_VARIANT, 1);
    buffer_offset += sizeof(int);
+
+   /* Impostor cross-fade */
+   glVertexAttribPointer(
+      INSTANCED_ATTRIB_FADE, // Attribute index
+      1,                     // size
+      GL_FLOAT,              // type
+      GL_FALSE,              // normalized?
+      TER_MODEL_INSTANCED_ITEM_SIZE, // stride
+      (void*)(buffer_offset) // array buffer offset
+   );
+   glVertexAttribDivisor(INSTANCED_ATTRIB_FADE, 1);
+   buffer_offset += sizeof(float);
 }
 
+/* Binds the VAO of the batch, with its instanced attributes reading from
+ * instanced_buf.
+ */
 static void
-model_bind_vao(TerModel *model, float *M4x4_list, unsigned num_instances,
-               bool render_motion)
+arena_bind_batch(TerModelArena *a, unsigned batch, unsigned instanced_buf)
 {
-   if (model->vao == 0) {
-      upload_and_bind_vertex_data(model, M4x4_list, num_instances);
-   } else {
-      upload_instanced_data_and_bind(model, M4x4_list, num_instances);
-      unsigned num_attrs = model_is_textured(model) ?
-         NUM_VERTEX_ATTRIBS_TEXTURED : NUM_VERTEX_ATTRIBS_SOLID;
-      for (unsigned i = 0; i < num_attrs; i++) {
-         /* Disable previous MVP attribute if not rendering motion vectors */
-         if (!render_motion && is_motion_attrib(i))
-            glDisableVertexAttribArray(i);
-         else
-            glEnableVertexAttribArray(i);
+   assert(batch < a->num_batches);
+
+   glBindVertexArray(a->batches[batch].vao);
+   a->bound_instanced_buf = instanced_buf;
+   ter_model_bind_instanced_attributes(a->bound_instanced_buf, 0);
+}
+
+static void
+arena_upload_materials(TerModelArena *a, TerModel **models, unsigned count)
+{
+   /* std140 layout of the Materials block: ambient, diffuse and specular
+    * arrays, with the shininess in the w component of the specular color.
+    */
+   const unsigned max = TER_MODEL_ARENA_MAX_MATERIALS;
+   glm::vec4 *data = g_new0(glm::vec4, 3 * max);
+   for (unsigned i = 0; i < count; i++) {
+      TerModel *m = models[i];
+      for (unsigned k = 0; k < TER_MODEL_MAX_MATERIALS * m->num_variants; k++) {
+         TerMaterial *mat = &m->materials[k];
+         unsigned idx = m->material_base + k;
+         data[idx] = glm::vec4(mat->ambient, 0.0f);
+         data[max + idx] = glm::vec4(mat->diffuse, 0.0f);
+         data[2 * max + idx] = glm::vec4(mat->specular, mat->shininess);
       }
    }
+
+   glGenBuffers(1, &a->material_buf);
+   glBindBuffer(GL_UNIFORM_BUFFER, a->material_buf);
+   glBufferData(GL_UNIFORM_BUFFER, 3 * max * sizeof(glm::vec4), data,
+                GL_STATIC_DRAW);
+   glBindBuffer(GL_UNIFORM_BUFFER, 0);
+   g_free(data);
 }
 
-static void
-model_unbind(TerModel *model)
+/*
+ * Merges the geometry and materials of the models into a new arena and
+ * uploads them. Models are assigned to the first batch with their vertex
+ * format that has room for their textures. Models must have all their
+ * variants by now and they can only be in one arena.
+ */
+TerModelArena *
+ter_model_arena_new(TerModel **models, unsigned count)
 {
-   bool is_textured = model_is_textured(model);
+   TerModelArena *a = g_new0(TerModelArena, 1);
+   int *sampler_base = g_new0(int, count);
 
-   if (is_textured)
-      glBindTexture(GL_TEXTURE_2D, 0);
+   for (unsigned i = 0; i < count; i++) {
+      TerModel *m = models[i];
+      bool is_textured = model_is_textured(m);
+      assert(!m->arena);
+
+      unsigned b;
+      for (b = 0; b < a->num_batches; b++) {
+         TerModelBatch *batch = &a->batches[b];
+         if (batch->textured == is_textured &&
+             batch->num_tids + m->num_tids <= TER_MODEL_MAX_TEXTURES)
+            break;
+      }
+      if (b == a->num_batches) {
+         assert(a->num_batches < TER_MODEL_ARENA_MAX_BATCHES);
+         a->batches[b].textured = is_textured;
+         a->num_batches++;
+      }
 
-   unsigned num_attrs =  is_textured ?
-      NUM_VERTEX_ATTRIBS_TEXTURED : NUM_VERTEX_ATTRIBS_SOLID;
-   for (unsigned i = 0; i < num_attrs; i++)
-      glDisableVertexAttribArray(i);
+      TerModelBatch *batch = &a->batches[b];
+      m->arena = a;
+      m->batch = b;
+      m->first_vertex = batch->num_vertices;
+      batch->num_vertices += m->vertices.size();
+      m->first_index = batch->num_indices;
+      batch->num_indices += m->indices.size();
+
+      sampler_base[i] = batch->num_tids;
+      for (unsigned t = 0; t < m->num_tids; t++)
+         batch->tids[batch->num_tids++] = m->tids[t];
+
+      m->material_base = a->num_materials;
+      a->num_materials += TER_MODEL_MAX_MATERIALS * m->num_variants;
+      assert(a->num_materials <= TER_MODEL_ARENA_MAX_MATERIALS);
+   }
 
-   glBindVertexArray(0);
+   arena_upload_materials(a, models, count);
+
+   for (unsigned b = 0; b < a->num_batches; b++) {
+      TerModelBatch *batch = &a->batches[b];
+      unsigned stride = vertex_byte_size(batch->textured);
+      unsigned bytes = batch->num_vertices * stride;
+      uint8_t *vertex_data = g_new(uint8_t, bytes);
+
+      for (unsigned i = 0; i < count; i++) {
+         TerModel *m = models[i];
+         if (m->batch != b)
+            continue;
+         model_write_vertex_data(m, vertex_data + m->first_vertex * stride,
+                                 sampler_base[i]);
+      }
+
+      /* Upload non-mutable vertex buffer */
+      glGenBuffers(1, &batch->vertex_buf);
+      glBindBuffer(GL_ARRAY_BUFFER, batch->vertex_buf);
+      glBufferData(GL_ARRAY_BUFFER, bytes, vertex_data, GL_STATIC_DRAW);
+      g_free(vertex_data);
+
+      /* Indices are relative to the first vertex of each model, which is
+       * the base vertex of its draw commands.
+       */
+      unsigned *index_data = g_new(unsigned, batch->num_indices);
+      for (unsigned i = 0; i < count; i++) {
+         TerModel *m = models[i];
+         if (m->batch != b)
+            continue;
+         memcpy(index_data + m->first_index, &m->indices[0],
+                m->indices.size() * sizeof(unsigned));
+      }
+
+      glGenVertexArrays(1, &batch->vao);
+      glBindVertexArray(batch->vao);
+
+      glGenBuffers(1, &batch->index_buf);
+      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, batch->index_buf);
+      glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+                   batch->num_indices * sizeof(unsigned), index_data,
+                   GL_STATIC_DRAW);
+      g_free(index_data);
+
+      batch_bind_vertex_attributes(batch);
+      glBindVertexArray(0);
+
+      ter_dbg(LOG_VBO, "MODEL-ARENA: VBO: INFO: Batch %u: uploaded %u bytes "
+              "(%u KB) for %u vertices (%u bytes/vertex), %u indices, "
+              "%u textures\n",
+              b, bytes, bytes / 1024, batch->num_vertices, stride,
+              batch->num_indices, batch->num_tids);
+   }
+
+   glBindBuffer(GL_ARRAY_BUFFER, 0);
+   g_free(sampler_base);
+
+   /* Without multi-draws we loop over the commands of the multi-draw */
+   a->multi_draw = ter_util_gl_version_at_least(4, 3);
+
+   ter_dbg(LOG_VBO, "MODEL-ARENA: INFO: %u models in %u batches, "
+           "%u materials, multi-draw: %s\n", count, a->num_batches,
+           a->num_materials, a->multi_draw ? "yes" : "no");
+
+   return a;
+}
+
+void
+ter_model_arena_free(TerModelArena *a)
+{
+   if (!a)
+      return;
+
+   for (unsigned b = 0; b < a->num_batches; b++) {
+      glDeleteVertexArrays(1, &a->batches[b].vao);
+      glDeleteBuffers(1, &a->batches[b].vertex_buf);
+      glDeleteBuffers(1, &a->batches[b].index_buf);
+   }
+   glDeleteBuffers(1, &a->material_buf);
+
+   g_free(a);
 }
 
 void
@@ -906,27 +1955,23 @@ ter_model_free(TerModel *m)
    std::vector<int>(m->mat_idx).swap(m->mat_idx);
    m->samplers.clear();
    std::vector<int>(m->samplers).swap(m->samplers);
-
-   glDeleteVertexArrays(1, &m->vao);
-   glDeleteBuffers(1, &m->vertex_buf);
-   glDeleteBuffers(TER_MODEL_NUM_INSTANCED_BUFFERS, m->instanced_buf);
+   m->indices.clear();
+   std::vector<unsigned>(m->indices).swap(m->indices);
 
    g_free(m);
 }
 
 static TerShaderProgramBasic *
-get_shader_program(TerModel *model, bool enable_shadow, bool *is_solid)
+get_shader_program(bool is_solid, bool enable_shadow)
 {
-   *is_solid = model->uvs.size() == 0;
-
    TerShaderProgramBasic *sh;
    if (!enable_shadow) {
-      if (*is_solid)
+      if (is_solid)
          sh = (TerShaderProgramBasic *) ter_cache_get("program/model-solid");
       else
          sh = (TerShaderProgramBasic *) ter_cache_get("program/model-tex");
    } else {
-      if (*is_solid)
+      if (is_solid)
          sh = (TerShaderProgramBasic *)
             ter_cache_get("program/model-solid-shadow");
       else
@@ -952,34 +1997,75 @@ ter_model_render(TerModel *model,
                  glm::vec3 pos, glm::vec3 rot, glm::vec3 scale,
                  bool enable_shadow)
 {
-   glm::mat4 Model = glm::mat4(1.0);
-   Model = glm::translate(Model, pos);
-   Model = glm::scale(Model, scale);
-   Model = glm::rotate(Model, DEG_TO_RAD(rot.x), glm::vec3(1, 0, 0));
-   Model = glm::rotate(Model, DEG_TO_RAD(rot.y), glm::vec3(0, 1, 0));
-   Model = glm::rotate(Model, DEG_TO_RAD(rot.z), glm::vec3(0, 0, 1));
-   float *Model_fptr = glm::value_ptr(Model);
-
-   ter_model_render_prepare(model, (float *) Model_fptr, 1,
-                            TER_FAR_PLANE, TER_FAR_PLANE,
-                            TER_SHADOW_PFC, enable_shadow, false);
-
-   glDrawArraysInstanced(GL_TRIANGLES, 0, model->vertices.size(), 1);
+   /* Instances only support uniform scales */
+   TerModelInstance instance;
+   memset(&instance, 0, sizeof(instance));
+   ter_model_instance_set_transform(&instance, pos, rot, scale.x);
+
+   TerModelArena *a = model->arena;
+   unsigned instanced_buf;
+   unsigned base_instance =
+      ter_model_arena_upload_instances(a, (const uint8_t *) &instance, 1,
+                                       &instanced_buf);
+   ter_model_arena_render_prepare(a, model->batch, instanced_buf,
+                                  TER_FAR_PLANE, TER_FAR_PLANE,
+                                  enable_shadow, TER_SHADOW_PFC, NULL);
+
+   TerModelDrawCommand cmd;
+   cmd.count = model->lods[0].num_indices;
+   cmd.instance_count = 1;
+   cmd.first_index = model->first_index + model->lods[0].first_index;
+   cmd.base_vertex = model->first_vertex;
+   cmd.base_instance = base_instance;
+   ter_model_arena_draw(a, &cmd, 1);
+
+   ter_model_arena_render_finish(a, model->batch);
+}
 
-   ter_model_render_finish(model);
+/*
+ * Sets the transform of an instance to translate(pos) * scale * R, where R
+ * rotates rot.x, rot.y and rot.z degrees around the X, Y and Z axes (R =
+ * Rx * Ry * Rz, like the model matrices of the objects).
+ */
+void
+ter_model_instance_set_transform(TerModelInstance *inst, glm::vec3 pos,
+                                 glm::vec3 rot, float scale)
+{
+   float sx = sinf(DEG_TO_RAD(rot.x) * 0.5f);
+   float cx = cosf(DEG_TO_RAD(rot.x) * 0.5f);
+   float sy = sinf(DEG_TO_RAD(rot.y) * 0.5f);
+   float cy = cosf(DEG_TO_RAD(rot.y) * 0.5f);
+   float sz = sinf(DEG_TO_RAD(rot.z) * 0.5f);
+   float cz = cosf(DEG_TO_RAD(rot.z) * 0.5f);
+
+   inst->position[0] = pos.x;
+   inst->position[1] = pos.y;
+   inst->position[2] = pos.z;
+   inst->scale = scale;
+
+   /* qx * qy * qz */
+   inst->rotation[0] = sx * cy * cz + cx * sy * sz;
+   inst->rotation[1] = cx * sy * cz - sx * cy * sz;
+   inst->rotation[2] = cx * cy * sz + sx * sy * cz;
+   inst->rotation[3] = cx * cy * cz - sx * sy * sz;
 }
 
+/*
+ * Sets up the shader program to draw the models of the arena that are
+ * textured or not (the batches of a kind share their program): view,
+ * lighting, materials and shadow maps. See ter_model_arena_render_prepare().
+ */
 TerShaderProgramBasic *
-ter_model_render_prepare(TerModel *model,
-                         float *M4x4_list, unsigned num_instances,
-                         float clip_far_plane, float render_far_plane,
-                         bool enable_shadow, unsigned shadow_pfc,
-                         bool render_motion)
+ter_model_arena_render_prepare_program(TerModelArena *a, bool textured,
+                                       float clip_far_plane,
+                                       float render_far_plane,
+                                       bool enable_shadow,
+                                       unsigned shadow_pfc,
+                                       const glm::mat4 *prev_vp)
 {
-   bool is_solid;
+   bool is_solid = !textured;
 
-   TerShaderProgramBasic *sh =
-      get_shader_program(model, enable_shadow, &is_solid);
+   TerShaderProgramBasic *sh = get_shader_program(is_solid, enable_shadow);
 
    TerShaderProgramModel *sh_model = (TerShaderProgramModel *) sh;
 
@@ -993,14 +2079,19 @@ ter_model_render_prepare(TerModel *model,
       glm::perspective(DEG_TO_RAD(TER_FOV), TER_ASPECT_RATIO,
                        TER_NEAR_PLANE, render_far_plane);
 
-   assert(!render_motion || render_far_plane == TER_FAR_PLANE);
+   assert(!prev_vp || render_far_plane == TER_FAR_PLANE);
 
    glm::mat4 *View = (glm::mat4 *) ter_cache_get("matrix/View");
    glm::mat4 *ViewInv = (glm::mat4 *) ter_cache_get("matrix/ViewInv");
    ter_shader_program_basic_load_VP(sh, &Projection, View, ViewInv);
 
-   ter_shader_program_model_load_materials(&sh_model->model,
-      model->materials, TER_MODEL_MAX_MATERIALS * model->num_variants);
+   /* Motion vectors, see TerModelInstance */
+   if (prev_vp)
+      ter_shader_program_model_load_prev_VP(&sh_model->model, prev_vp);
+
+   glBindBufferBase(GL_UNIFORM_BUFFER,
+                    TER_SHADER_PROGRAM_MODEL_MATERIALS_BINDING,
+                    a->material_buf);
 
    TerLight *light = (TerLight *) ter_cache_get("light/light0");
    ter_shader_program_basic_load_light(sh, light);
@@ -1014,7 +2105,7 @@ ter_model_render_prepare(TerModel *model,
    if (enable_shadow) {
       TerShaderProgramShadowData *sh_shadow =
          get_shader_program_shadow_data(sh, is_solid);
-      int shadow_map_sampler_unit = is_solid ? 0 : 4;
+      int shadow_map_sampler_unit = is_solid ? 0 : TER_MODEL_MAX_TEXTURES;
       TerShadowRenderer *sr =
          (TerShadowRenderer *) ter_cache_get("rendering/shadow-renderer");
 
@@ -1030,46 +2121,218 @@ ter_model_render_prepare(TerModel *model,
    ter_shader_program_model_load_near_far_planes(&sh_model->model,
       TER_NEAR_PLANE, clip_far_plane, render_far_plane);
 
-   if (!is_solid) {
-      for (unsigned i = 0; i < model->num_tids; i++) {
+   return sh;
+}
+
+/*
+ * Binds the textures and the VAO of a batch for the program set up by
+ * ter_model_arena_render_prepare_program(). Instance data comes from
+ * instanced_buf, written by a compute shader or streamed by the CPU (see
+ * ter_model_arena_upload_instances()).
+ */
+void
+ter_model_arena_render_prepare_batch(TerModelArena *a, unsigned batch,
+                                     TerShaderProgramBasic *sh,
+                                     unsigned instanced_buf)
+{
+   TerModelBatch *b = &a->batches[batch];
+
+   if (b->textured) {
+      for (unsigned i = 0; i < b->num_tids; i++) {
          glActiveTexture(GL_TEXTURE0 + i);
-         glBindTexture(GL_TEXTURE_2D, model->tids[i]);
+         glBindTexture(GL_TEXTURE_2D, b->tids[i]);
       }
       TerShaderProgramModelTex *sh_tex = (TerShaderProgramModelTex *) sh;
-      ter_shader_program_model_tex_load_textures(sh_tex, model->num_tids);
+      ter_shader_program_model_tex_load_textures(sh_tex, b->num_tids);
    }
 
-   model_bind_vao(model, M4x4_list, num_instances, render_motion);
+   arena_bind_batch(a, batch, instanced_buf);
 
+   unsigned num_attrs = b->textured ?
+      NUM_VERTEX_ATTRIBS_TEXTURED : NUM_VERTEX_ATTRIBS_SOLID;
+   for (unsigned i = 0; i < num_attrs; i++) {
+      if (!is_unused_attrib(i))
+         glEnableVertexAttribArray(i);
+   }
+   glEnableVertexAttribArray(INSTANCED_ATTRIB_FADE);
+}
+
+/*
+ * Sets up the state to draw the models of a batch: shader program, textures,
+ * materials and VAO (see ter_model_arena_render_prepare_program() and
+ * ter_model_arena_render_prepare_batch()).
+ */
+TerShaderProgramBasic *
+ter_model_arena_render_prepare(TerModelArena *a, unsigned batch,
+                               unsigned instanced_buf,
+                               float clip_far_plane, float render_far_plane,
+                               bool enable_shadow, unsigned shadow_pfc,
+                               const glm::mat4 *prev_vp)
+{
+   TerShaderProgramBasic *sh =
+      ter_model_arena_render_prepare_program(a, a->batches[batch].textured,
+                                             clip_far_plane, render_far_plane,
+                                             enable_shadow, shadow_pfc,
+                                             prev_vp);
+   ter_model_arena_render_prepare_batch(a, batch, sh, instanced_buf);
    return sh;
 }
 
+/*
+ * Like ter_model_arena_render_prepare(), but for a shader program that the
+ * caller sets up and that reads all the vertex and instanced attributes of
+ * the models (like the impostor bake program).
+ */
 void
-ter_model_render_prepare_for_shadow_map(TerModel *model,
-                                        float *M4x4_list,
-                                        unsigned num_instances)
+ter_model_arena_render_prepare_for_program(TerModelArena *a, unsigned batch,
+                                           unsigned instanced_buf)
 {
-   /* We expect that we render the first frame without shadows to generate 
-    * the VAO.
-    */
-   assert(model->vao);
+   arena_bind_batch(a, batch, instanced_buf);
+
+   unsigned num_attrs = a->batches[batch].textured ?
+      NUM_VERTEX_ATTRIBS_TEXTURED : NUM_VERTEX_ATTRIBS_SOLID;
+   for (unsigned i = 0; i < num_attrs; i++) {
+      if (!is_unused_attrib(i))
+         glEnableVertexAttribArray(i);
+   }
+   glEnableVertexAttribArray(INSTANCED_ATTRIB_FADE);
+}
 
-   upload_instanced_data_and_bind(model, M4x4_list, num_instances);
-   for (int i = 0; i < 5; i++)
+/*
+ * Like ter_model_arena_render_prepare(), but for the shadow map shader,
+ * which the caller sets up. It only needs the positions and the instance
+ * transforms.
+ */
+void
+ter_model_arena_render_prepare_for_shadow_map(TerModelArena *a,
+                                              unsigned batch,
+                                              unsigned instanced_buf)
+{
+   arena_bind_batch(a, batch, instanced_buf);
+   for (int i = 0; i <= INSTANCED_ATTRIB_ROTATION; i++)
       glEnableVertexAttribArray(i);
 }
 
+/*
+ * Streams instance data for the draws of this frame and returns the index
+ * of its first instance in *instanced_buf, to use as the base instance of
+ * the draw commands. Callers that can write their instance data directly
+ * should allocate it from the stream buffer themselves instead.
+ */
+unsigned
+ter_model_arena_upload_instances(TerModelArena *a, const uint8_t *data,
+                                 unsigned num_instances,
+                                 unsigned *instanced_buf)
+{
+   TerStreamBuffer *sb =
+      (TerStreamBuffer *) ter_cache_get("rendering/stream-buffer");
+
+   TerStreamRange range;
+   unsigned bytes = num_instances * TER_MODEL_INSTANCED_ITEM_SIZE;
+   ter_stream_buffer_alloc(sb, bytes, TER_MODEL_INSTANCED_ITEM_SIZE, &range);
+   memcpy(range.ptr, data, bytes);
+   ter_stream_buffer_flush(sb);
+
+   *instanced_buf = range.buf;
+   return range.offset / TER_MODEL_INSTANCED_ITEM_SIZE;
+}
+
+/*
+ * Streams the commands of a multi-draw and binds them as the indirect
+ * buffer. Returns their offset in it.
+ */
+size_t
+ter_model_bind_draw_commands(const TerModelDrawCommand *cmds, unsigned count)
+{
+   TerStreamBuffer *sb =
+      (TerStreamBuffer *) ter_cache_get("rendering/stream-buffer");
+
+   TerStreamRange range;
+   unsigned bytes = count * sizeof(TerModelDrawCommand);
+   ter_stream_buffer_alloc(sb, bytes, sizeof(unsigned), &range);
+   memcpy(range.ptr, cmds, bytes);
+   ter_stream_buffer_flush(sb);
+
+   glBindBuffer(GL_DRAW_INDIRECT_BUFFER, range.buf);
+   return range.offset;
+}
+
+/*
+ * Draws the commands, which must be for models in the prepared batch.
+ * Without glMultiDrawElementsIndirect (OpenGL 4.3) we draw the commands one
+ * by one, pointing the instanced attributes at the data of each of them
+ * since we can't use base instances either.
+ */
+void
+ter_model_arena_draw(TerModelArena *a,
+                     const TerModelDrawCommand *cmds, unsigned count)
+{
+   if (count == 0)
+      return;
+
+   if (a->multi_draw) {
+      size_t offset = ter_model_bind_draw_commands(cmds, count);
+      glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT,
+                                  (void *) offset, count, 0);
+      glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+      return;
+   }
+
+   for (unsigned i = 0; i < count; i++) {
+      const TerModelDrawCommand *cmd = &cmds[i];
+      if (cmd->instance_count == 0)
+         continue;
+      ter_model_bind_instanced_attributes(a->bound_instanced_buf,
+         (size_t) cmd->base_instance * TER_MODEL_INSTANCED_ITEM_SIZE);
+      glDrawElementsInstancedBaseVertex(GL_TRIANGLES, cmd->count,
+         GL_UNSIGNED_INT, (void *) (cmd->first_index * sizeof(unsigned)),
+         cmd->instance_count, cmd->base_vertex);
+   }
+}
+
+/*
+ * Draws count commands starting at command first in draw_buf, for models
+ * in the prepared batch. The commands are typically written by a compute
+ * shader. This requires OpenGL 4.3.
+ */
+void
+ter_model_arena_draw_indirect(TerModelArena *a, unsigned draw_buf,
+                              unsigned first, unsigned count)
+{
+   assert(a->multi_draw);
+
+   if (count == 0)
+      return;
+
+   glBindBuffer(GL_DRAW_INDIRECT_BUFFER, draw_buf);
+   glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT,
+                               (void *) (first * sizeof(TerModelDrawCommand)),
+                               count, 0);
+   glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
 
 void
-ter_model_render_finish(TerModel *model)
+ter_model_arena_render_finish(TerModelArena *a, unsigned batch)
 {
-   model_unbind(model);
+   bool is_textured = a->batches[batch].textured;
+
+   if (is_textured)
+      glBindTexture(GL_TEXTURE_2D, 0);
+
+   unsigned num_attrs =  is_textured ?
+      NUM_VERTEX_ATTRIBS_TEXTURED : NUM_VERTEX_ATTRIBS_SOLID;
+   for (unsigned i = 0; i < num_attrs; i++)
+      glDisableVertexAttribArray(i);
+   glDisableVertexAttribArray(INSTANCED_ATTRIB_FADE);
+
+   glBindVertexArray(0);
 }
 
 void
-ter_model_render_finish_for_shadow_map(TerModel *model)
+ter_model_arena_render_finish_for_shadow_map(TerModelArena *a,
+                                             unsigned batch)
 {
-   for (int i = 0; i < 5; i++)
+   for (int i = 0; i <= INSTANCED_ATTRIB_ROTATION; i++)
       glDisableVertexAttribArray(i);
    glBindVertexArray(0);
 }
@@ -1080,12 +2343,37 @@ ter_model_is_textured(TerModel *m)
    return m->uvs.size() > 0;
 }
 
+/*
+ * Selects the level of detail of an instance of the model given the
+ * largest simplification error we tolerate at its distance (in model
+ * units). That is the coarsest level within the tolerance, but we keep the
+ * current level while it is within the hysteresis margin of it, so
+ * instances around a threshold distance don't switch back and forth.
+ */
+unsigned
+ter_model_select_lod(TerModel *m, float tolerance, unsigned current)
+{
+   float min_tolerance = tolerance * (1.0f - TER_MODEL_LOD_HYSTERESIS);
+   float max_tolerance = tolerance * (1.0f + TER_MODEL_LOD_HYSTERESIS);
+
+   unsigned min_lod = 0, max_lod = 0;
+   for (unsigned l = 1; l < m->num_lods; l++) {
+      if (m->lods[l].error <= min_tolerance)
+         min_lod = l;
+      if (m->lods[l].error <= max_tolerance)
+         max_lod = l;
+   }
+
+   return CLAMP(current, min_lod, max_lod);
+}
+
 void
 ter_model_add_variant(TerModel *m, TerMaterial *material, unsigned *tids,
                       unsigned count)
 {
    assert(m->num_materials == count);
    assert(m->num_variants < TER_MODEL_MAX_VARIANTS);
+   assert(!m->arena);
 
    for (unsigned i = 0; i < count; i++) {
       m->materials[TER_MODEL_MAX_MATERIALS * m->num_variants + i] = material[i];
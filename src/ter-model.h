@@ -11,41 +11,57 @@
 #include "ter-texture.h"
 
 /* Instanced attributes:
- *  - Model (mat4)
- *  - Previous frame MVP (mat4, for motion)
- *  - Model variant index
+ *  - Position and uniform scale
+ *  - Rotation (unit quaternion)
+ *  - Model variant index (atlas row for impostors)
+ *  - Impostor cross-fade (0: geometry, 1: impostor)
+ *
+ * Shaders transform model space points to position + scale * rotation *
+ * point. Since the scale is uniform, normals only need to be rotated. There
+ * is no previous MVP per instance: objects don't move, so motion vectors
+ * come from the previous view projection of the pass.
  */
-#define TER_MODEL_INSTANCED_ITEM_SIZE (16 * sizeof(float) + 16 * sizeof(float) + 1 * sizeof(int))
-#define TER_MODEL_MAX_INSTANCED_OBJECTS (TER_MODEL_MAX_INSTANCED_VBO_BYTES / TER_MODEL_INSTANCED_ITEM_SIZE)
+typedef struct {
+   float position[3];
+   float scale;
+   float rotation[4];         /* x, y, z, w */
+   int variant_idx;
+   float fade;
+} TerModelInstance;
+
+#define TER_MODEL_INSTANCED_ITEM_SIZE sizeof(TerModelInstance)
+
+/* Maximum number of groups of models that are drawn together and size of the
+ * material table of the model shaders (the Materials uniform block)
+ */
+#define TER_MODEL_ARENA_MAX_BATCHES   8
+#define TER_MODEL_ARENA_MAX_MATERIALS 128
+
+struct _TerModelArena;
+struct _TerImpostorAtlas;
 
+/* A level of detail of a model: a range of the model indices */
 typedef struct {
-   unsigned vao;
-   unsigned vertex_buf;
-   unsigned instanced_buf[TER_MODEL_NUM_INSTANCED_BUFFERS];
-   /* Index of the currently active instanced buffer. The active instanced
-    * buffer is the one to which we upload new data for subsequent draw
-    * commands.
-    */
-   unsigned ibuf_idx;
-   /* Number of instances that we have uploaded to the currently active instance
-    * buffer by previous draw commands. When new instance data is uploaded, if
-    * we have enough room in the currently active buffer, we upload it at the
-    * end of the used region. If there is not enough space available in the
-    * active buffer, then we select the next buffer in the array, upload the
-    * data to it and mark it as the one currently active.
-    *
-    * Mapping larger buffers and using this tecnique is better for performance
-    * than allocating smaller buffers and increasing the number of buffers. It
-    * also makes better use of the memory allocated and allows us to render
-    * more instances in a single draw call.
-    */
-   unsigned ibuf_used;
+   unsigned first_index;
+   unsigned num_indices;
+   float error;            /* Simplification error, in model units */
+} TerModelLod;
 
+typedef struct {
+   /* Vertex attributes, deduplicated, and the triangle list indexing them,
+    * ordered for the post-transform vertex cache. The indices of all the
+    * levels of detail go one after the other.
+    */
    std::vector<glm::vec3> vertices;
    std::vector<glm::vec2> uvs;
    std::vector<glm::vec3> normals;
    std::vector<int> mat_idx; /* material index */
    std::vector<int> samplers;
+   std::vector<unsigned> indices;
+
+   /* From the full model to the coarsest simplification of it */
+   TerModelLod lods[TER_MODEL_MAX_LODS];
+   unsigned num_lods;
 
    TerMaterial materials[TER_MODEL_MAX_MATERIALS * TER_MODEL_MAX_VARIANTS];
    unsigned num_materials;
@@ -57,33 +73,121 @@ typedef struct {
    glm::vec3 center;
 
    char *name;
+
+   /* Location of the model in the geometry arena (see ter_model_arena_new) */
+   struct _TerModelArena *arena;
+   unsigned batch;
+   unsigned first_vertex;
+   unsigned first_index;
+   unsigned material_base;
+
+   /* Impostors of the model variants, if any (see ter_impostor_atlas_new) */
+   struct _TerImpostorAtlas *impostors;
+   unsigned impostor_row;
 } TerModel;
 
+/* Same layout as the commands of glMultiDrawElementsIndirect */
+typedef struct {
+   unsigned count;
+   unsigned instance_count;
+   unsigned first_index;
+   int base_vertex;
+   unsigned base_instance;
+} TerModelDrawCommand;
+
+/* Models drawn together: they have the same vertex format, so they use the
+ * same shader program, and their textures fit in the texture units of the
+ * program. Their vertices and indices are consecutive ranges of the batch
+ * vertex and index buffers.
+ */
+typedef struct {
+   bool textured;
+   unsigned vao;
+   unsigned vertex_buf;
+   unsigned index_buf;
+   unsigned num_vertices;
+   unsigned num_indices;
+   unsigned tids[TER_MODEL_MAX_TEXTURES];
+   unsigned num_tids;
+} TerModelBatch;
+
+/* Geometry of all the models merged into a few vertex buffers (one per
+ * batch) and their materials merged into a single table, so all instances
+ * of all the models in a batch can be drawn with a single multi-draw that
+ * reads the instance data of each model from a different region of a
+ * shared instanced buffer (through the base instance of its command).
+ */
+typedef struct _TerModelArena {
+   TerModelBatch batches[TER_MODEL_ARENA_MAX_BATCHES];
+   unsigned num_batches;
+
+   unsigned material_buf;
+   unsigned num_materials;
+
+   /* Instance data of the prepared batch. The CPU streams instance data
+    * and the commands of the multi-draws through the stream buffer (see
+    * ter_model_arena_upload_instances()).
+    */
+   unsigned bound_instanced_buf;
+
+   bool multi_draw;              /* glMultiDrawElementsIndirect available */
+} TerModelArena;
+
 TerModel *ter_model_load_obj(const char *path);
 void ter_model_free(TerModel *model);
 
-void ter_model_bind_vao_for_shadow_map(TerModel *model);
 void ter_model_render(TerModel *model,
                       glm::vec3 pos, glm::vec3 rot, glm::vec3 scale,
                       bool enable_shadow);
 
-TerShaderProgramBasic *ter_model_render_prepare(TerModel *model,
-                                                float *M4x4_list,
-                                                unsigned num_instances,
-                                                float clip_far_plane,
-                                                float render_far_plane,
-                                                bool enable_shadow,
-                                                unsigned shadow_pfc,
-                                                bool render_motion);
-void ter_model_render_prepare_for_shadow_map(TerModel *model,
-                                             float *M4x4_list,
-                                             unsigned num_instances);
-void ter_model_render_finish(TerModel *model);
-void ter_model_render_finish_for_shadow_map(TerModel *model);
+void ter_model_instance_set_transform(TerModelInstance *inst, glm::vec3 pos,
+                                      glm::vec3 rot, float scale);
 
 bool ter_model_is_textured(TerModel *m);
 
+unsigned ter_model_select_lod(TerModel *m, float tolerance, unsigned current);
+
 void ter_model_add_variant(TerModel *m, TerMaterial *materials, unsigned *tids,
                            unsigned count);
 
+TerModelArena *ter_model_arena_new(TerModel **models, unsigned count);
+void ter_model_arena_free(TerModelArena *a);
+
+TerShaderProgramBasic *ter_model_arena_render_prepare(TerModelArena *a,
+                                                      unsigned batch,
+                                                      unsigned instanced_buf,
+                                                      float clip_far_plane,
+                                                      float render_far_plane,
+                                                      bool enable_shadow,
+                                                      unsigned shadow_pfc,
+                                                      const glm::mat4 *prev_vp);
+TerShaderProgramBasic *ter_model_arena_render_prepare_program(
+   TerModelArena *a, bool textured, float clip_far_plane,
+   float render_far_plane, bool enable_shadow, unsigned shadow_pfc,
+   const glm::mat4 *prev_vp);
+void ter_model_arena_render_prepare_batch(TerModelArena *a, unsigned batch,
+                                          TerShaderProgramBasic *sh,
+                                          unsigned instanced_buf);
+void ter_model_arena_render_prepare_for_shadow_map(TerModelArena *a,
+                                                   unsigned batch,
+                                                   unsigned instanced_buf);
+void ter_model_arena_render_prepare_for_program(TerModelArena *a,
+                                                unsigned batch,
+                                                unsigned instanced_buf);
+unsigned ter_model_arena_upload_instances(TerModelArena *a,
+                                          const uint8_t *data,
+                                          unsigned num_instances,
+                                          unsigned *instanced_buf);
+void ter_model_arena_draw(TerModelArena *a,
+                          const TerModelDrawCommand *cmds, unsigned count);
+void ter_model_arena_draw_indirect(TerModelArena *a, unsigned draw_buf,
+                                   unsigned first, unsigned count);
+void ter_model_arena_render_finish(TerModelArena *a, unsigned batch);
+void ter_model_arena_render_finish_for_shadow_map(TerModelArena *a,
+                                                  unsigned batch);
+
+void ter_model_bind_instanced_attributes(unsigned buf, size_t buffer_offset);
+size_t ter_model_bind_draw_commands(const TerModelDrawCommand *cmds,
+                                    unsigned count);
+
 #endif
@@ -0,0 +1,361 @@
+#include "main.h"
+
+#include "ter-object-placement.h"
+
+/*
+ * Scatters objects over the terrain at random positions that don't collide
+ * with other objects.
+ *
+ * Collisions are tested against a uniform grid where each cell keeps the
+ * boxes of the colliding objects that overlap it, so each attempt only looks
+ * at the objects around it.
+ *
+ * The terrain is split in tiles that place their share of the objects in
+ * parallel, each with its own random generator. Tiles are processed in four
+ * phases, by the parity of their coordinates, so tiles placed at the same
+ * time are at least a tile apart. Objects can only reach up to half a tile
+ * minus a cell out of their tile, so tiles placed at the same time never
+ * touch the same cells. Objects that don't fit in their tile are retried
+ * anywhere in the terrain, sequentially.
+ *
+ * The result only depends on the seed, not on the number of threads.
+ */
+
+/* Sink objects a bit so they don't float over slopes */
+#define PLACEMENT_OFFSET_Y -0.05f
+
+/* Distance of the objects to the edges of the terrain */
+#define PLACEMENT_BORDER 1.0f
+
+typedef struct {
+   float x0, x1, y0, y1, z0, z1;
+} PlacementBox;
+
+typedef struct {
+   PlacementBox *boxes;
+   unsigned count;
+   unsigned capacity;
+} PlacementCell;
+
+/* Area of the terrain to place objects in. Like the terrain, it extends
+ * towards -Z, so it spans world Z coordinates [-z1, -z0].
+ */
+typedef struct {
+   float x0, x1, z0, z1;
+   uint64_t rng;
+   unsigned *pending;         /* Objects of each type left to place */
+   GPtrArray *objects;
+} PlacementTile;
+
+typedef struct {
+   TerTerrain *terrain;
+   const TerObjectPlacementType *types;
+   unsigned num_types;
+   unsigned type;             /* Type being placed */
+
+   PlacementCell *cells;
+   int cells_x, cells_z;
+
+   PlacementTile *tiles;
+   unsigned tiles_x, tiles_z;
+   unsigned *phase_tiles;     /* Tiles sorted by phase */
+   unsigned phase_start[5];   /* First tile of each phase */
+   unsigned phase;            /* Phase being placed */
+} PlacementJob;
+
+/* SplitMix64, small and fast, with good enough quality to scatter objects */
+static inline uint64_t
+placement_random(uint64_t *state)
+{
+   uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+   z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+   z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+   return z ^ (z >> 31);
+}
+
+/* Uniform in [0, 1) */
+static inline float
+placement_random_float(uint64_t *state)
+{
+   return (placement_random(state) >> 40) * (1.0f / 16777216.0f);
+}
+
+/* Independent generators derived from the seed, one per stream */
+static uint64_t
+placement_random_new(unsigned seed, unsigned stream)
+{
+   uint64_t state = (((uint64_t) seed) << 32) | stream;
+   return placement_random(&state);
+}
+
+static inline void
+placement_cell_range(PlacementJob *job, const PlacementBox *b,
+                     int *cx0, int *cx1, int *cz0, int *cz1)
+{
+   const float inv_size = 1.0f / TER_OBJECT_PLACEMENT_CELL_SIZE;
+   *cx0 = CLAMP((int) floorf(b->x0 * inv_size), 0, job->cells_x - 1);
+   *cx1 = CLAMP((int) floorf(b->x1 * inv_size), 0, job->cells_x - 1);
+   *cz0 = CLAMP((int) floorf(-b->z1 * inv_size), 0, job->cells_z - 1);
+   *cz1 = CLAMP((int) floorf(-b->z0 * inv_size), 0, job->cells_z - 1);
+}
+
+static bool
+placement_collides(PlacementJob *job, const PlacementBox *b)
+{
+   int cx0, cx1, cz0, cz1;
+   placement_cell_range(job, b, &cx0, &cx1, &cz0, &cz1);
+
+   for (int cz = cz0; cz <= cz1; cz++) {
+      for (int cx = cx0; cx <= cx1; cx++) {
+         PlacementCell *cell = &job->cells[cz * job->cells_x + cx];
+         for (unsigned i = 0; i < cell->count; i++) {
+            const PlacementBox *o = &cell->boxes[i];
+            if (b->x0 <= o->x1 && b->x1 >= o->x0 &&
+                b->y0 <= o->y1 && b->y1 >= o->y0 &&
+                b->z0 <= o->z1 && b->z1 >= o->z0)
+               return true;
+         }
+      }
+   }
+
+   return false;
+}
+
+static void
+placement_insert(PlacementJob *job, const PlacementBox *b)
+{
+   int cx0, cx1, cz0, cz1;
+   placement_cell_range(job, b, &cx0, &cx1, &cz0, &cz1);
+
+   for (int cz = cz0; cz <= cz1; cz++) {
+      for (int cx = cx0; cx <= cx1; cx++) {
+         PlacementCell *cell = &job->cells[cz * job->cells_x + cx];
+         if (cell->count == cell->capacity) {
+            cell->capacity = MAX(2 * cell->capacity, 4);
+            cell->boxes = g_renew(PlacementBox, cell->boxes, cell->capacity);
+         }
+         cell->boxes[cell->count++] = *b;
+      }
+   }
+}
+
+/*
+ * Tries to place an object of the given type at a random position of the
+ * tile. Objects whose box extends more than the margin out of the tile are
+ * rejected.
+ */
+static TerObject *
+placement_try(PlacementJob *job, unsigned type, PlacementTile *tile,
+              float margin)
+{
+   const TerObjectPlacementType *t = &job->types[type];
+
+   float x = tile->x0 + placement_random_float(&tile->rng) *
+                        (tile->x1 - tile->x0);
+   float z = -(tile->z0 + placement_random_float(&tile->rng) *
+                          (tile->z1 - tile->z0));
+   float s = 1.0f + placement_random_float(&tile->rng) / 1.5f;
+   float rot = placement_random_float(&tile->rng) * 360.0f;
+   uint64_t variant = placement_random(&tile->rng);
+
+   float y = ter_terrain_get_height_at(job->terrain, x, z);
+
+   /* We only allow certain objects to be submerged */
+   if (y < TER_TERRAIN_WATER_HEIGHT - 0.25f && !t->allow_underwater)
+      return NULL;
+
+   TerObject *o = t->constructor(x, y + PLACEMENT_OFFSET_Y, z, s);
+
+   if (t->allow_rotation)
+      o->rot.y = floorf(rot);
+
+   if (o->model->num_variants > 1)
+      o->variant = variant % o->model->num_variants;
+
+   ter_object_update_box(o);
+
+   PlacementBox b;
+   b.x0 = o->box.center.x - o->box.w;
+   b.x1 = o->box.center.x + o->box.w;
+   b.y0 = o->box.center.y - o->box.h;
+   b.y1 = o->box.center.y + o->box.h;
+   b.z0 = o->box.center.z - o->box.d;
+   b.z1 = o->box.center.z + o->box.d;
+
+   if (b.x0 < tile->x0 - margin || b.x1 > tile->x1 + margin ||
+       -b.z1 < tile->z0 - margin || -b.z0 > tile->z1 + margin ||
+       placement_collides(job, &b)) {
+      ter_object_free(o);
+      return NULL;
+   }
+
+   if (o->can_collide)
+      placement_insert(job, &b);
+
+   return o;
+}
+
+/*
+ * Places the pending objects of the tile of the type being placed. When an
+ * object can't be placed the rest are left pending.
+ */
+static void
+placement_tile(PlacementJob *job, PlacementTile *tile, float margin)
+{
+   unsigned *pending = &tile->pending[job->type];
+   for (; *pending > 0; (*pending)--) {
+      TerObject *o = NULL;
+      for (unsigned a = 0; !o && a < TER_OBJECT_PLACEMENT_MAX_ATTEMPTS; a++)
+         o = placement_try(job, job->type, tile, margin);
+
+      if (!o)
+         break;
+
+      g_ptr_array_add(tile->objects, o);
+   }
+}
+
+static void
+placement_tiles_range(void *data, unsigned start, unsigned end)
+{
+   PlacementJob *job = (PlacementJob *) data;
+   const float margin =
+      TER_OBJECT_PLACEMENT_TILE_SIZE / 2.0f - TER_OBJECT_PLACEMENT_CELL_SIZE;
+
+   const unsigned *tiles = &job->phase_tiles[job->phase_start[job->phase]];
+   for (unsigned i = start; i < end; i++)
+      placement_tile(job, &job->tiles[tiles[i]], margin);
+}
+
+/*
+ * Places count objects of each type on the terrain and returns them, in an
+ * order that only depends on the seed. Objects that can't be placed after
+ * TER_OBJECT_PLACEMENT_MAX_ATTEMPTS attempts are dropped.
+ */
+GPtrArray *
+ter_object_placement_run(TerTerrain *t, TerThreadPool *pool,
+                         const TerObjectPlacementType *types,
+                         unsigned num_types, unsigned seed)
+{
+   assert(TER_OBJECT_PLACEMENT_TILE_SIZE > 2.0f * TER_OBJECT_PLACEMENT_CELL_SIZE);
+
+   PlacementJob job;
+   job.terrain = t;
+   job.types = types;
+   job.num_types = num_types;
+
+   float width = ter_terrain_get_width(t);
+   float depth = ter_terrain_get_depth(t);
+
+   job.cells_x = (int) ceilf(width / TER_OBJECT_PLACEMENT_CELL_SIZE);
+   job.cells_z = (int) ceilf(depth / TER_OBJECT_PLACEMENT_CELL_SIZE);
+   job.cells = g_new0(PlacementCell, job.cells_x * job.cells_z);
+
+   PlacementTile area;
+   area.x0 = PLACEMENT_BORDER;
+   area.x1 = width - PLACEMENT_BORDER;
+   area.z0 = PLACEMENT_BORDER;
+   area.z1 = depth - PLACEMENT_BORDER;
+
+   job.tiles_x =
+      (unsigned) ceilf((area.x1 - area.x0) / TER_OBJECT_PLACEMENT_TILE_SIZE);
+   job.tiles_z =
+      (unsigned) ceilf((area.z1 - area.z0) / TER_OBJECT_PLACEMENT_TILE_SIZE);
+   unsigned num_tiles = job.tiles_x * job.tiles_z;
+   job.tiles = g_new0(PlacementTile, num_tiles);
+   job.phase_tiles = g_new(unsigned, num_tiles);
+   unsigned *pending = g_new0(unsigned, num_tiles * num_types);
+
+   for (unsigned tz = 0; tz < job.tiles_z; tz++) {
+      for (unsigned tx = 0; tx < job.tiles_x; tx++) {
+         unsigned i = tz * job.tiles_x + tx;
+         PlacementTile *tile = &job.tiles[i];
+         tile->x0 = area.x0 + tx * TER_OBJECT_PLACEMENT_TILE_SIZE;
+         tile->x1 = MIN(tile->x0 + TER_OBJECT_PLACEMENT_TILE_SIZE, area.x1);
+         tile->z0 = area.z0 + tz * TER_OBJECT_PLACEMENT_TILE_SIZE;
+         tile->z1 = MIN(tile->z0 + TER_OBJECT_PLACEMENT_TILE_SIZE, area.z1);
+         tile->rng = placement_random_new(seed, i);
+         tile->pending = &pending[i * num_types];
+         tile->objects = g_ptr_array_new();
+      }
+   }
+
+   /* Each object goes to the tile of a random point of the area, so tiles
+    * get a share proportional to their size.
+    */
+   area.rng = placement_random_new(seed, num_tiles);
+   for (unsigned i = 0; i < num_types; i++) {
+      for (unsigned j = 0; j < types[i].count; j++) {
+         float x = placement_random_float(&area.rng) * (area.x1 - area.x0);
+         float z = placement_random_float(&area.rng) * (area.z1 - area.z0);
+         unsigned tx = MIN((unsigned) (x / TER_OBJECT_PLACEMENT_TILE_SIZE),
+                           job.tiles_x - 1);
+         unsigned tz = MIN((unsigned) (z / TER_OBJECT_PLACEMENT_TILE_SIZE),
+                           job.tiles_z - 1);
+         job.tiles[tz * job.tiles_x + tx].pending[i]++;
+      }
+   }
+
+   /* Height queries build their lookup tables on first use, which is not
+    * thread safe.
+    */
+   ter_terrain_get_height_at(t, area.x0, -area.z0);
+
+   unsigned count = 0;
+   for (unsigned phase = 0; phase < 4; phase++) {
+      job.phase_start[phase] = count;
+      for (unsigned tz = 0; tz < job.tiles_z; tz++) {
+         for (unsigned tx = 0; tx < job.tiles_x; tx++) {
+            if ((((tz & 1) << 1) | (tx & 1)) == phase)
+               job.phase_tiles[count++] = tz * job.tiles_x + tx;
+         }
+      }
+   }
+   job.phase_start[4] = count;
+
+   /* Types are placed one after another, like they are listed, so objects
+    * see all the colliding objects of the previous types.
+    */
+   GPtrArray *objects = g_ptr_array_new();
+   area.pending = g_new0(unsigned, num_types);
+   area.objects = objects;
+   unsigned num_dropped = 0;
+   for (unsigned i = 0; i < num_types; i++) {
+      job.type = i;
+      for (job.phase = 0; job.phase < 4; job.phase++) {
+         ter_thread_pool_run(pool, placement_tiles_range, &job,
+                             job.phase_start[job.phase + 1] -
+                                job.phase_start[job.phase], 1);
+      }
+
+      for (unsigned j = 0; j < num_tiles; j++) {
+         PlacementTile *tile = &job.tiles[j];
+         for (unsigned k = 0; k < tile->objects->len; k++)
+            g_ptr_array_add(objects, g_ptr_array_index(tile->objects, k));
+         g_ptr_array_set_size(tile->objects, 0);
+         area.pending[i] += tile->pending[i];
+      }
+
+      /* Retry the objects that didn't fit in their tile anywhere */
+      placement_tile(&job, &area, FLT_MAX);
+      num_dropped += area.pending[i];
+   }
+
+   if (num_dropped > 0) {
+      ter_dbg(LOG_DEFAULT,
+              "PLACEMENT: WARNING: Dropped %u objects that didn't fit\n",
+              num_dropped);
+   }
+
+   for (int i = 0; i < job.cells_x * job.cells_z; i++)
+      g_free(job.cells[i].boxes);
+   g_free(job.cells);
+   for (unsigned i = 0; i < num_tiles; i++)
+      g_ptr_array_free(job.tiles[i].objects, TRUE);
+   g_free(job.tiles);
+   g_free(job.phase_tiles);
+   g_free(pending);
+   g_free(area.pending);
+
+   return objects;
+}
@@ -0,0 +1,25 @@
+#ifndef __TER_OBJECT_PLACEMENT_H__
+#define __TER_OBJECT_PLACEMENT_H__
+
+#include <glib.h>
+
+#include "ter-object.h"
+#include "ter-terrain.h"
+#include "ter-thread-pool.h"
+
+typedef TerObject *(*TerObjectPlacementConstructor)(float x, float y, float z,
+                                                     float s);
+
+/* A kind of object to scatter over the terrain */
+typedef struct {
+   TerObjectPlacementConstructor constructor;
+   unsigned count;
+   bool allow_underwater;
+   bool allow_rotation;    /* Random rotation around the vertical axis */
+} TerObjectPlacementType;
+
+GPtrArray *ter_object_placement_run(TerTerrain *t, TerThreadPool *pool,
+                                    const TerObjectPlacementType *types,
+                                    unsigned num_types, unsigned seed);
+
+#endif
@@ -3,282 +3,1754 @@
 #define GL_GLEXT_PROTOTYPES 1
 #include <GL/gl.h>
 
-#include <glm/gtc/type_ptr.hpp>
+#include <float.h>
+#include <stddef.h>
 
-#include "ter-camera.h"
-#include "ter-cache.h"
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
-static uint8_t instanced_buffer[TER_MODEL_MAX_INSTANCED_VBO_BYTES];
+#include "ter-cache.h"
+#include "ter-shader-program.h"
+#include "ter-shadow-renderer.h"
+#include "ter-stream-buffer.h"
 
-/* The object renderer keeps a map of all instances of a particular model
- * in the scene. When we need to render all objects, it renderes instances
- * sorted by model, and binds state for each model only once.
+/* The object renderer keeps a set with all instances of a particular model
+ * in the scene. When we need to render all objects, it submits the draws of
+ * each pass to a render queue sorted by state, so the instances of all the
+ * models that share state are drawn with a single multi-draw and each state
+ * is bound only once per pass.
  */
 
+/* Work group size of object-cull.comp */
+#define OBJECT_CULL_GROUP_SIZE 64
+
+/* Instance data read by object-cull.comp (std430 layout) */
 typedef struct {
-   TerClipVolume *clip;
-   float clip_far_plane;
-   float render_far_plane;
-   bool enable_shadows;
-   unsigned shadow_pfc;
-   bool render_motion;
-   const char *stage;
-   glm::mat4 *VP;
-} TerObjectRendererData;
+   float position[3];
+   float scale;
+   float rotation[4];
+   float box_min[3];
+   int variant_idx;
+   float box_max[3];
+   unsigned flags;
+} ObjectGpuInstance;
 
+/*
+ * Creates an object renderer for a world that spans [0, width] in X and
+ * [-depth, 0] in Z (like the terrain). Objects can be placed outside the
+ * world, but they are culled less efficiently.
+ */
 TerObjectRenderer *
-ter_object_renderer_new()
+ter_object_renderer_new(float width, float depth)
 {
    TerObjectRenderer *r = (TerObjectRenderer *) g_new0(TerObjectRenderer, 1);
-   r->sets = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+   r->width = width;
+   r->depth = depth;
+   r->arena = ter_arena_new(TER_OBJECT_RENDERER_ARENA_BLOCK_SIZE);
+   r->sets = g_ptr_array_new();
+   r->set_by_model = g_hash_table_new(g_str_hash, g_str_equal);
+   r->queue = ter_render_queue_new();
    return r;
 }
 
 void
 ter_object_renderer_free(TerObjectRenderer *r)
 {
-   g_list_free_full(r->all, (GDestroyNotify) ter_object_free);
-   g_list_free(r->solid);
-   g_hash_table_destroy(r->sets);
+   for (unsigned j = 0; r->gpu_culling && j < r->sets->len; j++) {
+      TerObjectSet *s = (TerObjectSet *) g_ptr_array_index(r->sets, j);
+      glDeleteBuffers(1, &s->gpu_instance_buf);
+   }
+   g_hash_table_destroy(r->set_by_model);
+   g_ptr_array_free(r->sets, TRUE);
+   ter_arena_free(r->arena);
+   g_free(r->gpu_command);
+   ter_render_queue_free(r->queue);
    g_free(r);
 }
 
+template <typename T>
+static void
+object_set_grow_array(TerArena *arena, T **array, unsigned count,
+                      unsigned capacity)
+{
+   T *new_array = (T *) ter_arena_alloc(arena, sizeof(T) * capacity, 64);
+   if (count > 0)
+      memcpy(new_array, *array, sizeof(T) * count);
+   *array = new_array;
+}
+
+static TerObjectTreeNode *
+object_tree_node_new(TerArena *arena, TerObjectTreeNode *parent,
+                     float cx, float cz, float half)
+{
+   TerObjectTreeNode *n = ter_arena_new0(arena, TerObjectTreeNode, 1);
+   n->cx = cx;
+   n->cz = cz;
+   n->half = half;
+   n->depth = parent ? parent->depth + 1 : 0;
+   n->parent = parent;
+   n->x0 = n->y0 = n->z0 = FLT_MAX;
+   n->x1 = n->y1 = n->z1 = -FLT_MAX;
+   return n;
+}
+
+/*
+ * Recomputes the subtree bounds of the node and its ancestors after an
+ * instance is removed from it.
+ */
+static void
+object_tree_refit(TerObjectSet *s, TerObjectTreeNode *n)
+{
+   for (; n; n = n->parent) {
+      n->x0 = n->y0 = n->z0 = FLT_MAX;
+      n->x1 = n->y1 = n->z1 = -FLT_MAX;
+      for (unsigned k = 0; k < n->num_items; k++) {
+         unsigned i = n->items[k];
+         n->x0 = MIN(n->x0, s->x0[i]);
+         n->x1 = MAX(n->x1, s->x1[i]);
+         n->y0 = MIN(n->y0, s->y0[i]);
+         n->y1 = MAX(n->y1, s->y1[i]);
+         n->z0 = MIN(n->z0, s->z0[i]);
+         n->z1 = MAX(n->z1, s->z1[i]);
+      }
+      for (unsigned c = 0; c < 4; c++) {
+         TerObjectTreeNode *child = n->child[c];
+         if (!child || child->subtree_items == 0)
+            continue;
+         n->x0 = MIN(n->x0, child->x0);
+         n->x1 = MAX(n->x1, child->x1);
+         n->y0 = MIN(n->y0, child->y0);
+         n->y1 = MAX(n->y1, child->y1);
+         n->z0 = MIN(n->z0, child->z0);
+         n->z1 = MAX(n->z1, child->z1);
+      }
+   }
+}
+
+static void
+object_tree_insert(TerObjectSet *s, unsigned i)
+{
+   float cx = (s->x0[i] + s->x1[i]) * 0.5f;
+   float cz = (s->z0[i] + s->z1[i]) * 0.5f;
+   float extent = MAX(s->x1[i] - s->x0[i], s->z1[i] - s->z0[i]) * 0.5f;
+
+   /* Descend while the child cell is at least as large as the instance.
+    * Instances centered outside the world end up in the border cells.
+    */
+   TerObjectTreeNode *n = s->tree;
+   while (n->depth < TER_OBJECT_RENDERER_TREE_DEPTH) {
+      float half = n->half * 0.5f;
+      if (extent > half)
+         break;
+
+      unsigned c = (cx >= n->cx ? 1 : 0) | (cz >= n->cz ? 2 : 0);
+      if (!n->child[c]) {
+         n->child[c] =
+            object_tree_node_new(s->arena, n,
+                                 n->cx + ((c & 1) ? half : -half),
+                                 n->cz + ((c & 2) ? half : -half), half);
+      }
+      n = n->child[c];
+   }
+
+   if (n->num_items == n->capacity) {
+      unsigned capacity = MAX(2 * n->capacity, 8);
+      unsigned *items =
+         (unsigned *) ter_arena_alloc(s->arena, sizeof(unsigned) * capacity,
+                                      sizeof(unsigned));
+      if (n->num_items > 0)
+         memcpy(items, n->items, sizeof(unsigned) * n->num_items);
+      n->items = items;
+      n->capacity = capacity;
+   }
+
+   s->node[i] = n;
+   s->slot[i] = n->num_items;
+   n->items[n->num_items++] = i;
+
+   for (; n; n = n->parent) {
+      n->x0 = MIN(n->x0, s->x0[i]);
+      n->x1 = MAX(n->x1, s->x1[i]);
+      n->y0 = MIN(n->y0, s->y0[i]);
+      n->y1 = MAX(n->y1, s->y1[i]);
+      n->z0 = MIN(n->z0, s->z0[i]);
+      n->z1 = MAX(n->z1, s->z1[i]);
+      n->subtree_items++;
+   }
+}
+
+static void
+object_tree_remove(TerObjectSet *s, unsigned i)
+{
+   TerObjectTreeNode *n = s->node[i];
+   unsigned last = n->items[--n->num_items];
+   n->items[s->slot[i]] = last;
+   s->slot[last] = s->slot[i];
+   s->node[i] = NULL;
+
+   for (TerObjectTreeNode *p = n; p; p = p->parent)
+      p->subtree_items--;
+   object_tree_refit(s, n);
+}
+
+/*
+ * Doubles the capacity of the set. The arena doesn't free memory, the old
+ * arrays are released with the renderer. That is fine since sets only grow
+ * while loading the scene.
+ */
+static void
+object_set_grow(TerObjectRenderer *r, TerObjectSet *s)
+{
+   unsigned capacity = MAX(2 * s->capacity, 64);
+   object_set_grow_array(r->arena, &s->pos, s->count, capacity);
+   object_set_grow_array(r->arena, &s->rot, s->count, capacity);
+   object_set_grow_array(r->arena, &s->scale, s->count, capacity);
+   object_set_grow_array(r->arena, &s->variant, s->count, capacity);
+   object_set_grow_array(r->arena, &s->flags, s->count, capacity);
+   object_set_grow_array(r->arena, &s->instance, s->count, capacity);
+   object_set_grow_array(r->arena, &s->node, s->count, capacity);
+   object_set_grow_array(r->arena, &s->slot, s->count, capacity);
+   object_set_grow_array(r->arena, &s->visible, 0, capacity);
+   object_set_grow_array(r->arena, &s->candidates, 0, capacity);
+   object_set_grow_array(r->arena, &s->view_mask, 0, capacity);
+   object_set_grow_array(r->arena, &s->x0, s->count, capacity);
+   object_set_grow_array(r->arena, &s->x1, s->count, capacity);
+   object_set_grow_array(r->arena, &s->y0, s->count, capacity);
+   object_set_grow_array(r->arena, &s->y1, s->count, capacity);
+   object_set_grow_array(r->arena, &s->z0, s->count, capacity);
+   object_set_grow_array(r->arena, &s->z1, s->count, capacity);
+   s->capacity = capacity;
+}
+
+/*
+ * Adds a copy of the object to the set of its model. The renderer takes
+ * ownership of the object, which is freed.
+ */
 void
 ter_object_renderer_add_object(TerObjectRenderer *r, TerObject *o)
 {
    const char *key = o->model->name;
-   GList *obj_list = (GList *) g_hash_table_lookup(r->sets, key);
-   obj_list = g_list_prepend(obj_list, o);
-   g_hash_table_insert(r->sets, g_strdup(key), obj_list);
-   r->all = g_list_prepend(r->all, o);
-   if (o->can_collide)
-      r->solid = g_list_prepend(r->solid, o);
+   TerObjectSet *s = (TerObjectSet *) g_hash_table_lookup(r->set_by_model, key);
+   if (!s) {
+      s = ter_arena_new0(r->arena, TerObjectSet, 1);
+      s->model = o->model;
+      s->arena = r->arena;
+      float half = MAX(r->width, r->depth) * 0.5f;
+      s->tree = object_tree_node_new(r->arena, NULL, r->width * 0.5f,
+                                     -r->depth * 0.5f, half);
+      g_hash_table_insert(r->set_by_model, (gpointer) key, s);
+      g_ptr_array_add(r->sets, s);
+   }
+
+   if (s->count == s->capacity)
+      object_set_grow(r, s);
+
+   unsigned i = s->count++;
+   s->variant[i] = o->variant;
+   s->flags[i] = (o->cast_shadow ? TER_OBJECT_FLAG_CAST_SHADOW : 0) |
+                 (o->can_collide ? TER_OBJECT_FLAG_CAN_COLLIDE : 0);
+   s->node[i] = NULL;
+   ter_object_set_update_transform(s, i, o->pos, o->rot, o->scale);
+
+   r->num_objects++;
+   ter_object_free(o);
 }
 
-GList *
-ter_object_renderer_get_all(TerObjectRenderer *r)
+/*
+ * Sets the transforms of instance i of the set, updating its bounding box
+ * and its place in the set tree, and marking its instance transform dirty.
+ * Instances only support uniform scales.
+ */
+void
+ter_object_set_update_transform(TerObjectSet *s, unsigned i,
+                                glm::vec3 pos, glm::vec3 rot, glm::vec3 scale)
 {
-   return r->all;
+   assert(scale.x == scale.y && scale.x == scale.z);
+
+   if (s->node[i])
+      object_tree_remove(s, i);
+
+   s->pos[i] = pos;
+   s->rot[i] = rot;
+   s->scale[i] = scale;
+
+   TerObject o;
+   o.model = s->model;
+   o.pos = pos;
+   o.rot = rot;
+   o.scale = scale;
+   ter_object_update_box(&o);
+
+   TerBox *box = ter_object_get_box(&o);
+   s->x0[i] = box->center.x - box->w;
+   s->x1[i] = box->center.x + box->w;
+   s->y0[i] = box->center.y - box->h;
+   s->y1[i] = box->center.y + box->h;
+   s->z0[i] = box->center.z - box->d;
+   s->z1[i] = box->center.z + box->d;
+   object_tree_insert(s, i);
+
+   if (s->gpu_dirty_end <= s->gpu_dirty_start) {
+      s->gpu_dirty_start = i;
+      s->gpu_dirty_end = i + 1;
+   } else {
+      s->gpu_dirty_start = MIN(s->gpu_dirty_start, i);
+      s->gpu_dirty_end = MAX(s->gpu_dirty_end, i + 1);
+   }
+
+   if (!(s->flags[i] & TER_OBJECT_FLAG_TRANSFORM_DIRTY)) {
+      s->flags[i] |= TER_OBJECT_FLAG_TRANSFORM_DIRTY;
+      s->num_dirty++;
+   }
 }
 
-GList *
-ter_object_renderer_get_solid(TerObjectRenderer *r)
+/*
+ * Recomputes the instance transforms of the instances whose transforms
+ * changed since the last update. For static scenery this only does any work
+ * on the first frame.
+ */
+void
+ter_object_set_update_transforms(TerObjectSet *s)
 {
-   return r->solid;
+   if (s->num_dirty == 0)
+      return;
+
+   unsigned *index = g_new(unsigned, s->num_dirty);
+   unsigned count = 0;
+   for (unsigned i = 0; i < s->count; i++) {
+      if (s->flags[i] & TER_OBJECT_FLAG_TRANSFORM_DIRTY) {
+         s->flags[i] &= ~TER_OBJECT_FLAG_TRANSFORM_DIRTY;
+         index[count++] = i;
+      }
+   }
+   assert(count == s->num_dirty);
+
+   ter_object_compute_instances(s->model, s->pos, s->rot, s->scale,
+                                index, count, s->instance);
+
+   ter_dbg(LOG_RENDER, "\tOBJ-RENDERER: INFO: updated %u instance "
+           "transforms\n", count);
+
+   g_free(index);
+   s->num_dirty = 0;
 }
 
-static inline bool
-can_be_clipped(TerObject *o, TerClipVolume *clip, float far_plane)
+/*
+ * Checks if the box collides with any of the solid objects
+ * (can_collide == true).
+ */
+bool
+ter_object_renderer_collides(TerObjectRenderer *r, TerBox *box)
 {
-   /* It is important to use this method to get the position
-    * because we want the position in the world and the position we store
-    * in the object the result of correcting the center displacement and
-    * applying the scaled height
-    */
-   glm::vec3 pos = ter_object_get_position(o);
+   TerClipVolume clip;
+   clip.x0 = box->center.x - box->w;
+   clip.x1 = box->center.x + box->w;
+   clip.y0 = box->center.y - box->h;
+   clip.y1 = box->center.y + box->h;
+   clip.z0 = box->center.z - box->d;
+   clip.z1 = box->center.z + box->d;
+
+   for (unsigned j = 0; j < r->sets->len; j++) {
+      TerObjectSet *s = (TerObjectSet *) g_ptr_array_index(r->sets, j);
+      unsigned count =
+         ter_object_set_cull(s, &clip, NULL, s->visible, s->candidates);
+      for (unsigned k = 0; k < count; k++) {
+         if (s->flags[s->visible[k]] & TER_OBJECT_FLAG_CAN_COLLIDE)
+            return true;
+      }
+   }
 
-   const float w = ter_object_get_width(o);
-   const float h = ter_object_get_height(o);
-   const float d = ter_object_get_depth(o);
+   return false;
+}
 
-   /* First we check if the object bounds are completely outside the
-    * clipping cuboid. If that is the case the object is certainly outside
-    * the viewing frustum and we can return early.
-    */
-   float x0 = pos.x - w / 2.0f;
-   float x1 = pos.x + w / 2.0f;
-   float y0 = pos.y;
-   float y1 = pos.y + h;
-   float z0 = pos.z - d / 2.0f;
-   float z1 = pos.z + d / 2.0f;
-
-   bool outside = x1 < clip->x0 || x0 > clip->x1 ||
-                  z1 < clip->z0 || z0 > clip->z1 ||
-                  y1 < clip->y0 || y0 > clip->y1;
-   if (outside)
-      return true;
-
-   /* Otherwise, we check the angle of the vector from the camera to the each
-    * of the object bounds and the camera view vector and match it against the
-    * FOV and the far plane to see if the object is within the perspective
-    * frustum.
-    */
-   glm::vec3 bounds[8];
-   bounds[0] = glm::vec3(x0, y0, z0);
-   bounds[1] = glm::vec3(x0, y0, z1);
-   bounds[2] = glm::vec3(x0, y1, z0);
-   bounds[3] = glm::vec3(x0, y1, z1);
-   bounds[4] = glm::vec3(x1, y0, z0);
-   bounds[5] = glm::vec3(x1, y0, z1);
-   bounds[6] = glm::vec3(x1, y1, z0);
-   bounds[7] = glm::vec3(x1, y1, z1);
-
-   TerCamera *cam = (TerCamera *) ter_cache_get("camera/main");
-   glm::vec3 view_dir = ter_camera_get_viewdir(cam);
-   ter_util_vec3_normalize(&view_dir);
-   for (int i = 0; i < 8; i++) {
-      /* Check if the boundary is too far away (or too close). If it is, then
-       * the boundary is outside the frustum, check the remaining boundaries.
-       */
-      glm::vec3 dir_from_cam = bounds[i] - cam->pos;
-      float dist = ter_util_vec3_module(dir_from_cam, 1, 1, 1);
-      if (dist > far_plane || dist < TER_NEAR_PLANE)
+#if defined(__SSE2__)
+/* A clip cuboid and frustum (optional) splatted for testing 4 boxes at a
+ * time. For each plane, the box corner furthest along its normal is selected
+ * with masks so the test doesn't branch on the plane orientation.
+ */
+typedef struct {
+   __m128 x0, x1, y0, y1, z0, z1;
+   int num_planes;
+   __m128 plane[6][4];
+   __m128 positive[6][3];
+} ObjectCullVolumeSSE2;
+
+static void
+object_cull_volume_init_sse2(ObjectCullVolumeSSE2 *v,
+                             const TerClipVolume *clip, const TerFrustum *f)
+{
+   const __m128 zero = _mm_setzero_ps();
+
+   v->x0 = _mm_set1_ps(clip->x0);
+   v->x1 = _mm_set1_ps(clip->x1);
+   v->y0 = _mm_set1_ps(clip->y0);
+   v->y1 = _mm_set1_ps(clip->y1);
+   v->z0 = _mm_set1_ps(clip->z0);
+   v->z1 = _mm_set1_ps(clip->z1);
+
+   v->num_planes = f ? 6 : 0;
+   for (int p = 0; p < v->num_planes; p++) {
+      const glm::vec4 &fp = f->planes[p];
+      v->plane[p][0] = _mm_set1_ps(fp.x);
+      v->plane[p][1] = _mm_set1_ps(fp.y);
+      v->plane[p][2] = _mm_set1_ps(fp.z);
+      v->plane[p][3] = _mm_set1_ps(fp.w);
+      for (int c = 0; c < 3; c++)
+         v->positive[p][c] = _mm_cmpge_ps(v->plane[p][c], zero);
+   }
+}
+
+/* Returns the mask of the boxes that are outside the volume */
+static inline int
+object_cull_volume_outside_sse2(const ObjectCullVolumeSSE2 *v,
+                                __m128 x0, __m128 x1, __m128 y0, __m128 y1,
+                                __m128 z0, __m128 z1)
+{
+   const __m128 zero = _mm_setzero_ps();
+
+   __m128 outside =
+      _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(x1, v->x0),
+                          _mm_cmpgt_ps(x0, v->x1)),
+                _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(y1, v->y0),
+                                    _mm_cmpgt_ps(y0, v->y1)),
+                          _mm_or_ps(_mm_cmplt_ps(z1, v->z0),
+                                    _mm_cmpgt_ps(z0, v->z1))));
+
+   for (int p = 0; p < v->num_planes; p++) {
+      __m128 x = _mm_or_ps(_mm_and_ps(v->positive[p][0], x1),
+                           _mm_andnot_ps(v->positive[p][0], x0));
+      __m128 y = _mm_or_ps(_mm_and_ps(v->positive[p][1], y1),
+                           _mm_andnot_ps(v->positive[p][1], y0));
+      __m128 z = _mm_or_ps(_mm_and_ps(v->positive[p][2], z1),
+                           _mm_andnot_ps(v->positive[p][2], z0));
+      __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(v->plane[p][0], x),
+                                       _mm_mul_ps(v->plane[p][1], y)),
+                            _mm_add_ps(_mm_mul_ps(v->plane[p][2], z),
+                                       v->plane[p][3]));
+      outside = _mm_or_ps(outside, _mm_cmplt_ps(d, zero));
+   }
+
+   return _mm_movemask_ps(outside);
+}
+
+#define OBJECT_SET_LOAD_BOXES_SSE2(s, i)                                    \
+   __m128 x0 = _mm_setr_ps(s->x0[i[0]], s->x0[i[1]], s->x0[i[2]], s->x0[i[3]]); \
+   __m128 x1 = _mm_setr_ps(s->x1[i[0]], s->x1[i[1]], s->x1[i[2]], s->x1[i[3]]); \
+   __m128 y0 = _mm_setr_ps(s->y0[i[0]], s->y0[i[1]], s->y0[i[2]], s->y0[i[3]]); \
+   __m128 y1 = _mm_setr_ps(s->y1[i[0]], s->y1[i[1]], s->y1[i[2]], s->y1[i[3]]); \
+   __m128 z0 = _mm_setr_ps(s->z0[i[0]], s->z0[i[1]], s->z0[i[2]], s->z0[i[3]]); \
+   __m128 z1 = _mm_setr_ps(s->z1[i[0]], s->z1[i[1]], s->z1[i[2]], s->z1[i[3]])
+
+static unsigned
+object_set_cull_items_sse2(TerObjectSet *s, const TerClipVolume *clip,
+                           const TerFrustum *f, const unsigned *items,
+                           unsigned count, unsigned *visible,
+                           unsigned *num_visible)
+{
+   ObjectCullVolumeSSE2 v;
+   object_cull_volume_init_sse2(&v, clip, f);
+
+   unsigned n = *num_visible;
+   unsigned k;
+   for (k = 0; k + 4 <= count; k += 4) {
+      const unsigned *i = items + k;
+      OBJECT_SET_LOAD_BOXES_SSE2(s, i);
+
+      int mask = ~object_cull_volume_outside_sse2(&v, x0, x1, y0, y1, z0, z1);
+      for (unsigned j = 0; j < 4; j++) {
+         visible[n] = i[j];
+         n += (mask >> j) & 1;
+      }
+   }
+
+   *num_visible = n;
+   return k;
+}
+#endif
+
+static bool
+object_set_item_is_visible(TerObjectSet *s, unsigned i,
+                           const TerClipVolume *clip, const TerFrustum *f)
+{
+   TerClipVolume box;
+   box.x0 = s->x0[i];
+   box.x1 = s->x1[i];
+   box.y0 = s->y0[i];
+   box.y1 = s->y1[i];
+   box.z0 = s->z0[i];
+   box.z1 = s->z1[i];
+
+   bool outside = box.x1 < clip->x0 || box.x0 > clip->x1 ||
+                  box.z1 < clip->z0 || box.z0 > clip->z1 ||
+                  box.y1 < clip->y0 || box.y0 > clip->y1;
+   return !outside && (!f || ter_util_frustum_intersects_clip_volume(f, &box));
+}
+
+/*
+ * Tests individual instances against the clip cuboid and the frustum (if
+ * any) and appends the ones that may be visible to visible.
+ */
+static unsigned
+object_set_cull_items(TerObjectSet *s, const TerClipVolume *clip,
+                      const TerFrustum *f, const unsigned *items,
+                      unsigned count, unsigned *visible, unsigned num_visible)
+{
+   unsigned k = 0;
+
+#if defined(__SSE2__)
+   k = object_set_cull_items_sse2(s, clip, f, items, count, visible,
+                                  &num_visible);
+#endif
+
+   for (; k < count; k++) {
+      unsigned i = items[k];
+      if (object_set_item_is_visible(s, i, clip, f))
+         visible[num_visible++] = i;
+   }
+
+   return num_visible;
+}
+
+typedef enum {
+   TREE_NODE_OUTSIDE,
+   TREE_NODE_INTERSECTS,
+   TREE_NODE_INSIDE,
+} TerObjectTreeNodeVisibility;
+
+static TerObjectTreeNodeVisibility
+object_tree_node_visibility(TerObjectTreeNode *n, const TerClipVolume *clip,
+                            const TerFrustum *f)
+{
+   if (n->x1 < clip->x0 || n->x0 > clip->x1 ||
+       n->z1 < clip->z0 || n->z0 > clip->z1 ||
+       n->y1 < clip->y0 || n->y0 > clip->y1)
+      return TREE_NODE_OUTSIDE;
+
+   bool inside = n->x0 >= clip->x0 && n->x1 <= clip->x1 &&
+                 n->z0 >= clip->z0 && n->z1 <= clip->z1 &&
+                 n->y0 >= clip->y0 && n->y1 <= clip->y1;
+
+   for (int p = 0; f && p < 6; p++) {
+      const glm::vec4 &fp = f->planes[p];
+      /* Furthest corner along the plane normal (and the nearest one) */
+      float far_d = fp.x * (fp.x >= 0.0f ? n->x1 : n->x0) +
+                    fp.y * (fp.y >= 0.0f ? n->y1 : n->y0) +
+                    fp.z * (fp.z >= 0.0f ? n->z1 : n->z0) + fp.w;
+      if (far_d < 0.0f)
+         return TREE_NODE_OUTSIDE;
+      float near_d = fp.x * (fp.x >= 0.0f ? n->x0 : n->x1) +
+                     fp.y * (fp.y >= 0.0f ? n->y0 : n->y1) +
+                     fp.z * (fp.z >= 0.0f ? n->z0 : n->z1) + fp.w;
+      if (near_d < 0.0f)
+         inside = false;
+   }
+
+   return inside ? TREE_NODE_INSIDE : TREE_NODE_INTERSECTS;
+}
+
+static void
+object_tree_collect(TerObjectTreeNode *n, unsigned *visible,
+                    unsigned *num_visible)
+{
+   memcpy(visible + *num_visible, n->items, sizeof(unsigned) * n->num_items);
+   *num_visible += n->num_items;
+   for (unsigned c = 0; c < 4; c++) {
+      if (n->child[c] && n->child[c]->subtree_items > 0)
+         object_tree_collect(n->child[c], visible, num_visible);
+   }
+}
+
+/*
+ * Descends the tree rejecting subtrees outside the clip volume. Instances
+ * in subtrees completely inside it are visible, instances in nodes that
+ * intersect its boundary are candidates that need to be tested one by one.
+ */
+static void
+object_tree_cull(TerObjectTreeNode *n, const TerClipVolume *clip,
+                 const TerFrustum *f, unsigned *visible,
+                 unsigned *num_visible, unsigned *candidates,
+                 unsigned *num_candidates)
+{
+   switch (object_tree_node_visibility(n, clip, f)) {
+   case TREE_NODE_OUTSIDE:
+      return;
+   case TREE_NODE_INSIDE:
+      object_tree_collect(n, visible, num_visible);
+      return;
+   case TREE_NODE_INTERSECTS:
+      break;
+   }
+
+   memcpy(candidates + *num_candidates, n->items,
+          sizeof(unsigned) * n->num_items);
+   *num_candidates += n->num_items;
+   for (unsigned c = 0; c < 4; c++) {
+      if (n->child[c] && n->child[c]->subtree_items > 0) {
+         object_tree_cull(n->child[c], clip, f, visible, num_visible,
+                          candidates, num_candidates);
+      }
+   }
+}
+
+/*
+ * Culls the instances of the set against the clip cuboid and the planes of
+ * the viewing frustum (if not NULL). The indices of the instances that may
+ * be visible are stored in visible and their number is returned. Both
+ * visible and candidates (used as scratch) must have room for all the
+ * instances in the set.
+ *
+ * The set tree is used to reject or accept whole regions of the world, so
+ * the cost depends on the number of instances near the clip volume rather
+ * than on the total. The remaining instances are tested 4 at a time with
+ * SSE2 when available. The test is conservative: a box is culled if it is
+ * outside the cuboid or its corner furthest along the normal of any of the
+ * planes is behind that plane.
+ */
+unsigned
+ter_object_set_cull(TerObjectSet *s, const TerClipVolume *clip,
+                    const TerFrustum *f, unsigned *visible,
+                    unsigned *candidates)
+{
+   if (s->count == 0)
+      return 0;
+
+   unsigned num_visible = 0;
+   unsigned num_candidates = 0;
+   object_tree_cull(s->tree, clip, f, visible, &num_visible,
+                    candidates, &num_candidates);
+
+   return object_set_cull_items(s, clip, f, candidates, num_candidates,
+                                visible, num_visible);
+}
+
+TerObjectRenderPass *
+ter_object_render_pass_new(const char *stage, unsigned flags)
+{
+   TerObjectRenderPass *p = g_new0(TerObjectRenderPass, 1);
+   p->stage = stage;
+   p->flags = flags;
+   p->lod_bias = 1.0f;
+   return p;
+}
+
+void
+ter_object_render_pass_free(TerObjectRenderPass *p)
+{
+   for (unsigned j = 0; j < p->num_sets; j++) {
+      g_free(p->sets[j].lod);
+      g_free(p->sets[j].fade);
+   }
+   if (p->gpu_draw_buf)
+      glDeleteBuffers(1, &p->gpu_draw_buf);
+   if (p->gpu_instanced_buf)
+      glDeleteBuffers(1, &p->gpu_instanced_buf);
+   g_free(p->sets);
+   g_free(p);
+}
+
+/* A render pass as seen by the visibility sweep */
+typedef struct {
+   const TerClipVolume *clip;
+   const TerFrustum *frustum;
+#if defined(__SSE2__)
+   ObjectCullVolumeSSE2 sse2;
+#endif
+} ObjectCullView;
+
+/*
+ * Tests instances against the views in test_mask and stores their view
+ * masks, which also include the views in inside_mask. The instances seen by
+ * any view are appended to s->visible. Each box is loaded once and tested
+ * against all the views.
+ */
+static void
+object_set_classify_items(TerObjectSet *s, const ObjectCullView *views,
+                          unsigned num_views, unsigned test_mask,
+                          unsigned inside_mask, const unsigned *items,
+                          unsigned count, unsigned *num_visible)
+{
+   unsigned n = *num_visible;
+   unsigned k = 0;
+
+#if defined(__SSE2__)
+   for (; k + 4 <= count; k += 4) {
+      const unsigned *i = items + k;
+      unsigned mask[4] = { inside_mask, inside_mask, inside_mask, inside_mask };
+      if (test_mask) {
+         OBJECT_SET_LOAD_BOXES_SSE2(s, i);
+         for (unsigned v = 0; v < num_views; v++) {
+            if (!(test_mask & (1 << v)))
+               continue;
+            int outside = object_cull_volume_outside_sse2(&views[v].sse2,
+                                                          x0, x1, y0, y1,
+                                                          z0, z1);
+            for (unsigned j = 0; j < 4; j++)
+               mask[j] |= ((~outside >> j) & 1) << v;
+         }
+      }
+
+      for (unsigned j = 0; j < 4; j++) {
+         s->view_mask[i[j]] = mask[j];
+         s->visible[n] = i[j];
+         n += mask[j] != 0;
+      }
+   }
+#endif
+
+   for (; k < count; k++) {
+      unsigned i = items[k];
+      unsigned mask = inside_mask;
+      for (unsigned v = 0; v < num_views; v++) {
+         if ((test_mask & (1 << v)) &&
+             object_set_item_is_visible(s, i, views[v].clip, views[v].frustum))
+            mask |= 1 << v;
+      }
+
+      s->view_mask[i] = mask;
+      s->visible[n] = i;
+      n += mask != 0;
+   }
+
+   *num_visible = n;
+}
+
+/*
+ * Multi-view version of object_tree_cull(). Views are dropped from
+ * test_mask as we descend into subtrees that are completely outside or
+ * inside them (the latter are added to inside_mask), so we stop descending
+ * when no view can see the subtree and skip the per-instance tests when all
+ * the views that see it contain it.
+ */
+static void
+object_tree_classify(TerObjectSet *s, TerObjectTreeNode *n,
+                     const ObjectCullView *views, unsigned num_views,
+                     unsigned test_mask, unsigned inside_mask,
+                     unsigned *num_visible)
+{
+   for (unsigned v = 0; v < num_views; v++) {
+      if (!(test_mask & (1 << v)))
          continue;
 
-      /* Check if the angle is inside the FOV, if it is then at least this
-       * boundary is visible and we can't clip the object.
-       *
-       * FIXME: I think we need a way to factor in the aspect ratio here
-       *        right now the Y-clip region seems too large.
-       */
-      ter_util_vec3_normalize(&dir_from_cam);
-      float dot = ter_util_vec3_dot(dir_from_cam, view_dir);
-      /* The abs. value of the result must be in [-1, 1] but there can be
-       * rounding errors that can lead to a values outside and that can confuse
-       * acos(), so clamp.
-       */
-      dot = CLAMP(dot, -1.0f, 1.0f);
-      float angle = acos(dot);
-      if (fabsf(angle) <= DEG_TO_RAD(TER_FOV + 5.0f))
-         return false;     
+      switch (object_tree_node_visibility(n, views[v].clip,
+                                          views[v].frustum)) {
+      case TREE_NODE_OUTSIDE:
+         test_mask &= ~(1 << v);
+         break;
+      case TREE_NODE_INSIDE:
+         test_mask &= ~(1 << v);
+         inside_mask |= 1 << v;
+         break;
+      case TREE_NODE_INTERSECTS:
+         break;
+      }
+   }
+
+   if ((test_mask | inside_mask) == 0)
+      return;
+
+   object_set_classify_items(s, views, num_views, test_mask, inside_mask,
+                             n->items, n->num_items, num_visible);
+   for (unsigned c = 0; c < 4; c++) {
+      if (n->child[c] && n->child[c]->subtree_items > 0) {
+         object_tree_classify(s, n->child[c], views, num_views,
+                              test_mask, inside_mask, num_visible);
+      }
+   }
+}
+
+typedef struct {
+   TerObjectRenderer *r;
+   TerObjectRenderPass **passes;
+   unsigned num_passes;
+   unsigned shadow_mask;      /* Passes that only render shadow casters */
+   ObjectCullView view[TER_OBJECT_RENDERER_MAX_PASSES];
+   float lod_factor[TER_OBJECT_RENDERER_MAX_PASSES];
+   float impostor_start[TER_OBJECT_RENDERER_MAX_PASSES];
+   float impostor_length[TER_OBJECT_RENDERER_MAX_PASSES];
+   unsigned cross_fade_mask;  /* Passes that cross-fade to impostors */
+   unsigned occlusion_mask;   /* Passes with an occlusion buffer */
+} ObjectRendererPrepareJob;
+
+/* Instance data slot of the impostors, after the levels of detail */
+#define OBJECT_IMPOSTOR_SLOT TER_MODEL_MAX_LODS
+
+/*
+ * Impostor cross-fade of an instance at the given distance to the LOD
+ * origin of a pass, from 0 (geometry only) to 1 (impostor only). Passes
+ * that don't cross-fade switch at the middle of the transition.
+ */
+static inline float
+object_renderer_impostor_fade(float distance, float start, float length,
+                              bool cross_fade)
+{
+   float fade = CLAMP((distance - start) / length, 0.0f, 1.0f);
+   if (!cross_fade)
+      fade = fade < 0.5f ? 0.0f : 1.0f;
+   return fade;
+}
+
+/*
+ * Packs the instance data of an instance at *d and advances *d past it:
+ * the cached transform with the model variant index and impostor cross-fade
+ */
+static inline void
+object_renderer_pack_instance(uint8_t **d, const TerModelInstance *transform,
+                              int variant_idx, float fade)
+{
+   TerModelInstance inst = *transform;
+   inst.variant_idx = variant_idx;
+   inst.fade = fade;
+   memcpy(*d, &inst, sizeof(inst));
+   *d += TER_MODEL_INSTANCED_ITEM_SIZE;
+}
+
+/*
+ * Computes the view mask of every instance of the set in a single sweep
+ * over the set tree and selects the level of detail of the visible
+ * instances in each pass that sees them, counting the instances of each
+ * group, so we know how much instance data each pass needs before packing
+ * it (see object_renderer_pack_set()). Instances that pass the volume tests
+ * are tested against the occlusion buffers of the passes that have one.
+ */
+static void
+object_renderer_select_set(ObjectRendererPrepareJob *job, unsigned j)
+{
+   TerObjectSet *s = (TerObjectSet *) g_ptr_array_index(job->r->sets, j);
+   unsigned num_passes = job->num_passes;
+   unsigned all_mask = (1 << num_passes) - 1;
+
+   unsigned num_visible = 0;
+   if (s->count == 0) {
+      /* Nothing to do */
+   } else if (TER_OBJECT_RENDERER_ENABLE_CLIPPING) {
+      object_tree_classify(s, s->tree, job->view, num_passes, all_mask, 0,
+                           &num_visible);
+   } else {
+      for (unsigned i = 0; i < s->count; i++) {
+         s->view_mask[i] = all_mask;
+         s->visible[i] = i;
+      }
+      num_visible = s->count;
    }
+   s->num_visible = num_visible;
+
+   unsigned num_seen[TER_OBJECT_RENDERER_MAX_PASSES];
+   unsigned num_occluded[TER_OBJECT_RENDERER_MAX_PASSES];
+   unsigned num_lod[TER_OBJECT_RENDERER_MAX_PASSES][TER_MODEL_MAX_LODS + 1];
+   memset(num_seen, 0, sizeof(num_seen));
+   memset(num_occluded, 0, sizeof(num_occluded));
+   memset(num_lod, 0, sizeof(num_lod));
 
-   /* None of the object boundaries is inside the perspective frustum, we can
-    * clip the object
+   for (unsigned v = 0; v < num_passes; v++) {
+      TerObjectRenderPassSet *ps = &job->passes[v]->sets[j];
+      for (unsigned l = 0; l <= TER_MODEL_MAX_LODS; l++)
+         ps->distance[l] = FLT_MAX;
+   }
+
+   /* Select the level of detail of the instances in each pass that
+    * renders them, or their impostor (or both while they cross-fade)
     */
-   return true;
+   for (unsigned k = 0; k < num_visible; k++) {
+      unsigned i = s->visible[k];
+      unsigned mask = s->view_mask[i];
+      for (unsigned v = 0; v < num_passes; v++)
+         num_seen[v] += (mask >> v) & 1;
+
+      if (mask & job->occlusion_mask) {
+         TerClipVolume box;
+         box.x0 = s->x0[i];
+         box.x1 = s->x1[i];
+         box.y0 = s->y0[i];
+         box.y1 = s->y1[i];
+         box.z0 = s->z0[i];
+         box.z1 = s->z1[i];
+         for (unsigned v = 0; v < num_passes; v++) {
+            if ((mask & job->occlusion_mask & (1 << v)) &&
+                ter_occlusion_buffer_is_occluded(job->passes[v]->occlusion,
+                                                 &box)) {
+               mask &= ~(1 << v);
+               num_occluded[v]++;
+            }
+         }
+      }
+
+      if (!(s->flags[i] & TER_OBJECT_FLAG_CAST_SHADOW))
+         mask &= ~job->shadow_mask;
+      s->view_mask[i] = mask;
+      if (!mask)
+         continue;
+
+      glm::vec3 center = glm::vec3(s->x0[i] + s->x1[i],
+                                   s->y0[i] + s->y1[i],
+                                   s->z0[i] + s->z1[i]) * 0.5f;
+      float scale = MAX(s->scale[i].x, MAX(s->scale[i].y, s->scale[i].z));
+
+      for (unsigned v = 0; v < num_passes; v++) {
+         if (!(mask & (1 << v)))
+            continue;
+
+         TerObjectRenderPass *p = job->passes[v];
+         TerObjectRenderPassSet *ps = &p->sets[j];
+         uint8_t *lod = &ps->lod[i];
+         uint8_t *fade = &ps->fade[i];
+         float distance = glm::distance(center, p->lod_origin);
+
+         *fade = 0;
+         if (s->model->impostors) {
+            float f = object_renderer_impostor_fade(distance,
+                         job->impostor_start[v], job->impostor_length[v],
+                         job->cross_fade_mask & (1 << v));
+            *fade = (uint8_t) roundf(f * 255.0f);
+            if (*fade > 0) {
+               num_lod[v][OBJECT_IMPOSTOR_SLOT]++;
+               ps->distance[OBJECT_IMPOSTOR_SLOT] =
+                  MIN(ps->distance[OBJECT_IMPOSTOR_SLOT], distance);
+            }
+         }
+
+         if (*fade < 255) {
+            *lod = ter_model_select_lod(s->model,
+                                        distance * job->lod_factor[v] / scale,
+                                        *lod);
+            num_lod[v][*lod]++;
+            ps->distance[*lod] = MIN(ps->distance[*lod], distance);
+         }
+      }
+   }
+
+   for (unsigned v = 0; v < num_passes; v++) {
+      TerObjectRenderPassSet *ps = &job->passes[v]->sets[j];
+      ps->num_instances = 0;
+      for (unsigned l = 0; l < TER_MODEL_MAX_LODS; l++) {
+         ps->lod_instances[l] = num_lod[v][l];
+         ps->num_instances += num_lod[v][l];
+      }
+      ps->num_impostors = num_lod[v][OBJECT_IMPOSTOR_SLOT];
+      ps->num_clipped = s->count - num_seen[v];
+      ps->num_occluded = num_occluded[v];
+   }
+}
+
+static void
+object_renderer_select_range(void *data, unsigned start, unsigned end)
+{
+   ObjectRendererPrepareJob *job = (ObjectRendererPrepareJob *) data;
+   for (unsigned j = start; j < end; j++)
+      object_renderer_select_set(job, j);
+}
+
+/*
+ * Packs the instance data of the visible instances of the set in each pass
+ * that sees them, grouped by level of detail and followed by the instances
+ * drawn as impostors, straight into the stream buffer.
+ */
+static void
+object_renderer_pack_set(ObjectRendererPrepareJob *job, unsigned j)
+{
+   TerObjectSet *s = (TerObjectSet *) g_ptr_array_index(job->r->sets, j);
+   unsigned num_passes = job->num_passes;
+
+   uint8_t *data[TER_OBJECT_RENDERER_MAX_PASSES][TER_MODEL_MAX_LODS + 1];
+   for (unsigned v = 0; v < num_passes; v++) {
+      TerObjectRenderPassSet *ps = &job->passes[v]->sets[j];
+      uint8_t *d = ps->instance_data;
+      for (unsigned l = 0; l < TER_MODEL_MAX_LODS; l++) {
+         data[v][l] = d;
+         d += ps->lod_instances[l] * TER_MODEL_INSTANCED_ITEM_SIZE;
+      }
+      data[v][OBJECT_IMPOSTOR_SLOT] = d;
+   }
+
+   for (unsigned k = 0; k < s->num_visible; k++) {
+      unsigned i = s->visible[k];
+      unsigned mask = s->view_mask[i];
+      if (!mask)
+         continue;
+
+      int variant_idx = s->variant[i] * TER_MODEL_MAX_MATERIALS;
+      int impostor_idx = s->model->impostor_row + s->variant[i];
+
+      for (unsigned v = 0; v < num_passes; v++) {
+         if (!(mask & (1 << v)))
+            continue;
+
+         TerObjectRenderPassSet *ps = &job->passes[v]->sets[j];
+         float fade = ps->fade[i] / 255.0f;
+
+         if (ps->fade[i] < 255) {
+            object_renderer_pack_instance(&data[v][ps->lod[i]],
+                                          &s->instance[i], variant_idx, fade);
+         }
+         if (ps->fade[i] > 0) {
+            object_renderer_pack_instance(&data[v][OBJECT_IMPOSTOR_SLOT],
+                                          &s->instance[i], impostor_idx, fade);
+         }
+      }
+   }
 }
 
 static void
-render_object_set_clipped(const char *key, GList *set, void *data)
+object_renderer_pack_range(void *data, unsigned start, unsigned end)
 {
-   if (!set)
+   ObjectRendererPrepareJob *job = (ObjectRendererPrepareJob *) data;
+   for (unsigned j = start; j < end; j++)
+      object_renderer_pack_set(job, j);
+}
+
+/*
+ * Uploads the instances that changed since the last upload to the buffers
+ * read by the GPU culling shader, (re)allocating them if the set grew.
+ */
+static void
+object_set_upload_gpu_instances(TerObjectSet *s)
+{
+   if (s->gpu_capacity < s->capacity) {
+      if (!s->gpu_instance_buf)
+         glGenBuffers(1, &s->gpu_instance_buf);
+
+      glBindBuffer(GL_SHADER_STORAGE_BUFFER, s->gpu_instance_buf);
+      glBufferData(GL_SHADER_STORAGE_BUFFER,
+                   sizeof(ObjectGpuInstance) * s->capacity, NULL,
+                   GL_DYNAMIC_DRAW);
+
+      s->gpu_capacity = s->capacity;
+      s->gpu_dirty_start = 0;
+      s->gpu_dirty_end = s->count;
+   }
+
+   if (s->gpu_dirty_end <= s->gpu_dirty_start)
       return;
 
-   TerObjectRendererData *d = (TerObjectRendererData *) data;
+   unsigned count = s->gpu_dirty_end - s->gpu_dirty_start;
+   ObjectGpuInstance *data = g_new(ObjectGpuInstance, count);
+   for (unsigned k = 0; k < count; k++) {
+      unsigned i = s->gpu_dirty_start + k;
+      ObjectGpuInstance *inst = &data[k];
+      memcpy(inst->position, s->instance[i].position, sizeof(inst->position));
+      inst->scale = s->instance[i].scale;
+      memcpy(inst->rotation, s->instance[i].rotation, sizeof(inst->rotation));
+      inst->box_min[0] = s->x0[i];
+      inst->box_min[1] = s->y0[i];
+      inst->box_min[2] = s->z0[i];
+      inst->box_max[0] = s->x1[i];
+      inst->box_max[1] = s->y1[i];
+      inst->box_max[2] = s->z1[i];
+      inst->variant_idx = s->variant[i] * TER_MODEL_MAX_MATERIALS;
+      inst->flags = s->flags[i] & TER_OBJECT_FLAG_CAST_SHADOW;
+   }
+
+   glBindBuffer(GL_SHADER_STORAGE_BUFFER, s->gpu_instance_buf);
+   glBufferSubData(GL_SHADER_STORAGE_BUFFER,
+                   sizeof(ObjectGpuInstance) * s->gpu_dirty_start,
+                   sizeof(ObjectGpuInstance) * count, data);
+   g_free(data);
+
+   ter_dbg(LOG_VBO, "OBJ-RENDERER: INFO: uploaded %u instances of %s\n",
+           count, s->model->name);
+
+   s->gpu_dirty_start = s->gpu_dirty_end = 0;
+}
+
+/*
+ * Assigns the draw command of each set in the passes, sorting them by the
+ * batch of the set model in the model arena.
+ */
+static void
+object_renderer_sort_gpu_commands(TerObjectRenderer *r)
+{
+   unsigned num_sets = r->sets->len;
+   r->gpu_command = g_renew(unsigned, r->gpu_command, num_sets);
+
+   unsigned n = 0;
+   for (unsigned b = 0; b < TER_MODEL_ARENA_MAX_BATCHES; b++) {
+      r->gpu_batch_first[b] = n;
+      for (unsigned j = 0; j < num_sets; j++) {
+         TerObjectSet *s = (TerObjectSet *) g_ptr_array_index(r->sets, j);
+         if (s->model->batch == b)
+            r->gpu_command[j] = n++;
+      }
+      r->gpu_batch_commands[b] = n - r->gpu_batch_first[b];
+   }
+   assert(n == num_sets);
+}
 
-   unsigned num_clipped = 0;
-   unsigned num_instances = 0;
-   GList *iter = set;
-   while (iter) {
-      TerObject *o = (TerObject *) iter->data;
+/*
+ * Makes sure the pass has room for the instance data of all the sets and
+ * resets its draw commands to render no instances. Each set has a command
+ * per level of detail (TER_MODEL_MAX_LODS, the ones past the levels of its
+ * model are left empty) and each of them can take all the instances. The
+ * impostor commands of the sets follow those of all the levels of detail.
+ */
+static void
+object_pass_setup_gpu(TerObjectRenderer *r, TerObjectRenderPass *p)
+{
+   unsigned num_commands = p->num_sets * (TER_MODEL_MAX_LODS + 1);
+   TerModelDrawCommand *cmd = g_new0(TerModelDrawCommand, num_commands);
+
+   unsigned capacity = 0;
+   for (unsigned j = 0; j < p->num_sets; j++) {
+      TerObjectSet *s = (TerObjectSet *) g_ptr_array_index(r->sets, j);
+      TerModel *m = s->model;
+      for (unsigned l = 0; l < m->num_lods; l++) {
+         TerModelDrawCommand *c =
+            &cmd[r->gpu_command[j] * TER_MODEL_MAX_LODS + l];
+         c->count = m->lods[l].num_indices;
+         c->first_index = m->first_index + m->lods[l].first_index;
+         c->base_vertex = m->first_vertex;
+         c->base_instance = capacity;
+         capacity += s->capacity;
+      }
+
+      if (m->impostors) {
+         TerModelDrawCommand *c = &cmd[p->num_sets * TER_MODEL_MAX_LODS + j];
+         ter_impostor_init_draw_command(c);
+         c->base_instance = capacity;
+         capacity += s->capacity;
+      }
+   }
+
+   if (p->gpu_capacity < capacity) {
+      if (!p->gpu_instanced_buf)
+         glGenBuffers(1, &p->gpu_instanced_buf);
+      glBindBuffer(GL_SHADER_STORAGE_BUFFER, p->gpu_instanced_buf);
+      glBufferData(GL_SHADER_STORAGE_BUFFER,
+                   TER_MODEL_INSTANCED_ITEM_SIZE * capacity, NULL,
+                   GL_DYNAMIC_COPY);
+      p->gpu_capacity = capacity;
+   }
+
+   if (!p->gpu_draw_buf)
+      glGenBuffers(1, &p->gpu_draw_buf);
+   glBindBuffer(GL_SHADER_STORAGE_BUFFER, p->gpu_draw_buf);
+   glBufferData(GL_SHADER_STORAGE_BUFFER,
+                sizeof(TerModelDrawCommand) * num_commands, cmd,
+                GL_DYNAMIC_COPY);
+   g_free(cmd);
+}
+
+/*
+ * GPU version of the visibility computation. For each pass and set, a
+ * compute shader culls the instances and writes the instance data of the
+ * visible ones and their number in the draw command of the set. The sets of
+ * each model batch are rendered with a single indirect multi-draw. The CPU
+ * cost only depends on the number of passes and sets.
+ */
+static void
+object_renderer_prepare_gpu(TerObjectRenderer *r,
+                            TerObjectRenderPass **passes,
+                            unsigned num_passes)
+{
+   TerShaderProgramObjectCull *sh =
+      (TerShaderProgramObjectCull *) ter_cache_get("program/object-cull");
+
+   for (unsigned j = 0; j < r->sets->len; j++)
+      object_set_upload_gpu_instances((TerObjectSet *) g_ptr_array_index(r->sets, j));
+
+   object_renderer_sort_gpu_commands(r);
+
+   glUseProgram(sh->prog.program);
+
+   ter_shader_program_object_cull_load_layout(sh,
+      TER_MODEL_INSTANCED_ITEM_SIZE / sizeof(unsigned),
+      offsetof(TerModelInstance, variant_idx) / sizeof(unsigned));
+
+   for (unsigned k = 0; k < num_passes; k++) {
+      TerObjectRenderPass *p = passes[k];
+      object_pass_setup_gpu(r, p);
 
       if (TER_OBJECT_RENDERER_ENABLE_CLIPPING) {
-         /* Skip objects outside the viewing frustum */
-         if (can_be_clipped(o, d->clip, d->clip_far_plane)) {
-            iter = g_list_next(iter);
-            num_clipped++;
+         ter_shader_program_object_cull_load_volume(sh, &p->clip,
+            p->use_frustum ? &p->frustum : NULL);
+      } else {
+         TerClipVolume all;
+         all.x0 = all.y0 = all.z0 = -FLT_MAX;
+         all.x1 = all.y1 = all.z1 = FLT_MAX;
+         ter_shader_program_object_cull_load_volume(sh, &all, NULL);
+      }
+
+      unsigned required_flags = (p->flags & TER_OBJECT_RENDER_PASS_SHADOW) ?
+         TER_OBJECT_FLAG_CAST_SHADOW : 0;
+
+      ter_shader_program_object_cull_load_lod_origin(sh, &p->lod_origin,
+         TER_MODEL_LOD_ERROR * p->lod_bias);
+      ter_shader_program_object_cull_load_impostor_fade(sh,
+         TER_IMPOSTOR_DISTANCE / p->lod_bias,
+         TER_IMPOSTOR_FADE_DISTANCE / p->lod_bias,
+         !(p->flags & TER_OBJECT_RENDER_PASS_SHADOW));
+
+      glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, p->gpu_instanced_buf);
+      glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, p->gpu_draw_buf);
+      for (unsigned j = 0; j < p->num_sets; j++) {
+         TerObjectSet *s = (TerObjectSet *) g_ptr_array_index(r->sets, j);
+         if (s->count == 0)
             continue;
+
+         float lod_errors[TER_MODEL_MAX_LODS];
+         for (unsigned l = 0; l < s->model->num_lods; l++)
+            lod_errors[l] = s->model->lods[l].error;
+
+         ter_shader_program_object_cull_load_set(sh, s->count,
+            r->gpu_command[j] * TER_MODEL_MAX_LODS, required_flags);
+         ter_shader_program_object_cull_load_lods(sh, lod_errors,
+                                                  s->model->num_lods);
+         ter_shader_program_object_cull_load_impostor(sh,
+            s->model->impostors ? p->num_sets * TER_MODEL_MAX_LODS + j : -1,
+            s->model->impostor_row);
+         glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, s->gpu_instance_buf);
+         glDispatchCompute((s->count + OBJECT_CULL_GROUP_SIZE - 1) /
+                           OBJECT_CULL_GROUP_SIZE, 1, 1);
+      }
+   }
+
+   /* The results are consumed as draw parameters and vertex attributes */
+   glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+}
+
+/*
+ * Switches the renderer to cull objects on the GPU (see
+ * object_renderer_prepare_gpu()). This requires OpenGL 4.3 and the
+ * "program/object-cull" shader program. Returns false, leaving culling on
+ * the CPU, if they are not available.
+ */
+bool
+ter_object_renderer_enable_gpu_culling(TerObjectRenderer *r)
+{
+   if (!ter_util_gl_version_at_least(4, 3) ||
+       !ter_cache_get("program/object-cull")) {
+      ter_dbg(LOG_DEFAULT, "OBJ-RENDERER: WARNING: GPU culling requires "
+              "OpenGL 4.3, culling objects on the CPU\n");
+      return false;
+   }
+
+   r->gpu_culling = true;
+   return true;
+}
+
+/*
+ * Computes the visible instances of every object set for each of the passes
+ * and packs their instance data. This is typically called once at the start
+ * of the frame with all the passes to render in it, so instance bounds are
+ * read once per frame rather than once per pass: each set is swept once,
+ * testing its instances against all the passes and recording the passes
+ * that see each of them in a bitmask. Sets are independent tasks for the
+ * thread pool (or run in the calling thread if pool is NULL).
+ *
+ * With GPU culling enabled, this only dispatches the culling shaders.
+ */
+void
+ter_object_renderer_prepare(TerObjectRenderer *r, TerThreadPool *pool,
+                            TerObjectRenderPass **passes, unsigned num_passes)
+{
+   unsigned num_sets = r->sets->len;
+   if (num_sets == 0 || num_passes == 0)
+      return;
+
+   assert(num_passes <= TER_OBJECT_RENDERER_MAX_PASSES);
+
+   /* Passes are prepared once per frame */
+   memset(&r->stats, 0, sizeof(r->stats));
+
+   /* Anything that modifies the sets is done here, before going parallel */
+   for (unsigned j = 0; j < num_sets; j++)
+      ter_object_set_update_transforms((TerObjectSet *) g_ptr_array_index(r->sets, j));
+
+   for (unsigned k = 0; k < num_passes; k++) {
+      TerObjectRenderPass *p = passes[k];
+      if (p->num_sets < num_sets) {
+         p->sets = g_renew(TerObjectRenderPassSet, p->sets, num_sets);
+         memset(p->sets + p->num_sets, 0,
+                sizeof(TerObjectRenderPassSet) * (num_sets - p->num_sets));
+         p->num_sets = num_sets;
+      }
+      p->num_occluded = 0;
+   }
+
+   if (r->gpu_culling) {
+      object_renderer_prepare_gpu(r, passes, num_passes);
+      return;
+   }
+
+   ObjectRendererPrepareJob job;
+   job.r = r;
+   job.passes = passes;
+   job.num_passes = num_passes;
+   job.shadow_mask = 0;
+   job.cross_fade_mask = 0;
+   job.occlusion_mask = 0;
+
+   for (unsigned k = 0; k < num_passes; k++) {
+      TerObjectRenderPass *p = passes[k];
+      for (unsigned j = 0; j < num_sets; j++) {
+         TerObjectSet *s = (TerObjectSet *) g_ptr_array_index(r->sets, j);
+         TerObjectRenderPassSet *ps = &p->sets[j];
+         if (ps->capacity < s->count) {
+            ps->lod = (uint8_t *) g_realloc(ps->lod, s->capacity);
+            memset(ps->lod + ps->capacity, 0, s->capacity - ps->capacity);
+            ps->fade = (uint8_t *) g_realloc(ps->fade, s->capacity);
+            ps->capacity = s->capacity;
          }
       }
 
-      /* Update instanced buffer */
-      glm::mat4 Model = ter_object_get_model_matrix(o);
-      float *Model_fptr = glm::value_ptr(Model);
+      if (p->flags & TER_OBJECT_RENDER_PASS_SHADOW)
+         job.shadow_mask |= 1 << k;
+      else
+         job.cross_fade_mask |= 1 << k;
 
-      /* Model */
-      unsigned offset = num_instances * TER_MODEL_INSTANCED_ITEM_SIZE;
-      unsigned model_size = 16 * sizeof(float);
-      memcpy(instanced_buffer + offset, Model_fptr, model_size);
-      offset += model_size;
+      if (p->occlusion)
+         job.occlusion_mask |= 1 << k;
 
-      /* Prev MVP. This is only required for motion blur, so if it is disabled
-       * we can just skip this.
-       */
-      if (TER_MOTION_BLUR_FILTER_ENABLE) {
-         unsigned prev_mvp_size = 16 * sizeof(float);
-         if (d->render_motion) {
-            float *prev_mvp_fptr;
-            if (o->prev_mvp_valid) {
-               prev_mvp_fptr = glm::value_ptr(o->prev_mvp);
-            } else {
-               glm::mat4 current_mvp = (*d->VP) * Model;
-               prev_mvp_fptr = glm::value_ptr(current_mvp);
-            }
-            memcpy(instanced_buffer + offset, prev_mvp_fptr, prev_mvp_size);
-            ter_object_set_prev_mvp(o, (*d->VP) * Model);
+      job.lod_factor[k] = TER_MODEL_LOD_ERROR * p->lod_bias;
+      job.impostor_start[k] = TER_IMPOSTOR_DISTANCE / p->lod_bias;
+      job.impostor_length[k] = TER_IMPOSTOR_FADE_DISTANCE / p->lod_bias;
+
+      ObjectCullView *v = &job.view[k];
+      v->clip = &p->clip;
+      v->frustum = p->use_frustum ? &p->frustum : NULL;
+#if defined(__SSE2__)
+      object_cull_volume_init_sse2(&v->sse2, v->clip, v->frustum);
+#endif
+   }
+
+   ter_thread_pool_run(pool, object_renderer_select_range, &job, num_sets, 1);
+
+   /* Now that we know the number of instances of each set in each pass,
+    * allocate their instance data in the stream buffer, one range per pass
+    */
+   TerStreamBuffer *sb =
+      (TerStreamBuffer *) ter_cache_get("rendering/stream-buffer");
+   for (unsigned k = 0; k < num_passes; k++) {
+      TerObjectRenderPass *p = passes[k];
+      unsigned num_instances = 0;
+      for (unsigned j = 0; j < num_sets; j++) {
+         num_instances += p->sets[j].num_instances + p->sets[j].num_impostors;
+         p->num_occluded += p->sets[j].num_occluded;
+      }
+
+      TerStreamRange range;
+      ter_stream_buffer_alloc(sb, num_instances * TER_MODEL_INSTANCED_ITEM_SIZE,
+                              TER_MODEL_INSTANCED_ITEM_SIZE, &range);
+      p->stream_buf = range.buf;
+
+      unsigned base = range.offset / TER_MODEL_INSTANCED_ITEM_SIZE;
+      for (unsigned j = 0; j < num_sets; j++) {
+         TerObjectRenderPassSet *ps = &p->sets[j];
+         ps->instance_data = range.ptr;
+         ps->base_instance = base;
+         unsigned count = ps->num_instances + ps->num_impostors;
+         if (range.ptr)
+            range.ptr += count * TER_MODEL_INSTANCED_ITEM_SIZE;
+         base += count;
+      }
+   }
+
+   ter_thread_pool_run(pool, object_renderer_pack_range, &job, num_sets, 1);
+   ter_stream_buffer_flush(sb);
+}
+
+/* Programs, textures and VAOs in the render queue keys of the passes. The
+ * textures of batch b are b + 1 and its VAO is b. Shadow map passes draw
+ * all the batches with the same program and no textures.
+ */
+#define OBJECT_QUEUE_PROGRAM_SOLID     0
+#define OBJECT_QUEUE_PROGRAM_TEXTURED  1
+#define OBJECT_QUEUE_PROGRAM_IMPOSTOR  2
+#define OBJECT_QUEUE_TEXTURES_NONE     0
+#define OBJECT_QUEUE_TEXTURES_IMPOSTOR (TER_MODEL_ARENA_MAX_BATCHES + 1)
+#define OBJECT_QUEUE_VAO_IMPOSTOR      TER_MODEL_ARENA_MAX_BATCHES
+
+/* Item of a packet: the instances of a group of a set (a level of detail or
+ * the impostors, see TerObjectRenderPassSet). With GPU culling, it is the
+ * VAO, as the commands of a batch (or all the impostor commands) are drawn
+ * together.
+ */
+#define OBJECT_QUEUE_ITEM(set, group) \
+   ((set) * (TER_MODEL_MAX_LODS + 1) + (group))
+
+/* A pass being rendered through the render queue */
+typedef struct {
+   TerObjectRenderer *r;
+   TerObjectRenderPass *p;
+   TerModelArena *a;
+   TerImpostorAtlas *ia;
+   unsigned instanced_buf;
+
+   /* Shadow map passes, see ter_object_renderer_render_shadow_map() */
+   bool shadow_map;
+   const glm::mat4 *light_projection;
+   const glm::mat4 *light_view;
+
+   /* Other passes, see ter_object_renderer_render_pass() */
+   float clip_far_plane;
+   float render_far_plane;
+   bool enable_shadows;
+   unsigned shadow_pfc;
+   const glm::mat4 *prev_vp;  /* Only when rendering motion */
+
+   /* Bound state (-1 if none) */
+   int program;
+   int vao;
+   TerShaderProgramBasic *sh;
+} ObjectQueuePass;
+
+static inline uint64_t
+object_queue_batch_key(ObjectQueuePass *qp, unsigned batch, float distance)
+{
+   bool textured = qp->a->batches[batch].textured && !qp->shadow_map;
+   return ter_render_queue_key(0,
+      textured ? OBJECT_QUEUE_PROGRAM_TEXTURED : OBJECT_QUEUE_PROGRAM_SOLID,
+      textured ? batch + 1 : OBJECT_QUEUE_TEXTURES_NONE,
+      batch, distance / qp->render_far_plane);
+}
+
+static inline uint64_t
+object_queue_impostor_key(ObjectQueuePass *qp, float distance)
+{
+   return ter_render_queue_key(0, OBJECT_QUEUE_PROGRAM_IMPOSTOR,
+                               OBJECT_QUEUE_TEXTURES_IMPOSTOR,
+                               OBJECT_QUEUE_VAO_IMPOSTOR,
+                               distance / qp->render_far_plane);
+}
+
+/*
+ * Pushes a packet for each group of visible instances of each set in the
+ * pass, keyed by its state and the distance to its nearest instance.
+ */
+static void
+object_queue_submit(ObjectQueuePass *qp)
+{
+   TerObjectRenderer *r = qp->r;
+   TerObjectRenderPass *p = qp->p;
+   TerRenderQueue *q = r->queue;
+
+   ter_render_queue_reset(q);
+
+   if (r->gpu_culling) {
+      bool has_impostors = false;
+      for (unsigned j = 0; j < p->num_sets; j++) {
+         TerObjectSet *s = (TerObjectSet *) g_ptr_array_index(r->sets, j);
+         has_impostors = has_impostors || s->model->impostors;
+      }
+
+      for (unsigned b = 0; b < qp->a->num_batches; b++) {
+         if (p->num_sets > 0 && r->gpu_batch_commands[b] > 0)
+            ter_render_queue_push(q, object_queue_batch_key(qp, b, 0.0f), b);
+      }
+      if (qp->ia && has_impostors) {
+         ter_render_queue_push(q, object_queue_impostor_key(qp, 0.0f),
+                               OBJECT_QUEUE_VAO_IMPOSTOR);
+      }
+      return;
+   }
+
+   for (unsigned j = 0; j < p->num_sets; j++) {
+      TerObjectSet *s = (TerObjectSet *) g_ptr_array_index(r->sets, j);
+      TerObjectRenderPassSet *ps = &p->sets[j];
+      TerModel *m = s->model;
+
+      for (unsigned l = 0; l < m->num_lods; l++) {
+         if (ps->lod_instances[l] > 0) {
+            ter_render_queue_push(q,
+               object_queue_batch_key(qp, m->batch, ps->distance[l]),
+               OBJECT_QUEUE_ITEM(j, l));
          }
-         offset += prev_mvp_size;
       }
 
-      /* Model variant index */
-      unsigned variant_idx_size = sizeof(int);
-      unsigned variant_idx = o->variant * TER_MODEL_MAX_MATERIALS;
-      memcpy(instanced_buffer + offset, &variant_idx, variant_idx_size);
-      offset += variant_idx_size;
+      if (qp->ia && ps->num_impostors > 0) {
+         ter_render_queue_push(q,
+            object_queue_impostor_key(qp, ps->distance[OBJECT_IMPOSTOR_SLOT]),
+            OBJECT_QUEUE_ITEM(j, OBJECT_IMPOSTOR_SLOT));
+      }
 
-      iter = g_list_next(iter);
-      num_instances++;
-   };
+      if (ps->num_instances > 0 || ps->num_impostors > 0) {
+         ter_dbg(LOG_RENDER, "\tOBJ-RENDERER: INFO: %s: clipped %u / %u "
+                 "objects, %u occluded, %u / %u at full detail, "
+                 "%u impostors\n", m->name,
+                 ps->num_clipped, s->count, ps->num_occluded,
+                 ps->lod_instances[0],
+                 ps->num_instances, ps->num_impostors);
+      }
+   }
+}
 
-   TerObject *o = (TerObject *) set->data;
-   ter_model_render_prepare(o->model, (float *) instanced_buffer, num_instances,
-                            d->clip_far_plane, d->render_far_plane,
-                            d->enable_shadows, d->shadow_pfc,
-                            d->render_motion);
+static void
+object_queue_unbind(ObjectQueuePass *qp)
+{
+   if (qp->vao < 0)
+      return;
 
-   glDrawArraysInstanced(GL_TRIANGLES, 0, o->model->vertices.size(),
-                         num_instances);
+   if (qp->vao == OBJECT_QUEUE_VAO_IMPOSTOR)
+      ter_impostor_atlas_render_finish(qp->ia);
+   else if (qp->shadow_map)
+      ter_model_arena_render_finish_for_shadow_map(qp->a, qp->vao);
+   else
+      ter_model_arena_render_finish(qp->a, qp->vao);
+   qp->vao = -1;
+}
 
-   ter_model_render_finish(o->model);
+static unsigned
+object_queue_shadow_map_textures(ObjectQueuePass *qp)
+{
+   if (qp->shadow_map || !qp->enable_shadows)
+      return 0;
 
-   ter_dbg(LOG_RENDER, "\tOBJ-RENDERER: INFO: clipped %u / %u objects\n",
-           num_clipped, num_clipped + num_instances);
+   TerShadowRenderer *sr =
+      (TerShadowRenderer *) ter_cache_get("rendering/shadow-renderer");
+   return sr->shadow_box->csm_levels;
 }
 
-/* Renders the objects clipped to the provided clip cuboid first and to a
- * viewing frustum with clip_far_plane second. The render far plane is used
- * to create a projection matrix for rendering. Usually, the clip far plane
- * and the render far plane will be the same, but in cases like the refraction
- * texture that need to render depth information with the default far plane
- * but fade objects against the clip plane, they can be different.
+/*
+ * Binds the state of a packet key. The program is only bound if it changed
+ * since the previous packet, the textures and VAO of a batch are bound with
+ * the batch.
+ */
+static void
+object_queue_bind(ObjectQueuePass *qp, uint64_t key)
+{
+   int program = TER_RENDER_KEY_FIELD(key, PROGRAM);
+   int vao = TER_RENDER_KEY_FIELD(key, VAO);
+   TerRenderStats *stats = &qp->r->stats;
+
+   object_queue_unbind(qp);
+
+   /* The atlas binds its program, textures and VAO together */
+   if (program == OBJECT_QUEUE_PROGRAM_IMPOSTOR) {
+      if (qp->shadow_map) {
+         ter_impostor_atlas_render_prepare_for_shadow_map(qp->ia,
+            qp->instanced_buf, qp->light_projection, qp->light_view);
+      } else {
+         ter_impostor_atlas_render_prepare(qp->ia, qp->instanced_buf,
+                                           qp->clip_far_plane,
+                                           qp->render_far_plane,
+                                           qp->enable_shadows,
+                                           qp->shadow_pfc,
+                                           qp->prev_vp);
+      }
+      stats->program_binds++;
+      stats->texture_binds += 2 + object_queue_shadow_map_textures(qp);
+      stats->vao_binds++;
+      qp->program = program;
+      qp->vao = vao;
+      return;
+   }
+
+   if (program != qp->program) {
+      if (qp->shadow_map) {
+         TerShaderProgramShadowMap *sh = (TerShaderProgramShadowMap *)
+            ter_cache_get("program/shadow-map-instanced");
+         glUseProgram(sh->prog.program);
+         ter_shader_program_shadow_map_load_VP(sh, qp->light_projection,
+                                               qp->light_view);
+      } else {
+         qp->sh = ter_model_arena_render_prepare_program(qp->a,
+            program == OBJECT_QUEUE_PROGRAM_TEXTURED,
+            qp->clip_far_plane, qp->render_far_plane,
+            qp->enable_shadows, qp->shadow_pfc, qp->prev_vp);
+         stats->texture_binds += object_queue_shadow_map_textures(qp);
+      }
+      stats->program_binds++;
+      qp->program = program;
+   }
+
+   if (qp->shadow_map) {
+      ter_model_arena_render_prepare_for_shadow_map(qp->a, vao,
+                                                    qp->instanced_buf);
+   } else {
+      ter_model_arena_render_prepare_batch(qp->a, vao, qp->sh,
+                                           qp->instanced_buf);
+      if (program == OBJECT_QUEUE_PROGRAM_TEXTURED)
+         stats->texture_binds += qp->a->batches[vao].num_tids;
+   }
+   stats->vao_binds++;
+   qp->vao = vao;
+}
+
+/*
+ * Draws packets that share the bound state with a single multi-draw. The
+ * instance data of each packet was packed into the stream buffer of the pass
+ * by ter_object_renderer_prepare() and is read from the base instance of its
+ * command, or, with GPU culling, it is in the instanced buffer of the pass,
+ * next to the draw commands.
+ */
+static void
+object_queue_draw(ObjectQueuePass *qp, const TerRenderPacket *packets,
+                  unsigned count)
+{
+   TerObjectRenderer *r = qp->r;
+   TerObjectRenderPass *p = qp->p;
+   bool impostors = qp->vao == OBJECT_QUEUE_VAO_IMPOSTOR;
+
+   if (r->gpu_culling) {
+      for (unsigned i = 0; i < count; i++) {
+         unsigned b = packets[i].item;
+         if (impostors) {
+            ter_impostor_atlas_draw_indirect(qp->ia, p->gpu_draw_buf,
+                                             p->num_sets * TER_MODEL_MAX_LODS,
+                                             p->num_sets);
+         } else {
+            ter_model_arena_draw_indirect(qp->a, p->gpu_draw_buf,
+               r->gpu_batch_first[b] * TER_MODEL_MAX_LODS,
+               r->gpu_batch_commands[b] * TER_MODEL_MAX_LODS);
+         }
+      }
+      r->stats.draw_calls += count;
+      return;
+   }
+
+   TerModelDrawCommand *cmds = g_newa(TerModelDrawCommand, count);
+   for (unsigned i = 0; i < count; i++) {
+      unsigned j = packets[i].item / (TER_MODEL_MAX_LODS + 1);
+      unsigned g = packets[i].item % (TER_MODEL_MAX_LODS + 1);
+      TerObjectSet *s = (TerObjectSet *) g_ptr_array_index(r->sets, j);
+      TerObjectRenderPassSet *ps = &p->sets[j];
+      TerModel *m = s->model;
+      TerModelDrawCommand *cmd = &cmds[i];
+
+      /* Groups are stored one after another, impostors last */
+      unsigned first = 0;
+      for (unsigned l = 0; l < g && l < TER_MODEL_MAX_LODS; l++)
+         first += ps->lod_instances[l];
+
+      if (g == OBJECT_IMPOSTOR_SLOT) {
+         ter_impostor_init_draw_command(cmd);
+         cmd->instance_count = ps->num_impostors;
+      } else {
+         cmd->count = m->lods[g].num_indices;
+         cmd->instance_count = ps->lod_instances[g];
+         cmd->first_index = m->first_index + m->lods[g].first_index;
+         cmd->base_vertex = m->first_vertex;
+      }
+      cmd->base_instance = ps->base_instance + first;
+   }
+
+   if (impostors)
+      ter_impostor_atlas_draw(qp->ia, cmds, count);
+   else
+      ter_model_arena_draw(qp->a, cmds, count);
+   r->stats.draw_calls += qp->a->multi_draw ? 1 : count;
+}
+
+/*
+ * Sorts the packets of the pass and executes them, binding state only when
+ * it changes and drawing each run of packets with the same state together.
+ */
+static void
+object_queue_execute(ObjectQueuePass *qp)
+{
+   TerRenderQueue *q = qp->r->queue;
+   ter_render_queue_sort(q);
+
+   qp->program = -1;
+   qp->vao = -1;
+   qp->sh = NULL;
+
+   unsigned first = 0;
+   while (first < q->count) {
+      uint64_t state = q->packets[first].key >> TER_RENDER_KEY_VAO_SHIFT;
+      unsigned last = first + 1;
+      while (last < q->count &&
+             (q->packets[last].key >> TER_RENDER_KEY_VAO_SHIFT) == state)
+         last++;
+
+      object_queue_bind(qp, q->packets[first].key);
+      object_queue_draw(qp, &q->packets[first], last - first);
+      first = last;
+   }
+
+   object_queue_unbind(qp);
+}
+
+static void
+object_queue_pass_init(ObjectQueuePass *qp, TerObjectRenderer *r,
+                       TerObjectRenderPass *p)
+{
+   memset(qp, 0, sizeof(ObjectQueuePass));
+   qp->r = r;
+   qp->p = p;
+   qp->a = (TerModelArena *) ter_cache_get("models/arena");
+   qp->ia = (TerImpostorAtlas *) ter_cache_get("models/impostors");
+   qp->instanced_buf = r->gpu_culling ? p->gpu_instanced_buf : p->stream_buf;
+}
+
+/* Renders the objects of a pass prepared with ter_object_renderer_prepare().
+ * The clip far plane is the distance at which objects fade out and the
+ * render far plane is used to create a projection matrix for rendering.
+ * Usually, they will be the same, but in cases like the refraction texture
+ * that need to render depth information with the default far plane but
+ * fade objects against the clip plane, they can be different.
  */
 void
-ter_object_renderer_render_clipped(TerObjectRenderer *r,
-                                   float clip_far_plane,
-                                   float render_far_plane,
-                                   bool enable_blending,
-                                   bool enable_shadows,
-                                   unsigned shadow_pfc,
-                                   TerClipVolume *clip,
-                                   bool render_motion,
-                                   const char *stage)
+ter_object_renderer_render_pass(TerObjectRenderer *r, TerObjectRenderPass *p,
+                                float clip_far_plane, float render_far_plane,
+                                bool enable_blending, bool enable_shadows,
+                                unsigned shadow_pfc)
 {
+   bool render_motion = p->flags & TER_OBJECT_RENDER_PASS_MOTION;
+
    ter_dbg(LOG_RENDER,
            "OBJ-RENDERER: INFO: stage: %s: blending: %s, shadows: %s, "
-           "blur: %s\n", stage, enable_blending ? "on" : "off",
+           "blur: %s\n", p->stage, enable_blending ? "on" : "off",
            enable_shadows ? "on" : "off", render_motion ? "on" : "off");
 
    if (enable_blending)
       glEnable(GL_BLEND);
 
-   glm::mat4 *Projection = (glm::mat4 *) ter_cache_get("matrix/Projection");
-   glm::mat4 *View = (glm::mat4 *) ter_cache_get("matrix/View");
-   glm::mat4 VP = (*Projection) * (*View);
+   ObjectQueuePass qp;
+   object_queue_pass_init(&qp, r, p);
+   qp.clip_far_plane = clip_far_plane;
+   qp.render_far_plane = render_far_plane;
+   qp.enable_shadows = enable_shadows;
+   qp.shadow_pfc = shadow_pfc;
+
+   /* Objects don't move, so their motion only depends on the view
+    * projection of the previous frame (see TerModelInstance)
+    */
+   if (render_motion)
+      qp.prev_vp = p->prev_VP_valid ? &p->prev_VP : &p->VP;
 
-   TerObjectRendererData data;
-   data.clip = clip;
-   data.clip_far_plane = clip_far_plane;
-   data.render_far_plane = render_far_plane;
-   data.enable_shadows = enable_shadows;
-   data.shadow_pfc = shadow_pfc;
-   data.render_motion = render_motion;
-   data.stage = stage;
-   data.VP = &VP;
-   g_hash_table_foreach(r->sets, (GHFunc) render_object_set_clipped, &data);
+   object_queue_submit(&qp);
+   object_queue_execute(&qp);
+
+   if (render_motion) {
+      p->prev_VP = p->VP;
+      p->prev_VP_valid = true;
+   }
 
    if (enable_blending)
       glDisable(GL_BLEND);
 }
 
+/*
+ * Renders the shadow casters of a pass prepared with
+ * ter_object_renderer_prepare() into the bound shadow map, with the light
+ * projection and view of the shadow map.
+ */
+void
+ter_object_renderer_render_shadow_map(TerObjectRenderer *r,
+                                      TerObjectRenderPass *p,
+                                      const glm::mat4 *projection,
+                                      const glm::mat4 *view)
+{
+   ObjectQueuePass qp;
+   object_queue_pass_init(&qp, r, p);
+   qp.shadow_map = true;
+   qp.light_projection = projection;
+   qp.light_view = view;
+   qp.render_far_plane = TER_FAR_PLANE;
+
+   object_queue_submit(&qp);
+   object_queue_execute(&qp);
+}
+
 static void
-load_object_box_data(TerObject *o, glm::vec3 *vdata)
+load_object_box_data(TerObjectSet *s, unsigned i, glm::vec3 *vdata)
 {
-   TerBox *box = ter_object_get_box(o);
-   glm::vec3 c = box->center;
-   float w = box->w;
-   float h = box->h;
-   float d = box->d;
+   glm::vec3 c = glm::vec3(s->x0[i] + s->x1[i],
+                           s->y0[i] + s->y1[i],
+                           s->z0[i] + s->z1[i]) * 0.5f;
+   float w = (s->x1[i] - s->x0[i]) * 0.5f;
+   float h = (s->y1[i] - s->y0[i]) * 0.5f;
+   float d = (s->z1[i] - s->z0[i]) * 0.5f;
 
    /* Bottom */
    vdata[0] = glm::vec3(c.x - w, c.y - h, c.z - d);
@@ -312,7 +1784,7 @@ load_object_box_data(TerObject *o, glm::vec3 *vdata)
 }
 
 static void
-render_object_set_boxes(const char *key, GList *set, void *data)
+render_object_set_boxes(TerObjectSet *s)
 {
    /* We should really not allocate GL resources in local static variables
     * But this is a debug mode, so we don't care too much
@@ -321,7 +1793,7 @@ render_object_set_boxes(const char *key, GList *set, void *data)
    static unsigned vao = 0;
    static glm::vec3 vdata[24];
 
-   if (!set)
+   if (s->count == 0)
       return;
 
    if (vao == 0) {
@@ -367,24 +1839,17 @@ render_object_set_boxes(const char *key, GList *set, void *data)
    /* Not really caring about performance here, but it is okay,
     * it is a debug feature
     */
-   GList *iter = set;
-   while (iter) {
-      TerObject *o = (TerObject *) iter->data;
-
+   for (unsigned i = 0; i < s->count; i++) {
       /* Don't render bounding boxes for objects that don't produce collisions
        */
-      if (!o->can_collide) {
-         iter = g_list_next(iter);
+      if (!(s->flags[i] & TER_OBJECT_FLAG_CAN_COLLIDE))
          continue;
-      }
 
-      load_object_box_data(o, vdata);
+      load_object_box_data(s, i, vdata);
       glBindBuffer(GL_ARRAY_BUFFER, vertex_buf);
       glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(vdata), vdata);
 
       glDrawArrays(GL_LINES, 0, 24);
-
-      iter = g_list_next(iter);
    }
 
    glBindVertexArray(0);
@@ -393,5 +1858,6 @@ render_object_set_boxes(const char *key, GList *set, void *data)
 void
 ter_object_renderer_render_boxes(TerObjectRenderer *r)
 {
-   g_hash_table_foreach(r->sets, (GHFunc) render_object_set_boxes, NULL);
+   for (unsigned i = 0; i < r->sets->len; i++)
+      render_object_set_boxes((TerObjectSet *) g_ptr_array_index(r->sets, i));
 }
@@ -5,30 +5,207 @@
 
 #include "ter-object.h"
 #include "ter-util.h"
+#include "ter-arena.h"
+#include "ter-thread-pool.h"
+#include "ter-impostor.h"
+#include "ter-render-queue.h"
+#include "ter-occlusion-buffer.h"
 
+#define TER_OBJECT_FLAG_CAST_SHADOW    (1 << 0)
+#define TER_OBJECT_FLAG_CAN_COLLIDE    (1 << 1)
+#define TER_OBJECT_FLAG_TRANSFORM_DIRTY (1 << 2)
+
+/* Node of a loose quadtree over the instances of a set. Instances are
+ * stored in the deepest node whose cell is at least as large as their box
+ * and contains their center, so their box can extend up to half a cell out
+ * of it. Nodes keep the bounds of all the instances in their subtree, which
+ * is what we test for culling.
+ */
+typedef struct _TerObjectTreeNode {
+   float cx, cz, half;              /* Cell center and half size */
+   float x0, x1, y0, y1, z0, z1;    /* Subtree bounds */
+   unsigned depth;
+   unsigned *items;
+   unsigned num_items;
+   unsigned capacity;
+   unsigned subtree_items;
+   struct _TerObjectTreeNode *parent;
+   struct _TerObjectTreeNode *child[4];
+} TerObjectTreeNode;
+
+/* All the instances of a model, stored as a structure of arrays so culling
+ * and instance packing are linear loops over packed data. Each instance
+ * caches its world space bounding box (see ter_object_update_box), with one
+ * array per bound.
+ *
+ * Instance transforms (see TerModelInstance) are cached too. Changing the
+ * transforms of an instance marks it dirty and dirty instances are
+ * recomputed in a batch by ter_object_set_update_transforms() before
+ * rendering.
+ *
+ * Instances are indexed by a loose quadtree so culling can reject whole
+ * regions of the world without looking at the instances in them.
+ */
 typedef struct {
-   GHashTable *sets; /* Objects classified by model */
-   GList *all;       /* All objects */
-   GList *solid;     /* Solid objects (can_collide == true) */
+   TerModel *model;
+   TerArena *arena;
+   unsigned count;
+   unsigned capacity;
+
+   glm::vec3 *pos;
+   glm::vec3 *rot;
+   glm::vec3 *scale;
+   int *variant;
+   uint8_t *flags;
+   TerModelInstance *instance;
+   unsigned num_dirty;
+
+   TerObjectTreeNode *tree;
+   TerObjectTreeNode **node;  /* Tree node of each instance */
+   unsigned *slot;            /* Index of the instance in the node items */
+
+   unsigned *visible;         /* Culling output */
+   unsigned num_visible;
+   unsigned *candidates;      /* Culling scratch */
+   uint8_t *view_mask;        /* Passes that see each visible instance */
+
+   float *x0, *x1;
+   float *y0, *y1;
+   float *z0, *z1;
+
+   /* GPU culling: instance transforms and bounds and the range of
+    * instances that changed since they were last uploaded.
+    */
+   unsigned gpu_instance_buf;
+   unsigned gpu_capacity;
+   unsigned gpu_dirty_start, gpu_dirty_end;
+} TerObjectSet;
+
+typedef struct {
+   float width, depth;        /* World extent, for the object trees */
+   TerArena *arena;           /* Sets and their arrays */
+   GPtrArray *sets;           /* Objects classified by model */
+   GHashTable *set_by_model;  /* Model name -> set */
+   unsigned num_objects;
+   bool gpu_culling;          /* See ter_object_renderer_enable_gpu_culling() */
+
+   /* GPU culling: draw command of each set in the passes. Commands are
+    * sorted by model batch, so each batch is drawn with a single multi-draw.
+    */
+   unsigned *gpu_command;
+   unsigned gpu_batch_first[TER_MODEL_ARENA_MAX_BATCHES];
+   unsigned gpu_batch_commands[TER_MODEL_ARENA_MAX_BATCHES];
+
+   TerRenderQueue *queue;     /* Draws of the pass being rendered */
+   TerRenderStats stats;      /* Since the last prepare */
 } TerObjectRenderer;
 
-TerObjectRenderer *ter_object_renderer_new();
+#define TER_OBJECT_RENDER_PASS_SHADOW  (1 << 0)  /* Only shadow casters */
+#define TER_OBJECT_RENDER_PASS_MOTION  (1 << 1)  /* Render motion vectors */
+
+/* Passes that can be prepared together (bits in the instance view masks) */
+#define TER_OBJECT_RENDERER_MAX_PASSES 8
+
+/* Visible instances of a set in a pass. Their instance data is grouped by
+ * level of detail, from the first level to the last, and followed by the
+ * instances drawn as impostors. Instances that cross-fade to their impostor
+ * are in both groups.
+ *
+ * The instance data is written directly to the stream buffer, at the base
+ * instance of the set in the stream buffer of the pass, and is only valid
+ * for the frame it was prepared in.
+ */
+typedef struct {
+   uint8_t *instance_data;    /* TER_MODEL_INSTANCED_ITEM_SIZE per instance */
+   unsigned base_instance;
+   unsigned num_instances;    /* Not counting impostors */
+   unsigned lod_instances[TER_MODEL_MAX_LODS];
+   unsigned num_impostors;
+   float distance[TER_MODEL_MAX_LODS + 1];   /* Nearest of each group */
+   unsigned num_clipped;
+   unsigned num_occluded;
+   unsigned capacity;
+   uint8_t *lod;              /* Level of detail of each instance */
+   uint8_t *fade;             /* Impostor cross-fade of each instance */
+} TerObjectRenderPassSet;
+
+/* A render pass over the scene objects. The caller sets the volume to cull
+ * against, then ter_object_renderer_prepare() finds the visible instances
+ * of each set for all the passes of the frame at once and packs their
+ * instance data, so rendering the pass only needs to draw it.
+ *
+ * Levels of detail are selected by the distance of the instances to the
+ * LOD origin (usually the camera position). The bias scales the tolerated
+ * simplification error, so passes that need less detail use coarser levels,
+ * and divides the distance at which models switch to their impostors.
+ * Shadow passes switch without cross-fading.
+ *
+ * Passes with an occlusion buffer also cull the instances that are hidden
+ * behind its occluders, which the caller renders before preparing the pass.
+ * GPU culling doesn't use it.
+ */
+typedef struct _TerObjectRenderPass {
+   const char *stage;
+   unsigned flags;
+   TerClipVolume clip;
+   TerFrustum frustum;
+   bool use_frustum;
+   glm::mat4 VP;              /* With TER_OBJECT_RENDER_PASS_MOTION */
+   glm::mat4 prev_VP;         /* VP of the previous frame */
+   bool prev_VP_valid;
+   glm::vec3 lod_origin;
+   float lod_bias;
+   TerOcclusionBuffer *occlusion;
+
+   TerObjectRenderPassSet *sets;
+   unsigned num_sets;
+   unsigned stream_buf;       /* Instance data of the sets */
+   unsigned num_occluded;     /* Instances culled by the occlusion buffer */
+
+   /* GPU culling: one indirect draw command per set and level of detail,
+    * followed by one impostor command per set, and the instance data of all
+    * of them, each in its own region (at the base instance of its command).
+    */
+   unsigned gpu_draw_buf;
+   unsigned gpu_instanced_buf;
+   unsigned gpu_capacity;
+} TerObjectRenderPass;
+
+TerObjectRenderer *ter_object_renderer_new(float width, float depth);
 void ter_object_renderer_free(TerObjectRenderer *r);
 
 void ter_object_renderer_add_object(TerObjectRenderer *r, TerObject *o);
-void ter_object_renderer_render_all(TerObjectRenderer *r, bool enable_shadows);
-void ter_object_renderer_render_clipped(TerObjectRenderer *r,
-                                        float clip_far_plane,
-                                        float render_far_plane,
-                                        bool enable_blending,
-                                        bool enable_shadows,
-                                        unsigned shadow_pfc,
-                                        TerClipVolume *clip,
-                                        bool render_motion,
-                                        const char *stage);
+
+bool ter_object_renderer_enable_gpu_culling(TerObjectRenderer *r);
+
+void ter_object_renderer_prepare(TerObjectRenderer *r, TerThreadPool *pool,
+                                 TerObjectRenderPass **passes,
+                                 unsigned num_passes);
+void ter_object_renderer_render_pass(TerObjectRenderer *r,
+                                     TerObjectRenderPass *p,
+                                     float clip_far_plane,
+                                     float render_far_plane,
+                                     bool enable_blending,
+                                     bool enable_shadows,
+                                     unsigned shadow_pfc);
+void ter_object_renderer_render_shadow_map(TerObjectRenderer *r,
+                                           TerObjectRenderPass *p,
+                                           const glm::mat4 *projection,
+                                           const glm::mat4 *view);
 
 void ter_object_renderer_render_boxes(TerObjectRenderer *r);
-GList *ter_object_renderer_get_all(TerObjectRenderer *r);
-GList *ter_object_renderer_get_solid(TerObjectRenderer *r);
+bool ter_object_renderer_collides(TerObjectRenderer *r, TerBox *box);
+
+void ter_object_set_update_transform(TerObjectSet *s, unsigned i,
+                                     glm::vec3 pos, glm::vec3 rot,
+                                     glm::vec3 scale);
+void ter_object_set_update_transforms(TerObjectSet *s);
+unsigned ter_object_set_cull(TerObjectSet *s, const TerClipVolume *clip,
+                             const TerFrustum *f, unsigned *visible,
+                             unsigned *candidates);
+
+TerObjectRenderPass *ter_object_render_pass_new(const char *stage,
+                                                unsigned flags);
+void ter_object_render_pass_free(TerObjectRenderPass *p);
 
 #endif
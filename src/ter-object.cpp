@@ -2,6 +2,10 @@
 
 #include <glib.h>
 
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 TerObject *
 ter_object_new(TerModel *model, float x, float y, float z)
 
@@ -36,7 +40,18 @@ ter_object_is_rotated(TerObject *o)
 glm::mat4
 ter_object_get_model_matrix(TerObject *o)
 {
-   bool is_rotated = ter_object_is_rotated(o);
+   return ter_object_compute_model_matrix(o->model, o->pos, o->rot, o->scale);
+}
+
+/*
+ * Computes the model matrix for an instance of the model with the given
+ * transforms (see TerObject).
+ */
+glm::mat4
+ter_object_compute_model_matrix(TerModel *model, glm::vec3 pos,
+                                glm::vec3 rot, glm::vec3 scale)
+{
+   bool is_rotated = rot.x || rot.y || rot.z;
 
    /* 1. Center the model around <0,0,0> if we need to rotate
     * 2. Rotate (Z, Y, X)
@@ -53,21 +68,173 @@ ter_object_get_model_matrix(TerObject *o)
     */
 
    glm::mat4 Model = glm::mat4(1.0);
-   Model = glm::translate(Model, o->pos);
-   Model = glm::scale(Model, o->scale);
+   Model = glm::translate(Model, pos);
+   Model = glm::scale(Model, scale);
    if (is_rotated)
-      Model = glm::translate(Model, o->model->center);
-   if (o->rot.x)
-     Model = glm::rotate(Model, DEG_TO_RAD(o->rot.x), glm::vec3(1, 0, 0));
-   if (o->rot.y)
-      Model = glm::rotate(Model, DEG_TO_RAD(o->rot.y), glm::vec3(0, 1, 0));
-   if (o->rot.z)
-      Model = glm::rotate(Model, DEG_TO_RAD(o->rot.z), glm::vec3(0, 0, 1));
+      Model = glm::translate(Model, model->center);
+   if (rot.x)
+     Model = glm::rotate(Model, DEG_TO_RAD(rot.x), glm::vec3(1, 0, 0));
+   if (rot.y)
+      Model = glm::rotate(Model, DEG_TO_RAD(rot.y), glm::vec3(0, 1, 0));
+   if (rot.z)
+      Model = glm::rotate(Model, DEG_TO_RAD(rot.z), glm::vec3(0, 0, 1));
    if (is_rotated)
-      Model = glm::translate(Model, -o->model->center);
+      Model = glm::translate(Model, -model->center);
    return Model;
 }
 
+/*
+ * Rotates v by the unit quaternion q (x, y, z, w), like the shaders do.
+ */
+static inline glm::vec3
+rotate_by_quaternion(const float *q, glm::vec3 v)
+{
+   glm::vec3 u = glm::vec3(q[0], q[1], q[2]);
+   glm::vec3 t = 2.0f * glm::cross(u, v);
+   return v + q[3] * t + glm::cross(u, t);
+}
+
+/*
+ * Computes the instance transform (see TerModelInstance) that is equivalent
+ * to ter_object_compute_model_matrix(). Instances only support uniform
+ * scales, so only scale.x is used.
+ */
+void
+ter_object_compute_instance(TerModel *model, glm::vec3 pos, glm::vec3 rot,
+                            glm::vec3 scale, TerModelInstance *instance)
+{
+   ter_model_instance_set_transform(instance, pos, rot, scale.x);
+
+   /* The model rotates around its center: pos + S * (c - R * c) */
+   if (rot.x || rot.y || rot.z) {
+      glm::vec3 c = model->center;
+      glm::vec3 t = pos +
+         scale.x * (c - rotate_by_quaternion(instance->rotation, c));
+      instance->position[0] = t.x;
+      instance->position[1] = t.y;
+      instance->position[2] = t.z;
+   }
+}
+
+/*
+ * ter_object_compute_instance() for 4 instances at a time, one per SIMD
+ * lane. With R = Rx * Ry * Rz, the rotation is the quaternion product
+ * qx * qy * qz and the position is pos + s * (c - R * c), which reduces to
+ * pos for unrotated instances (q = (0, 0, 0, 1)).
+ */
+#if defined(__SSE2__)
+static unsigned
+object_compute_instances_sse2(TerModel *model, const glm::vec3 *pos,
+                              const glm::vec3 *rot, const glm::vec3 *scale,
+                              const unsigned *index, unsigned count,
+                              TerModelInstance *instances)
+{
+   float lane[6][4] __attribute__ ((aligned (16)));
+   const __m128 two = _mm_set1_ps(2.0f);
+   const __m128 c0 = _mm_set1_ps(model->center.x);
+   const __m128 c1 = _mm_set1_ps(model->center.y);
+   const __m128 c2 = _mm_set1_ps(model->center.z);
+
+   unsigned k;
+   for (k = 0; k + 4 <= count; k += 4) {
+      /* Sines and cosines of the half angles are computed per lane, the
+       * rest is vectorized.
+       */
+      for (unsigned j = 0; j < 4; j++) {
+         glm::vec3 r = rot[index[k + j]];
+         lane[0][j] = r.x ? sinf(DEG_TO_RAD(r.x) * 0.5f) : 0.0f;
+         lane[1][j] = r.x ? cosf(DEG_TO_RAD(r.x) * 0.5f) : 1.0f;
+         lane[2][j] = r.y ? sinf(DEG_TO_RAD(r.y) * 0.5f) : 0.0f;
+         lane[3][j] = r.y ? cosf(DEG_TO_RAD(r.y) * 0.5f) : 1.0f;
+         lane[4][j] = r.z ? sinf(DEG_TO_RAD(r.z) * 0.5f) : 0.0f;
+         lane[5][j] = r.z ? cosf(DEG_TO_RAD(r.z) * 0.5f) : 1.0f;
+      }
+      __m128 sx = _mm_load_ps(lane[0]);
+      __m128 cx = _mm_load_ps(lane[1]);
+      __m128 sy = _mm_load_ps(lane[2]);
+      __m128 cy = _mm_load_ps(lane[3]);
+      __m128 sz = _mm_load_ps(lane[4]);
+      __m128 cz = _mm_load_ps(lane[5]);
+
+      /* q = qx * qy * qz */
+      __m128 cycz = _mm_mul_ps(cy, cz);
+      __m128 sysz = _mm_mul_ps(sy, sz);
+      __m128 sycz = _mm_mul_ps(sy, cz);
+      __m128 cysz = _mm_mul_ps(cy, sz);
+      __m128 qx = _mm_add_ps(_mm_mul_ps(sx, cycz), _mm_mul_ps(cx, sysz));
+      __m128 qy = _mm_sub_ps(_mm_mul_ps(cx, sycz), _mm_mul_ps(sx, cysz));
+      __m128 qz = _mm_add_ps(_mm_mul_ps(cx, cysz), _mm_mul_ps(sx, sycz));
+      __m128 qw = _mm_sub_ps(_mm_mul_ps(cx, cycz), _mm_mul_ps(sx, sysz));
+
+      /* c - R * c = -(w * t + u x t), with t = 2 * (u x c) */
+      __m128 t0 = _mm_mul_ps(two, _mm_sub_ps(_mm_mul_ps(qy, c2),
+                                             _mm_mul_ps(qz, c1)));
+      __m128 t1 = _mm_mul_ps(two, _mm_sub_ps(_mm_mul_ps(qz, c0),
+                                             _mm_mul_ps(qx, c2)));
+      __m128 t2 = _mm_mul_ps(two, _mm_sub_ps(_mm_mul_ps(qx, c1),
+                                             _mm_mul_ps(qy, c0)));
+      __m128 d0 = _mm_add_ps(_mm_mul_ps(qw, t0),
+                  _mm_sub_ps(_mm_mul_ps(qy, t2), _mm_mul_ps(qz, t1)));
+      __m128 d1 = _mm_add_ps(_mm_mul_ps(qw, t1),
+                  _mm_sub_ps(_mm_mul_ps(qz, t0), _mm_mul_ps(qx, t2)));
+      __m128 d2 = _mm_add_ps(_mm_mul_ps(qw, t2),
+                  _mm_sub_ps(_mm_mul_ps(qx, t1), _mm_mul_ps(qy, t0)));
+
+      for (unsigned j = 0; j < 4; j++) {
+         unsigned i = index[k + j];
+         lane[0][j] = pos[i].x;
+         lane[1][j] = pos[i].y;
+         lane[2][j] = pos[i].z;
+         lane[3][j] = scale[i].x;
+      }
+      __m128 s = _mm_load_ps(lane[3]);
+      __m128 p0 = _mm_sub_ps(_mm_load_ps(lane[0]), _mm_mul_ps(s, d0));
+      __m128 p1 = _mm_sub_ps(_mm_load_ps(lane[1]), _mm_mul_ps(s, d1));
+      __m128 p2 = _mm_sub_ps(_mm_load_ps(lane[2]), _mm_mul_ps(s, d2));
+
+      /* Transposing gives us the position + scale and the rotation of each
+       * instance.
+       */
+      _MM_TRANSPOSE4_PS(p0, p1, p2, s);
+      _MM_TRANSPOSE4_PS(qx, qy, qz, qw);
+      __m128 transform[2][4] = { { p0, p1, p2, s }, { qx, qy, qz, qw } };
+      for (unsigned j = 0; j < 4; j++) {
+         TerModelInstance *inst = &instances[index[k + j]];
+         _mm_storeu_ps(inst->position, transform[0][j]);
+         _mm_storeu_ps(inst->rotation, transform[1][j]);
+      }
+   }
+
+   return k;
+}
+#endif
+
+/*
+ * Batched version of ter_object_compute_instance() for instances of the
+ * same model: computes the transform of instances[index[k]] from pos, rot
+ * and scale at index[k] for each k < count. The variant index and the fade
+ * of the instances are left untouched.
+ */
+void
+ter_object_compute_instances(TerModel *model, const glm::vec3 *pos,
+                             const glm::vec3 *rot, const glm::vec3 *scale,
+                             const unsigned *index, unsigned count,
+                             TerModelInstance *instances)
+{
+   unsigned k = 0;
+
+#if defined(__SSE2__)
+   k = object_compute_instances_sse2(model, pos, rot, scale,
+                                     index, count, instances);
+#endif
+
+   for (; k < count; k++) {
+      unsigned i = index[k];
+      ter_object_compute_instance(model, pos[i], rot[i], scale[i],
+                                  &instances[i]);
+   }
+}
+
 float
 ter_object_get_height(TerObject *o)
 {
@@ -26,6 +26,15 @@ void ter_object_free(TerObject *o);
 
 void ter_object_render(TerObject *o, bool enable_shadow);
 glm::mat4 ter_object_get_model_matrix(TerObject *o);
+glm::mat4 ter_object_compute_model_matrix(TerModel *model, glm::vec3 pos,
+                                          glm::vec3 rot, glm::vec3 scale);
+void ter_object_compute_instance(TerModel *model, glm::vec3 pos,
+                                 glm::vec3 rot, glm::vec3 scale,
+                                 TerModelInstance *instance);
+void ter_object_compute_instances(TerModel *model, const glm::vec3 *pos,
+                                  const glm::vec3 *rot, const glm::vec3 *scale,
+                                  const unsigned *index, unsigned count,
+                                  TerModelInstance *instances);
 
 float ter_object_get_height(TerObject *o);
 float ter_object_get_width(TerObject *o);
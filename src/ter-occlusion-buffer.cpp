@@ -0,0 +1,318 @@
+#include "main.h"
+
+#include "ter-occlusion-buffer.h"
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/* Rows rasterized by each job of the thread pool */
+#define OCCLUSION_BAND_ROWS (2 * TER_OCCLUSION_BUFFER_TILE_SIZE)
+
+/* Triangles with a smaller area (in pixels) cover no pixel centers */
+#define OCCLUSION_MIN_AREA 1e-6f
+
+/*
+ * Creates an occlusion buffer of width x height pixels. Both must be
+ * multiples of the tile size.
+ */
+TerOcclusionBuffer *
+ter_occlusion_buffer_new(int width, int height)
+{
+   assert(width % TER_OCCLUSION_BUFFER_TILE_SIZE == 0);
+   assert(height % OCCLUSION_BAND_ROWS == 0);
+
+   TerOcclusionBuffer *b = g_new0(TerOcclusionBuffer, 1);
+   b->width = width;
+   b->height = height;
+   b->depth = g_new0(float, width * height);
+   b->tiles_x = width / TER_OCCLUSION_BUFFER_TILE_SIZE;
+   b->tiles_y = height / TER_OCCLUSION_BUFFER_TILE_SIZE;
+   b->tile_depth = g_new0(float, b->tiles_x * b->tiles_y);
+   return b;
+}
+
+void
+ter_occlusion_buffer_free(TerOcclusionBuffer *b)
+{
+   g_free(b->depth);
+   g_free(b->tile_depth);
+   g_free(b->triangles);
+   g_free(b);
+}
+
+/*
+ * Starts a new set of occluders, seen through the view projection vp.
+ */
+void
+ter_occlusion_buffer_begin(TerOcclusionBuffer *b, const glm::mat4 *vp)
+{
+   b->start_time = g_get_monotonic_time();
+   b->VP = *vp;
+   b->num_triangles = 0;
+}
+
+/*
+ * Sets up a triangle with vertices in screen space (x, y, 1/w).
+ */
+static void
+occlusion_setup_triangle(TerOcclusionBuffer *b, glm::vec3 v0, glm::vec3 v1,
+                         glm::vec3 v2)
+{
+   float area = (v1.x - v0.x) * (v2.y - v0.y) - (v1.y - v0.y) * (v2.x - v0.x);
+   if (fabsf(area) < OCCLUSION_MIN_AREA)
+      return;
+   if (area < 0.0f) {
+      glm::vec3 tmp = v1;
+      v1 = v2;
+      v2 = tmp;
+      area = -area;
+   }
+
+   /* Pixels with their centers inside the bounds of the triangle */
+   float min_x = MIN(v0.x, MIN(v1.x, v2.x));
+   float max_x = MAX(v0.x, MAX(v1.x, v2.x));
+   float min_y = MIN(v0.y, MIN(v1.y, v2.y));
+   float max_y = MAX(v0.y, MAX(v1.y, v2.y));
+   if (max_x < 0.0f || min_x > b->width || max_y < 0.0f || min_y > b->height)
+      return;
+
+   TerOcclusionTriangle tri;
+   tri.x0 = MAX((int) ceilf(min_x - 0.5f), 0);
+   tri.x1 = MIN((int) floorf(max_x - 0.5f), b->width - 1);
+   tri.y0 = MAX((int) ceilf(min_y - 0.5f), 0);
+   tri.y1 = MIN((int) floorf(max_y - 0.5f), b->height - 1);
+   if (tri.x0 > tri.x1 || tri.y0 > tri.y1)
+      return;
+
+   /* Edge i goes from vertex i to the next one. Its function is positive
+    * inside the triangle and 0 at the opposite vertex, so the 1/w at a pixel
+    * is the sum of the 1/w of the vertices weighted by the function of their
+    * opposite edges, divided by the area.
+    */
+   const glm::vec3 v[3] = { v0, v1, v2 };
+   for (unsigned k = 0; k < 3; k++)
+      tri.iw[k] = 0.0f;
+
+   for (unsigned i = 0; i < 3; i++) {
+      const glm::vec3 &va = v[i];
+      const glm::vec3 &vb = v[(i + 1) % 3];
+      float a = va.y - vb.y;
+      float c = vb.x - va.x;
+      float e[3] = { a, c, -a * va.x - c * va.y + 0.5f * (a + c) };
+
+      float w = v[(i + 2) % 3].z / area;
+      for (unsigned k = 0; k < 3; k++) {
+         tri.edge[i][k] = e[k];
+         tri.iw[k] += e[k] * w;
+      }
+   }
+
+   if (b->num_triangles == b->capacity) {
+      b->capacity = MAX(b->capacity * 2, 256);
+      b->triangles = g_renew(TerOcclusionTriangle, b->triangles, b->capacity);
+   }
+   b->triangles[b->num_triangles++] = tri;
+}
+
+/*
+ * Adds an occluder triangle with world space vertices. The part in front of
+ * the near plane is clipped away.
+ */
+void
+ter_occlusion_buffer_add_triangle(TerOcclusionBuffer *b, glm::vec3 p0,
+                                  glm::vec3 p1, glm::vec3 p2)
+{
+   const glm::vec4 in[3] = {
+      b->VP * glm::vec4(p0, 1.0f),
+      b->VP * glm::vec4(p1, 1.0f),
+      b->VP * glm::vec4(p2, 1.0f),
+   };
+
+   /* Clip against the near plane (z >= -w) */
+   glm::vec4 out[4];
+   unsigned num_out = 0;
+   for (unsigned i = 0; i < 3; i++) {
+      const glm::vec4 &a = in[i];
+      const glm::vec4 &c = in[(i + 1) % 3];
+      float da = a.z + a.w;
+      float dc = c.z + c.w;
+      if (da >= 0.0f)
+         out[num_out++] = a;
+      if ((da >= 0.0f) != (dc >= 0.0f))
+         out[num_out++] = a + (c - a) * (da / (da - dc));
+   }
+
+   if (num_out < 3)
+      return;
+
+   glm::vec3 s[4];
+   for (unsigned i = 0; i < num_out; i++) {
+      float iw = 1.0f / out[i].w;
+      s[i].x = (out[i].x * iw * 0.5f + 0.5f) * b->width;
+      s[i].y = (out[i].y * iw * 0.5f + 0.5f) * b->height;
+      s[i].z = iw;
+   }
+
+   for (unsigned i = 2; i < num_out; i++)
+      occlusion_setup_triangle(b, s[0], s[i - 1], s[i]);
+}
+
+/*
+ * Keeps the nearest 1/w of the triangle in the pixels of row y it covers.
+ */
+static inline void
+occlusion_rasterize_row(TerOcclusionBuffer *b, const TerOcclusionTriangle *t,
+                        int y)
+{
+   float *row = b->depth + y * b->width;
+   float fy = (float) y;
+
+#if defined(__SSE2__)
+   /* Groups of 4 pixels, the edge functions reject the ones outside */
+   int x = t->x0 & ~3;
+   __m128 xv = _mm_add_ps(_mm_set1_ps((float) x),
+                          _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f));
+   const __m128 step = _mm_set1_ps(4.0f);
+   const __m128 zero = _mm_setzero_ps();
+
+   __m128 ea[3], ec[3];
+   for (unsigned i = 0; i < 3; i++) {
+      ea[i] = _mm_set1_ps(t->edge[i][0]);
+      ec[i] = _mm_set1_ps(t->edge[i][1] * fy + t->edge[i][2]);
+   }
+   const __m128 za = _mm_set1_ps(t->iw[0]);
+   const __m128 zc = _mm_set1_ps(t->iw[1] * fy + t->iw[2]);
+
+   for (; x <= t->x1; x += 4) {
+      __m128 e0 = _mm_add_ps(_mm_mul_ps(ea[0], xv), ec[0]);
+      __m128 e1 = _mm_add_ps(_mm_mul_ps(ea[1], xv), ec[1]);
+      __m128 e2 = _mm_add_ps(_mm_mul_ps(ea[2], xv), ec[2]);
+      __m128 inside = _mm_and_ps(_mm_cmpge_ps(e0, zero),
+                                 _mm_and_ps(_mm_cmpge_ps(e1, zero),
+                                            _mm_cmpge_ps(e2, zero)));
+      __m128 z = _mm_and_ps(inside, _mm_add_ps(_mm_mul_ps(za, xv), zc));
+      _mm_storeu_ps(row + x, _mm_max_ps(_mm_loadu_ps(row + x), z));
+      xv = _mm_add_ps(xv, step);
+   }
+#else
+   for (int x = t->x0; x <= t->x1; x++) {
+      float fx = (float) x;
+      bool inside = true;
+      for (unsigned i = 0; i < 3 && inside; i++)
+         inside = t->edge[i][0] * fx + t->edge[i][1] * fy + t->edge[i][2] >= 0.0f;
+      if (inside)
+         row[x] = MAX(row[x], t->iw[0] * fx + t->iw[1] * fy + t->iw[2]);
+   }
+#endif
+}
+
+/*
+ * Rasterizes all the triangles in bands [start, end), then updates the
+ * tiles in them.
+ */
+static void
+occlusion_rasterize_bands(void *data, unsigned start, unsigned end)
+{
+   TerOcclusionBuffer *b = (TerOcclusionBuffer *) data;
+   const int tile = TER_OCCLUSION_BUFFER_TILE_SIZE;
+   int y0 = start * OCCLUSION_BAND_ROWS;
+   int y1 = end * OCCLUSION_BAND_ROWS - 1;
+
+   memset(b->depth + y0 * b->width, 0,
+          (y1 - y0 + 1) * b->width * sizeof(float));
+
+   for (unsigned i = 0; i < b->num_triangles; i++) {
+      const TerOcclusionTriangle *t = &b->triangles[i];
+      for (int y = MAX(t->y0, y0); y <= MIN(t->y1, y1); y++)
+         occlusion_rasterize_row(b, t, y);
+   }
+
+   for (int ty = y0 / tile; ty <= y1 / tile; ty++) {
+      for (int tx = 0; tx < b->tiles_x; tx++) {
+         float farthest = FLT_MAX;
+         for (int y = ty * tile; y < (ty + 1) * tile; y++) {
+            const float *row = b->depth + y * b->width + tx * tile;
+            for (int x = 0; x < tile; x++)
+               farthest = MIN(farthest, row[x]);
+         }
+         b->tile_depth[ty * b->tiles_x + tx] = farthest;
+      }
+   }
+}
+
+/*
+ * Rasterizes the occluders added since ter_occlusion_buffer_begin().
+ */
+void
+ter_occlusion_buffer_rasterize(TerOcclusionBuffer *b, TerThreadPool *pool)
+{
+   ter_thread_pool_run(pool, occlusion_rasterize_bands, b,
+                       b->height / OCCLUSION_BAND_ROWS, 1);
+
+   b->stats.triangles = b->num_triangles;
+   b->stats.raster_ms = (g_get_monotonic_time() - b->start_time) / 1000.0;
+}
+
+/*
+ * Returns true if the box is behind the occluders in all the pixels it
+ * covers. Boxes that cross the near plane are never occluded.
+ */
+bool
+ter_occlusion_buffer_is_occluded(const TerOcclusionBuffer *b,
+                                 const TerClipVolume *box)
+{
+   float min_x = FLT_MAX, max_x = -FLT_MAX;
+   float min_y = FLT_MAX, max_y = -FLT_MAX;
+   float nearest = 0.0f;
+
+   /* 1/w is linear over the screen, so its maximum over the box (its
+    * nearest point) is at one of the corners.
+    */
+   for (unsigned i = 0; i < 8; i++) {
+      glm::vec4 p = b->VP * glm::vec4((i & 1) ? box->x1 : box->x0,
+                                      (i & 2) ? box->y1 : box->y0,
+                                      (i & 4) ? box->z1 : box->z0,
+                                      1.0f);
+      if (p.w <= 0.0f || p.z < -p.w)
+         return false;
+
+      float iw = 1.0f / p.w;
+      float x = (p.x * iw * 0.5f + 0.5f) * b->width;
+      float y = (p.y * iw * 0.5f + 0.5f) * b->height;
+      min_x = MIN(min_x, x);
+      max_x = MAX(max_x, x);
+      min_y = MIN(min_y, y);
+      max_y = MAX(max_y, y);
+      nearest = MAX(nearest, iw);
+   }
+
+   /* Occluders are sampled at pixel centers, so test the pixels with their
+    * centers around the box too, which cover the gaps between samples.
+    */
+   int x0 = MAX((int) floorf(min_x - 0.5f), 0);
+   int x1 = MIN((int) floorf(max_x + 0.5f), b->width - 1);
+   int y0 = MAX((int) floorf(min_y - 0.5f), 0);
+   int y1 = MIN((int) floorf(max_y + 0.5f), b->height - 1);
+   if (x0 > x1 || y0 > y1)
+      return false;
+
+   const int tile = TER_OCCLUSION_BUFFER_TILE_SIZE;
+   for (int ty = y0 / tile; ty <= y1 / tile; ty++) {
+      for (int tx = x0 / tile; tx <= x1 / tile; tx++) {
+         /* All the pixels of the tile are in front of the box */
+         if (b->tile_depth[ty * b->tiles_x + tx] > nearest)
+            continue;
+
+         for (int y = MAX(y0, ty * tile); y <= MIN(y1, (ty + 1) * tile - 1); y++) {
+            const float *row = b->depth + y * b->width;
+            for (int x = MAX(x0, tx * tile); x <= MIN(x1, (tx + 1) * tile - 1); x++) {
+               if (row[x] <= nearest)
+                  return false;
+            }
+         }
+      }
+   }
+
+   return true;
+}
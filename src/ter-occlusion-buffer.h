@@ -0,0 +1,70 @@
+#ifndef __TER_OCCLUSION_BUFFER_H__
+#define __TER_OCCLUSION_BUFFER_H__
+
+#include <glm/glm.hpp>
+
+#include <glib.h>
+
+#include "ter-util.h"
+#include "ter-thread-pool.h"
+
+/* Size of the tiles that keep the farthest depth of their pixels */
+#define TER_OCCLUSION_BUFFER_TILE_SIZE 8
+
+/* A triangle set up for rasterization: edge functions and 1/w as planes
+ * over the screen (a * x + b * y + c), at pixel centers.
+ */
+typedef struct {
+   float edge[3][3];
+   float iw[3];
+   int x0, y0, x1, y1;        /* Pixel bounds, inclusive */
+} TerOcclusionTriangle;
+
+typedef struct {
+   unsigned triangles;        /* Occluder triangles rasterized */
+   double raster_ms;          /* Set up and rasterization time */
+} TerOcclusionBufferStats;
+
+/*
+ * Low resolution depth buffer that the CPU renders a few large occluders
+ * into (such as a coarse version of the terrain), so we can discard objects
+ * hidden behind them before we spend time packing and drawing them.
+ *
+ * Pixels store the 1/w of the nearest occluder, which is linear in screen
+ * space, or 0 if no occluder covers them. Occluders have to be
+ * conservative: they can't cover anything the real geometry doesn't.
+ *
+ * Triangles are set up in the main thread and rasterized in bands of rows
+ * by the thread pool. Each tile of TER_OCCLUSION_BUFFER_TILE_SIZE pixels per
+ * side also keeps the farthest depth of its pixels, so tests can accept or
+ * reject most tiles without looking at their pixels.
+ */
+typedef struct {
+   int width, height;
+   float *depth;
+   int tiles_x, tiles_y;
+   float *tile_depth;         /* Farthest occluder of each tile */
+
+   glm::mat4 VP;
+
+   TerOcclusionTriangle *triangles;
+   unsigned num_triangles;
+   unsigned capacity;
+
+   gint64 start_time;
+   TerOcclusionBufferStats stats;
+} TerOcclusionBuffer;
+
+TerOcclusionBuffer *ter_occlusion_buffer_new(int width, int height);
+void ter_occlusion_buffer_free(TerOcclusionBuffer *b);
+
+void ter_occlusion_buffer_begin(TerOcclusionBuffer *b, const glm::mat4 *vp);
+void ter_occlusion_buffer_add_triangle(TerOcclusionBuffer *b, glm::vec3 p0,
+                                       glm::vec3 p1, glm::vec3 p2);
+void ter_occlusion_buffer_rasterize(TerOcclusionBuffer *b,
+                                    TerThreadPool *pool);
+
+bool ter_occlusion_buffer_is_occluded(const TerOcclusionBuffer *b,
+                                      const TerClipVolume *box);
+
+#endif
@@ -0,0 +1,108 @@
+#include "main.h"
+
+#include "ter-render-queue.h"
+
+TerRenderQueue *
+ter_render_queue_new()
+{
+   return g_new0(TerRenderQueue, 1);
+}
+
+void
+ter_render_queue_free(TerRenderQueue *q)
+{
+   g_free(q->packets);
+   g_free(q->scratch);
+   g_free(q);
+}
+
+/*
+ * Builds the sort key of a draw (see TerRenderPacket). Ids that don't fit
+ * their field are truncated, so callers should number their state compactly.
+ */
+uint64_t
+ter_render_queue_key(unsigned pass, unsigned program, unsigned textures,
+                     unsigned vao, float depth)
+{
+   const uint64_t max_depth = (1ull << TER_RENDER_KEY_DEPTH_BITS) - 1;
+   uint64_t d = (uint64_t) (CLAMP(depth, 0.0f, 1.0f) * max_depth);
+
+#define KEY_FIELD(value, field) \
+   (((uint64_t) (value) & ((1ull << TER_RENDER_KEY_##field##_BITS) - 1)) << \
+    TER_RENDER_KEY_##field##_SHIFT)
+
+   return KEY_FIELD(pass, PASS) |
+          KEY_FIELD(program, PROGRAM) |
+          KEY_FIELD(textures, TEXTURES) |
+          KEY_FIELD(vao, VAO) |
+          KEY_FIELD(d, DEPTH);
+
+#undef KEY_FIELD
+}
+
+void
+ter_render_queue_reset(TerRenderQueue *q)
+{
+   q->count = 0;
+}
+
+void
+ter_render_queue_push(TerRenderQueue *q, uint64_t key, unsigned item)
+{
+   if (q->count == q->capacity) {
+      q->capacity = MAX(2 * q->capacity, 64);
+      q->packets = g_renew(TerRenderPacket, q->packets, q->capacity);
+      q->scratch = g_renew(TerRenderPacket, q->scratch, q->capacity);
+   }
+
+   TerRenderPacket *packet = &q->packets[q->count++];
+   packet->key = key;
+   packet->item = item;
+}
+
+/*
+ * Sorts the packets by key with a least significant digit radix sort, one
+ * byte per pass. The histograms of all the bytes are built in a single
+ * sweep and bytes that are the same in all the keys are skipped, which is
+ * most of them since queues only use a few distinct states. Packets with
+ * the same key keep the order in which they were pushed.
+ */
+void
+ter_render_queue_sort(TerRenderQueue *q)
+{
+   if (q->count < 2)
+      return;
+
+   unsigned histogram[8][256];
+   memset(histogram, 0, sizeof(histogram));
+   for (unsigned i = 0; i < q->count; i++) {
+      uint64_t key = q->packets[i].key;
+      for (unsigned b = 0; b < 8; b++)
+         histogram[b][(key >> (8 * b)) & 0xff]++;
+   }
+
+   TerRenderPacket *src = q->packets;
+   TerRenderPacket *dst = q->scratch;
+   for (unsigned b = 0; b < 8; b++) {
+      unsigned *h = histogram[b];
+      if (h[(src[0].key >> (8 * b)) & 0xff] == q->count)
+         continue;
+
+      unsigned offset = 0;
+      for (unsigned d = 0; d < 256; d++) {
+         unsigned n = h[d];
+         h[d] = offset;
+         offset += n;
+      }
+
+      for (unsigned i = 0; i < q->count; i++)
+         dst[h[(src[i].key >> (8 * b)) & 0xff]++] = src[i];
+
+      TerRenderPacket *tmp = src;
+      src = dst;
+      dst = tmp;
+   }
+
+   q->packets = src;
+   q->scratch = dst;
+}
@@ -0,0 +1,66 @@
+#ifndef __TER_RENDER_QUEUE_H__
+#define __TER_RENDER_QUEUE_H__
+
+#include <stdint.h>
+
+/*
+ * Draw packets sorted by a 64-bit key, so the draws that share state are
+ * executed together and the state is only bound when it changes. From the
+ * most significant bits, the key holds:
+ *
+ *    pass (4) | program (8) | textures (12) | VAO (12) | depth (28)
+ *
+ * Depth is the distance of the draw to the camera, normalized to [0, 1],
+ * so draws with the same state go front to back.
+ */
+#define TER_RENDER_KEY_PASS_BITS       4
+#define TER_RENDER_KEY_PROGRAM_BITS    8
+#define TER_RENDER_KEY_TEXTURES_BITS   12
+#define TER_RENDER_KEY_VAO_BITS        12
+#define TER_RENDER_KEY_DEPTH_BITS      28
+
+#define TER_RENDER_KEY_DEPTH_SHIFT     0
+#define TER_RENDER_KEY_VAO_SHIFT \
+   (TER_RENDER_KEY_DEPTH_SHIFT + TER_RENDER_KEY_DEPTH_BITS)
+#define TER_RENDER_KEY_TEXTURES_SHIFT \
+   (TER_RENDER_KEY_VAO_SHIFT + TER_RENDER_KEY_VAO_BITS)
+#define TER_RENDER_KEY_PROGRAM_SHIFT \
+   (TER_RENDER_KEY_TEXTURES_SHIFT + TER_RENDER_KEY_TEXTURES_BITS)
+#define TER_RENDER_KEY_PASS_SHIFT \
+   (TER_RENDER_KEY_PROGRAM_SHIFT + TER_RENDER_KEY_PROGRAM_BITS)
+
+#define TER_RENDER_KEY_FIELD(key, field) \
+   (((key) >> TER_RENDER_KEY_##field##_SHIFT) & \
+    ((1ull << TER_RENDER_KEY_##field##_BITS) - 1))
+
+typedef struct {
+   uint64_t key;
+   unsigned item;             /* Draw to execute, defined by the caller */
+} TerRenderPacket;
+
+typedef struct {
+   TerRenderPacket *packets;
+   TerRenderPacket *scratch;  /* Radix sort buffer */
+   unsigned count;
+   unsigned capacity;
+} TerRenderQueue;
+
+/* Binds done by the render queues, to measure how well sorting works */
+typedef struct {
+   unsigned program_binds;
+   unsigned texture_binds;
+   unsigned vao_binds;
+   unsigned draw_calls;
+} TerRenderStats;
+
+TerRenderQueue *ter_render_queue_new();
+void ter_render_queue_free(TerRenderQueue *q);
+
+uint64_t ter_render_queue_key(unsigned pass, unsigned program,
+                              unsigned textures, unsigned vao, float depth);
+
+void ter_render_queue_reset(TerRenderQueue *q);
+void ter_render_queue_push(TerRenderQueue *q, uint64_t key, unsigned item);
+void ter_render_queue_sort(TerRenderQueue *q);
+
+#endif
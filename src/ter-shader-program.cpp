@@ -60,14 +60,9 @@ compile_shader(GLuint shaderID, const char *file)
    }
 }
 
-static unsigned
-link_program(GLuint vertexShaderID, GLuint fragmentShaderID)
+static void
+check_link_status(GLuint programID)
 {
-   GLuint programID = glCreateProgram();
-   glAttachShader(programID, vertexShaderID);
-   glAttachShader(programID, fragmentShaderID);
-   glLinkProgram(programID);
-
    GLint result;
    int infoLogLength;
    glGetProgramiv(programID, GL_LINK_STATUS, &result);
@@ -82,6 +77,16 @@ link_program(GLuint vertexShaderID, GLuint fragmentShaderID)
       printf("ERROR: failed to link shader program\n");
       exit(1);
    }
+}
+
+static unsigned
+link_program(GLuint vertexShaderID, GLuint fragmentShaderID)
+{
+   GLuint programID = glCreateProgram();
+   glAttachShader(programID, vertexShaderID);
+   glAttachShader(programID, fragmentShaderID);
+   glLinkProgram(programID);
+   check_link_status(programID);
 
    ter_dbg(LOG_SHADER, "SHADER: INFO: Linked shader program %d: "
            "vs(%d) + fs(%d)\n", programID, vertexShaderID, fragmentShaderID);
@@ -104,6 +109,26 @@ build_shader_program(const char *vertexFile, const char *fragmentFile)
    return link_program(vertexShaderID, fragmentShaderID);
 }
 
+/* Compute shaders require OpenGL 4.3 */
+static unsigned
+build_compute_program(const char *computeFile)
+{
+   GLuint computeShaderID = glCreateShader(GL_COMPUTE_SHADER);
+   compile_shader(computeShaderID, computeFile);
+
+   GLuint programID = glCreateProgram();
+   glAttachShader(programID, computeShaderID);
+   glLinkProgram(programID);
+   check_link_status(programID);
+
+   ter_dbg(LOG_SHADER, "SHADER: INFO: Linked shader program %d: cs(%d)\n",
+           programID, computeShaderID);
+
+   glDeleteShader(computeShaderID);
+
+   return programID;
+}
+
 static void
 init_program(TerShaderProgram *p, unsigned programID)
 {
@@ -315,6 +340,26 @@ init_shadow_data(TerShaderProgramShadowData *p, unsigned programID)
    p->shadow_pfc_loc = glGetUniformLocation(programID, "ShadowPFC");   
 }
 
+static void
+init_terrain_grid_data(TerShaderProgramTerrainGridData *p, unsigned programID)
+{
+   p->grid_depth_loc = glGetUniformLocation(programID, "TerrainGridDepth");
+   p->step_loc = glGetUniformLocation(programID, "TerrainStep");
+   p->height_loc = glGetUniformLocation(programID, "TerrainHeight");
+}
+
+void
+ter_shader_program_terrain_grid_data_load(TerShaderProgramTerrainGridData *p,
+                                          int grid_depth,
+                                          float step,
+                                          float height_scale,
+                                          float height_bias)
+{
+   glUniform1i(p->grid_depth_loc, grid_depth);
+   glUniform1f(p->step_loc, step);
+   glUniform2f(p->height_loc, height_scale, height_bias);
+}
+
 TerShaderProgramTerrain *
 ter_shader_program_terrain_new()
 {
@@ -324,6 +369,7 @@ ter_shader_program_terrain_new()
    init_basic(&p->basic, programID);
    p->sampler_loc = glGetUniformLocation(programID, "SamplerTerrain");
    p->sampler_divisor_loc = glGetUniformLocation(programID, "SamplerCoordDivisor");
+   init_terrain_grid_data(&p->grid, programID);
    return p;
 }
 
@@ -338,6 +384,68 @@ ter_shader_program_terrain_shadow_new()
    p->sampler_divisor_loc = glGetUniformLocation(programID, "SamplerCoordDivisor");
    init_shadow_data(&p->shadow, programID);
    p->prev_mvp_loc = glGetUniformLocation(programID, "PrevMVP");
+   init_terrain_grid_data(&p->grid, programID);
+   return p;
+}
+
+static void
+init_terrain_lod_data(TerShaderProgramTerrainLodData *p, unsigned programID)
+{
+   p->height_map_loc = glGetUniformLocation(programID, "HeightMap");
+   p->grid_size_loc = glGetUniformLocation(programID, "LodGridSize");
+   p->step_loc = glGetUniformLocation(programID, "TerrainStep");
+   p->max_sample_loc = glGetUniformLocation(programID, "TerrainMaxSample");
+   p->camera_position_loc =
+      glGetUniformLocation(programID, "LodCameraPosition");
+   p->morph_loc = glGetUniformLocation(programID, "LodMorph");
+}
+
+void
+ter_shader_program_terrain_lod_data_load(TerShaderProgramTerrainLodData *p,
+                                         unsigned height_map_unit,
+                                         int grid_size,
+                                         float step,
+                                         int max_sample_x,
+                                         int max_sample_z,
+                                         const glm::vec3 *camera_position,
+                                         const glm::vec2 *morph,
+                                         unsigned num_levels)
+{
+   glUniform1i(p->height_map_loc, height_map_unit);
+   glUniform1i(p->grid_size_loc, grid_size);
+   glUniform1f(p->step_loc, step);
+   glUniform2i(p->max_sample_loc, max_sample_x, max_sample_z);
+   glUniform3f(p->camera_position_loc,
+               camera_position->x, camera_position->y, camera_position->z);
+   glUniform2fv(p->morph_loc, num_levels, &morph[0][0]);
+}
+
+TerShaderProgramTerrain *
+ter_shader_program_terrain_lod_new()
+{
+   unsigned programID = build_shader_program("../shaders/terrain-lod.vert",
+                                             "../shaders/terrain.frag");
+   TerShaderProgramTerrain *p = g_new0(TerShaderProgramTerrain, 1);
+   init_basic(&p->basic, programID);
+   p->sampler_loc = glGetUniformLocation(programID, "SamplerTerrain");
+   p->sampler_divisor_loc = glGetUniformLocation(programID, "SamplerCoordDivisor");
+   init_terrain_lod_data(&p->lod, programID);
+   return p;
+}
+
+TerShaderProgramTerrain *
+ter_shader_program_terrain_lod_shadow_new()
+{
+   unsigned programID =
+      build_shader_program("../shaders/terrain-lod-shadow.vert",
+                           "../shaders/terrain-shadow.frag");
+   TerShaderProgramTerrain *p = g_new0(TerShaderProgramTerrain, 1);
+   init_basic(&p->basic, programID);
+   p->sampler_loc = glGetUniformLocation(programID, "SamplerTerrain");
+   p->sampler_divisor_loc = glGetUniformLocation(programID, "SamplerCoordDivisor");
+   init_shadow_data(&p->shadow, programID);
+   p->prev_mvp_loc = glGetUniformLocation(programID, "PrevMVP");
+   init_terrain_lod_data(&p->lod, programID);
    return p;
 }
 
@@ -390,17 +498,14 @@ init_model_data(TerShaderProgramModelData *p, unsigned program)
       glGetUniformLocation(program, "FarClipPlane");
    p->far_render_plane_loc =
       glGetUniformLocation(program, "FarRenderPlane");
-
-   for (int i = 0; i < TER_MODEL_MAX_MATERIALS * TER_MODEL_MAX_VARIANTS; i++) {
-      char *name;
-      name = g_strdup_printf("MaterialAmbient[%d]", i);
-      p->ambient_loc[i] = glGetUniformLocation(program, name);
-      name = g_strdup_printf("MaterialDiffuse[%d]", i);
-      p->diffuse_loc[i] = glGetUniformLocation(program, name);
-      name = g_strdup_printf("MaterialSpecular[%d]", i);
-      p->specular_loc[i] = glGetUniformLocation(program, name);
-      name = g_strdup_printf("MaterialShininess[%d]", i);
-      p->shininess_loc[i] = glGetUniformLocation(program, name);
+   p->prev_vp_loc =
+      glGetUniformLocation(program, "PrevViewProjection");
+
+   /* Materials come from a uniform buffer shared by all the models */
+   unsigned materials_block = glGetUniformBlockIndex(program, "Materials");
+   if (materials_block != GL_INVALID_INDEX) {
+      glUniformBlockBinding(program, materials_block,
+                            TER_SHADER_PROGRAM_MODEL_MATERIALS_BINDING);
    }
 }
 
@@ -462,7 +567,7 @@ void
 ter_shader_program_model_tex_load_textures(TerShaderProgramModelTex *p,
                                            unsigned num_units)
 {
-   assert(num_units < 4);
+   assert(num_units <= TER_MODEL_MAX_TEXTURES);
    for (unsigned i = 0; i < num_units; i++) {
       glUniform1i(p->tex_diffuse_loc[i], i);
    }
@@ -479,20 +584,92 @@ ter_shader_program_model_load_near_far_planes(TerShaderProgramModelData *p,
 }
 
 void
-ter_shader_program_model_load_materials(TerShaderProgramModelData *p,
-                                        TerMaterial *materials,
-                                        unsigned count)
+ter_shader_program_model_load_prev_VP(TerShaderProgramModelData *p,
+                                      const glm::mat4 *mat)
 {
-   for (unsigned i = 0; i < count; i++) {
-      const TerMaterial &mat = materials[i];
-      glUniform3f(p->ambient_loc[i],
-                  mat.ambient.r, mat.ambient.g, mat.ambient.b);
-      glUniform3f(p->diffuse_loc[i],
-                  mat.diffuse.r, mat.diffuse.g, mat.diffuse.b);
-      glUniform3f(p->specular_loc[i],
-                  mat.specular.r, mat.specular.g, mat.specular.b);
-      glUniform1f(p->shininess_loc[i], mat.shininess);
-   }
+   glUniformMatrix4fv(p->prev_vp_loc, 1, GL_FALSE, &(*mat)[0][0]);
+}
+
+TerShaderProgramModel *
+ter_shader_program_impostor_bake_new()
+{
+   unsigned programID = build_shader_program("../shaders/impostor-bake.vert",
+                                             "../shaders/impostor-bake.frag");
+   TerShaderProgramModel *p = g_new0(TerShaderProgramModel, 1);
+   init_basic(&p->basic, programID);
+   init_model_data(&p->model, programID);
+   return p;
+}
+
+static void
+init_impostor(TerShaderProgramImpostor *p, unsigned programID)
+{
+   init_basic(&p->basic, programID);
+   init_model_data(&p->model, programID);
+   p->eye_loc = glGetUniformLocation(programID, "Eye");
+   p->tex_albedo_loc = glGetUniformLocation(programID, "TexAlbedo");
+   p->tex_normal_loc = glGetUniformLocation(programID, "TexNormal");
+   p->num_views_loc = glGetUniformLocation(programID, "NumViews");
+   p->num_rows_loc = glGetUniformLocation(programID, "NumRows");
+   p->row_center_loc = glGetUniformLocation(programID, "RowCenter");
+   p->row_size_loc = glGetUniformLocation(programID, "RowSize");
+}
+
+TerShaderProgramImpostor *
+ter_shader_program_impostor_new()
+{
+   unsigned programID = build_shader_program("../shaders/impostor.vert",
+                                             "../shaders/impostor.frag");
+   TerShaderProgramImpostor *p = g_new0(TerShaderProgramImpostor, 1);
+   init_impostor(p, programID);
+   return p;
+}
+
+TerShaderProgramImpostor *
+ter_shader_program_impostor_shadow_new()
+{
+   unsigned programID = build_shader_program("../shaders/impostor-shadow.vert",
+                                             "../shaders/impostor-shadow.frag");
+   TerShaderProgramImpostor *p = g_new0(TerShaderProgramImpostor, 1);
+   init_impostor(p, programID);
+   init_shadow_data(&p->shadow, programID);
+   return p;
+}
+
+TerShaderProgramImpostor *
+ter_shader_program_impostor_shadow_map_new()
+{
+   unsigned programID =
+      build_shader_program("../shaders/impostor-shadow-map.vert",
+                           "../shaders/impostor-shadow-map.frag");
+   TerShaderProgramImpostor *p = g_new0(TerShaderProgramImpostor, 1);
+   init_impostor(p, programID);
+   return p;
+}
+
+void
+ter_shader_program_impostor_load_atlas(TerShaderProgramImpostor *p,
+                                       unsigned albedo_unit,
+                                       unsigned normal_unit,
+                                       unsigned num_views,
+                                       const glm::vec4 *row_center,
+                                       const glm::vec2 *row_size,
+                                       unsigned num_rows)
+{
+   assert(num_rows <= TER_IMPOSTOR_MAX_ROWS);
+   glUniform1i(p->tex_albedo_loc, albedo_unit);
+   glUniform1i(p->tex_normal_loc, normal_unit);
+   glUniform1i(p->num_views_loc, num_views);
+   glUniform1i(p->num_rows_loc, num_rows);
+   glUniform4fv(p->row_center_loc, num_rows, &row_center[0][0]);
+   glUniform2fv(p->row_size_loc, num_rows, &row_size[0][0]);
+}
+
+void
+ter_shader_program_impostor_load_eye(TerShaderProgramImpostor *p,
+                                     const glm::vec4 *eye)
+{
+   glUniform4fv(p->eye_loc, 1, &(*eye)[0]);
 }
 
 TerShaderProgramWater *
@@ -603,6 +780,35 @@ ter_shader_program_shadow_map_instanced_new()
   return p;
 }
 
+TerShaderProgramShadowMap *
+ter_shader_program_shadow_map_terrain_new()
+{
+   unsigned programID =
+      build_shader_program("../shaders/shadow-map-terrain.vert",
+                           "../shaders/shadow-map.frag");
+   TerShaderProgramShadowMap *p = g_new0(TerShaderProgramShadowMap, 1);
+   init_program(&p->prog, programID);
+   p->projection_loc = glGetUniformLocation(programID, "Projection");
+   p->view_loc = glGetUniformLocation(programID, "View");
+   p->model_loc = glGetUniformLocation(programID, "Model");
+   init_terrain_grid_data(&p->grid, programID);
+   return p;
+}
+
+TerShaderProgramShadowMap *
+ter_shader_program_shadow_map_terrain_lod_new()
+{
+   unsigned programID =
+      build_shader_program("../shaders/shadow-map-terrain-lod.vert",
+                           "../shaders/shadow-map.frag");
+   TerShaderProgramShadowMap *p = g_new0(TerShaderProgramShadowMap, 1);
+   init_program(&p->prog, programID);
+   p->projection_loc = glGetUniformLocation(programID, "Projection");
+   p->view_loc = glGetUniformLocation(programID, "View");
+   init_terrain_lod_data(&p->lod, programID);
+   return p;
+}
+
 void
 ter_shader_program_shadow_map_load_VP(TerShaderProgramShadowMap *p,
                                        const glm::mat4 *projection,
@@ -643,6 +849,102 @@ ter_shader_program_box_load_MVP(TerShaderProgramBox *p, glm::mat4 *MVP)
    glUniformMatrix4fv(p->mvp_loc, 1, GL_FALSE, &(*MVP)[0][0]);
 }
 
+TerShaderProgramObjectCull *
+ter_shader_program_object_cull_new()
+{
+   unsigned programID = build_compute_program("../shaders/object-cull.comp");
+
+   TerShaderProgramObjectCull *p = g_new0(TerShaderProgramObjectCull, 1);
+   init_program(&p->prog, programID);
+
+   p->num_instances_loc = glGetUniformLocation(programID, "NumInstances");
+   p->draw_index_loc = glGetUniformLocation(programID, "DrawIndex");
+   p->required_flags_loc = glGetUniformLocation(programID, "RequiredFlags");
+   p->item_words_loc = glGetUniformLocation(programID, "ItemWords");
+   p->variant_word_loc = glGetUniformLocation(programID, "VariantWord");
+   p->clip_min_loc = glGetUniformLocation(programID, "ClipMin");
+   p->clip_max_loc = glGetUniformLocation(programID, "ClipMax");
+   p->num_planes_loc = glGetUniformLocation(programID, "NumPlanes");
+   p->planes_loc = glGetUniformLocation(programID, "Planes");
+   p->lod_origin_loc = glGetUniformLocation(programID, "LodOrigin");
+   p->lod_factor_loc = glGetUniformLocation(programID, "LodFactor");
+   p->num_lods_loc = glGetUniformLocation(programID, "NumLods");
+   p->lod_errors_loc = glGetUniformLocation(programID, "LodErrors");
+   p->impostor_draw_loc = glGetUniformLocation(programID, "ImpostorDraw");
+   p->impostor_row_loc = glGetUniformLocation(programID, "ImpostorRow");
+   p->impostor_fade_loc = glGetUniformLocation(programID, "ImpostorFade");
+   p->cross_fade_loc = glGetUniformLocation(programID, "CrossFade");
+
+   return p;
+}
+
+void
+ter_shader_program_object_cull_load_layout(TerShaderProgramObjectCull *p,
+                                           unsigned item_words,
+                                           unsigned variant_word)
+{
+   glUniform1ui(p->item_words_loc, item_words);
+   glUniform1ui(p->variant_word_loc, variant_word);
+}
+
+void
+ter_shader_program_object_cull_load_volume(TerShaderProgramObjectCull *p,
+                                           const TerClipVolume *clip,
+                                           const TerFrustum *f)
+{
+   glUniform3f(p->clip_min_loc, clip->x0, clip->y0, clip->z0);
+   glUniform3f(p->clip_max_loc, clip->x1, clip->y1, clip->z1);
+   glUniform1i(p->num_planes_loc, f ? 6 : 0);
+   if (f)
+      glUniform4fv(p->planes_loc, 6, &f->planes[0][0]);
+}
+
+void
+ter_shader_program_object_cull_load_set(TerShaderProgramObjectCull *p,
+                                        unsigned num_instances,
+                                        unsigned draw_index,
+                                        unsigned required_flags)
+{
+   glUniform1ui(p->num_instances_loc, num_instances);
+   glUniform1ui(p->draw_index_loc, draw_index);
+   glUniform1ui(p->required_flags_loc, required_flags);
+}
+
+void
+ter_shader_program_object_cull_load_lod_origin(TerShaderProgramObjectCull *p,
+                                               const glm::vec3 *origin,
+                                               float factor)
+{
+   glUniform3fv(p->lod_origin_loc, 1, &(*origin)[0]);
+   glUniform1f(p->lod_factor_loc, factor);
+}
+
+void
+ter_shader_program_object_cull_load_lods(TerShaderProgramObjectCull *p,
+                                         const float *errors,
+                                         unsigned num_lods)
+{
+   glUniform1ui(p->num_lods_loc, num_lods);
+   glUniform1fv(p->lod_errors_loc, num_lods, errors);
+}
+
+void
+ter_shader_program_object_cull_load_impostor_fade(TerShaderProgramObjectCull *p,
+                                                  float start, float length,
+                                                  bool cross_fade)
+{
+   glUniform2f(p->impostor_fade_loc, start, length);
+   glUniform1i(p->cross_fade_loc, cross_fade);
+}
+
+void
+ter_shader_program_object_cull_load_impostor(TerShaderProgramObjectCull *p,
+                                             int draw_index, unsigned row)
+{
+   glUniform1i(p->impostor_draw_loc, draw_index);
+   glUniform1ui(p->impostor_row_loc, row);
+}
+
 static void
 init_filter_simple(TerShaderProgramFilterSimple *p, unsigned programID)
 {
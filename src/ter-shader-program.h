@@ -103,16 +103,51 @@ void ter_shader_program_shadow_data_load_(TerShaderProgramShadowData *p,
                                           TerShadowRenderer *sr,
                                           unsigned unit);
 
+typedef struct {
+   unsigned height_map_loc;
+   unsigned grid_size_loc;
+   unsigned step_loc;
+   unsigned max_sample_loc;
+   unsigned camera_position_loc;
+   unsigned morph_loc;
+} TerShaderProgramTerrainLodData;
+
+void ter_shader_program_terrain_lod_data_load(TerShaderProgramTerrainLodData *p,
+                                              unsigned height_map_unit,
+                                              int grid_size,
+                                              float step,
+                                              int max_sample_x,
+                                              int max_sample_z,
+                                              const glm::vec3 *camera_position,
+                                              const glm::vec2 *morph,
+                                              unsigned num_levels);
+
+typedef struct {
+   unsigned grid_depth_loc;
+   unsigned step_loc;
+   unsigned height_loc;
+} TerShaderProgramTerrainGridData;
+
+void ter_shader_program_terrain_grid_data_load(TerShaderProgramTerrainGridData *p,
+                                               int grid_depth,
+                                               float step,
+                                               float height_scale,
+                                               float height_bias);
+
 typedef struct {
    TerShaderProgramBasic basic;
    unsigned sampler_loc;
    unsigned sampler_divisor_loc;
    TerShaderProgramShadowData shadow;
    unsigned prev_mvp_loc;
+   TerShaderProgramTerrainGridData grid;
+   TerShaderProgramTerrainLodData lod;
 } TerShaderProgramTerrain;
 
 TerShaderProgramTerrain *ter_shader_program_terrain_new();
 TerShaderProgramTerrain *ter_shader_program_terrain_shadow_new();
+TerShaderProgramTerrain *ter_shader_program_terrain_lod_new();
+TerShaderProgramTerrain *ter_shader_program_terrain_lod_shadow_new();
 
 void ter_shader_program_terrain_load_sampler(TerShaderProgramTerrain *p,
                                              int unit, float divisor);
@@ -132,12 +167,12 @@ void ter_shader_program_skybox_load_sampler(TerShaderProgramSkybox *p, int unit)
 void ter_shader_program_skybox_load_prev_MVP(TerShaderProgramSkybox *p, 
                                              glm::mat4 *mat);
 
+/* Uniform buffer binding of the Materials block of the model shaders */
+#define TER_SHADER_PROGRAM_MODEL_MATERIALS_BINDING 0
+
 typedef struct {
-   unsigned ambient_loc[TER_MODEL_MAX_MATERIALS * TER_MODEL_MAX_VARIANTS];
-   unsigned diffuse_loc[TER_MODEL_MAX_MATERIALS * TER_MODEL_MAX_VARIANTS];
-   unsigned specular_loc[TER_MODEL_MAX_MATERIALS * TER_MODEL_MAX_VARIANTS];   
-   unsigned shininess_loc[TER_MODEL_MAX_MATERIALS * TER_MODEL_MAX_VARIANTS];
    unsigned near_plane_loc, far_clip_plane_loc, far_render_plane_loc;
+   unsigned prev_vp_loc;
 } TerShaderProgramModelData;
 
 typedef struct {
@@ -170,10 +205,37 @@ void ter_shader_program_model_tex_load_textures(TerShaderProgramModelTex *p,
 void ter_shader_program_model_load_near_far_planes(TerShaderProgramModelData *p,
                                                    float near, float far_clip,
                                                    float far_render);
+void ter_shader_program_model_load_prev_VP(TerShaderProgramModelData *p,
+                                           const glm::mat4 *mat);
 
-void ter_shader_program_model_load_materials(TerShaderProgramModelData *p,
-                                             TerMaterial *materials,
-                                             unsigned count);
+TerShaderProgramModel *ter_shader_program_impostor_bake_new();
+
+typedef struct {
+   TerShaderProgramBasic basic;
+   TerShaderProgramModelData model;
+   TerShaderProgramShadowData shadow;
+   unsigned eye_loc;
+   unsigned tex_albedo_loc;
+   unsigned tex_normal_loc;
+   unsigned num_views_loc;
+   unsigned num_rows_loc;
+   unsigned row_center_loc;
+   unsigned row_size_loc;
+} TerShaderProgramImpostor;
+
+TerShaderProgramImpostor *ter_shader_program_impostor_new();
+TerShaderProgramImpostor *ter_shader_program_impostor_shadow_new();
+TerShaderProgramImpostor *ter_shader_program_impostor_shadow_map_new();
+
+void ter_shader_program_impostor_load_atlas(TerShaderProgramImpostor *p,
+                                            unsigned albedo_unit,
+                                            unsigned normal_unit,
+                                            unsigned num_views,
+                                            const glm::vec4 *row_center,
+                                            const glm::vec2 *row_size,
+                                            unsigned num_rows);
+void ter_shader_program_impostor_load_eye(TerShaderProgramImpostor *p,
+                                          const glm::vec4 *eye);
 
 typedef struct {
    TerShaderProgramBasic basic;
@@ -221,10 +283,14 @@ typedef struct {
    unsigned projection_loc;
    unsigned view_loc;
    unsigned model_loc;
+   TerShaderProgramTerrainGridData grid;
+   TerShaderProgramTerrainLodData lod;
 } TerShaderProgramShadowMap;
 
 TerShaderProgramShadowMap *ter_shader_program_shadow_map_new();
 TerShaderProgramShadowMap *ter_shader_program_shadow_map_instanced_new();
+TerShaderProgramShadowMap *ter_shader_program_shadow_map_terrain_new();
+TerShaderProgramShadowMap *ter_shader_program_shadow_map_terrain_lod_new();
 
 void ter_shader_program_shadow_map_load_VP(TerShaderProgramShadowMap *p,
                                             const glm::mat4 *projection,
@@ -244,6 +310,53 @@ TerShaderProgramBox *ter_shader_program_box_new();
 void ter_shader_program_box_load_MVP(TerShaderProgramBox *p,
                                      glm::mat4 *MVP);
 
+typedef struct {
+   TerShaderProgram prog;
+
+   unsigned num_instances_loc;
+   unsigned draw_index_loc;
+   unsigned required_flags_loc;
+   unsigned item_words_loc;
+   unsigned variant_word_loc;
+   unsigned clip_min_loc;
+   unsigned clip_max_loc;
+   unsigned num_planes_loc;
+   unsigned planes_loc;
+   unsigned lod_origin_loc;
+   unsigned lod_factor_loc;
+   unsigned num_lods_loc;
+   unsigned lod_errors_loc;
+   unsigned impostor_draw_loc;
+   unsigned impostor_row_loc;
+   unsigned impostor_fade_loc;
+   unsigned cross_fade_loc;
+} TerShaderProgramObjectCull;
+
+TerShaderProgramObjectCull *ter_shader_program_object_cull_new();
+void ter_shader_program_object_cull_load_layout(TerShaderProgramObjectCull *p,
+                                                unsigned item_words,
+                                                unsigned variant_word);
+void ter_shader_program_object_cull_load_volume(TerShaderProgramObjectCull *p,
+                                                const TerClipVolume *clip,
+                                                const TerFrustum *f);
+void ter_shader_program_object_cull_load_set(TerShaderProgramObjectCull *p,
+                                             unsigned num_instances,
+                                             unsigned draw_index,
+                                             unsigned required_flags);
+void ter_shader_program_object_cull_load_lod_origin(TerShaderProgramObjectCull *p,
+                                                    const glm::vec3 *origin,
+                                                    float factor);
+void ter_shader_program_object_cull_load_lods(TerShaderProgramObjectCull *p,
+                                              const float *errors,
+                                              unsigned num_lods);
+void ter_shader_program_object_cull_load_impostor_fade(TerShaderProgramObjectCull *p,
+                                                       float start,
+                                                       float length,
+                                                       bool cross_fade);
+void ter_shader_program_object_cull_load_impostor(TerShaderProgramObjectCull *p,
+                                                  int draw_index,
+                                                  unsigned row);
+
 typedef struct {
    TerShaderProgram prog;
    unsigned texture_loc;
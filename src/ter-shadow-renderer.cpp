@@ -3,13 +3,9 @@
 
 #include <glm/gtc/type_ptr.hpp>
 
-static uint8_t instanced_buffer[TER_MODEL_MAX_INSTANCED_VBO_BYTES];
-
 typedef struct {
    TerShadowRenderer *sr;
-   TerShaderProgramShadowMap *sh, *sh_instanced;
-   glm::vec3 clip_center;
-   float clip_w, clip_h, clip_d;
+   TerShaderProgramShadowMap *sh, *sh_terrain, *sh_terrain_lod;
    bool rendered;
    TerTerrain *terrain;
    TerObjectRenderer *obj_renderer;
@@ -22,6 +18,12 @@ ter_shadow_renderer_new(TerLight *light, TerCamera *camera)
    TerShadowRenderer *sr = g_new0(TerShadowRenderer, 1);
    sr->light = light;
    sr->shadow_box = ter_shadow_box_new(light, camera);
+   for (unsigned level = 0; level < TER_MAX_CSM_LEVELS; level++) {
+      sr->obj_pass[level] =
+         ter_object_render_pass_new("shadow map",
+                                    TER_OBJECT_RENDER_PASS_SHADOW);
+      sr->obj_pass[level]->lod_bias = TER_SHADOW_RENDERER_LOD_BIAS;
+   }
    return sr;
 }
 
@@ -29,6 +31,8 @@ void
 ter_shadow_renderer_free(TerShadowRenderer *sr)
 {
    ter_shadow_box_free(sr->shadow_box);
+   for (unsigned level = 0; level < TER_MAX_CSM_LEVELS; level++)
+      ter_object_render_pass_free(sr->obj_pass[level]);
    g_free(sr);
 }
 
@@ -94,121 +98,80 @@ render_stop(TerShadowRenderer *sr, int level)
    glDisableVertexAttribArray(0);
 }
 
-static inline bool
-can_be_clipped(TerObject *o, glm::vec3 c, float w, float h, float d)
+static void
+render_objects(TerObjectRenderPass *p, ShadowRendererRenderData *d)
 {
-   /* It is important to use this method to get the position
-    * because we want the position in the world and the position we store
-    * in the object the result of correcting the center displacement and
-    * applying the scaled height
-    */
-   glm::vec3 pos = ter_object_get_position(o);
-
-   /* The shadow map uses orthographic projection and we really want to
-    * render anything inside it, so the clipping is simpler than in the
-    * case of the object renderer.
-    */
-   const float ow = ter_object_get_width(o);
-   const float oh = ter_object_get_height(o);
-   const float od = ter_object_get_depth(o);
-
-   /* First we check if the object bounds are completely outside the
-    * clipping cuboid. If that is the case the object is certainly outside
-    * the viewing frustum and we can return early.
-    */
-   float x0 = pos.x - ow / 2.0f;
-   float x1 = pos.x + ow / 2.0f;
-   float y0 = pos.y;
-   float y1 = pos.y + oh;
-   float z0 = pos.z - od / 2.0f;
-   float z1 = pos.z + od / 2.0f;
-
-   return x1 < c.x - w || x0 > c.x + w ||
-          z1 < c.z - d || z0 > c.z + d ||
-          y1 < c.y - h || y0 > c.y + h;
+   TerShadowRenderer *sr = d->sr;
+   ter_object_renderer_render_shadow_map(d->obj_renderer, p,
+                                         &sr->LightProjection[d->level],
+                                         &sr->LightView[d->level]);
 }
 
 static void
-render_object_set(const char * key, GList *set, void *data)
+get_terrain_clip_volume(ShadowRendererRenderData *data, TerClipVolume *clip)
 {
-   if (!set)
-      return;
-
-   GList *iter = set;
-   ShadowRendererRenderData *d = (ShadowRendererRenderData *) data;
-
-   TerObject *o = (TerObject *) iter->data;
-   if (o->model->vao == 0) {
-      d->rendered = false;
-      return;
-   }
-
-   TerShadowRenderer *sr = d->sr;
-   TerShaderProgramShadowMap *sh = d->sh_instanced;
+   glm::vec3 clip_center;
+   float clip_w, clip_h, clip_d;
+   ter_shadow_box_get_clipping_box(data->sr->shadow_box, &clip_center,
+                                   &clip_w, &clip_h, &clip_d,
+                                   data->level);
+   clip->x0 = clip_center.x - clip_w;
+   clip->x1 = clip_center.x + clip_w;
+   clip->z0 = clip_center.z - clip_d;
+   clip->z1 = clip_center.z + clip_d;
+   clip->y0 = clip_center.y - clip_h;
+   clip->y1 = clip_center.y + clip_h;
+}
 
+static void
+render_terrain_lod(TerTerrain *t, ShadowRendererRenderData *data)
+{
+   TerShaderProgramShadowMap *sh = data->sh_terrain_lod;
    glUseProgram(sh->prog.program);
 
-   ter_shader_program_shadow_map_load_VP(sh,
-      &sr->LightProjection[d->level], &sr->LightView[d->level]);
-
-   glm::vec3 cc = d->clip_center;
-   unsigned num_clipped = 0;
-   unsigned num_instances = 0;
-   while (iter) {
-      TerObject *o = (TerObject *) iter->data;
-      if (!o->cast_shadow) {
-         iter = g_list_next(iter);
-         continue;
-      }
-
-      if (TER_SHADOW_RENDERER_ENABLE_CLIPPING &&
-          TER_OBJECT_RENDERER_ENABLE_CLIPPING) {
-         /* Don't render objects outside the shadow map clip volume */
-         if (can_be_clipped(o, cc, d->clip_w, d->clip_h, d->clip_d)) {
-            iter = g_list_next(iter);
-            num_clipped++;
-            continue;
-         }
-      }
-
-      glm::mat4 Model = ter_object_get_model_matrix(o);
-      float *Model_fptr = glm::value_ptr(Model);
-
-      unsigned offset = num_instances * TER_MODEL_INSTANCED_ITEM_SIZE;
-      unsigned model_size = 16 * sizeof(float);
-      memcpy(instanced_buffer + offset, Model_fptr, model_size);
-      offset += model_size;
-
-      unsigned variant_idx_size = sizeof(int);
-      unsigned variant_idx = o->variant * TER_MODEL_MAX_MATERIALS;
-      memcpy(instanced_buffer + offset, &variant_idx, variant_idx_size);
-      offset += variant_idx_size;
+   ter_shader_program_shadow_map_load_VP(
+      sh,
+      &data->sr->LightProjection[data->level],
+      &data->sr->LightView[data->level]);
 
-      iter = g_list_next(iter);
-      num_instances++;
+   /* Chunk selection always needs a clip volume, so use the entire terrain
+    * if clipping is disabled.
+    */
+   TerClipVolume clip;
+   if (TER_SHADOW_RENDERER_ENABLE_CLIPPING) {
+      get_terrain_clip_volume(data, &clip);
+   } else {
+      clip.x0 = 0.0f;
+      clip.x1 = ter_terrain_get_width(t);
+      clip.z0 = -ter_terrain_get_depth(t);
+      clip.z1 = 0.0f;
+      clip.y0 = -FLT_MAX;
+      clip.y1 = FLT_MAX;
    }
 
-   ter_model_render_prepare_for_shadow_map(
-      o->model, (float *) instanced_buffer, num_instances);
-
-   glDrawArraysInstanced(GL_TRIANGLES, 0, o->model->vertices.size(),
-                         num_instances);
+   TerFrustum frustum;
+   glm::mat4 LightViewProj =
+      data->sr->LightProjection[data->level] * data->sr->LightView[data->level];
+   ter_util_frustum_from_matrix(&frustum, &LightViewProj);
+   ter_terrain_update_index_buffer_for_clip_volume(t, &clip, &frustum, 1);
 
-   ter_model_render_finish_for_shadow_map(o->model);
-
-   ter_dbg(LOG_RENDER, "\tSHADOW-RENDERER: INFO: clipped %u / %u objects\n",
-           num_clipped, num_clipped + num_instances);
+   ter_terrain_render_lod_chunks(t, &sh->lod);
 }
 
 static void
 render_terrain(TerTerrain *t, ShadowRendererRenderData *data)
 {
+   if (TER_TERRAIN_LOD_ENABLE) {
+      render_terrain_lod(t, data);
+      return;
+   }
+
    if (t->vao == 0) {
       data->rendered = false;
       return;
    }
 
-   TerShaderProgramShadowMap *sh = data->sh;
+   TerShaderProgramShadowMap *sh = data->sh_terrain;
    glUseProgram(sh->prog.program);
 
    glBindVertexArray(t->vao);
@@ -220,28 +183,26 @@ render_terrain(TerTerrain *t, ShadowRendererRenderData *data)
       &data->sr->LightProjection[data->level],
       &data->sr->LightView[data->level],
       &Model);
+   ter_shader_program_terrain_grid_data_load(&sh->grid, t->depth, t->step,
+                                             t->height_scale, t->height_bias);
 
-   size_t buffer_offset = 0;
+   size_t buffer_offset = t->ibuf_offset;
    if (TER_SHADOW_RENDERER_ENABLE_CLIPPING &&
        TER_TERRAIN_ENABLE_CLIPPING) {
-      glm::vec3 clip_center;
-      float clip_w, clip_h, clip_d;
-      ter_shadow_box_get_clipping_box(data->sr->shadow_box, &clip_center,
-                                      &clip_w, &clip_h, &clip_d,
-                                      data->level);
       TerClipVolume clip;
-      clip.x0 = clip_center.x - clip_w;
-      clip.x1 = clip_center.x + clip_w;
-      clip.z0 = clip_center.z - clip_d;
-      clip.z1 = clip_center.z + clip_d;
-      clip.y0 = clip_center.y - clip_h;
-      clip.y1 = clip_center.y + clip_h;
-      buffer_offset = ter_terrain_update_index_buffer_for_clip_volume(t, &clip);
+      get_terrain_clip_volume(data, &clip);
+
+      TerFrustum frustum;
+      glm::mat4 LightViewProj =
+         data->sr->LightProjection[data->level] *
+         data->sr->LightView[data->level];
+      ter_util_frustum_from_matrix(&frustum, &LightViewProj);
+      buffer_offset =
+         ter_terrain_update_index_buffer_for_clip_volume(t, &clip, &frustum, 1);
    }
 
-   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, t->index_buf[t->ibuf_idx]);
-   glDrawElements(GL_TRIANGLE_STRIP, t->num_indices,
-                  GL_UNSIGNED_INT, (void *) buffer_offset);
+   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, t->ibuf);
+   ter_terrain_draw_grid(t, buffer_offset);
 
    glBindVertexArray(0);
    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
@@ -253,10 +214,6 @@ render_shadow_map_level(TerShadowRenderer *sr,
 {
    int level = data->level;
 
-   ter_shadow_box_get_clipping_box(sr->shadow_box, &data->clip_center,
-                                   &data->clip_w, &data->clip_h, &data->clip_d,
-                                   level);
-
    ter_dbg(LOG_RENDER,
            "SHADOW-RENDERER: INFO: level: %d, "
            "cuboid size: %.1f x %.1f x %.1f\n",
@@ -275,21 +232,64 @@ render_shadow_map_level(TerShadowRenderer *sr,
     */
    render_terrain(data->terrain, data);
 
-   g_hash_table_foreach(data->obj_renderer->sets,
-                        (GHFunc) render_object_set, data);
+   render_objects(sr->obj_pass[level], data);
 
    render_stop(sr, level);
 }
 
+/*
+ * Updates the shadow box for the current camera and sets up the object
+ * render passes for its levels, which are returned in passes. They must be
+ * prepared with ter_object_renderer_prepare() before rendering the shadow
+ * map. Returns the number of passes.
+ */
+unsigned
+ter_shadow_renderer_prepare(TerShadowRenderer *sr,
+                            TerObjectRenderPass **passes)
+{
+   ter_shadow_box_update(sr->shadow_box);
+
+   for (unsigned level = 0; level < sr->shadow_box->csm_levels; level++) {
+      /* The shadow map uses orthographic projection and we really want to
+       * render anything inside it, so the clipping is simpler than in the
+       * case of the object renderer: we only cull against the clip cuboid.
+       */
+      /* Levels of detail are selected by the distance to the camera rather
+       * than to the light, since that is what sets the size of the shadows
+       * on the screen.
+       */
+      TerObjectRenderPass *p = sr->obj_pass[level];
+      p->use_frustum = false;
+      p->lod_origin = sr->shadow_box->camera->pos;
+      if (TER_SHADOW_RENDERER_ENABLE_CLIPPING) {
+         glm::vec3 cc;
+         float w, h, d;
+         ter_shadow_box_get_clipping_box(sr->shadow_box, &cc, &w, &h, &d,
+                                         level);
+         p->clip.x0 = cc.x - w;
+         p->clip.x1 = cc.x + w;
+         p->clip.y0 = cc.y - h;
+         p->clip.y1 = cc.y + h;
+         p->clip.z0 = cc.z - d;
+         p->clip.z1 = cc.z + d;
+      } else {
+         p->clip.x0 = p->clip.y0 = p->clip.z0 = -FLT_MAX;
+         p->clip.x1 = p->clip.y1 = p->clip.z1 = FLT_MAX;
+      }
+      passes[level] = p;
+   }
+
+   return sr->shadow_box->csm_levels;
+}
+
 /*
  * Renders the scene objects (only the vertices) to a shadow map using the 
- * the shadow-map shader.
+ * the shadow-map shader. The object passes must have been prepared (see
+ * ter_shadow_renderer_prepare()).
  */
 bool
 ter_shadow_renderer_render(TerShadowRenderer *sr)
 {
-   ter_shadow_box_update(sr->shadow_box);
-
    TerObjectRenderer *obj_renderer =
       (TerObjectRenderer *) ter_cache_get("rendering/obj-renderer");
 
@@ -299,13 +299,17 @@ ter_shadow_renderer_render(TerShadowRenderer *sr)
    TerShaderProgramShadowMap *sh =
       (TerShaderProgramShadowMap *) ter_cache_get("program/shadow-map");
 
-   TerShaderProgramShadowMap *sh_instanced =
-      (TerShaderProgramShadowMap *) ter_cache_get("program/shadow-map-instanced");
+   TerShaderProgramShadowMap *sh_terrain =
+      (TerShaderProgramShadowMap *) ter_cache_get("program/shadow-map-terrain");
+
+   TerShaderProgramShadowMap *sh_terrain_lod =
+      (TerShaderProgramShadowMap *) ter_cache_get("program/shadow-map-terrain-lod");
 
    ShadowRendererRenderData data;
    data.sr = sr;
    data.sh = sh;
-   data.sh_instanced = sh_instanced;
+   data.sh_terrain = sh_terrain;
+   data.sh_terrain_lod = sh_terrain_lod;
    data.rendered = true;
    data.terrain = terrain;
    data.obj_renderer = obj_renderer;
@@ -10,11 +10,14 @@
 #include "ter-shadow-map.h"
 #include "ter-shadow-box.h"
 
+struct _TerObjectRenderPass;
+
 typedef struct {
    TerLight *light;
    TerShadowBox *shadow_box;
    glm::mat4 LightProjection[TER_MAX_CSM_LEVELS];
    glm::mat4 LightView[TER_MAX_CSM_LEVELS];
+   struct _TerObjectRenderPass *obj_pass[TER_MAX_CSM_LEVELS];
 } TerShadowRenderer;
 
 TerShadowRenderer *ter_shadow_renderer_new(TerLight *light, TerCamera *cam);
@@ -22,6 +25,8 @@ void ter_shadow_renderer_free(TerShadowRenderer *sr);
 
 glm::mat4 ter_shadow_renderer_get_shadow_map_space_vp(TerShadowRenderer *sr,
                                                       unsigned level);
+unsigned ter_shadow_renderer_prepare(TerShadowRenderer *sr,
+                                     struct _TerObjectRenderPass **passes);
 bool ter_shadow_renderer_render(TerShadowRenderer *sr);
 
 #endif
@@ -0,0 +1,276 @@
+#include "main.h"
+
+#include "ter-stream-buffer.h"
+
+/* Rounds offset up to a multiple of align, which needs not be a power of
+ * two (instance data is aligned to the size of an instance).
+ */
+static inline size_t
+stream_buffer_align(size_t offset, size_t align)
+{
+   return align > 1 ? (offset + align - 1) / align * align : offset;
+}
+
+static void
+stream_buffer_create_storage(TerStreamBuffer *sb)
+{
+   size_t bytes = sb->frame_size * sb->num_frames;
+
+   glGenBuffers(1, &sb->buf);
+   glBindBuffer(GL_COPY_WRITE_BUFFER, sb->buf);
+   if (sb->persistent) {
+      GLbitfield flags =
+         GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+      glBufferStorage(GL_COPY_WRITE_BUFFER, bytes, NULL, flags);
+      sb->map = (uint8_t *)
+         glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, bytes, flags);
+      assert(sb->map);
+   } else {
+      glBufferData(GL_COPY_WRITE_BUFFER, bytes, NULL, GL_STREAM_DRAW);
+   }
+   glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+   ter_dbg(LOG_VBO, "STREAM-BUFFER: VBO: INFO: %u KB per frame, %u frames "
+           "in flight, persistent mapping: %s\n",
+           (unsigned) (sb->frame_size / 1024), sb->num_frames,
+           sb->persistent ? "yes" : "no");
+}
+
+/*
+ * Creates a stream buffer with room for frame_size bytes in each of
+ * num_frames frames in flight. Persistent mapping requires OpenGL 4.4.
+ */
+TerStreamBuffer *
+ter_stream_buffer_new(size_t frame_size, unsigned num_frames)
+{
+   assert(num_frames >= 1 && num_frames <= TER_STREAM_BUFFER_MAX_FRAMES);
+
+   TerStreamBuffer *sb = g_new0(TerStreamBuffer, 1);
+   sb->frame_size = frame_size;
+   sb->num_frames = num_frames;
+   sb->persistent = ter_util_gl_version_at_least(4, 4);
+   sb->overflow = g_ptr_array_new();
+   stream_buffer_create_storage(sb);
+   return sb;
+}
+
+static void
+stream_buffer_delete_overflow(TerStreamBuffer *sb)
+{
+   for (unsigned i = 0; i < sb->overflow->len; i++) {
+      unsigned buf = GPOINTER_TO_UINT(g_ptr_array_index(sb->overflow, i));
+      glDeleteBuffers(1, &buf);
+   }
+   g_ptr_array_set_size(sb->overflow, 0);
+   sb->num_overflow_flushed = 0;
+}
+
+void
+ter_stream_buffer_free(TerStreamBuffer *sb)
+{
+   ter_stream_buffer_flush(sb);
+   stream_buffer_delete_overflow(sb);
+   g_ptr_array_free(sb->overflow, TRUE);
+   for (unsigned i = 0; i < sb->num_frames; i++) {
+      if (sb->fence[i])
+         glDeleteSync(sb->fence[i]);
+   }
+   glDeleteBuffers(1, &sb->buf);
+   g_free(sb);
+}
+
+/*
+ * Waits until the GPU is done with the frame that last used the region,
+ * counting a stall if it isn't done yet.
+ */
+static void
+stream_buffer_wait(TerStreamBuffer *sb, unsigned frame)
+{
+   GLsync fence = sb->fence[frame];
+   if (!fence)
+      return;
+
+   GLenum status = glClientWaitSync(fence, 0, 0);
+   if (status == GL_TIMEOUT_EXPIRED) {
+      gint64 start = g_get_monotonic_time();
+      do {
+         status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+                                   1000000000ull);
+      } while (status == GL_TIMEOUT_EXPIRED);
+      sb->stats.stalls++;
+      sb->stats.stall_ms += (g_get_monotonic_time() - start) / 1000.0;
+   }
+
+   glDeleteSync(fence);
+   sb->fence[frame] = NULL;
+}
+
+/*
+ * Replaces the storage with a larger one once all the frames in flight are
+ * done with it. This only happens after a frame overflowed.
+ */
+static void
+stream_buffer_grow(TerStreamBuffer *sb, size_t frame_size)
+{
+   for (unsigned i = 0; i < sb->num_frames; i++)
+      stream_buffer_wait(sb, i);
+
+   glDeleteBuffers(1, &sb->buf);
+   sb->map = NULL;
+   sb->frame_size = frame_size;
+   sb->frame = 0;
+   sb->stats.grows++;
+   stream_buffer_create_storage(sb);
+}
+
+/*
+ * Ends the current frame and starts the next one, which reuses the region
+ * of the frame num_frames before it. Everything allocated so far must have
+ * been drawn, since this is what the fences track.
+ */
+void
+ter_stream_buffer_next_frame(TerStreamBuffer *sb)
+{
+   ter_stream_buffer_flush(sb);
+   sb->fence[sb->frame] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+   /* The GL keeps deleted buffers alive until the draws that use them are
+    * done, so overflow buffers can go right away.
+    */
+   stream_buffer_delete_overflow(sb);
+
+   sb->stats.frames++;
+   sb->stats.frame_bytes = sb->frame_bytes;
+   sb->stats.peak_frame_bytes =
+      MAX(sb->stats.peak_frame_bytes, sb->frame_bytes);
+   size_t frame_bytes = sb->frame_bytes;
+   sb->frame_bytes = 0;
+   sb->used = 0;
+
+   if (frame_bytes > sb->frame_size) {
+      size_t frame_size = MAX(sb->frame_size, 1);
+      while (frame_size < frame_bytes)
+         frame_size *= 2;
+      ter_dbg(LOG_VBO, "STREAM-BUFFER: VBO: INFO: Frame overflowed, "
+              "growing to %u KB per frame\n", (unsigned) (frame_size / 1024));
+      stream_buffer_grow(sb, frame_size);
+   } else {
+      sb->frame = (sb->frame + 1) % sb->num_frames;
+      stream_buffer_wait(sb, sb->frame);
+   }
+}
+
+/*
+ * Gives the allocation a buffer of its own, mapped until the next flush,
+ * for the rest of the frame.
+ */
+static void
+stream_buffer_alloc_overflow(TerStreamBuffer *sb, size_t size,
+                             TerStreamRange *range)
+{
+   glGenBuffers(1, &range->buf);
+   glBindBuffer(GL_COPY_WRITE_BUFFER, range->buf);
+   glBufferData(GL_COPY_WRITE_BUFFER, size, NULL, GL_STREAM_DRAW);
+   range->ptr = (uint8_t *)
+      glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, size,
+                       GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+   glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+   range->offset = 0;
+   range->size = size;
+
+   g_ptr_array_add(sb->overflow, GUINT_TO_POINTER(range->buf));
+   sb->stats.overflows++;
+
+   ter_dbg(LOG_VBO, "STREAM-BUFFER: VBO: WARNING: %u bytes don't fit in "
+           "the frame, using a separate buffer\n", (unsigned) size);
+}
+
+/*
+ * Allocates size bytes in the current frame, at an offset that is a
+ * multiple of align. The range can be written until the next call to
+ * ter_stream_buffer_flush() and drawn until the end of the frame.
+ */
+void
+ter_stream_buffer_alloc(TerStreamBuffer *sb, size_t size, size_t align,
+                        TerStreamRange *range)
+{
+   size_t region = sb->frame * sb->frame_size;
+   size_t region_end = region + sb->frame_size;
+   size_t offset = stream_buffer_align(region + sb->used, align);
+
+   sb->frame_bytes += offset - (region + sb->used) + size;
+
+   if (size == 0) {
+      range->buf = sb->buf;
+      range->offset = 0;
+      range->ptr = NULL;
+      range->size = 0;
+      return;
+   }
+
+   if (offset + size > region_end) {
+      stream_buffer_alloc_overflow(sb, size, range);
+      return;
+   }
+
+   if (!sb->persistent && !sb->mapped) {
+      sb->mapped_start = region + sb->used;
+      glBindBuffer(GL_COPY_WRITE_BUFFER, sb->buf);
+      sb->mapped = (uint8_t *)
+         glMapBufferRange(GL_COPY_WRITE_BUFFER, sb->mapped_start,
+                          region_end - sb->mapped_start,
+                          GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT |
+                          GL_MAP_INVALIDATE_RANGE_BIT);
+      glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+   }
+
+   range->buf = sb->buf;
+   range->offset = offset;
+   range->size = size;
+   range->ptr = sb->persistent ? sb->map + offset :
+                                 sb->mapped + (offset - sb->mapped_start);
+   sb->used = offset + size - region;
+}
+
+/*
+ * Shrinks a range to the size actually written, for callers that allocate
+ * for the worst case. The space is only returned to the frame if nothing
+ * was allocated after the range.
+ */
+void
+ter_stream_buffer_commit(TerStreamBuffer *sb, TerStreamRange *range,
+                         size_t size)
+{
+   assert(size <= range->size);
+
+   size_t unused = range->size - size;
+   size_t region = sb->frame * sb->frame_size;
+   sb->frame_bytes -= unused;
+   if (range->buf == sb->buf &&
+       range->offset + range->size == region + sb->used)
+      sb->used -= unused;
+   range->size = size;
+}
+
+/*
+ * Makes the data written to the ranges allocated so far visible to the GPU.
+ * Persistent mappings are coherent, so this only needs to unmap the
+ * buffers that we map while allocating.
+ */
+void
+ter_stream_buffer_flush(TerStreamBuffer *sb)
+{
+   if (sb->mapped) {
+      glBindBuffer(GL_COPY_WRITE_BUFFER, sb->buf);
+      glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+      sb->mapped = NULL;
+   }
+
+   for (unsigned i = sb->num_overflow_flushed; i < sb->overflow->len; i++) {
+      unsigned buf = GPOINTER_TO_UINT(g_ptr_array_index(sb->overflow, i));
+      glBindBuffer(GL_COPY_WRITE_BUFFER, buf);
+      glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+   }
+   sb->num_overflow_flushed = sb->overflow->len;
+   glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
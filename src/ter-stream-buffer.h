@@ -0,0 +1,87 @@
+#ifndef __TER_STREAM_BUFFER_H__
+#define __TER_STREAM_BUFFER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <glib.h>
+
+#include "ter-util.h"
+
+/* Maximum number of frames the CPU can get ahead of the GPU */
+#define TER_STREAM_BUFFER_MAX_FRAMES 4
+
+/* A range of a stream buffer. The caller writes its data through ptr, then
+ * calls ter_stream_buffer_flush() before drawing from buf at offset.
+ */
+typedef struct {
+   unsigned buf;
+   size_t offset;
+   uint8_t *ptr;
+   size_t size;
+} TerStreamRange;
+
+typedef struct {
+   unsigned frames;
+   unsigned stalls;           /* Frames that had to wait for the GPU */
+   double stall_ms;           /* Time spent waiting */
+   unsigned overflows;        /* Allocations that didn't fit in their frame */
+   unsigned grows;
+   size_t frame_bytes;        /* Allocated in the last frame */
+   size_t peak_frame_bytes;
+} TerStreamBufferStats;
+
+/*
+ * Data that the CPU writes every frame for the GPU to read (instance data,
+ * terrain chunks...). The buffer is a ring with a region per frame in
+ * flight: allocations are appended to the region of the current frame and
+ * a fence is inserted when the frame ends, so a region is only written
+ * again once the GPU is done with the frame that used it.
+ *
+ * With OpenGL 4.4 the whole buffer is mapped once, persistently and
+ * coherently, so callers write directly to memory the GPU reads. Otherwise
+ * the free part of the current region is mapped without synchronization
+ * (the fences take care of that) while we allocate, and it is unmapped by
+ * ter_stream_buffer_flush().
+ *
+ * Allocations that don't fit in the current region get a buffer of their
+ * own for the frame, and the ring grows at the next frame to fit a whole
+ * frame, so there is no limit to the data of a frame.
+ */
+typedef struct {
+   unsigned buf;
+   bool persistent;
+   uint8_t *map;              /* Persistent mapping of the whole buffer */
+   size_t frame_size;         /* Size of each region */
+   unsigned num_frames;
+   unsigned frame;            /* Region of the current frame */
+   size_t used;               /* Bytes allocated in the current region */
+   GLsync fence[TER_STREAM_BUFFER_MAX_FRAMES];
+
+   /* Non-persistent mapping of the current region, from mapped_start */
+   uint8_t *mapped;
+   size_t mapped_start;
+
+   /* Buffers of the allocations that overflowed in the current frame, the
+    * first num_overflow_flushed are unmapped already.
+    */
+   GPtrArray *overflow;
+   unsigned num_overflow_flushed;
+
+   size_t frame_bytes;        /* Requested in the current frame */
+
+   TerStreamBufferStats stats;
+} TerStreamBuffer;
+
+TerStreamBuffer *ter_stream_buffer_new(size_t frame_size, unsigned num_frames);
+void ter_stream_buffer_free(TerStreamBuffer *sb);
+
+void ter_stream_buffer_next_frame(TerStreamBuffer *sb);
+
+void ter_stream_buffer_alloc(TerStreamBuffer *sb, size_t size, size_t align,
+                             TerStreamRange *range);
+void ter_stream_buffer_commit(TerStreamBuffer *sb, TerStreamRange *range,
+                              size_t size);
+void ter_stream_buffer_flush(TerStreamBuffer *sb);
+
+#endif
@@ -1,5 +1,9 @@
 #include "main.h"
 
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 TerTerrain *
 ter_terrain_new(unsigned width, unsigned depth, float step)
 {
@@ -7,342 +11,2005 @@ ter_terrain_new(unsigned width, unsigned depth, float step)
    t->width = width;
    t->depth = depth;
    t->step = step;
+   t->inv_step = 1.0f / step;
    t->height = g_new0(float, width * depth);
+   t->planes_dirty = true;
+   t->pyramid_dirty = true;
+   return t;
+}
+
+/*
+ * Creates a terrain that streams its heights from a heightfield file instead
+ * of keeping them in memory. The terrain takes ownership of the heightfield.
+ * This requires the LOD renderer, since it is the one that knows how to work
+ * with height map tiles.
+ */
+TerTerrain *
+ter_terrain_new_from_heightfield(TerHeightfield *hf, float step)
+{
+   assert(TER_TERRAIN_LOD_ENABLE);
+   assert(hf->header.tile_size == TER_TERRAIN_LOD_TILE_SIZE);
+   assert(hf->header.chunk_size == TER_TERRAIN_LOD_CHUNK_SIZE);
+
+   TerTerrain *t = g_new0(TerTerrain, 1);
+   t->width = hf->header.width;
+   t->depth = hf->header.depth;
+   t->step = step;
+   t->inv_step = 1.0f / step;
+   t->hf = hf;
+   t->pyramid_dirty = true;
    return t;
 }
 
+static void
+terrain_lod_free(TerTerrainLod *lod)
+{
+   glDeleteVertexArrays(1, &lod->vao);
+   glDeleteBuffers(1, &lod->grid_index_buf);
+   glDeleteTextures(1, &lod->height_tex);
+   glDeleteBuffers(1, &lod->upload_buf);
+
+   g_free(lod->tile_layer);
+   g_free(lod->layer_tile);
+   g_free(lod->layer_stamp);
+   g_free(lod->tile_requested);
+}
+
+void
+ter_terrain_free(TerTerrain *t)
+{
+   glDeleteVertexArrays(1, &t->vao);
+   glDeleteBuffers(1, &t->vertex_buf);
+   glDeleteBuffers(1, &t->index_buf);
+
+   terrain_lod_free(&t->lod);
+
+   for (unsigned l = 0; l < t->pyramid.num_levels; l++) {
+      g_free(t->pyramid.level[l].min_height);
+      g_free(t->pyramid.level[l].max_height);
+   }
+
+   if (t->hf)
+      ter_heightfield_free(t->hf);
+   g_free(t->height);
+   g_free(t->planes);
+   g_free(t->vertices);
+   g_free(t->indices);
+   g_free(t->draw_count);
+   g_free(t->draw_offset);
+   g_free(t);
+}
+
+/*
+ * Sets the height of sample (w, d). Once the terrain has been built, call
+ * ter_terrain_update_region() with the modified samples afterwards.
+ */
+void
+ter_terrain_set_height(TerTerrain *t, unsigned w, unsigned d, float h)
+{
+   assert(!t->hf);
+   TERRAIN(t, w, d) = h;
+}
+
+/*
+ * Computes the height equations for the two triangles of a terrain quad
+ * from the heights at its corners.
+ *
+ * Quads are split along the diagonal that goes from (x + 1, z) to (x, z + 1),
+ * so the first triangle covers u + v <= 1 and the second covers the rest.
+ */
+static inline void
+terrain_compute_quad_planes(float h00, float h10, float h01, float h11,
+                            TerTerrainPlane *p0, TerTerrainPlane *p1)
+{
+   p0->h = h00;
+   p0->dx = h10 - h00;
+   p0->dz = h01 - h00;
+   p0->pad = 0.0f;
+
+   /* The second triangle's equation is anchored at (1, 1), we move it
+    * to (0, 0) so both triangles are evaluated in the same way.
+    */
+   p1->h = h10 + h01 - h11;
+   p1->dx = h11 - h01;
+   p1->dz = h11 - h10;
+   p1->pad = 0.0f;
+}
+
+/*
+ * Computes the height equations for the two triangles of each terrain quad
+ * in the region [x0, x1) x [z0, z1) (in quad coordinates).
+ */
+static void
+terrain_update_planes(TerTerrain *t, int x0, int z0, int x1, int z1)
+{
+   if (!t->planes)
+      t->planes = g_new(TerTerrainPlane, (t->width - 1) * (t->depth - 1) * 2);
+
+   for (int x = x0; x < x1; x++) {
+      for (int z = z0; z < z1; z++) {
+         terrain_compute_quad_planes(TERRAIN(t, x, z),
+                                     TERRAIN(t, x + 1, z),
+                                     TERRAIN(t, x, z + 1),
+                                     TERRAIN(t, x + 1, z + 1),
+                                     &TER_TERRAIN_PLANE(t, x, z, 0),
+                                     &TER_TERRAIN_PLANE(t, x, z, 1));
+      }
+   }
+}
+
+static inline void
+terrain_ensure_planes(TerTerrain *t)
+{
+   if (t->planes_dirty) {
+      terrain_update_planes(t, 0, 0, t->width - 1, t->depth - 1);
+      t->planes_dirty = false;
+   }
+}
+
+/*
+ * Height queries on streamed terrains read the samples from the heightfield
+ * (paging in their tiles as needed) since there is no plane table.
+ */
+static float
+terrain_get_streamed_height_at(TerTerrain *t, float x, float z)
+{
+   float fx = CLAMP(x * t->inv_step, 0.0f, (float) (t->width - 1));
+   float fz = CLAMP(-z * t->inv_step, 0.0f, (float) (t->depth - 1));
+   int qx = (int) MIN(fx, (float) (t->width - 2));
+   int qz = (int) MIN(fz, (float) (t->depth - 2));
+   float u = fx - qx;
+   float v = fz - qz;
+
+   float h10 = ter_heightfield_get_sample(t->hf, qx + 1, qz);
+   float h01 = ter_heightfield_get_sample(t->hf, qx, qz + 1);
+
+   /* Same triangle split as terrain_update_planes() */
+   if (u + v <= 1.0f) {
+      float h00 = ter_heightfield_get_sample(t->hf, qx, qz);
+      return h00 + (h10 - h00) * u + (h01 - h00) * v;
+   } else {
+      float h11 = ter_heightfield_get_sample(t->hf, qx + 1, qz + 1);
+      return h10 + h01 - h11 + (h11 - h01) * u + (h11 - h10) * v;
+   }
+}
+
+float
+ter_terrain_get_height_at(TerTerrain *t, float x, float z)
+{
+   if (t->hf)
+      return terrain_get_streamed_height_at(t, x, z);
+
+   terrain_ensure_planes(t);
+
+   /* Terrain's Z extends towards -Z, but our vertices need positive numbers.
+    * Coordinates outside the terrain are clamped to its edges.
+    */
+   float fx = CLAMP(x * t->inv_step, 0.0f, (float) (t->width - 1));
+   float fz = CLAMP(-z * t->inv_step, 0.0f, (float) (t->depth - 1));
+
+   /* Find the quad we are in and our offsets into it */
+   int qx = (int) MIN(fx, (float) (t->width - 2));
+   int qz = (int) MIN(fz, (float) (t->depth - 2));
+   float u = fx - qx;
+   float v = fz - qz;
+
+   const TerTerrainPlane *p = &TER_TERRAIN_PLANE(t, qx, qz, u + v > 1.0f);
+   return p->h + p->dx * u + p->dz * v;
+}
+
+#if defined(__AVX2__)
+static unsigned
+terrain_get_heights_at_avx2(TerTerrain *t, const float *x, const float *z,
+                            float *h, unsigned count)
+{
+   const __m256 inv_step = _mm256_set1_ps(t->inv_step);
+   const __m256 neg_inv_step = _mm256_set1_ps(-t->inv_step);
+   const __m256 zero = _mm256_setzero_ps();
+   const __m256 one = _mm256_set1_ps(1.0f);
+   const __m256 max_fx = _mm256_set1_ps((float) (t->width - 1));
+   const __m256 max_fz = _mm256_set1_ps((float) (t->depth - 1));
+   const __m256 max_qx = _mm256_set1_ps((float) (t->width - 2));
+   const __m256 max_qz = _mm256_set1_ps((float) (t->depth - 2));
+   const __m256i quads_d = _mm256_set1_epi32(t->depth - 1);
+   const float *planes = (const float *) t->planes;
+
+   unsigned i;
+   for (i = 0; i + 8 <= count; i += 8) {
+      __m256 fx = _mm256_mul_ps(_mm256_loadu_ps(x + i), inv_step);
+      __m256 fz = _mm256_mul_ps(_mm256_loadu_ps(z + i), neg_inv_step);
+      fx = _mm256_min_ps(_mm256_max_ps(fx, zero), max_fx);
+      fz = _mm256_min_ps(_mm256_max_ps(fz, zero), max_fz);
+
+      __m256i qx = _mm256_cvttps_epi32(_mm256_min_ps(fx, max_qx));
+      __m256i qz = _mm256_cvttps_epi32(_mm256_min_ps(fz, max_qz));
+      __m256 u = _mm256_sub_ps(fx, _mm256_cvtepi32_ps(qx));
+      __m256 v = _mm256_sub_ps(fz, _mm256_cvtepi32_ps(qz));
+
+      /* The comparison yields -1 for the second triangle */
+      __m256i tri = _mm256_castps_si256(
+         _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_GT_OQ));
+
+      /* Plane index times 2, so we can gather with a scale of 8 bytes
+       * without overflowing 32-bit offsets for large terrains.
+       */
+      __m256i idx = _mm256_add_epi32(_mm256_mullo_epi32(qx, quads_d), qz);
+      idx = _mm256_slli_epi32(_mm256_sub_epi32(_mm256_add_epi32(idx, idx), tri),
+                              1);
+
+      __m256 ph = _mm256_i32gather_ps(planes + 0, idx, 8);
+      __m256 pdx = _mm256_i32gather_ps(planes + 1, idx, 8);
+      __m256 pdz = _mm256_i32gather_ps(planes + 2, idx, 8);
+
+      __m256 r = _mm256_add_ps(ph, _mm256_add_ps(_mm256_mul_ps(pdx, u),
+                                                 _mm256_mul_ps(pdz, v)));
+      _mm256_storeu_ps(h + i, r);
+   }
+
+   return i;
+}
+#endif
+
+#if defined(__SSE2__)
+static unsigned
+terrain_get_heights_at_sse2(TerTerrain *t, const float *x, const float *z,
+                            float *h, unsigned count)
+{
+   const __m128 inv_step = _mm_set1_ps(t->inv_step);
+   const __m128 neg_inv_step = _mm_set1_ps(-t->inv_step);
+   const __m128 zero = _mm_setzero_ps();
+   const __m128 one = _mm_set1_ps(1.0f);
+   const __m128 max_fx = _mm_set1_ps((float) (t->width - 1));
+   const __m128 max_fz = _mm_set1_ps((float) (t->depth - 1));
+   const __m128 max_qx = _mm_set1_ps((float) (t->width - 2));
+   const __m128 max_qz = _mm_set1_ps((float) (t->depth - 2));
+   int qx_lanes[4] __attribute__ ((aligned (16)));
+   int qz_lanes[4] __attribute__ ((aligned (16)));
+   int tri_mask;
+
+   unsigned i;
+   for (i = 0; i + 4 <= count; i += 4) {
+      __m128 fx = _mm_mul_ps(_mm_loadu_ps(x + i), inv_step);
+      __m128 fz = _mm_mul_ps(_mm_loadu_ps(z + i), neg_inv_step);
+      fx = _mm_min_ps(_mm_max_ps(fx, zero), max_fx);
+      fz = _mm_min_ps(_mm_max_ps(fz, zero), max_fz);
+
+      __m128i qx = _mm_cvttps_epi32(_mm_min_ps(fx, max_qx));
+      __m128i qz = _mm_cvttps_epi32(_mm_min_ps(fz, max_qz));
+      __m128 u = _mm_sub_ps(fx, _mm_cvtepi32_ps(qx));
+      __m128 v = _mm_sub_ps(fz, _mm_cvtepi32_ps(qz));
+      tri_mask = _mm_movemask_ps(_mm_cmpgt_ps(_mm_add_ps(u, v), one));
+
+      /* SSE2 has no 32-bit integer multiply or gather, so we fetch the
+       * planes with scalar loads and transpose them into h, dx and dz
+       * vectors.
+       */
+      _mm_store_si128((__m128i *) qx_lanes, qx);
+      _mm_store_si128((__m128i *) qz_lanes, qz);
+
+      __m128 p0 = _mm_loadu_ps((const float *)
+         &TER_TERRAIN_PLANE(t, qx_lanes[0], qz_lanes[0], (tri_mask >> 0) & 1));
+      __m128 p1 = _mm_loadu_ps((const float *)
+         &TER_TERRAIN_PLANE(t, qx_lanes[1], qz_lanes[1], (tri_mask >> 1) & 1));
+      __m128 p2 = _mm_loadu_ps((const float *)
+         &TER_TERRAIN_PLANE(t, qx_lanes[2], qz_lanes[2], (tri_mask >> 2) & 1));
+      __m128 p3 = _mm_loadu_ps((const float *)
+         &TER_TERRAIN_PLANE(t, qx_lanes[3], qz_lanes[3], (tri_mask >> 3) & 1));
+      _MM_TRANSPOSE4_PS(p0, p1, p2, p3);
+
+      __m128 r = _mm_add_ps(p0, _mm_add_ps(_mm_mul_ps(p1, u),
+                                           _mm_mul_ps(p2, v)));
+      _mm_storeu_ps(h + i, r);
+   }
+
+   return i;
+}
+#endif
+
+/*
+ * Batched version of ter_terrain_get_height_at(). Computes the terrain height
+ * at each (x[i], z[i]) and stores it in h[i].
+ *
+ * Uses AVX2 when the build targets it (-mavx2) and SSE2 otherwise, with any
+ * remaining queries handled by the scalar path.
+ */
+void
+ter_terrain_get_heights_at(TerTerrain *t, const float *x, const float *z,
+                           float *h, unsigned count)
+{
+   unsigned i = 0;
+
+   if (t->hf) {
+      for (; i < count; i++)
+         h[i] = terrain_get_streamed_height_at(t, x[i], z[i]);
+      return;
+   }
+
+   terrain_ensure_planes(t);
+
+#if defined(__AVX2__)
+   i = terrain_get_heights_at_avx2(t, x, z, h, count);
+#elif defined(__SSE2__)
+   i = terrain_get_heights_at_sse2(t, x, z, h, count);
+#endif
+
+   for (; i < count; i++)
+      h[i] = ter_terrain_get_height_at(t, x[i], z[i]);
+}
+
+static inline unsigned
+terrain_log2(unsigned n)
+{
+   unsigned l = 0;
+   while ((1u << (l + 1)) <= n)
+      l++;
+   return l;
+}
+
+static inline float
+terrain_get_sample(TerTerrain *t, int x, int z)
+{
+   return t->hf ? ter_heightfield_get_sample(t->hf, x, z) : TERRAIN(t, x, z);
+}
+
+/*
+ * Sets up the levels of the height pyramid. In-memory terrains store all
+ * levels but the first. Streamed terrains start at the level of the
+ * heightfield chunks, since we don't want to page in the whole file.
+ */
+static void
+terrain_pyramid_init(TerTerrain *t)
+{
+   TerTerrainPyramid *p = &t->pyramid;
+   unsigned first_level =
+      t->hf ? terrain_log2(t->hf->header.chunk_size) : 1;
+
+   int nodes_x = t->width - 1;
+   int nodes_z = t->depth - 1;
+   unsigned l = 0;
+   do {
+      assert(l < TER_TERRAIN_PYRAMID_MAX_LEVELS);
+      TerTerrainPyramidLevel *level = &p->level[l];
+      level->nodes_x = nodes_x;
+      level->nodes_z = nodes_z;
+      if (l >= first_level) {
+         level->min_height = g_new(float, nodes_x * nodes_z);
+         level->max_height = g_new(float, nodes_x * nodes_z);
+      }
+
+      nodes_x = (nodes_x + 1) / 2;
+      nodes_z = (nodes_z + 1) / 2;
+      l++;
+   } while (l <= first_level ||
+            p->level[l - 1].nodes_x > 1 || p->level[l - 1].nodes_z > 1);
+
+   p->num_levels = l;
+}
+
+/*
+ * Updates the pyramid nodes that cover the quads in [x0, x1) x [z0, z1).
+ */
+static void
+terrain_pyramid_update(TerTerrain *t, int x0, int z0, int x1, int z1)
+{
+   TerTerrainPyramid *p = &t->pyramid;
+
+   for (unsigned l = 1; l < p->num_levels; l++) {
+      TerTerrainPyramidLevel *level = &p->level[l];
+      if (!level->min_height)
+         continue;
+
+      TerTerrainPyramidLevel *child = &p->level[l - 1];
+      int size = 1 << l;
+      for (int nx = x0 >> l; nx <= (x1 - 1) >> l; nx++) {
+         for (int nz = z0 >> l; nz <= (z1 - 1) >> l; nz++) {
+            float min_h = FLT_MAX, max_h = -FLT_MAX;
+            if (child->min_height) {
+               for (int cx = 2 * nx; cx < MIN(2 * nx + 2, child->nodes_x); cx++) {
+                  for (int cz = 2 * nz; cz < MIN(2 * nz + 2, child->nodes_z); cz++) {
+                     unsigned c = cx * child->nodes_z + cz;
+                     min_h = MIN(min_h, child->min_height[c]);
+                     max_h = MAX(max_h, child->max_height[c]);
+                  }
+               }
+            } else if (t->hf) {
+               /* Precomputed by the heightfield, chunk size matches */
+               ter_heightfield_get_chunk_bounds(t->hf, nx, nz, &min_h, &max_h);
+            } else {
+               int sx1 = MIN((nx + 1) * size, t->width - 1);
+               int sz1 = MIN((nz + 1) * size, t->depth - 1);
+               for (int x = nx * size; x <= sx1; x++) {
+                  for (int z = nz * size; z <= sz1; z++) {
+                     min_h = MIN(min_h, TERRAIN(t, x, z));
+                     max_h = MAX(max_h, TERRAIN(t, x, z));
+                  }
+               }
+            }
+            level->min_height[nx * level->nodes_z + nz] = min_h;
+            level->max_height[nx * level->nodes_z + nz] = max_h;
+         }
+      }
+   }
+}
+
+static inline void
+terrain_ensure_pyramid(TerTerrain *t)
+{
+   if (t->pyramid_dirty) {
+      if (t->pyramid.num_levels == 0)
+         terrain_pyramid_init(t);
+      terrain_pyramid_update(t, 0, 0, t->width - 1, t->depth - 1);
+      t->pyramid_dirty = false;
+   }
+}
+
+/*
+ * Returns the pyramid level with nodes of 2^l quads per side. Levels above
+ * the top of the pyramid are the same as the top level (a single node).
+ */
+static inline const TerTerrainPyramidLevel *
+terrain_pyramid_level(TerTerrain *t, unsigned l)
+{
+   return &t->pyramid.level[MIN(l, t->pyramid.num_levels - 1)];
+}
+
+/*
+ * Ray-casting works in grid space: X and Z are measured in quads (with Z
+ * growing with the sample index) and Y is unchanged. This is a linear
+ * transform so the ray parameter is the same in both spaces.
+ */
+typedef struct {
+   glm::vec3 o;
+   glm::vec3 d;
+} TerrainRay;
+
+typedef struct {
+   unsigned level;
+   int nx, nz;
+   float t0, t1;
+} TerrainRayNode;
+
+/* Small margin for the node boxes so rays that go exactly through node
+ * corners don't slip between them due to rounding.
+ */
+#define TERRAIN_RAY_EPSILON 1e-4f
+
+/*
+ * Clips the ray interval [t0, t1] to the slab [lo, hi] in one axis.
+ */
+static inline bool
+terrain_ray_clip_slab(float o, float d, float lo, float hi,
+                      float *t0, float *t1)
+{
+   if (d == 0.0f)
+      return o >= lo && o <= hi;
+
+   float inv_d = 1.0f / d;
+   float ta = (lo - o) * inv_d;
+   float tb = (hi - o) * inv_d;
+   *t0 = MAX(*t0, MIN(ta, tb));
+   *t1 = MIN(*t1, MAX(ta, tb));
+   return *t0 <= *t1;
+}
+
+static inline bool
+terrain_ray_clip_node(TerTerrain *t, const TerrainRay *r,
+                      TerrainRayNode *node)
+{
+   int size = 1 << node->level;
+   float x0 = node->nx * size - TERRAIN_RAY_EPSILON;
+   float z0 = node->nz * size - TERRAIN_RAY_EPSILON;
+   float x1 = MIN((node->nx + 1) * size, t->width - 1) + TERRAIN_RAY_EPSILON;
+   float z1 = MIN((node->nz + 1) * size, t->depth - 1) + TERRAIN_RAY_EPSILON;
+   return terrain_ray_clip_slab(r->o.x, r->d.x, x0, x1, &node->t0, &node->t1) &&
+          terrain_ray_clip_slab(r->o.z, r->d.z, z0, z1, &node->t0, &node->t1);
+}
+
+/*
+ * Finds the first intersection of the ray with a terrain triangle in
+ * [t0, t1], where the ray is above a plane at t0 and below it at the hit.
+ */
+static inline bool
+terrain_ray_hit_plane(const TerrainRay *r, const TerTerrainPlane *p,
+                      float ou, float ov, float t0, float t1, float *hit)
+{
+   float f0 = r->o.y + r->d.y * t0 -
+              (p->h + p->dx * (ou + r->d.x * t0) + p->dz * (ov + r->d.z * t0));
+   if (f0 <= 0.0f) {
+      *hit = t0;
+      return true;
+   }
+
+   float f1 = r->o.y + r->d.y * t1 -
+              (p->h + p->dx * (ou + r->d.x * t1) + p->dz * (ov + r->d.z * t1));
+   if (f1 <= 0.0f) {
+      *hit = t0 + (t1 - t0) * f0 / (f0 - f1);
+      return true;
+   }
+
+   return false;
+}
+
+/*
+ * Intersects the ray with the two triangles of quad (qx, qz), which the ray
+ * crosses in [t0, t1].
+ */
+static bool
+terrain_ray_hit_quad(TerTerrain *t, const TerrainRay *r, int qx, int qz,
+                     float t0, float t1, float *hit)
+{
+   TerTerrainPlane p[2];
+   if (t->hf) {
+      terrain_compute_quad_planes(terrain_get_sample(t, qx, qz),
+                                  terrain_get_sample(t, qx + 1, qz),
+                                  terrain_get_sample(t, qx, qz + 1),
+                                  terrain_get_sample(t, qx + 1, qz + 1),
+                                  &p[0], &p[1]);
+   } else {
+      p[0] = TER_TERRAIN_PLANE(t, qx, qz, 0);
+      p[1] = TER_TERRAIN_PLANE(t, qx, qz, 1);
+   }
+
+   /* Split the interval where the ray crosses the quad diagonal (u + v = 1) */
+   float ou = r->o.x - qx;
+   float ov = r->o.z - qz;
+   float ds = r->d.x + r->d.z;
+   float tm = t1;
+   if (ds != 0.0f)
+      tm = CLAMP((1.0f - ou - ov) / ds, t0, t1);
+
+   float tc = 0.5f * (t0 + tm);
+   unsigned first = ou + ov + ds * tc > 1.0f;
+   if (terrain_ray_hit_plane(r, &p[first], ou, ov, t0, tm, hit))
+      return true;
+   return tm < t1 &&
+          terrain_ray_hit_plane(r, &p[1 - first], ou, ov, tm, t1, hit);
+}
+
+static bool
+terrain_raycast(TerTerrain *t, glm::vec3 origin, glm::vec3 dir,
+                float max_dist, float *hit_dist)
+{
+   TerrainRay r;
+   r.o = glm::vec3(origin.x * t->inv_step, origin.y, -origin.z * t->inv_step);
+   r.d = glm::vec3(dir.x * t->inv_step, dir.y, -dir.z * t->inv_step);
+
+   /* Each node replaces itself with at most 4 children */
+   TerrainRayNode stack[3 * TER_TERRAIN_PYRAMID_MAX_LEVELS + 1];
+   unsigned sp = 0;
+
+   TerrainRayNode *root = &stack[sp++];
+   root->level = t->pyramid.num_levels - 1;
+   root->nx = 0;
+   root->nz = 0;
+   root->t0 = 0.0f;
+   root->t1 = max_dist;
+   if (!terrain_ray_clip_node(t, &r, root))
+      return false;
+
+   /* Visit the children that are closer to the ray origin first */
+   int sx = r.d.x < 0.0f;
+   int sz = r.d.z < 0.0f;
+
+   while (sp > 0) {
+      TerrainRayNode node = stack[--sp];
+
+      if (node.level == 0) {
+         if (terrain_ray_hit_quad(t, &r, node.nx, node.nz,
+                                  node.t0, node.t1, hit_dist))
+            return true;
+         continue;
+      }
+
+      const TerTerrainPyramidLevel *level = &t->pyramid.level[node.level];
+      if (level->min_height) {
+         unsigned n = node.nx * level->nodes_z + node.nz;
+         float y0 = r.o.y + r.d.y * node.t0;
+         float y1 = r.o.y + r.d.y * node.t1;
+
+         /* The ray passes over everything in this node */
+         if (MIN(y0, y1) > level->max_height[n])
+            continue;
+
+         /* The ray is under everything in this node. Since we go front to
+          * back, this can only happen if the ray starts under the terrain.
+          */
+         if (MAX(y0, y1) < level->min_height[n]) {
+            *hit_dist = node.t0;
+            return true;
+         }
+      }
+
+      const TerTerrainPyramidLevel *child_level =
+         &t->pyramid.level[node.level - 1];
+      /* Push the far child first so the near one is popped first */
+      static const int order[4][2] = { {1, 1}, {1, 0}, {0, 1}, {0, 0} };
+      for (int i = 0; i < 4; i++) {
+         TerrainRayNode child;
+         child.level = node.level - 1;
+         child.nx = 2 * node.nx + (order[i][0] ^ sx);
+         child.nz = 2 * node.nz + (order[i][1] ^ sz);
+         if (child.nx >= child_level->nodes_x ||
+             child.nz >= child_level->nodes_z)
+            continue;
+
+         child.t0 = node.t0;
+         child.t1 = node.t1;
+         if (terrain_ray_clip_node(t, &r, &child))
+            stack[sp++] = child;
+      }
+   }
+
+   return false;
+}
+
+/*
+ * Casts a ray against the terrain. The ray starts at origin and extends up
+ * to max_dist times the length of dir. On a hit, hit_dist is the ray
+ * parameter at the hit point (origin + dir * hit_dist). Rays that start
+ * under the terrain hit it at their origin.
+ */
+bool
+ter_terrain_raycast(TerTerrain *t, glm::vec3 origin, glm::vec3 dir,
+                    float max_dist, float *hit_dist)
+{
+   if (!t->hf)
+      terrain_ensure_planes(t);
+   terrain_ensure_pyramid(t);
+   return terrain_raycast(t, origin, dir, max_dist, hit_dist);
+}
+
+typedef struct {
+   TerTerrain *t;
+   const glm::vec3 *origin;
+   const glm::vec3 *dir;
+   float max_dist;
+   float *hit_dist;
+} TerrainRaycastJob;
+
+static void
+terrain_raycast_range(void *data, unsigned start, unsigned end)
+{
+   TerrainRaycastJob *job = (TerrainRaycastJob *) data;
+   for (unsigned i = start; i < end; i++) {
+      if (!terrain_raycast(job->t, job->origin[i], job->dir[i], job->max_dist,
+                           &job->hit_dist[i]))
+         job->hit_dist[i] = -1.0f;
+   }
+}
+
+/*
+ * Batched version of ter_terrain_raycast(). Stores the hit distance of each
+ * ray in hit_dist[i], or -1.0 if the ray misses the terrain. Rays are split
+ * across the threads in the pool (if not NULL).
+ */
+void
+ter_terrain_raycast_batch(TerTerrain *t, TerThreadPool *pool,
+                          const glm::vec3 *origin, const glm::vec3 *dir,
+                          float max_dist, float *hit_dist, unsigned count)
+{
+   if (!t->hf)
+      terrain_ensure_planes(t);
+   terrain_ensure_pyramid(t);
+
+   TerrainRaycastJob job;
+   job.t = t;
+   job.origin = origin;
+   job.dir = dir;
+   job.max_dist = max_dist;
+   job.hit_dist = hit_dist;
+   ter_thread_pool_run(pool, terrain_raycast_range, &job, count, 256);
+}
+
+void
+ter_terrain_set_heights_from_texture(TerTerrain *t, int texture,
+                                     float offset, float scale)
+{
+   TerTextureManager *tex_mgr =
+      (TerTextureManager *) ter_cache_get("textures/manager");
+   
+   SDL_Surface *image = ter_texture_manager_get_image(tex_mgr, texture);
+
+   for (int x = 0; x < t->width; x++) {
+      for (int z = 0; z < t->depth; z++) {
+         float h = ter_heightfield_sample_image(image, t->width, t->depth,
+                                                x, z, offset, scale);
+         ter_terrain_set_height(t, x, z, h);
+      }
+   }
+
+   ter_terrain_update_region(t, 0, 0, t->width - 1, t->depth - 1);
+}
+
+static void
+compute_indices_for_clip_volume(TerTerrain *t, TerClipVolume *clip)
+{
+   int min_col = MAX(MIN(clip->x0 / t->step, t->width - 2), 0);
+   int max_col = MAX(MIN((clip->x1 + t->step) / t->step, t->width - 2), 0);
+
+   /* Z1 is always largest, because our terrain grows towrds -Z, it means that
+    * it defines the min_row
+    */
+   int min_row = MAX(MIN(-clip->z1 / t->step, t->depth - 1), 0);
+   int max_row = MAX(MIN(- (clip->z0 - t->step) / t->step, t->depth - 1), 0);
+
+   /* If this happens then the terrain is not visible */
+   if (min_col == max_col || min_row == max_row) {
+      t->num_indices = 0;
+      return;
+   }
+
+   unsigned index = 0;
+   for (int c = min_col; c <= max_col; c++) {
+      for (int r = min_row; r <= max_row; r++) {
+         /* If this is not the first strip then we need to produce a degenerate
+          * link with the previous strip using the first vertex from this strip
+          * and the last vertex from the last before we start recording the
+          * new strip. Here is the first vertex of this strip.
+          */
+         if (c > min_col && r == min_row)
+            t->indices[index++] = c * t->depth + r;
+
+         t->indices[index++] = c * t->depth + r;
+         t->indices[index++] = (c + 1) * t->depth + r;
+
+         /* Link the next triangle strip using degenerate triangles. For that
+          * we need to duplicate the last vertex of this strip and the first
+          * vertex of the next.
+          */
+         if (r == max_row && c < max_col)
+            t->indices[index++] = (c + 1) * t->depth + r;
+      }
+   }
+
+   t->num_indices = index;
+}
+
+/* Primitive restart index for TER_TERRAIN_STATIC_INDICES */
+#define TERRAIN_RESTART_INDEX 0xffffffff
+
+/*
+ * Indices for TER_TERRAIN_STATIC_INDICES: one triangle strip per column of
+ * quads, each followed by a primitive restart index.
+ */
+static void
+terrain_build_static_indices(TerTerrain *t)
+{
+   unsigned indices_per_col = 2 * t->depth + 1;
+   t->num_indices = (t->width - 1) * indices_per_col;
+   t->indices = g_new(unsigned, t->num_indices);
+
+   unsigned index = 0;
+   for (int c = 0; c < t->width - 1; c++) {
+      for (int r = 0; r < t->depth; r++) {
+         t->indices[index++] = c * t->depth + r;
+         t->indices[index++] = (c + 1) * t->depth + r;
+      }
+      t->indices[index++] = TERRAIN_RESTART_INDEX;
+   }
+
+   /* Worst case for chunk culling is every other chunk of each column */
+   unsigned max_draws =
+      (t->width - 1) * ((t->depth - 2) / TER_TERRAIN_CHUNK_SIZE / 2 + 1);
+   t->draw_count = g_new(int, max_draws);
+   t->draw_offset = g_new(const void *, max_draws);
+}
+
+/* Culling parameters and statistics for one terrain selection pass */
+typedef struct {
+   TerClipVolume *clip;
+   const TerFrustum *frustums;
+   unsigned num_frustums;
+   unsigned num_culled;
+} TerrainCull;
+
+/*
+ * Returns true if the box is outside the clip volume or outside all the
+ * frustums (if any).
+ */
+static bool
+terrain_cull_box(TerrainCull *cull, const TerClipVolume *box)
+{
+   bool visible = ter_util_clip_volume_intersects(box, cull->clip);
+   if (visible && cull->num_frustums > 0) {
+      visible = false;
+      for (unsigned i = 0; i < cull->num_frustums && !visible; i++)
+         visible = ter_util_frustum_intersects_clip_volume(&cull->frustums[i], box);
+   }
+
+   if (!visible)
+      cull->num_culled++;
+   return !visible;
+}
+
+static inline void
+terrain_add_draw(TerTerrain *t, int col, int min_row, int max_row)
+{
+   unsigned indices_per_col = 2 * t->depth + 1;
+   t->draw_count[t->num_draws] = 2 * (max_row - min_row + 1);
+   t->draw_offset[t->num_draws] =
+      (const void *) ((col * indices_per_col + 2 * min_row) * sizeof(unsigned));
+   t->num_draws++;
+}
+
+/*
+ * Chunk culling for static indices: draws the rows of each column covered by
+ * consecutive visible chunks with a single range.
+ */
+static void
+compute_draws_for_chunks(TerTerrain *t, TerrainCull *cull,
+                         int min_col, int max_col, int min_row, int max_row)
+{
+   const int size = TER_TERRAIN_CHUNK_SIZE;
+   const TerTerrainPyramidLevel *bounds =
+      terrain_pyramid_level(t, terrain_log2(TER_TERRAIN_CHUNK_SIZE));
+   unsigned num_visible = 0;
+
+   for (int cx = min_col / size; cx <= max_col / size; cx++) {
+      int c0 = MAX(cx * size, min_col);
+      int c1 = MIN((cx + 1) * size - 1, max_col);
+
+      int run_start = -1;
+      for (int cz = min_row / size; cz <= max_row / size + 1; cz++) {
+         bool visible = false;
+         if (cz * size < max_row && cz < bounds->nodes_z) {
+            TerClipVolume box;
+            box.x0 = cx * size * t->step;
+            box.x1 = MIN((cx + 1) * size, t->width - 1) * t->step;
+            box.z0 = -MIN((cz + 1) * size, t->depth - 1) * t->step;
+            box.z1 = -cz * size * t->step;
+            box.y0 = bounds->min_height[cx * bounds->nodes_z + cz];
+            box.y1 = bounds->max_height[cx * bounds->nodes_z + cz];
+            visible = !terrain_cull_box(cull, &box);
+         }
+
+         if (visible) {
+            num_visible++;
+            if (run_start < 0)
+               run_start = cz;
+         } else if (run_start >= 0) {
+            int r0 = MAX(run_start * size, min_row);
+            int r1 = MIN(cz * size, max_row);
+            for (int c = c0; c <= c1; c++)
+               terrain_add_draw(t, c, r0, r1);
+            run_start = -1;
+         }
+      }
+   }
+
+   ter_dbg(LOG_RENDER,
+           "TERRAIN: RENDER: INFO: Drawing %u chunks, culled %u chunks "
+           "(%u draws)\n", num_visible, cull->num_culled, t->num_draws);
+}
+
+/*
+ * Selects the ranges of the static index buffer to draw for the clip volume.
+ * If we need full columns, we draw all of them in one go, otherwise we draw
+ * the visible range of rows of each column.
+ */
+static void
+compute_draws_for_clip_volume(TerTerrain *t, TerrainCull *cull)
+{
+   TerClipVolume *clip = cull->clip;
+
+   /* Same as compute_indices_for_clip_volume() */
+   int min_col = MAX(MIN(clip->x0 / t->step, t->width - 2), 0);
+   int max_col = MAX(MIN((clip->x1 + t->step) / t->step, t->width - 2), 0);
+   int min_row = MAX(MIN(-clip->z1 / t->step, t->depth - 1), 0);
+   int max_row = MAX(MIN(- (clip->z0 - t->step) / t->step, t->depth - 1), 0);
+
+   t->num_draws = 0;
+   if (min_col == max_col || min_row == max_row)
+      return;
+
+   if (TER_TERRAIN_ENABLE_CHUNK_CULLING && cull->num_frustums > 0) {
+      terrain_ensure_pyramid(t);
+      compute_draws_for_chunks(t, cull, min_col, max_col, min_row, max_row);
+      return;
+   }
+
+   unsigned indices_per_col = 2 * t->depth + 1;
+   if (min_row == 0 && max_row == t->depth - 1) {
+      t->draw_count[0] = (max_col - min_col + 1) * indices_per_col - 1;
+      t->draw_offset[0] =
+         (const void *) (min_col * indices_per_col * sizeof(unsigned));
+      t->num_draws = 1;
+      return;
+   }
+
+   for (int c = min_col; c <= max_col; c++)
+      terrain_add_draw(t, c, min_row, max_row);
+}
+
+/*
+ * Sets up the quadtree levels. Node bounds come from the height pyramid, the
+ * smallest chunks match the pyramid level with nodes of the same size.
+ */
+static void
+terrain_lod_build_levels(TerTerrain *t)
+{
+   TerTerrainLod *lod = &t->lod;
+
+   terrain_ensure_pyramid(t);
+   unsigned first_level = terrain_log2(TER_TERRAIN_LOD_CHUNK_SIZE);
+
+   for (unsigned l = 0; l < lod->num_levels; l++) {
+      TerTerrainLodLevel *level = &lod->level[l];
+      const TerTerrainPyramidLevel *bounds =
+         terrain_pyramid_level(t, first_level + l);
+      level->node_size = TER_TERRAIN_LOD_CHUNK_SIZE << l;
+      level->nodes_x = bounds->nodes_x;
+      level->nodes_z = bounds->nodes_z;
+      level->min_height = bounds->min_height;
+      level->max_height = bounds->max_height;
+   }
+}
+
+static void
+terrain_lod_build(TerTerrain *t)
+{
+   TerTerrainLod *lod = &t->lod;
+
+   assert(TER_TERRAIN_LOD_TILE_SIZE > TER_TERRAIN_LOD_CHUNK_SIZE);
+   lod->num_levels = 1;
+   while ((TER_TERRAIN_LOD_CHUNK_SIZE << (lod->num_levels - 1)) <
+          TER_TERRAIN_LOD_TILE_SIZE) {
+      lod->num_levels++;
+   }
+   assert(lod->num_levels <= TER_TERRAIN_LOD_MAX_LEVELS);
+   assert((TER_TERRAIN_LOD_CHUNK_SIZE << (lod->num_levels - 1)) ==
+          TER_TERRAIN_LOD_TILE_SIZE);
+
+   lod->tiles_x = (t->width - 2) / TER_TERRAIN_LOD_TILE_SIZE + 1;
+   lod->tiles_z = (t->depth - 2) / TER_TERRAIN_LOD_TILE_SIZE + 1;
+
+   /* Each level covers twice the distance of the previous one and vertices
+    * start morphing into the next level at a fraction of that range, so that
+    * they are fully morphed by the time the next level takes over. The least
+    * detailed level covers everything and never morphs.
+    */
+   float prev_range = 0.0f;
+   for (unsigned l = 0; l < lod->num_levels; l++) {
+      if (l == lod->num_levels - 1) {
+         lod->range[l] = FLT_MAX;
+         lod->morph[l] = glm::vec2(FLT_MAX, 0.0f);
+      } else {
+         lod->range[l] = TER_TERRAIN_LOD_DISTANCE * (1 << l);
+         float start =
+            prev_range + (lod->range[l] - prev_range) * TER_TERRAIN_LOD_MORPH_RATIO;
+         lod->morph[l] = glm::vec2(start, 1.0f / (lod->range[l] - start));
+         prev_range = lod->range[l];
+      }
+   }
+   for (unsigned l = lod->num_levels; l < TER_TERRAIN_LOD_MAX_LEVELS; l++)
+      lod->morph[l] = glm::vec2(FLT_MAX, 0.0f);
+
+   terrain_lod_build_levels(t);
+
+   lod->num_chunks = 0;
+}
+
+/*
+ * Octahedral normal encoding: projects the normal onto the octahedron
+ * |x| + |y| + |z| = 1 and folds the lower half (y < 0) over the upper half,
+ * so it can be stored as its (x, z) coordinates.
+ */
+static void
+terrain_encode_normal(const glm::vec3 &n, int16_t *out)
+{
+   float l1 = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+   float x = n.x / l1;
+   float z = n.z / l1;
+   if (n.y < 0.0f) {
+      float fx = (1.0f - fabsf(z)) * (x >= 0.0f ? 1.0f : -1.0f);
+      float fz = (1.0f - fabsf(x)) * (z >= 0.0f ? 1.0f : -1.0f);
+      x = fx;
+      z = fz;
+   }
+   out[0] = (int16_t) roundf(CLAMP(x, -1.0f, 1.0f) * 32767.0f);
+   out[1] = (int16_t) roundf(CLAMP(z, -1.0f, 1.0f) * 32767.0f);
+}
+
+static inline uint16_t
+terrain_quantize_height(TerTerrain *t, float h, float inv_scale)
+{
+   h = (h - t->height_bias) * inv_scale;
+   return (uint16_t) roundf(CLAMP(h, 0.0f, 65535.0f));
+}
+
+/*
+ * Encodes the vertex for sample (x, z). Normals are computed from the central
+ * differences of the heights around the vertex, using the nearest inner
+ * sample for vertices at the edges of the terrain.
+ */
+static inline void
+terrain_encode_vertex(TerTerrain *t, int x, int z, float inv_scale,
+                      TerTerrainVertex *v)
+{
+   int nx = CLAMP(x, 1, t->width - 2);
+   int nz = CLAMP(z, 1, t->depth - 2);
+
+   v->height = terrain_quantize_height(t, TERRAIN(t, x, z), inv_scale);
+   v->pad = 0;
+
+   /* Terrain expands towards -Z */
+   glm::vec3 n = glm::vec3(TERRAIN(t, nx - 1, nz) - TERRAIN(t, nx + 1, nz),
+                           2.0f,
+                           TERRAIN(t, nx, nz + 1) - TERRAIN(t, nx, nz - 1));
+   terrain_encode_normal(n, v->normal);
+}
+
+#if defined(__SSE2__)
+/*
+ * Encodes vertices (x, z0) to (x, z1) 4 at a time. All of them need to have
+ * inner samples on both sides in both axes.
+ *
+ * Terrain normals always point up, so we can skip the octahedral fold and
+ * also the normalization, since the encoding divides by the L1 norm anyway.
+ */
+static int
+terrain_encode_column_sse2(TerTerrain *t, int x, int z0, int z1,
+                           float inv_scale, TerTerrainVertex *out)
+{
+   const __m128 bias = _mm_set1_ps(t->height_bias);
+   const __m128 scale = _mm_set1_ps(inv_scale);
+   const __m128 zero = _mm_setzero_ps();
+   const __m128 max_height = _mm_set1_ps(65535.0f);
+   const __m128 two = _mm_set1_ps(2.0f);
+   const __m128 norm = _mm_set1_ps(32767.0f);
+   const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+   const __m128i u16_bias = _mm_set1_epi32(32768);
+   const __m128i u16_flip = _mm_set1_epi16((short) 0x8000);
+
+   const float *hc = &TERRAIN(t, x, 0);
+   const float *hl = &TERRAIN(t, x - 1, 0);
+   const float *hr = &TERRAIN(t, x + 1, 0);
+
+   int z;
+   for (z = z0; z + 4 <= z1; z += 4) {
+      __m128 h = _mm_loadu_ps(hc + z);
+      __m128 dx = _mm_sub_ps(_mm_loadu_ps(hl + z), _mm_loadu_ps(hr + z));
+      __m128 dz = _mm_sub_ps(_mm_loadu_ps(hc + z + 1), _mm_loadu_ps(hc + z - 1));
+
+      /* Heights: SSE2 can only pack to signed 16-bit, so shift the range */
+      h = _mm_mul_ps(_mm_sub_ps(h, bias), scale);
+      h = _mm_min_ps(_mm_max_ps(h, zero), max_height);
+      __m128i hq = _mm_sub_epi32(_mm_cvtps_epi32(h), u16_bias);
+      hq = _mm_xor_si128(_mm_packs_epi32(hq, hq), u16_flip);
+
+      /* Normals */
+      __m128 l1 = _mm_add_ps(_mm_add_ps(_mm_and_ps(dx, abs_mask), two),
+                             _mm_and_ps(dz, abs_mask));
+      __m128 inv_l1 = _mm_div_ps(norm, l1);
+      __m128i nq = _mm_packs_epi32(_mm_cvtps_epi32(_mm_mul_ps(dx, inv_l1)),
+                                   _mm_cvtps_epi32(_mm_mul_ps(dz, inv_l1)));
+      nq = _mm_unpacklo_epi16(nq, _mm_unpackhi_epi64(nq, nq));
+
+      /* Interleave into (height, pad, normal x, normal z) */
+      hq = _mm_unpacklo_epi16(hq, _mm_setzero_si128());
+      _mm_storeu_si128((__m128i *) &out[z], _mm_unpacklo_epi32(hq, nq));
+      _mm_storeu_si128((__m128i *) &out[z + 2], _mm_unpackhi_epi32(hq, nq));
+   }
+
+   return z;
+}
+#endif
+
+typedef struct {
+   TerTerrain *t;
+   float inv_scale;
+   float *min_height;         /* Per column */
+   float *max_height;
+} TerrainBuildJob;
+
+static void
+terrain_build_height_range(void *data, unsigned start, unsigned end)
+{
+   TerrainBuildJob *job = (TerrainBuildJob *) data;
+   TerTerrain *t = job->t;
+
+   for (unsigned x = start; x < end; x++) {
+      const float *h = &TERRAIN(t, x, 0);
+      float min_h = h[0], max_h = h[0];
+      for (int z = 1; z < t->depth; z++) {
+         min_h = MIN(min_h, h[z]);
+         max_h = MAX(max_h, h[z]);
+      }
+      job->min_height[x] = min_h;
+      job->max_height[x] = max_h;
+   }
+}
+
+static void
+terrain_build_vertex_columns(void *data, unsigned start, unsigned end)
+{
+   TerrainBuildJob *job = (TerrainBuildJob *) data;
+   TerTerrain *t = job->t;
+
+   for (unsigned x = start; x < end; x++) {
+      TerTerrainVertex *out = &t->vertices[x * t->depth];
+      int z = 0;
+#if defined(__SSE2__)
+      if (x > 0 && (int) x < t->width - 1) {
+         terrain_encode_vertex(t, x, 0, job->inv_scale, &out[0]);
+         z = terrain_encode_column_sse2(t, x, 1, t->depth - 1,
+                                        job->inv_scale, out);
+      }
+#endif
+      for (; z < t->depth; z++)
+         terrain_encode_vertex(t, x, z, job->inv_scale, &out[z]);
+   }
+}
+
+/*
+ * Builds the vertex buffer data for the terrain grid (see TerTerrainVertex),
+ * splitting the grid into bands of columns processed by the thread pool
+ * (or by the calling thread if pool is NULL).
+ */
+void
+ter_terrain_build_vertices(TerTerrain *t, TerThreadPool *pool)
+{
+   assert(t->width >= 3 && t->depth >= 3);
+
+   TerrainBuildJob job;
+   job.t = t;
+   job.min_height = g_new(float, t->width);
+   job.max_height = g_new(float, t->width);
+
+   /* Aim for tasks of about 64K vertices */
+   unsigned grain = MAX(1, (64 * 1024) / t->depth);
+
+   /* Heights are quantized to the range of the terrain */
+   ter_thread_pool_run(pool, terrain_build_height_range, &job,
+                       t->width, grain);
+   float min_h = FLT_MAX, max_h = -FLT_MAX;
+   for (int x = 0; x < t->width; x++) {
+      min_h = MIN(min_h, job.min_height[x]);
+      max_h = MAX(max_h, job.max_height[x]);
+   }
+   /* Leave room for runtime edits, see ter_terrain_update_region() */
+   float margin = (max_h - min_h) * TER_TERRAIN_EDIT_HEIGHT_MARGIN;
+   t->height_bias = min_h - margin;
+   t->height_scale = max_h > min_h ? max_h - min_h + 2.0f * margin : 1.0f;
+   job.inv_scale = 65535.0f / t->height_scale;
+
+   if (!t->vertices)
+      t->vertices = g_new(TerTerrainVertex, t->width * t->depth);
+   ter_thread_pool_run(pool, terrain_build_vertex_columns, &job,
+                       t->width, grain);
+
+   g_free(job.min_height);
+   g_free(job.max_height);
+}
+
+void
+ter_terrain_build_mesh(TerTerrain *t)
+{
+   if (TER_TERRAIN_LOD_ENABLE) {
+      terrain_lod_build(t);
+      return;
+   }
+
+   assert(!t->hf);
+
+   int vertices_w = t->width;
+   int vertices_d = t->depth;
+
+   /* Add each vertex in the grid. We are going to render using an index buffer
+    * so we don't need to duplicate vertices, which reduces massively the
+    * storage requirements for the vertex data, since terrains have high
+    * vertex counts.
+    */
+   ter_terrain_build_vertices(t,
+                              (TerThreadPool *) ter_cache_get("threads/pool"));
+
+   TerClipVolume clip;
+   clip.x0 = 0.0f;
+   clip.x1 = (t->width - 1) * t->step;
+   clip.z1 = 0.0f;
+   clip.z0 = -(t->depth - 1) * t->step;
+
+   if (TER_TERRAIN_STATIC_INDICES) {
+      terrain_build_static_indices(t);
+      if (TER_TERRAIN_ENABLE_CHUNK_CULLING)
+         terrain_ensure_pyramid(t);
+
+      TerrainCull cull = { &clip, NULL, 0, 0 };
+      compute_draws_for_clip_volume(t, &cull);
+      return;
+   }
+
+   /* Build the indices to render the terrain using a single triangle strip
+    * (using degenerate triangles) since that yields much better performance
+    * than rendering triangles.
+    */
+   unsigned num_indices =
+      (vertices_w - 1) * (vertices_d * 2) + (vertices_w - 2) + (vertices_d - 2);
+   t->indices = g_new0(unsigned, num_indices);
+   t->max_indices = num_indices;
+
+   /* Initialize the number of rendering indices so it covers the entire
+    * terrain.
+    */
+   compute_indices_for_clip_volume(t, &clip);
+
+   assert(num_indices == t->num_indices);
+}
+
+static void
+terrain_unbind()
+{
+   glBindTexture(GL_TEXTURE_2D, 0);
+   glDisableVertexAttribArray(0);
+   glDisableVertexAttribArray(1);
+   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+   glBindVertexArray(0);
+}
+
+static void
+terrain_bind_vao(TerTerrain *t)
+{
+   if (t->vao == 0) {
+      /* See TerTerrainVertex. We don't need the vertex data after the
+       * upload.
+       */
+      unsigned vertex_count = t->width * t->depth;
+      unsigned vertex_byte_size = sizeof(TerTerrainVertex);
+      unsigned bytes = vertex_count * vertex_byte_size;
+
+      /* Create vertex buffer and upload data to it */
+      glGenBuffers(1, &t->vertex_buf);
+      glBindBuffer(GL_ARRAY_BUFFER, t->vertex_buf);
+      glBufferData(GL_ARRAY_BUFFER, bytes, t->vertices, GL_STATIC_DRAW);
+      g_free(t->vertices);
+      t->vertices = NULL;
+
+      /* Upload the indices of the whole grid. Without static indices, this
+       * is what we draw until we select a clip volume, whose indices are
+       * streamed. Either way we don't need to keep them around.
+       */
+      unsigned index_bytes = t->num_indices * sizeof(unsigned);
+      glGenBuffers(1, &t->index_buf);
+      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, t->index_buf);
+      glBufferData(GL_ELEMENT_ARRAY_BUFFER, index_bytes, t->indices,
+                   GL_STATIC_DRAW);
+      g_free(t->indices);
+      t->indices = NULL;
+      t->ibuf = t->index_buf;
+      t->ibuf_offset = 0;
+
+      glGenVertexArrays(1, &t->vao);
+      glBindVertexArray(t->vao);
+
+      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, t->ibuf);
+
+      glEnableVertexAttribArray(0);
+      glVertexAttribPointer(
+         0,                  // Attribute index
+         1,                  // size
+         GL_UNSIGNED_SHORT,  // type
+         GL_TRUE,            // normalized?
+         vertex_byte_size,   // stride
+         (void*)0            // array buffer offset
+      );
+
+      glEnableVertexAttribArray(1);
+      glVertexAttribPointer(
+         1,                  // Attribute index
+         2,                  // size
+         GL_SHORT,           // type
+         GL_TRUE,            // normalized?
+         vertex_byte_size,   // stride
+         (void*)offsetof(TerTerrainVertex, normal) // array buffer offset
+      );
+
+      ter_dbg(LOG_VBO,
+              "TERRAIN: VBO: INFO: Uploaded %u bytes (%u KB) "
+              "for %u vertices (%u bytes/vertex)\n",
+              bytes, bytes / 1024, vertex_count, vertex_byte_size);
+
+      unsigned num_indices = index_bytes / sizeof(int);
+      ter_dbg(LOG_VBO,
+              "TERRAIN: VBO: INFO: Uploaded %u bytes (%u KB) "
+              "for %u indices (%u bytes/index)\n",
+              index_bytes, index_bytes / 1024, num_indices, sizeof(int));
+   } else {
+      glBindVertexArray(t->vao);
+      glEnableVertexAttribArray(0);
+      glEnableVertexAttribArray(1);
+
+      /* Always bind the current index buffer explicitly: streamed indices
+       * change buffers, and it seems as if binding the VAO doesn't reliably
+       * bind the index buffer anyway. Maybe intel drivers are not storing
+       * the index buffer binding in the VAO state?
+       */
+      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, t->ibuf);
+   }
+}
+
+/*
+ * Uploads the height map as a texture array with one layer per terrain tile.
+ * Each layer includes a border of 1 sample on each side (replicating the
+ * terrain edges) so the vertex shader can compute normals and morph heights
+ * at the tile edges without sampling other layers.
+ *
+ * Streamed terrains only allocate TER_TERRAIN_STREAMING_GPU_TILES layers
+ * here, tiles are uploaded as they are loaded (see terrain_lod_stream_tiles).
+ */
+static void
+terrain_lod_upload_height_map(TerTerrain *t)
+{
+   TerTerrainLod *lod = &t->lod;
+   const int layer_size = TER_TERRAIN_LOD_TILE_SIZE + 3;
+   int num_tiles = lod->tiles_x * lod->tiles_z;
+
+   lod->num_layers =
+      t->hf ? MIN(num_tiles, TER_TERRAIN_STREAMING_GPU_TILES) : num_tiles;
+   lod->tile_layer = g_new(int, num_tiles);
+   lod->layer_tile = g_new(int, lod->num_layers);
+   for (int i = 0; i < num_tiles; i++)
+      lod->tile_layer[i] = t->hf ? -1 : i;
+   for (unsigned i = 0; i < lod->num_layers; i++)
+      lod->layer_tile[i] = t->hf ? -1 : i;
+
+   glGenTextures(1, &lod->height_tex);
+   glBindTexture(GL_TEXTURE_2D_ARRAY, lod->height_tex);
+   glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_R32F, layer_size, layer_size,
+                lod->num_layers, 0, GL_RED, GL_FLOAT, NULL);
+   glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+   glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+   glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+   glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+   if (t->hf) {
+      lod->tile_requested = g_new0(bool, num_tiles);
+      lod->layer_stamp = g_new0(unsigned, lod->num_layers);
+      glGenBuffers(1, &lod->upload_buf);
+      glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+      ter_dbg(LOG_VBO,
+              "TERRAIN: VBO: INFO: Allocated %u height map layers "
+              "for %d streamed tiles\n", lod->num_layers, num_tiles);
+      return;
+   }
+
+   float *data = g_new(float, layer_size * layer_size);
+   for (int tx = 0; tx < lod->tiles_x; tx++) {
+      for (int tz = 0; tz < lod->tiles_z; tz++) {
+         int x0 = tx * TER_TERRAIN_LOD_TILE_SIZE - 1;
+         int z0 = tz * TER_TERRAIN_LOD_TILE_SIZE - 1;
+         for (int j = 0; j < layer_size; j++) {
+            int z = CLAMP(z0 + j, 0, t->depth - 1);
+            for (int i = 0; i < layer_size; i++) {
+               int x = CLAMP(x0 + i, 0, t->width - 1);
+               data[j * layer_size + i] = TERRAIN(t, x, z);
+            }
+         }
+         glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0,
+                         tz * lod->tiles_x + tx, layer_size, layer_size, 1,
+                         GL_RED, GL_FLOAT, data);
+      }
+   }
+   g_free(data);
+
+   glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+   unsigned bytes = layer_size * layer_size * num_tiles * 4;
+   ter_dbg(LOG_VBO,
+           "TERRAIN: VBO: INFO: Uploaded %u bytes (%u KB) "
+           "for %d height map tiles\n",
+           bytes, bytes / 1024, num_tiles);
+}
+
+/*
+ * Updates the height map texels of all the tiles that include samples in
+ * [x0, x1] x [z0, z1], including the tile borders.
+ */
+static void
+terrain_lod_update_height_map(TerTerrain *t, int x0, int z0, int x1, int z1)
+{
+   TerTerrainLod *lod = &t->lod;
+   const int tile_size = TER_TERRAIN_LOD_TILE_SIZE;
+   const int layer_size = TER_TERRAIN_LOD_TILE_SIZE + 3;
+
+   /* Texels past the terrain edges replicate the edge samples, so a tile can
+    * have more texels to update than the region has samples.
+    */
+   float *data = g_new(float, layer_size * layer_size);
+   glBindTexture(GL_TEXTURE_2D_ARRAY, lod->height_tex);
+
+   int tx0 = MAX((x0 - 2) / tile_size, 0);
+   int tz0 = MAX((z0 - 2) / tile_size, 0);
+   int tx1 = MIN((x1 + 1) / tile_size, lod->tiles_x - 1);
+   int tz1 = MIN((z1 + 1) / tile_size, lod->tiles_z - 1);
+   for (int tx = tx0; tx <= tx1; tx++) {
+      for (int tz = tz0; tz <= tz1; tz++) {
+         /* Streamed tiles that are not resident are uploaded when loaded */
+         int layer = lod->tile_layer[tz * lod->tiles_x + tx];
+         if (layer < 0)
+            continue;
+
+         /* Texels that replicate the terrain edges map to the same sample,
+          * but the mapping is still monotonic, so the texels to update form
+          * a rectangle.
+          */
+         int ox = tx * tile_size - 1;
+         int oz = tz * tile_size - 1;
+         int i0 = layer_size, i1 = -1, j0 = layer_size, j1 = -1;
+         for (int i = 0; i < layer_size; i++) {
+            int x = CLAMP(ox + i, 0, t->width - 1);
+            if (x >= x0 && x <= x1) {
+               i0 = MIN(i0, i);
+               i1 = i;
+            }
+            int z = CLAMP(oz + i, 0, t->depth - 1);
+            if (z >= z0 && z <= z1) {
+               j0 = MIN(j0, i);
+               j1 = i;
+            }
+         }
+         if (i1 < i0 || j1 < j0)
+            continue;
+
+         int w = i1 - i0 + 1;
+         for (int j = j0; j <= j1; j++) {
+            int z = CLAMP(oz + j, 0, t->depth - 1);
+            for (int i = i0; i <= i1; i++) {
+               int x = CLAMP(ox + i, 0, t->width - 1);
+               data[(j - j0) * w + (i - i0)] = TERRAIN(t, x, z);
+            }
+         }
+         glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, i0, j0, layer,
+                         w, j1 - j0 + 1, 1, GL_RED, GL_FLOAT, data);
+      }
+   }
+
+   glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+   g_free(data);
+}
+
+/*
+ * Re-encodes the vertices in [x0, x1] x [z0, z1]. If the vertex data has
+ * already been uploaded, we upload each column range of the region with
+ * glBufferSubData() (vertices are stored column by column).
+ */
+static void
+terrain_update_vertex_region(TerTerrain *t, int x0, int z0, int x1, int z1)
+{
+   float inv_scale = 65535.0f / t->height_scale;
+   int rows = z1 - z0 + 1;
+
+   if (t->vertices) {
+      for (int x = x0; x <= x1; x++) {
+         for (int z = z0; z <= z1; z++)
+            terrain_encode_vertex(t, x, z, inv_scale,
+                                  &t->vertices[x * t->depth + z]);
+      }
+      return;
+   }
+
+   TerTerrainVertex *column = g_new(TerTerrainVertex, rows);
+   glBindBuffer(GL_ARRAY_BUFFER, t->vertex_buf);
+   for (int x = x0; x <= x1; x++) {
+      for (int z = z0; z <= z1; z++)
+         terrain_encode_vertex(t, x, z, inv_scale, &column[z - z0]);
+      glBufferSubData(GL_ARRAY_BUFFER,
+                      (x * t->depth + z0) * sizeof(TerTerrainVertex),
+                      rows * sizeof(TerTerrainVertex), column);
+   }
+   glBindBuffer(GL_ARRAY_BUFFER, 0);
+   g_free(column);
+}
+
+/*
+ * Vertex heights are quantized to the height range of the terrain when it is
+ * built. If an edit goes beyond that range we need to re-quantize and upload
+ * all the vertices.
+ */
+static bool
+terrain_requantize_vertices(TerTerrain *t, int x0, int z0, int x1, int z1)
+{
+   float min_h = FLT_MAX, max_h = -FLT_MAX;
+   for (int x = x0; x <= x1; x++) {
+      for (int z = z0; z <= z1; z++) {
+         min_h = MIN(min_h, TERRAIN(t, x, z));
+         max_h = MAX(max_h, TERRAIN(t, x, z));
+      }
+   }
+   if (min_h >= t->height_bias && max_h <= t->height_bias + t->height_scale)
+      return false;
+
+   ter_terrain_build_vertices(t,
+                              (TerThreadPool *) ter_cache_get("threads/pool"));
+   if (t->vao) {
+      unsigned bytes = t->width * t->depth * sizeof(TerTerrainVertex);
+      glBindBuffer(GL_ARRAY_BUFFER, t->vertex_buf);
+      glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, t->vertices);
+      glBindBuffer(GL_ARRAY_BUFFER, 0);
+      g_free(t->vertices);
+      t->vertices = NULL;
+
+      ter_dbg(LOG_VBO,
+              "TERRAIN: VBO: INFO: Height range changed, re-uploaded "
+              "%u bytes (%u KB) for all vertices\n", bytes, bytes / 1024);
+   }
+
+   return true;
+}
+
+/*
+ * Propagates changes to the heights of samples in [x0, x1] x [z0, z1] (see
+ * ter_terrain_set_height) to the height query planes, the height pyramid
+ * (and with it the culling bounds) and the GPU data. Only the parts that
+ * depend on the modified samples are updated, which for the vertex normals
+ * means a border of 1 sample around the region.
+ */
+void
+ter_terrain_update_region(TerTerrain *t, int x0, int z0, int x1, int z1)
+{
+   assert(!t->hf);
+
+   x0 = MAX(x0, 0);
+   z0 = MAX(z0, 0);
+   x1 = MIN(x1, t->width - 1);
+   z1 = MIN(z1, t->depth - 1);
+   if (x1 < x0 || z1 < z0)
+      return;
+
+   /* Quads that have any of the samples as a corner */
+   int qx0 = MAX(x0 - 1, 0);
+   int qz0 = MAX(z0 - 1, 0);
+   int qx1 = MIN(x1 + 1, t->width - 1);
+   int qz1 = MIN(z1 + 1, t->depth - 1);
+
+   /* Structures that were not built yet or are pending a full update don't
+    * need anything from us.
+    */
+   if (t->planes && !t->planes_dirty)
+      terrain_update_planes(t, qx0, qz0, qx1, qz1);
+   if (t->pyramid.num_levels > 0 && !t->pyramid_dirty)
+      terrain_pyramid_update(t, qx0, qz0, qx1, qz1);
+
+   if (TER_TERRAIN_LOD_ENABLE) {
+      if (t->lod.height_tex)
+         terrain_lod_update_height_map(t, x0, z0, x1, z1);
+      return;
+   }
+
+   if (!t->vao && !t->vertices)
+      return;
+
+   if (terrain_requantize_vertices(t, x0, z0, x1, z1))
+      return;
+
+   /* Normals use the samples on each side, edge vertices use the normals
+    * of the nearest inner vertices.
+    */
+   int vx0 = x0 - 1 <= 1 ? 0 : x0 - 1;
+   int vz0 = z0 - 1 <= 1 ? 0 : z0 - 1;
+   int vx1 = x1 + 1 >= t->width - 2 ? t->width - 1 : x1 + 1;
+   int vz1 = z1 + 1 >= t->depth - 2 ? t->depth - 1 : z1 + 1;
+   terrain_update_vertex_region(t, vx0, vz0, vx1, vz1);
+}
+
+/*
+ * Raises (or lowers, if delta is negative) the terrain around (x, z) with a
+ * smooth falloff that reaches 0 at the given radius. Streamed terrains keep
+ * no heights in memory, so they can't be deformed.
+ */
 void
-ter_terrain_free(TerTerrain *t)
+ter_terrain_deform(TerTerrain *t, float x, float z, float radius,
+                   float delta)
 {
-   glDeleteVertexArrays(1, &t->vao);
-   glDeleteVertexArrays(1, &t->vertex_buf);
-   glDeleteVertexArrays(TER_TERRAIN_NUM_INDEX_BUFFERS, &t->index_buf[0]);
+   if (t->hf) {
+      ter_dbg(LOG_DEFAULT,
+              "TERRAIN: WARNING: Streamed terrains can't be deformed\n");
+      return;
+   }
 
-   ter_mesh_free(t->mesh);
-   g_free(t->height);
-   g_free(t->indices);
-   g_free(t);
+   float fx = x * t->inv_step;
+   float fz = -z * t->inv_step;
+   float r = radius * t->inv_step;
+   float inv_r2 = 1.0f / (r * r);
+
+   int x0 = MAX((int) ceilf(fx - r), 0);
+   int z0 = MAX((int) ceilf(fz - r), 0);
+   int x1 = MIN((int) floorf(fx + r), t->width - 1);
+   int z1 = MIN((int) floorf(fz + r), t->depth - 1);
+
+   for (int sx = x0; sx <= x1; sx++) {
+      for (int sz = z0; sz <= z1; sz++) {
+         float d2 = ((sx - fx) * (sx - fx) + (sz - fz) * (sz - fz)) * inv_r2;
+         if (d2 < 1.0f) {
+            float w = 1.0f - d2;
+            TERRAIN(t, sx, sz) += delta * w * w;
+         }
+      }
+   }
+
+   ter_terrain_update_region(t, x0, z0, x1, z1);
 }
 
-void
-ter_terrain_set_height(TerTerrain *t, unsigned w, unsigned d, float h)
+/*
+ * Finds a height map layer for a new streamed tile: a free one if possible,
+ * otherwise the least recently used one that was not used by the current
+ * selection pass. Returns -1 if there is none.
+ */
+static int
+terrain_lod_alloc_layer(TerTerrain *t)
 {
-   TERRAIN(t, w, d) = h;
+   TerTerrainLod *lod = &t->lod;
+
+   int best = -1;
+   for (unsigned i = 0; i < lod->num_layers; i++) {
+      if (lod->layer_tile[i] < 0)
+         return i;
+      if (lod->layer_stamp[i] != lod->pass &&
+          (best < 0 || lod->layer_stamp[i] < lod->layer_stamp[best])) {
+         best = i;
+      }
+   }
+
+   if (best >= 0)
+      lod->tile_layer[lod->layer_tile[best]] = -1;
+
+   return best;
 }
 
-float
-ter_terrain_get_height_at(TerTerrain *t, float x, float z)
+/*
+ * Uploads tiles completed by the heightfield loader thread to the height map
+ * texture. Data goes through an orphaned pixel buffer so the copy into the
+ * texture doesn't have to wait for frames in flight that are still using it.
+ */
+static void
+terrain_lod_stream_tiles(TerTerrain *t)
 {
-   /* Terrain's Z extends towards -Z, but our vertices need positive numbers */
-   z = -z;
-
-   /* Find offsets of the coords into a terrain quad */
-   float offx = fmodf(x, t->step);
-   float offz = fmodf(z, t->step);
-
-   /* Compute the plane equation for the triangle we are in */
-   glm::vec3 p1, p2, p3;
-   float A, B, C, D;
-   if (offx + offz <= t->step) {
-      /* First triangle in the quad */
-      p1.x = trunc(x / t->step);
-      p1.z = trunc(z / t->step);
-      p1.y = TERRAIN(t, (int)p1.x, (int)p1.z);
-
-      p2.x = trunc(x / t->step) + 1;
-      p2.z = trunc(z / t->step);
-      p2.y = TERRAIN(t, (int)p2.x, (int)p2.z);
-
-      p3.x = trunc(x / t->step);
-      p3.z = trunc(z / t->step) + 1;
-      p3.y = TERRAIN(t, (int)p3.x, (int)p3.z);
-   } else {
-      /* Second triangle in the quad */
-      p1.x = trunc(x / t->step) + 1;
-      p1.z = trunc(z / t->step);
-      p1.y = TERRAIN(t, (int)p1.x, (int)p1.z);
+   TerTerrainLod *lod = &t->lod;
+   const int layer_size = TER_TERRAIN_LOD_TILE_SIZE + 3;
+   const size_t tile_bytes = layer_size * layer_size * sizeof(float);
+
+   TerHeightfieldTileData *loaded[TER_TERRAIN_STREAMING_UPLOADS_PER_FRAME];
+   unsigned num_loaded = 0;
+   while (num_loaded < TER_TERRAIN_STREAMING_UPLOADS_PER_FRAME &&
+          (loaded[num_loaded] = ter_heightfield_pop_loaded_tile(t->hf))) {
+      num_loaded++;
+   }
 
-      p2.x = trunc(x / t->step);
-      p2.z = trunc(z / t->step) + 1;
-      p2.y = TERRAIN(t, (int)p2.x, (int)p2.z);
+   if (num_loaded > 0) {
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, lod->upload_buf);
+      glBufferData(GL_PIXEL_UNPACK_BUFFER, num_loaded * tile_bytes, NULL,
+                   GL_STREAM_DRAW);
+      glBindTexture(GL_TEXTURE_2D_ARRAY, lod->height_tex);
+
+      for (unsigned i = 0; i < num_loaded; i++) {
+         TerHeightfieldTileData *td = loaded[i];
+         lod->tile_requested[td->tile] = false;
+
+         int layer = terrain_lod_alloc_layer(t);
+         if (layer >= 0) {
+            glBufferSubData(GL_PIXEL_UNPACK_BUFFER, i * tile_bytes, tile_bytes,
+                            td->data);
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer,
+                            layer_size, layer_size, 1, GL_RED, GL_FLOAT,
+                            (void *) (i * tile_bytes));
+            lod->tile_layer[td->tile] = layer;
+            lod->layer_tile[layer] = td->tile;
+            lod->layer_stamp[layer] = lod->pass;
+         }
+
+         ter_heightfield_tile_data_free(td);
+      }
 
-      p3.x = trunc(x / t->step) + 1;
-      p3.z = trunc(z / t->step) + 1;
-      p3.y = TERRAIN(t, (int)p3.x, (int)p3.z);
-   }
+      glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 
-   /* Above we compute X,Z coords as vertex indices so we could use TERRAIN()
-    * to compute heights at specific vertices, but to apply the plane equation
-    * we need to turn the coordinates into world units
-    */
-   p1.x *= t->step;
-   p1.z *= t->step;
-   p2.x *= t->step;
-   p2.z *= t->step;
-   p3.x *= t->step;
-   p3.z *= t->step;
-
-   /* FIXME: we probably want to pre-compute plane equations for each
-    * triangle in the terrain rather than recomputing them all the time
-    */
-   A = (p2.y - p1.y) * (p3.z - p1.z) - (p3.y - p1.y) * (p2.z - p1.z);
-   B = (p2.z - p1.z) * (p3.x - p1.x) - (p3.z - p1.z) * (p2.x - p1.x);
-   C = (p2.x - p1.x) * (p3.y - p1.y) - (p3.x - p1.x) * (p2.y - p1.y);
-   D = -(A * p1.x + B * p1.y + C * p1.z);
+      ter_dbg(LOG_VBO,
+              "TERRAIN: VBO: INFO: Streamed %u height map tiles\n",
+              num_loaded);
+   }
 
-   /* Use the plane equation to find Y given (X,Z) */
-   return (-D - C * z - A * x) / B;
+   ter_heightfield_trim(t->hf);
 }
 
-void
-ter_terrain_set_heights_from_texture(TerTerrain *t, int texture,
-                                     float offset, float scale)
+static void
+terrain_lod_bind_vao(TerTerrain *t)
 {
-   TerTextureManager *tex_mgr =
-      (TerTextureManager *) ter_cache_get("textures/manager");
-   
-   SDL_Surface *image = ter_texture_manager_get_image(tex_mgr, texture);
-   uint8_t *pixels = (uint8_t *) image->pixels;
-   float scale_x = ((float) image->w) / (t->width - 1);
-   float scale_z = ((float) image->h) / (t->depth - 1);
-
-   for (int x = 0; x < t->width; x++) {
-      for (int z = 0; z < t->depth; z++) {
-         int img_x = (int) truncf(x * scale_x);
-         int img_y = (int) truncf(z * scale_z);
-         float h = pixels[img_y * image->pitch + img_x * 4];
+   TerTerrainLod *lod = &t->lod;
 
-         /* Normalize height to [-1, 1] */ 
-         h = h / 127.5 - 1.0f;
+   if (lod->vao) {
+      glBindVertexArray(lod->vao);
+      glEnableVertexAttribArray(0);
+      glEnableVertexAttribArray(1);
+      return;
+   }
 
-         /* Apply scale */
-         h *= scale;
+   terrain_lod_upload_height_map(t);
 
-         /* Apply height offset */
-         h += offset;
+   glGenVertexArrays(1, &lod->vao);
+   glBindVertexArray(lod->vao);
 
-         ter_terrain_set_height(t, x, z, h);
+   /* The chunk grid has no vertex data, the vertex shader derives the grid
+    * position from the vertex ID and samples the height map. We only need
+    * the indices to render it as a list of triangles.
+    */
+   const int grid_size = TER_TERRAIN_LOD_CHUNK_SIZE / 2;
+   const int grid_verts = grid_size + 1;
+   lod->num_grid_indices = grid_size * grid_size * 6;
+   uint16_t *indices = g_new(uint16_t, lod->num_grid_indices);
+   unsigned index = 0;
+   for (int j = 0; j < grid_size; j++) {
+      for (int i = 0; i < grid_size; i++) {
+         /* Same triangle split as ter_terrain_get_height_at() */
+         uint16_t v00 = j * grid_verts + i;
+         uint16_t v10 = v00 + 1;
+         uint16_t v01 = v00 + grid_verts;
+         uint16_t v11 = v01 + 1;
+         indices[index++] = v00;
+         indices[index++] = v10;
+         indices[index++] = v01;
+         indices[index++] = v01;
+         indices[index++] = v10;
+         indices[index++] = v11;
       }
    }
-}
 
-static glm::vec3
-calculate_normal(TerTerrain *t, unsigned x, unsigned z)
-{
-   if (x == 0)
-      x = 1;
-   if (z == 0)
-      z = 1;
-   float hl = TERRAIN(t, x - 1, z);
-   float hr = TERRAIN(t, x + 1, z);
-   float hd = TERRAIN(t, x, z + 1); /* Terrain expands towards -Z */
-   float hu = TERRAIN(t, x, z - 1);
-   glm::vec3 n = glm::vec3(hl - hr, 2.0f, hd - hu);
-   ter_util_vec3_normalize(&n);
-   return n;
+   glGenBuffers(1, &lod->grid_index_buf);
+   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, lod->grid_index_buf);
+   glBufferData(GL_ELEMENT_ARRAY_BUFFER, lod->num_grid_indices * sizeof(uint16_t),
+                indices, GL_STATIC_DRAW);
+   g_free(indices);
+
+   /* Per-chunk data is streamed (see terrain_lod_update_for_clip_volume()) */
+   glEnableVertexAttribArray(0);
+   glVertexAttribDivisor(0, 1);
+   glEnableVertexAttribArray(1);
+   glVertexAttribDivisor(1, 1);
 }
 
 static void
-compute_indices_for_clip_volume(TerTerrain *t, TerClipVolume *clip)
+terrain_lod_add_chunk(TerTerrain *t, int level, int x, int z)
 {
-   int min_col = MAX(MIN(clip->x0 / t->step, t->width - 2), 0);
-   int max_col = MAX(MIN((clip->x1 + t->step) / t->step, t->width - 2), 0);
+   TerTerrainLod *lod = &t->lod;
 
-   /* Z1 is always largest, because our terrain grows towrds -Z, it means that
-    * it defines the min_row
+   /* Skip quadrants of nodes at the far edges of the terrain that are
+    * entirely outside it.
     */
-   int min_row = MAX(MIN(-clip->z1 / t->step, t->depth - 1), 0);
-   int max_row = MAX(MIN(- (clip->z0 - t->step) / t->step, t->depth - 1), 0);
+   if (x >= t->width - 1 || z >= t->depth - 1)
+      return;
 
-   /* If this happens then the terrain is not visible */
-   if (min_col == max_col || min_row == max_row) {
-      t->num_indices = 0;
+   if (lod->num_chunks >= TER_TERRAIN_LOD_MAX_CHUNKS) {
+      ter_dbg(LOG_RENDER,
+              "TERRAIN: RENDER: WARNING: too many chunks, increase "
+              "TER_TERRAIN_LOD_MAX_CHUNKS\n");
       return;
    }
 
-   unsigned index = 0;
-   for (int c = min_col; c <= max_col; c++) {
-      for (int r = min_row; r <= max_row; r++) {
-         /* If this is not the first strip then we need to produce a degenerate
-          * link with the previous strip using the first vertex from this strip
-          * and the last vertex from the last before we start recording the
-          * new strip. Here is the first vertex of this strip.
-          */
-         if (c > min_col && r == min_row)
-            t->indices[index++] = c * t->depth + r;
-
-         t->indices[index++] = c * t->depth + r;
-         t->indices[index++] = (c + 1) * t->depth + r;
+   int tx = x / TER_TERRAIN_LOD_TILE_SIZE;
+   int tz = z / TER_TERRAIN_LOD_TILE_SIZE;
+
+   TerTerrainChunk *c = &lod->chunks[lod->num_chunks++];
+   c->origin_x = x;
+   c->origin_z = z;
+   c->spacing = 1 << level;
+   c->level = level;
+   c->layer = lod->tile_layer[tz * lod->tiles_x + tx];
+   c->tile_x = tx * TER_TERRAIN_LOD_TILE_SIZE;
+   c->tile_z = tz * TER_TERRAIN_LOD_TILE_SIZE;
+   c->pad = 0;
+}
 
-         /* Link the next triangle strip using degenerate triangles. For that
-          * we need to duplicate the last vertex of this strip and the first
-          * vertex of the next.
-          */
-         if (r == max_row && c < max_col)
-            t->indices[index++] = (c + 1) * t->depth + r;
-      }
-   }
+/*
+ * Adds the quadrant (qx, qz) of a node to the list of chunks to render, at
+ * the level of detail of that node.
+ */
+static inline void
+terrain_lod_add_node_quadrant(TerTerrain *t, int level, int nx, int nz,
+                              int qx, int qz)
+{
+   int size = t->lod.level[level].node_size;
+   terrain_lod_add_chunk(t, level,
+                         nx * size + qx * size / 2,
+                         nz * size + qz * size / 2);
+}
 
-   t->num_indices = index;
+static void
+terrain_lod_get_node_box(TerTerrain *t, int level, int nx, int nz,
+                         TerClipVolume *box)
+{
+   TerTerrainLodLevel *l = &t->lod.level[level];
+   int x0 = nx * l->node_size;
+   int z0 = nz * l->node_size;
+   int x1 = MIN(x0 + l->node_size, t->width - 1);
+   int z1 = MIN(z0 + l->node_size, t->depth - 1);
+
+   box->x0 = x0 * t->step;
+   box->x1 = x1 * t->step;
+   box->z0 = -z1 * t->step;
+   box->z1 = -z0 * t->step;
+   box->y0 = l->min_height[nx * l->nodes_z + nz];
+   box->y1 = l->max_height[nx * l->nodes_z + nz];
 }
 
-void
-ter_terrain_build_mesh(TerTerrain *t)
+/*
+ * CDLOD node selection. Returns false if the node is out of the range of its
+ * level, in which case the caller has to cover its area at its own (lower)
+ * level of detail.
+ */
+static bool
+terrain_lod_select_node(TerTerrain *t, TerrainCull *cull,
+                        int level, int nx, int nz)
 {
-   /* GL's +Z axis goes towards the camera, so make the terrain's Z coordinates
-    * negative so that larger (negative) Z coordinates are more distant.
-    */
-   t->mesh = ter_mesh_new();
+   TerTerrainLod *lod = &t->lod;
 
-   int vertices_w = t->width;
-   int vertices_d = t->depth;
+   TerClipVolume box;
+   terrain_lod_get_node_box(t, level, nx, nz, &box);
 
-   /* Add each vertex in the grid. We are going to render using an index buffer
-    * so we don't need to duplicate vertices, which reduces massively the
-    * storage requirements for the vertex data, since terrains have high
-    * vertex counts.
-    */
-   for (int vx = 0; vx < vertices_w; vx++) {
-      for (int vz = 0; vz < vertices_d; vz++) {
-         float vy = TERRAIN(t, vx, vz);
-         glm::vec3 v0 = glm::vec3(vx * t->step, vy, -vz * t->step);
-         glm::vec3 n0 = calculate_normal(t, vx, vz);
-         ter_mesh_add_vertex(t->mesh, v0.x, v0.y, v0.z, n0.x, n0.y, n0.z);
-      }
+   /* Culled nodes are handled by not rendering them */
+   if (terrain_cull_box(cull, &box))
+      return true;
+
+   float dist_sq = ter_util_clip_volume_distance_sq(&box, lod->camera_pos);
+   if (level < (int) lod->num_levels - 1 &&
+       dist_sq > lod->range[level] * lod->range[level]) {
+      return false;
    }
 
-   /* Build the indices to render the terrain using a single triangle strip
-    * (using degenerate triangles) since that yields much better performance
-    * than rendering triangles.
+   /* If we are at the most detailed level or none of the node is within
+    * the range of the next level, render the full node at this level.
     */
-   unsigned num_indices =
-      (vertices_w - 1) * (vertices_d * 2) + (vertices_w - 2) + (vertices_d - 2);
-   t->indices = g_new0(unsigned, num_indices);
+   if (level == 0 ||
+       dist_sq > lod->range[level - 1] * lod->range[level - 1]) {
+      for (int q = 0; q < 4; q++)
+         terrain_lod_add_node_quadrant(t, level, nx, nz, q & 1, q >> 1);
+      return true;
+   }
 
-   /* Initialize the number of rendering indices so it covers the entire
-    * terrain.
+   /* Otherwise, try to render the children with more detail and render
+    * the quadrants that they don't cover at this level.
     */
-   TerClipVolume clip;
-   clip.x0 = 0.0f;
-   clip.x1 = (t->width - 1) * t->step;
-   clip.z1 = 0.0f;
-   clip.z0 = -(t->depth - 1) * t->step;
-   compute_indices_for_clip_volume(t, &clip);
+   TerTerrainLodLevel *child_level = &lod->level[level - 1];
+   for (int q = 0; q < 4; q++) {
+      int cx = 2 * nx + (q & 1);
+      int cz = 2 * nz + (q >> 1);
+      if (cx >= child_level->nodes_x || cz >= child_level->nodes_z)
+         continue;
+      if (!terrain_lod_select_node(t, cull, level - 1, cx, cz))
+         terrain_lod_add_node_quadrant(t, level, nx, nz, q & 1, q >> 1);
+   }
 
-   assert(num_indices == t->num_indices);
+   return true;
 }
 
-static void
-terrain_unbind()
+/*
+ * Selects the terrain chunks to render within the clip volume and uploads
+ * their instance data. Returns the offset of that data in the current chunk
+ * buffer.
+ */
+static size_t
+terrain_lod_update_for_clip_volume(TerTerrain *t, TerrainCull *cull)
 {
-   glBindTexture(GL_TEXTURE_2D, 0);
-   glDisableVertexAttribArray(0);
-   glDisableVertexAttribArray(1);
-   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-   glBindVertexArray(0);
-}
+   TerTerrainLod *lod = &t->lod;
 
-static void
-terrain_bind_vao(TerTerrain *t)
-{
-   if (t->vao == 0) {
-      TerMesh *mesh = t->mesh;
+   TerCamera *cam = (TerCamera *) ter_cache_get("camera/main");
+   lod->camera_pos = cam->pos;
 
-      unsigned vertex_count = mesh->vertices.size();
-      assert(vertex_count == mesh->normals.size());
+   terrain_lod_bind_vao(t);
+   glBindVertexArray(0);
 
-      /* Interleave attributes for better performance on some platforms. We
-       * need a buffer large enough to store 2 vec3 attributes per vertex
-       * (position and normal).
-       */
-      unsigned vertex_byte_size = 2 * sizeof(glm::vec3);
-      unsigned vertex_float_size = vertex_byte_size / sizeof(float);
-      unsigned bytes = vertex_count * vertex_byte_size;
-      uint8_t *vertex_data = g_new(uint8_t, bytes);
-
-      float *vertex_data_f = (float *) vertex_data;
-      for (unsigned i = 0; i < vertex_count; i++) {
-         memcpy(&vertex_data_f[vertex_float_size * i], &mesh->vertices[i],
-                sizeof(glm::vec3));
-         memcpy(&vertex_data_f[vertex_float_size * i + 3], &mesh->normals[i],
-                sizeof(glm::vec3));
-      }
+   if (t->hf) {
+      lod->pass++;
+      terrain_lod_stream_tiles(t);
+   }
 
-      /* Create vertex buffer and upload data to it */
-      glGenBuffers(1, &t->vertex_buf);
-      glBindBuffer(GL_ARRAY_BUFFER, t->vertex_buf);
-      glBufferData(GL_ARRAY_BUFFER, bytes, vertex_data, GL_STATIC_DRAW);
-      g_free(vertex_data);
-
-      /* Create storage for index buffers and upload that to the first */
-      t->ibuf_idx = 0;
-      glGenBuffers(TER_TERRAIN_NUM_INDEX_BUFFERS, t->index_buf);
-      for (unsigned i = 0; i < TER_TERRAIN_NUM_INDEX_BUFFERS; i++) {
-         glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, t->index_buf[i]);
-         glBufferData(GL_ELEMENT_ARRAY_BUFFER,
-                      TER_TERRAIN_MAX_IB_BYTES,
-                      i == t->ibuf_idx ? t->indices : NULL,
-                      GL_DYNAMIC_DRAW);
+   /* Chunks are written directly to the stream buffer as we select them */
+   TerStreamBuffer *sb =
+      (TerStreamBuffer *) ter_cache_get("rendering/stream-buffer");
+   TerStreamRange range;
+   ter_stream_buffer_alloc(sb,
+                           TER_TERRAIN_LOD_MAX_CHUNKS * sizeof(TerTerrainChunk),
+                           16, &range);
+   lod->chunks = (TerTerrainChunk *) range.ptr;
+
+   lod->num_chunks = 0;
+   int root_level = lod->num_levels - 1;
+   for (int tx = 0; tx < lod->tiles_x; tx++) {
+      for (int tz = 0; tz < lod->tiles_z; tz++) {
+         int tile = tz * lod->tiles_x + tx;
+
+         /* Streamed tiles that are not in the height map yet are requested
+          * and skipped until they are available.
+          */
+         if (t->hf && lod->tile_layer[tile] < 0) {
+            TerClipVolume box;
+            terrain_lod_get_node_box(t, root_level, tx, tz, &box);
+            if (!lod->tile_requested[tile] &&
+                ter_util_clip_volume_intersects(&box, cull->clip)) {
+               ter_heightfield_request_tile(t->hf, tile);
+               lod->tile_requested[tile] = true;
+            }
+            continue;
+         }
+
+         unsigned num_chunks = lod->num_chunks;
+         terrain_lod_select_node(t, cull, root_level, tx, tz);
+         if (t->hf && lod->num_chunks > num_chunks)
+            lod->layer_stamp[lod->tile_layer[tile]] = lod->pass;
       }
-      t->ibuf_used = t->num_indices;
+   }
 
-      glGenVertexArrays(1, &t->vao);
-      glBindVertexArray(t->vao);
+   lod->chunks = NULL;
+   ter_stream_buffer_commit(sb, &range,
+                            lod->num_chunks * sizeof(TerTerrainChunk));
+   ter_stream_buffer_flush(sb);
+   lod->chunk_buf = range.buf;
+   lod->chunk_offset = range.offset;
 
-      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, t->index_buf[t->ibuf_idx]);
+   ter_dbg(LOG_RENDER,
+           "TERRAIN: RENDER: INFO: Selected %u chunks (%u triangles), "
+           "culled %u nodes\n",
+           lod->num_chunks, lod->num_chunks * lod->num_grid_indices / 3,
+           cull->num_culled);
 
-      glEnableVertexAttribArray(0);
-      glVertexAttribPointer(
-         0,                  // Attribute index
-         3,                  // size
-         GL_FLOAT,           // type
-         GL_FALSE,           // normalized?
-         vertex_byte_size,   // stride
-         (void*)0            // array buffer offset
-      );
+   return lod->chunk_offset;
+}
 
-      glEnableVertexAttribArray(1);
-      glVertexAttribPointer(
-         1,                  // Attribute index
-         3,                  // size
-         GL_FLOAT,           // type
-         GL_FALSE,           // normalized?
-         vertex_byte_size,   // stride
-         (void*)sizeof(glm::vec3) // array buffer offset
-      );
+/*
+ * Renders the terrain chunks selected by the last call to
+ * ter_terrain_update_index_buffer_for_clip_volume(). The caller is expected
+ * to have setup the program (and any uniforms other than the LOD data).
+ */
+void
+ter_terrain_render_lod_chunks(TerTerrain *t, TerShaderProgramTerrainLodData *sh)
+{
+   TerTerrainLod *lod = &t->lod;
 
-      ter_dbg(LOG_VBO,
-              "TERRAIN: VBO: INFO: Uploaded %u bytes (%u KB) "
-              "for %u vertices (%u bytes/vertex)\n",
-              bytes, bytes / 1024, vertex_count, vertex_byte_size);
+   if (lod->num_chunks == 0)
+      return;
 
-      unsigned index_bytes = TER_TERRAIN_MAX_IB_BYTES;
-      unsigned num_indices = TER_TERRAIN_MAX_IB_BYTES / sizeof(int);
-      ter_dbg(LOG_VBO,
-              "TERRAIN: VBO: INFO: Uploaded %u bytes (%u KB) "
-              "for %u indices (%u bytes/index)\n",
-              index_bytes, index_bytes / 1024, num_indices, sizeof(int));
-   } else {
-      glBindVertexArray(t->vao);
-      glEnableVertexAttribArray(0);
-      glEnableVertexAttribArray(1);
+   ter_shader_program_terrain_lod_data_load(sh,
+                                            TER_TERRAIN_LOD_HEIGHT_MAP_UNIT,
+                                            TER_TERRAIN_LOD_CHUNK_SIZE / 2,
+                                            t->step,
+                                            t->width - 1, t->depth - 1,
+                                            &lod->camera_pos,
+                                            lod->morph,
+                                            TER_TERRAIN_LOD_MAX_LEVELS);
 
-      /* Always bind the current index buffer explicitly, it seems as if binding
-       * the VAO doesn't reliably bind the first index buffer when ibuf_idx = 0.
-       * Otherwise we should  only need to bind if ibuf_idx > 0, but this does not
-       * work. Maybe intel drivers are not storing the index buffer binding in
-       * the VAO state?
-       */
-      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, t->index_buf[t->ibuf_idx]);
-   }
+   glActiveTexture(GL_TEXTURE0 + TER_TERRAIN_LOD_HEIGHT_MAP_UNIT);
+   glBindTexture(GL_TEXTURE_2D_ARRAY, lod->height_tex);
+   glBindSampler(TER_TERRAIN_LOD_HEIGHT_MAP_UNIT, 0);
+
+   terrain_lod_bind_vao(t);
+
+   glBindBuffer(GL_ARRAY_BUFFER, lod->chunk_buf);
+   glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(TerTerrainChunk),
+                         (void *) lod->chunk_offset);
+   glVertexAttribIPointer(1, 4, GL_INT, sizeof(TerTerrainChunk),
+                          (void *) (lod->chunk_offset + 4 * sizeof(float)));
+
+   glDrawElementsInstanced(GL_TRIANGLES, lod->num_grid_indices,
+                           GL_UNSIGNED_SHORT, 0, lod->num_chunks);
+
+   glBindVertexArray(0);
+   glBindBuffer(GL_ARRAY_BUFFER, 0);
+   glActiveTexture(GL_TEXTURE0 + TER_TERRAIN_LOD_HEIGHT_MAP_UNIT);
+   glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+   glActiveTexture(GL_TEXTURE0);
 }
 
-static void
+static TerShaderProgramTerrain *
 terrain_prepare(TerTerrain *t, bool enable_shadows, bool render_motion)
 {
-   TerShaderProgramTerrain *sh = (TerShaderProgramTerrain *)
-      (enable_shadows ? ter_cache_get("program/terrain-shadow") :
-                        ter_cache_get("program/terrain"));
+   TerShaderProgramTerrain *sh;
+   if (TER_TERRAIN_LOD_ENABLE) {
+      sh = (TerShaderProgramTerrain *)
+         (enable_shadows ? ter_cache_get("program/terrain-lod-shadow") :
+                           ter_cache_get("program/terrain-lod"));
+   } else {
+      sh = (TerShaderProgramTerrain *)
+         (enable_shadows ? ter_cache_get("program/terrain-shadow") :
+                           ter_cache_get("program/terrain"));
+   }
    glUseProgram(sh->basic.prog.program);
 
    glm::mat4 *Projection = (glm::mat4 *) ter_cache_get("matrix/Projection");
@@ -395,7 +2062,15 @@ terrain_prepare(TerTerrain *t, bool enable_shadows, bool render_motion)
       ter_shader_program_shadow_data_load_(&sh->shadow, sr, 1);
    }
 
-   terrain_bind_vao(t);
+   /* With LOD, the chunk VAO is bound at render time */
+   if (!TER_TERRAIN_LOD_ENABLE) {
+      terrain_bind_vao(t);
+      ter_shader_program_terrain_grid_data_load(&sh->grid, t->depth, t->step,
+                                                t->height_scale,
+                                                t->height_bias);
+   }
+
+   return sh;
 }
 
 static inline void
@@ -404,109 +2079,207 @@ terrain_finish()
    terrain_unbind();
 }
 
-void
-ter_terrain_compute_clipped_indices(TerTerrain *t, TerClipVolume *clip,
-                                    unsigned *count, size_t *offset)
-{
-   /* Our terrian indices cover terrain rendering by columns, so compute
-    * how many columns in the vertex grid are to be cliped at the start
-    * and the end of the terrain based on the x0/x1 dimensions of the clip
-    * volume
-    */
-   int min_col = MAX(MIN(clip->x0 / t->step, t->width), 0);
-   int max_col = MAX(MIN((clip->x1 + t->step) / t->step, t->width - 2), 0);
-
-   /* For each column in the terrain, we render 2 * depth vertices, plus
-    * 2 extra vertices to produce a degenerate triangle so we can join the
-    * strip for the next column.
-    */
-   int indices_per_col = 2 * t->depth + 2;
-
-   /* Compute how many indices we need to skip at the start of the index buffer
-    * to start rendering at "min_col" and how many indices we can skip at
-    * the tail of the buffer index to stop rendering at "max_col". Also, notice
-    * that the last column we render has index "width - 2" and that for that
-    * column we don't have those 2 extra indices to produce a degenerate (since
-    * that is the last strip to render).
-    */
-   int clipped_indices_start = min_col * indices_per_col;
-   int clipped_indices_end =
-      MAX(0, ((t->width - 2) - max_col) * indices_per_col - 2);
-
-   *offset = min_col * indices_per_col * sizeof(int);
-   *count = t->num_indices - clipped_indices_start - clipped_indices_end;
-}
-
+/*
+ * Selects the parts of the terrain to render within the clip volume. If
+ * frustums are provided (and chunk culling is enabled), parts of the terrain
+ * outside all of them are culled too.
+ */
 size_t
 ter_terrain_update_index_buffer_for_clip_volume(TerTerrain *t,
-                                                TerClipVolume *clip)
+                                                TerClipVolume *clip,
+                                                const TerFrustum *frustums,
+                                                unsigned num_frustums)
 {
+   TerrainCull cull;
+   cull.clip = clip;
+   cull.frustums = frustums;
+   cull.num_frustums = TER_TERRAIN_ENABLE_CHUNK_CULLING ? num_frustums : 0;
+   cull.num_culled = 0;
+
+   if (TER_TERRAIN_LOD_ENABLE)
+      return terrain_lod_update_for_clip_volume(t, &cull);
+
    /* The first frame will call this before we ever bind the terrain VAO,
     * which is when we create the index buffer.
     */
-   if (!t->ibuf_idx)
+   if (!t->vao)
       terrain_bind_vao(t);
 
-   compute_indices_for_clip_volume(t, clip);
-
-   /* Upload the new index data */
-   size_t buffer_offset = 0;
+   /* Static indices only need to select what to draw */
+   if (TER_TERRAIN_STATIC_INDICES) {
+      compute_draws_for_clip_volume(t, &cull);
+      return 0;
+   }
 
-   /* See if we have enough room in the current index buffer for the indices
-    * we want to upload. If not, bind the next buffer and upload there.
+   /* Write the indices directly to the stream buffer, making room for all
+    * of them since we don't know how many we need until we are done.
     */
-   unsigned ibuf_available = TER_TERRAIN_MAX_IB_INDICES - t->ibuf_used;
-   if (t->num_indices > ibuf_available) {
-      t->ibuf_idx++;
-      if (t->ibuf_idx >= TER_TERRAIN_NUM_INDEX_BUFFERS)
-         t->ibuf_idx = 0;
-      t->ibuf_used = t->num_indices;
-   } else {
-      buffer_offset = t->ibuf_used * sizeof(unsigned);
-      t->ibuf_used += t->num_indices;
-   }
+   TerStreamBuffer *sb =
+      (TerStreamBuffer *) ter_cache_get("rendering/stream-buffer");
+   TerStreamRange range;
+   ter_stream_buffer_alloc(sb, t->max_indices * sizeof(unsigned),
+                           sizeof(unsigned), &range);
+   t->indices = (unsigned *) range.ptr;
+   compute_indices_for_clip_volume(t, clip);
+   t->indices = NULL;
 
    unsigned index_bytes = t->num_indices * sizeof(unsigned);
-   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, t->index_buf[t->ibuf_idx]);
-   glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, buffer_offset,
-                   index_bytes, t->indices);
+   ter_stream_buffer_commit(sb, &range, index_bytes);
+   ter_stream_buffer_flush(sb);
+   t->ibuf = range.buf;
+   t->ibuf_offset = range.offset;
 
    ter_dbg(LOG_VBO,
-           "TERRAIN: VBO: INFO: Uploaded %u bytes (%u KB) "
+           "TERRAIN: VBO: INFO: Streamed %u bytes (%u KB) "
            "for %u indices (%u bytes/index) (buf=%u, offset=%u)\n",
            index_bytes, index_bytes / 1024, t->num_indices, sizeof(int),
-           t->ibuf_idx, buffer_offset);
+           t->ibuf, (unsigned) t->ibuf_offset);
 
-   return buffer_offset;
+   return t->ibuf_offset;
 }
 
-static inline size_t
-get_current_ib_offset(TerTerrain *t)
+/*
+ * Returns the height of a corner of the nodes of a pyramid level: the lowest
+ * of the nodes around it, so the surface through the corners stays below
+ * the terrain.
+ */
+static inline float
+terrain_occluder_corner_height(const TerTerrainPyramidLevel *nodes,
+                               int cx, int cz)
 {
-   /* After uploading data to the index buffer we have moved ibuf_used
-    * exactly by num_indices so ibuf_used points right after the last
-    * slot used. To compute where the current index buffer starts, we
-    * have to remove the number of indices currently active.
-    */
-   return (t->ibuf_used - t->num_indices) * sizeof(unsigned);
+   float h = FLT_MAX;
+   for (int nx = MAX(cx - 1, 0); nx <= MIN(cx, nodes->nodes_x - 1); nx++) {
+      for (int nz = MAX(cz - 1, 0); nz <= MIN(cz, nodes->nodes_z - 1); nz++)
+         h = MIN(h, nodes->min_height[nx * nodes->nodes_z + nz]);
+   }
+   return h;
+}
+
+/*
+ * Adds a coarse version of the terrain within the clip volume (and the
+ * frustum, if any) to the occlusion buffer, with a quad per node of the
+ * pyramid level (nodes of 2^level quads per side). The quads go through
+ * the lowest heights around their corners, so they are always below the
+ * terrain and can't hide anything the terrain doesn't hide from a camera
+ * above it.
+ */
+void
+ter_terrain_add_occluders(TerTerrain *t, TerOcclusionBuffer *b,
+                          unsigned level, TerClipVolume *clip,
+                          const TerFrustum *frustum)
+{
+   terrain_ensure_pyramid(t);
+
+   /* Streamed terrains only have bounds from the heightfield chunk level */
+   TerTerrainPyramid *p = &t->pyramid;
+   unsigned l = MIN(MAX(level, 1), p->num_levels - 1);
+   while (l < p->num_levels - 1 && !p->level[l].min_height)
+      l++;
+   const TerTerrainPyramidLevel *nodes = &p->level[l];
+   if (!nodes->min_height)
+      return;
+
+   TerrainCull cull;
+   cull.clip = clip;
+   cull.frustums = frustum;
+   cull.num_frustums = frustum ? 1 : 0;
+   cull.num_culled = 0;
+
+   int size = 1 << l;
+   int min_nx = MAX(MIN((int) (clip->x0 / t->step) / size, nodes->nodes_x - 1), 0);
+   int max_nx = MAX(MIN((int) (clip->x1 / t->step) / size, nodes->nodes_x - 1), 0);
+   int min_nz = MAX(MIN((int) (-clip->z1 / t->step) / size, nodes->nodes_z - 1), 0);
+   int max_nz = MAX(MIN((int) (-clip->z0 / t->step) / size, nodes->nodes_z - 1), 0);
+
+   unsigned num_nodes = 0;
+   for (int nx = min_nx; nx <= max_nx; nx++) {
+      float x0 = nx * size * t->step;
+      float x1 = MIN((nx + 1) * size, t->width - 1) * t->step;
+      for (int nz = min_nz; nz <= max_nz; nz++) {
+         TerClipVolume box;
+         box.x0 = x0;
+         box.x1 = x1;
+         box.z0 = -MIN((nz + 1) * size, t->depth - 1) * t->step;
+         box.z1 = -nz * size * t->step;
+         box.y0 = nodes->min_height[nx * nodes->nodes_z + nz];
+         box.y1 = nodes->max_height[nx * nodes->nodes_z + nz];
+         if (terrain_cull_box(&cull, &box))
+            continue;
+
+         glm::vec3 c00 = glm::vec3(box.x0,
+            terrain_occluder_corner_height(nodes, nx, nz), box.z1);
+         glm::vec3 c10 = glm::vec3(box.x1,
+            terrain_occluder_corner_height(nodes, nx + 1, nz), box.z1);
+         glm::vec3 c01 = glm::vec3(box.x0,
+            terrain_occluder_corner_height(nodes, nx, nz + 1), box.z0);
+         glm::vec3 c11 = glm::vec3(box.x1,
+            terrain_occluder_corner_height(nodes, nx + 1, nz + 1), box.z0);
+         ter_occlusion_buffer_add_triangle(b, c00, c10, c11);
+         ter_occlusion_buffer_add_triangle(b, c00, c11, c01);
+         num_nodes++;
+      }
+   }
+
+   ter_dbg(LOG_RENDER,
+           "TERRAIN: RENDER: INFO: Added %u occluder nodes (level %u), "
+           "culled %u\n", num_nodes, l, cull.num_culled);
+}
+
+/*
+ * Draws the terrain grid as selected by the last call to
+ * ter_terrain_update_index_buffer_for_clip_volume(), which returned
+ * buffer_offset. Expects the terrain VAO and index buffer to be bound.
+ */
+void
+ter_terrain_draw_grid(TerTerrain *t, size_t buffer_offset)
+{
+   if (TER_TERRAIN_STATIC_INDICES) {
+      if (t->num_draws == 0)
+         return;
+      glEnable(GL_PRIMITIVE_RESTART);
+      glPrimitiveRestartIndex(TERRAIN_RESTART_INDEX);
+      glMultiDrawElements(GL_TRIANGLE_STRIP, t->draw_count, GL_UNSIGNED_INT,
+                          t->draw_offset, t->num_draws);
+      glDisable(GL_PRIMITIVE_RESTART);
+   } else {
+      glDrawElements(GL_TRIANGLE_STRIP, t->num_indices,
+                     GL_UNSIGNED_INT, (void *) buffer_offset);
+   }
 }
 
 /*
- * Notice that this expects that the index buffer has been properly
- * updated with the current active indices. To do that, callers of this
- * function should've called ter_terrain_update_index_buffer_for_clip_volume()
- * prior to calling this, which updates the index buffer with the indices
- * relevant to the clipping region passed as parameter. This will simply
- * render t->num_vertices at the currently active index buffer offset
- * where ter_terrain_update_index_buffer_for_clip_volume() uploaded index data.
+ * Notice that this expects that the parts of the terrain to render have been
+ * properly selected. To do that, callers of this function should've called
+ * ter_terrain_update_index_buffer_for_clip_volume() prior to calling this,
+ * which selects the chunks (or the index ranges) relevant to the clipping
+ * region passed as parameter. This will simply draw what was selected.
  */
 void
 ter_terrain_render(TerTerrain *t, bool enable_shadows, bool render_motion)
 {
-   terrain_prepare(t, enable_shadows, render_motion);
-   glDrawElements(GL_TRIANGLE_STRIP, t->num_indices,
-                  GL_UNSIGNED_INT, (void *) get_current_ib_offset(t));
-   terrain_finish();
+   TerShaderProgramTerrain *sh =
+      terrain_prepare(t, enable_shadows, render_motion);
+
+   if (TER_TERRAIN_LOD_ENABLE) {
+      ter_terrain_render_lod_chunks(t, &sh->lod);
+      glBindTexture(GL_TEXTURE_2D, 0);
+   } else {
+      ter_terrain_draw_grid(t, t->ibuf_offset);
+      terrain_finish();
+   }
+}
+
+/*
+ * Renders the region of the terrain within the clip volume. This replaces
+ * the current clipping region set with
+ * ter_terrain_update_index_buffer_for_clip_volume().
+ */
+void
+ter_terrain_render_clipped(TerTerrain *t, bool enable_shadows,
+                           TerClipVolume *clip)
+{
+   ter_terrain_update_index_buffer_for_clip_volume(t, clip, NULL, 0);
+   ter_terrain_render(t, enable_shadows, false);
 }
 
 float
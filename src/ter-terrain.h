@@ -1,36 +1,163 @@
 #ifndef __DRV_TERRAIN_H__
 #define __DRV_TERRAIN_H__
 
-#include "ter-mesh.h"
 #include "ter-util.h"
+#include "ter-thread-pool.h"
+#include "ter-shader-program.h"
+#include "ter-heightfield.h"
+#include "ter-occlusion-buffer.h"
+
+/* Pre-computed height equation for a terrain triangle. The height at a point
+ * inside the triangle is h + dx * u + dz * v, where (u, v) are the coordinates
+ * of the point within its terrain quad, normalized to [0, 1]. The padding
+ * keeps each plane 16 bytes long so SIMD code can load it in one go.
+ */
+typedef struct {
+   float h, dx, dz, pad;
+} TerTerrainPlane;
+
+/* Vertex format of the terrain grid. X and Z are implied by the vertex index
+ * (vertices are stored column by column), so we only store the height,
+ * quantized to 16 bits with a per-terrain scale and bias, and the normal,
+ * octahedral-encoded into two 16-bit normalized values.
+ */
+typedef struct {
+   uint16_t height;
+   uint16_t pad;
+   int16_t normal[2];
+} TerTerrainVertex;
+
+/* Min/max height pyramid over the terrain quads. Level l has a node for each
+ * block of 2^l x 2^l quads, up to a single node covering the whole terrain.
+ * Level 0 is not stored since quad bounds are cheap to compute from the
+ * heights. Streamed terrains only store the levels covered by the heightfield
+ * chunk bounds. Levels without data have NULL bounds.
+ */
+#define TER_TERRAIN_PYRAMID_MAX_LEVELS 24
+
+typedef struct {
+   int nodes_x, nodes_z;
+   float *min_height;
+   float *max_height;
+} TerTerrainPyramidLevel;
+
+typedef struct {
+   unsigned num_levels;
+   TerTerrainPyramidLevel level[TER_TERRAIN_PYRAMID_MAX_LEVELS];
+} TerTerrainPyramid;
+
+/* Maximum number of levels of detail supported by the terrain shaders */
+#define TER_TERRAIN_LOD_MAX_LEVELS 8
+
+/* Texture unit we use to bind the terrain height map. Units before this one
+ * are used for the surface texture and the shadow maps.
+ */
+#define TER_TERRAIN_LOD_HEIGHT_MAP_UNIT (1 + TER_MAX_CSM_LEVELS)
 
-/* We need a large enough index buffer to:
- *
- * 1. Ensure that we have room for the worse case scenario (all indices)
- * 2. Avoid stalling the GPU with updates to the index buffer.
- *
- * So we use two buffers that are twice the size of the worse case scenario.
+/* Per-instance data for a terrain chunk. Chunks are rendered using a grid
+ * of TER_TERRAIN_LOD_CHUNK_SIZE / 2 quads per side (a quarter of a quadtree
+ * node), with grid vertices placed "spacing" samples apart.
  */
-#define TER_TERRAIN_NUM_INDEX_BUFFERS 3
-#define TER_TERRAIN_MAX_IB_BYTES (((TER_TERRAIN_VX - 1) * (TER_TERRAIN_VZ * 2) + (TER_TERRAIN_VX - 2) + (TER_TERRAIN_VZ - 2)) * sizeof(unsigned) * 2)
-#define TER_TERRAIN_MAX_IB_INDICES (TER_TERRAIN_MAX_IB_BYTES / sizeof(unsigned))
+typedef struct {
+   float origin_x, origin_z;  /* First height sample covered */
+   float spacing;             /* Height samples between grid vertices */
+   float level;               /* Level of detail (0 is the most detailed) */
+   int layer;                 /* Height map tile (texture array layer) */
+   int tile_x, tile_z;        /* First height sample covered by the tile */
+   int pad;
+} TerTerrainChunk;
+
+/* Height bounds of the quadtree nodes at a given level of detail. The bounds
+ * are owned by the terrain's height pyramid.
+ */
+typedef struct {
+   int nodes_x, nodes_z;
+   int node_size;             /* Quads per side */
+   const float *min_height;
+   const float *max_height;
+} TerTerrainLodLevel;
+
+typedef struct {
+   unsigned num_levels;
+   TerTerrainLodLevel level[TER_TERRAIN_LOD_MAX_LEVELS];
+   float range[TER_TERRAIN_LOD_MAX_LEVELS];
+   glm::vec2 morph[TER_TERRAIN_LOD_MAX_LEVELS];
+
+   int tiles_x, tiles_z;
+
+   /* Height map texture layer assigned to each tile and vice versa (-1 if
+    * none). Without streaming, each tile has its own layer.
+    */
+   int *tile_layer;
+   int *layer_tile;
+   unsigned num_layers;
+
+   /* Streaming: tiles requested to the heightfield loader, the last
+    * selection pass that used each layer and the buffer we use to upload
+    * new tiles.
+    */
+   bool *tile_requested;
+   unsigned *layer_stamp;
+   unsigned pass;
+   unsigned upload_buf;
+
+   /* Chunks selected for rendering and the camera position used to select
+    * them (vertex morphing must use the same position). Selection writes
+    * the chunks directly to the stream buffer, chunks only points to them
+    * while selecting.
+    */
+   TerTerrainChunk *chunks;
+   unsigned num_chunks;
+   unsigned chunk_buf;
+   size_t chunk_offset;
+   glm::vec3 camera_pos;
+
+   unsigned height_tex;
+   unsigned vao;
+   unsigned grid_index_buf;
+   unsigned num_grid_indices;
+} TerTerrainLod;
 
 typedef struct {
    int width, depth;
    float step;
+   float inv_step;
+
+   /* Heights are either in memory or streamed from a heightfield file */
    float *height;
+   TerHeightfield *hf;
 
-   TerMesh *mesh;
-   unsigned *indices;
+   /* Two planes per terrain quad, see TER_TERRAIN_PLANE() */
+   TerTerrainPlane *planes;
+   bool planes_dirty;
+
+   /* Height bounds for ray-casting and culling */
+   TerTerrainPyramid pyramid;
+   bool pyramid_dirty;
+
+   TerTerrainVertex *vertices;        /* Until uploaded */
+   unsigned *indices;                 /* Until uploaded */
    unsigned num_indices;
+   unsigned max_indices;
 
    unsigned vao;
    unsigned vertex_buf;
+   float height_scale, height_bias;   /* Vertex height dequantization */
+
+   /* Indices of the whole grid. Without TER_TERRAIN_STATIC_INDICES, the
+    * indices selected for a clip volume are streamed (see TerStreamBuffer)
+    * and ibuf is the buffer we draw from.
+    */
+   unsigned index_buf;
+   unsigned ibuf;
+   size_t ibuf_offset;
 
-   unsigned index_buf[TER_TERRAIN_NUM_INDEX_BUFFERS];
-   unsigned ibuf_idx;
-   unsigned ibuf_used;
-   unsigned ibuf_cur_offset;
+   /* Index ranges to draw with TER_TERRAIN_STATIC_INDICES */
+   int *draw_count;
+   const void **draw_offset;
+   unsigned num_draws;
+
+   TerTerrainLod lod;
 
    TerMaterial material;
 
@@ -39,24 +166,46 @@ typedef struct {
 } TerTerrain;
 
 #define TERRAIN(t, w, d) t->height[(w) * t->depth + (d)]
+#define TER_TERRAIN_PLANE(t, w, d, tri) \
+   t->planes[((w) * (t->depth - 1) + (d)) * 2 + (tri)]
 
 TerTerrain *ter_terrain_new(unsigned width, unsigned depth, float step);
+TerTerrain *ter_terrain_new_from_heightfield(TerHeightfield *hf, float step);
 void ter_terrain_free(TerTerrain *t);
 
 void ter_terrain_set_height(TerTerrain *t, unsigned w, unsigned d, float h);
+void ter_terrain_update_region(TerTerrain *t, int x0, int z0, int x1, int z1);
+void ter_terrain_deform(TerTerrain *t, float x, float z, float radius,
+                        float delta);
 
 float ter_terrain_get_height_at(TerTerrain *t, float x, float z);
+void ter_terrain_get_heights_at(TerTerrain *t, const float *x, const float *z,
+                                float *h, unsigned count);
+
+bool ter_terrain_raycast(TerTerrain *t, glm::vec3 origin, glm::vec3 dir,
+                         float max_dist, float *hit_dist);
+void ter_terrain_raycast_batch(TerTerrain *t, TerThreadPool *pool,
+                               const glm::vec3 *origin, const glm::vec3 *dir,
+                               float max_dist, float *hit_dist,
+                               unsigned count);
 
 void ter_terrain_set_heights_from_texture(TerTerrain *t, int tex, float offset, float scale);
    
+void ter_terrain_build_vertices(TerTerrain *t, TerThreadPool *pool);
 void ter_terrain_build_mesh(TerTerrain *t);
 
 void ter_terrain_render(TerTerrain *t, bool enable_shadows, bool render_motion);
 void ter_terrain_render_clipped(TerTerrain *t, bool enable_shadows, TerClipVolume *clip);
+void ter_terrain_render_lod_chunks(TerTerrain *t, TerShaderProgramTerrainLodData *sh);
+
+size_t ter_terrain_update_index_buffer_for_clip_volume(TerTerrain *t, TerClipVolume *clip,
+                                                       const TerFrustum *frustums,
+                                                       unsigned num_frustums);
+void ter_terrain_draw_grid(TerTerrain *t, size_t buffer_offset);
 
-void ter_terrain_compute_clipped_indices(TerTerrain *t, TerClipVolume *clip,
-                                         unsigned *count, size_t *offset);
-size_t ter_terrain_update_index_buffer_for_clip_volume(TerTerrain *t, TerClipVolume *clip);
+void ter_terrain_add_occluders(TerTerrain *t, TerOcclusionBuffer *b,
+                               unsigned level, TerClipVolume *clip,
+                               const TerFrustum *frustum);
 
 float ter_terrain_get_width(TerTerrain *t);
 float ter_terrain_get_depth(TerTerrain *t);
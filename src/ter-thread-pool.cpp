@@ -0,0 +1,159 @@
+#include "main.h"
+
+/*
+ * A parallel job split into ranges of items. The items are partitioned
+ * across the participants (the pool workers plus the calling thread), each
+ * of which takes ranges from the front of its own queue and, once it is
+ * empty, steals ranges from the queues of the others. This keeps all the
+ * threads busy when the cost of the items is uneven.
+ */
+typedef struct {
+   volatile int next;
+   int end;
+   char pad[64 - 2 * sizeof(int)];  /* Avoid false sharing */
+} ThreadPoolQueue;
+
+typedef struct {
+   TerThreadPoolFunc func;
+   void *data;
+   unsigned grain;
+   unsigned num_queues;
+   ThreadPoolQueue *queues;
+   unsigned pending;                /* Workers still running, see mutex */
+   GMutex mutex;
+   GCond done;
+} ThreadPoolJob;
+
+typedef struct {
+   ThreadPoolJob *job;
+   unsigned queue;
+} ThreadPoolTask;
+
+static bool
+thread_pool_job_run_range(ThreadPoolJob *job, ThreadPoolQueue *q)
+{
+   int start = g_atomic_int_add(&q->next, (int) job->grain);
+   if (start >= q->end)
+      return false;
+
+   unsigned end = MIN((unsigned) start + job->grain, (unsigned) q->end);
+   job->func(job->data, start, end);
+   return true;
+}
+
+static void
+thread_pool_job_work(ThreadPoolJob *job, unsigned queue)
+{
+   for (unsigned i = 0; i < job->num_queues; i++) {
+      ThreadPoolQueue *q = &job->queues[(queue + i) % job->num_queues];
+      while (thread_pool_job_run_range(job, q));
+   }
+}
+
+static void
+thread_pool_worker(gpointer task_data, gpointer pool_data)
+{
+   ThreadPoolTask *task = (ThreadPoolTask *) task_data;
+   ThreadPoolJob *job = task->job;
+
+   thread_pool_job_work(job, task->queue);
+
+   /* The job lives in the stack of the caller, which returns as soon as it
+    * sees no pending workers, so we can't touch the job after unlocking.
+    */
+   g_mutex_lock(&job->mutex);
+   if (--job->pending == 0)
+      g_cond_signal(&job->done);
+   g_mutex_unlock(&job->mutex);
+}
+
+/*
+ * Creates a pool with num_threads workers, or one per CPU if num_threads
+ * is 0.
+ */
+TerThreadPool *
+ter_thread_pool_new(unsigned num_threads)
+{
+   if (num_threads == 0)
+      num_threads = g_get_num_processors();
+
+   TerThreadPool *p = g_new0(TerThreadPool, 1);
+   p->num_threads = num_threads;
+   p->pool = g_thread_pool_new(thread_pool_worker, p, num_threads,
+                               TRUE, NULL);
+
+   ter_dbg(LOG_DEFAULT,
+           "THREAD POOL: INFO: Created pool with %u threads\n", num_threads);
+
+   return p;
+}
+
+void
+ter_thread_pool_free(TerThreadPool *p)
+{
+   g_thread_pool_free(p->pool, FALSE, TRUE);
+   g_free(p);
+}
+
+/*
+ * Runs func on items [0, count) in ranges of grain items and waits for it
+ * to complete. The calling thread takes part in the job. If p is NULL, or
+ * there is a single range, func only runs in the calling thread.
+ */
+void
+ter_thread_pool_run(TerThreadPool *p, TerThreadPoolFunc func, void *data,
+                    unsigned count, unsigned grain)
+{
+   if (count == 0)
+      return;
+
+   grain = MAX(grain, 1);
+   unsigned num_tasks = (count + grain - 1) / grain;
+   if (!p || num_tasks == 1) {
+      func(data, 0, count);
+      return;
+   }
+
+   /* Split the ranges evenly across the queues, the calling thread works
+    * on the first one.
+    */
+   unsigned num_workers = MIN(p->num_threads, num_tasks - 1);
+   unsigned num_queues = num_workers + 1;
+   ThreadPoolQueue *queues = g_new0(ThreadPoolQueue, num_queues);
+   for (unsigned i = 0; i < num_queues; i++) {
+      queues[i].next = (num_tasks * i / num_queues) * grain;
+      queues[i].end = MIN((num_tasks * (i + 1) / num_queues) * grain, count);
+   }
+
+   ThreadPoolJob job;
+   job.func = func;
+   job.data = data;
+   job.grain = grain;
+   job.num_queues = num_queues;
+   job.queues = queues;
+   job.pending = num_workers;
+   g_mutex_init(&job.mutex);
+   g_cond_init(&job.done);
+
+   ThreadPoolTask *tasks = g_new(ThreadPoolTask, num_workers);
+   for (unsigned i = 0; i < num_workers; i++) {
+      tasks[i].job = &job;
+      tasks[i].queue = i + 1;
+      g_thread_pool_push(p->pool, &tasks[i], NULL);
+   }
+
+   thread_pool_job_work(&job, 0);
+
+   /* Wait for the workers to leave the job, even if there is nothing left
+    * for them to do, since they reference it.
+    */
+   g_mutex_lock(&job.mutex);
+   while (job.pending > 0)
+      g_cond_wait(&job.done, &job.mutex);
+   g_mutex_unlock(&job.mutex);
+
+   g_mutex_clear(&job.mutex);
+   g_cond_clear(&job.done);
+   g_free(queues);
+   g_free(tasks);
+}
@@ -0,0 +1,23 @@
+#ifndef __TER_THREAD_POOL_H__
+#define __TER_THREAD_POOL_H__
+
+#include <glib.h>
+
+/*
+ * Processes items [start, end) of a parallel job. Ranges are disjoint, so
+ * functions only need to synchronize access to data shared across items.
+ */
+typedef void (*TerThreadPoolFunc)(void *data, unsigned start, unsigned end);
+
+typedef struct {
+   GThreadPool *pool;
+   unsigned num_threads;
+} TerThreadPool;
+
+TerThreadPool *ter_thread_pool_new(unsigned num_threads);
+void ter_thread_pool_free(TerThreadPool *p);
+
+void ter_thread_pool_run(TerThreadPool *p, TerThreadPoolFunc func, void *data,
+                         unsigned count, unsigned grain);
+
+#endif
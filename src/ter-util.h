@@ -32,6 +32,11 @@ typedef struct {
    float x0, x1, y0, y1, z0, z1;
 } TerClipVolume;
 
+/* Frustum planes (a, b, c, d), with normals pointing inside the frustum */
+typedef struct {
+   glm::vec4 planes[6];
+} TerFrustum;
+
 enum {
    LOG_DEFAULT = 0,
    LOG_FPS,
@@ -133,4 +138,77 @@ ter_util_vec3_dot(glm::vec3 u, glm::vec3 v)
    return u.x * v.x + u.y * v.y + u.z * v.z;
 }
 
+static inline bool
+ter_util_clip_volume_intersects(const TerClipVolume *a, const TerClipVolume *b)
+{
+   return a->x0 <= b->x1 && a->x1 >= b->x0 &&
+          a->y0 <= b->y1 && a->y1 >= b->y0 &&
+          a->z0 <= b->z1 && a->z1 >= b->z0;
+}
+
+/*
+ * Squared distance from point p to the closest point in the volume
+ * (0 if p is inside the volume).
+ */
+static inline float
+ter_util_clip_volume_distance_sq(const TerClipVolume *c, glm::vec3 p)
+{
+   float dx = fmaxf(fmaxf(c->x0 - p.x, 0.0f), p.x - c->x1);
+   float dy = fmaxf(fmaxf(c->y0 - p.y, 0.0f), p.y - c->y1);
+   float dz = fmaxf(fmaxf(c->z0 - p.z, 0.0f), p.z - c->z1);
+   return dx * dx + dy * dy + dz * dz;
+}
+
+/*
+ * Extracts the frustum planes from a view-projection matrix (Gribb and
+ * Hartmann). Works for both perspective and orthographic projections.
+ */
+static inline void
+ter_util_frustum_from_matrix(TerFrustum *f, const glm::mat4 *vp)
+{
+   const glm::mat4 &m = *vp;
+   for (int i = 0; i < 3; i++) {
+      for (int j = 0; j < 2; j++) {
+         float sign = j == 0 ? 1.0f : -1.0f;
+         glm::vec4 *p = &f->planes[i * 2 + j];
+         p->x = m[0][3] + sign * m[0][i];
+         p->y = m[1][3] + sign * m[1][i];
+         p->z = m[2][3] + sign * m[2][i];
+         p->w = m[3][3] + sign * m[3][i];
+      }
+   }
+}
+
+/*
+ * Conservative box/frustum test: the box is outside if its corner furthest
+ * along the normal of any plane is behind that plane.
+ */
+static inline bool
+ter_util_frustum_intersects_clip_volume(const TerFrustum *f,
+                                        const TerClipVolume *c)
+{
+   for (int i = 0; i < 6; i++) {
+      const glm::vec4 &p = f->planes[i];
+      float x = p.x >= 0.0f ? c->x1 : c->x0;
+      float y = p.y >= 0.0f ? c->y1 : c->y0;
+      float z = p.z >= 0.0f ? c->z1 : c->z0;
+      if (p.x * x + p.y * y + p.z * z + p.w < 0.0f)
+         return false;
+   }
+   return true;
+}
+
+/*
+ * Checks the version of the current GL context. We create a 3.3 core
+ * context, but drivers usually give us the latest version they support.
+ */
+static inline bool
+ter_util_gl_version_at_least(int major, int minor)
+{
+   int ctx_major = 0, ctx_minor = 0;
+   glGetIntegerv(GL_MAJOR_VERSION, &ctx_major);
+   glGetIntegerv(GL_MINOR_VERSION, &ctx_minor);
+   return ctx_major > major || (ctx_major == major && ctx_minor >= minor);
+}
+
 #endif